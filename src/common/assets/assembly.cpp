@@ -126,21 +126,32 @@ Assembly::Assembly() { type.set(AssetType::Type::assembly); }
 
 EntityID Assembly::inject(EntityManager& em, std::vector<EntityID>* entityMapRef)
 {
-    std::vector<EntityID> entityMap(entities.size());
+    // Spawn every group of entities that share an archetype in one go, copying components straight into the chunks.
+    // Groups are kept in the order their first entity appears, so the spawn order and the IDs handed out don't
+    // depend on hashing
+    std::vector<std::pair<ComponentSet, std::vector<size_t>>> archetypeGroups;
+    std::unordered_map<ComponentSet, size_t> groupIndices;
     for(size_t i = 0; i < entities.size(); ++i)
     {
-        EntityAsset& entity = entities[i];
-        entityMap[i] = em.createEntity(entity.runtimeComponentIDs());
+        ComponentSet components = entities[i].runtimeComponentIDs();
+        auto [groupIndex, isNew] = groupIndices.try_emplace(components, archetypeGroups.size());
+        if(isNew)
+            archetypeGroups.emplace_back(std::move(components), std::vector<size_t>{});
+        archetypeGroups[groupIndex->second].second.push_back(i);
     }
-    EntityID rootID = entityMap[rootIndex];
 
-    for(size_t i = 0; i < entities.size(); ++i)
+    std::vector<EntityID> entityMap(entities.size());
+    for(auto& [components, group] : archetypeGroups)
     {
-        EntityAsset& entity = entities[i];
-        EntityID id = entityMap[i];
-        for(auto& component : entity.components)
-            em.setComponent(id, component);
+        auto ids = em.createEntities(
+            components, group.size(), [&](const ComponentDescription* def, size_t first, size_t count, byte* dest) {
+            for(size_t i = 0; i < count; ++i)
+                def->copy(entities[group[first + i]].getComponent(def)->data(), dest + def->size() * i);
+        });
+        for(size_t i = 0; i < group.size(); ++i)
+            entityMap[group[i]] = ids[i];
     }
+    EntityID rootID = entityMap[rootIndex];
 
 #ifdef CLIENT
     auto* am = Runtime::getModule<AssetManager>();
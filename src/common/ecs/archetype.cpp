@@ -1,32 +1,133 @@
 #include "archetype.h"
 
+#include <algorithm>
+#include <stdexcept>
 #include "chunk.h"
 #include "entitySet.h"
 
-size_t Archetype::chunkIndex(size_t entity) const { return entity / (Chunk::allocationSize() / _entitySize); }
+float ArchetypeMemoryStats::utilisation() const
+{
+    return allocatedBytes ? static_cast<float>(usedBytes) / static_cast<float>(allocatedBytes) : 0.0f;
+}
+
+size_t Archetype::chunkIndex(size_t entity) const { return entity / _chunkCapacity; }
 
 Archetype::Archetype(const std::vector<const ComponentDescription*>& components,
-                     std::shared_ptr<ChunkPool>& chunkAllocator)
+                     std::shared_ptr<ChunkPool>& chunkAllocator,
+                     const ChunkLayout& layout)
+    : _columnIndex(components), _layout(layout)
 {
     _chunkAllocator = chunkAllocator;
     _entitySize = 0;
-    _componentDescriptions = components;
     for(auto component : components)
     {
         _components.add(component->id);
         _entitySize += component->size();
+        _tracksRowChanges |= component->trackRowChanges;
     }
+    _chunkCapacity = _layout.capacity(_columnIndex.components(), _layout.chunkSize);
+    if(_chunkCapacity == 0)
+        throw std::runtime_error("Archetype entities don't fit in a chunk");
 }
 
 Archetype::~Archetype()
 {
     while(!_chunks.empty())
+        releaseLastChunk();
+}
+
+size_t Archetype::chunkAllocationSize(size_t budget) const
+{
+    size_t capacity = _layout.capacity(_columnIndex.components(), budget);
+    return alignColumn(_layout.columnsSize(_columnIndex.components(), capacity), Chunk::maxAlignment);
+}
+
+std::unique_ptr<Chunk> Archetype::allocateChunk(size_t budget)
+{
+    std::unique_ptr<Chunk> chunk = _chunkAllocator->allocate(chunkAllocationSize(budget));
+    chunk->setComponents(_columnIndex, _layout);
+    return chunk;
+}
+
+void Archetype::replaceFirstChunk(size_t budget)
+{
+    assert(_chunks.size() == 1);
+    std::unique_ptr<Chunk> replacement = allocateChunk(budget);
+    Chunk* first = _chunks[0].get();
+    size_t count = first->size();
+    assert(count <= replacement->maxCapacity());
+    replacement->createEntities(count);
+    first->moveEntities(replacement.get(), 0, 0, count);
+    // The rows only moved, so the replacement keeps the versions and changed rows they had
+    for(size_t c = 0; c < first->columns().size(); ++c)
+        replacement->column(c).copyChangesFrom(first->column(c));
+    first->removeEntities(count);
+    _chunkAllocator->release(std::move(_chunks[0]));
+    _chunks[0] = std::move(replacement);
+    _chunkCapacity = _chunks[0]->maxCapacity();
+}
+
+void Archetype::reserveChunk(size_t entity)
+{
+    while(chunkIndex(entity) >= _chunks.size())
     {
-        *_chunkAllocator << _chunks[_chunks.size() - 1];
-        _chunks.erase(_chunks.end() - 1);
+        if(_chunks.empty())
+        {
+            // Start from the smallest size that holds an entity
+            size_t budget = std::min(_layout.minChunkSize, _layout.chunkSize);
+            while(budget < _layout.chunkSize && _layout.capacity(_columnIndex.components(), budget) == 0)
+                budget *= 2;
+            _chunks.push_back(allocateChunk(std::min(budget, _layout.chunkSize)));
+            _chunkCapacity = _chunks[0]->maxCapacity();
+            continue;
+        }
+
+        Chunk* first = _chunks[0].get();
+        size_t fullCapacity = _layout.capacity(_columnIndex.components(), _layout.chunkSize);
+        if(_chunks.size() > 1 || first->maxCapacity() == fullCapacity)
+        {
+            _chunks.push_back(allocateChunk(_layout.chunkSize));
+            continue;
+        }
+
+        // Only one chunk exists, so entities map to it no matter its capacity and it can be swapped for a bigger one
+        size_t budget = std::min(first->allocationSize() * 2, _layout.chunkSize);
+        const auto& components = _columnIndex.components();
+        while(budget < _layout.chunkSize && _layout.capacity(components, budget) <= first->maxCapacity())
+            budget = std::min(budget * 2, _layout.chunkSize);
+        replaceFirstChunk(budget);
     }
 }
 
+size_t Archetype::shrinkBudget() const
+{
+    if(_chunks.size() != 1)
+        return 0;
+    const Chunk* chunk = _chunks[0].get();
+    size_t wanted = std::max<size_t>(_size * 2, 1);
+    size_t budget = std::min(_layout.minChunkSize, _layout.chunkSize);
+    while(budget < _layout.chunkSize && _layout.capacity(_columnIndex.components(), budget) < wanted)
+        budget *= 2;
+    budget = std::min(budget, _layout.chunkSize);
+    return chunkAllocationSize(budget) * 2 <= chunk->allocationSize() ? budget : 0;
+}
+
+size_t Archetype::shrinkToFit()
+{
+    size_t budget = shrinkBudget();
+    if(budget == 0)
+        return 0;
+    size_t before = _chunks[0]->allocationSize();
+    replaceFirstChunk(budget);
+    return before - _chunks[0]->allocationSize();
+}
+
+void Archetype::releaseLastChunk()
+{
+    _chunkAllocator->release(std::move(_chunks.back()));
+    _chunks.pop_back();
+}
+
 bool Archetype::hasComponent(ComponentID component) const { return _components.contains(component); }
 
 bool Archetype::hasComponents(const ComponentSet& comps) const { return _components.contains(comps); }
@@ -48,7 +149,7 @@ VirtualComponentView Archetype::getComponent(size_t entity, ComponentID componen
 
     size_t index = entity - chunk * _chunks[0]->maxCapacity();
     assert(index < _chunks[chunk]->size());
-    VirtualComponentView o = _chunks[chunk]->getComponent(component)[index];
+    VirtualComponentView o = _chunks[chunk]->column(_columnIndex.find(component))[index];
     return o;
 }
 
@@ -61,7 +162,7 @@ void Archetype::setComponent(size_t entity, VirtualComponent&& component)
 
     size_t index = entity - chunk * _chunks[0]->maxCapacity();
     assert(index < _chunks[chunk]->size());
-    auto& componentView = _chunks[chunk]->getComponent(component.description()->id);
+    auto& componentView = _chunks[chunk]->column(_columnIndex.find(component.description()->id));
     componentView.setComponent(index, std::move(component));
     componentView.version++;
 }
@@ -75,50 +176,39 @@ void Archetype::setComponent(size_t entity, VirtualComponentView component)
 
     size_t index = entity - chunk * _chunks[0]->maxCapacity();
     assert(index < _chunks[chunk]->size());
-    auto& componentView = _chunks[chunk]->getComponent(component.description()->id);
+    auto& componentView = _chunks[chunk]->column(_columnIndex.find(component.description()->id));
     componentView.setComponent(index, component);
     componentView.version++;
 }
 
-bool Archetype::isChildOf(const Archetype* parent, ComponentID& connectingComponent) const
-{
-    connectingComponent = -1;
-    assert(_components.size() + 1 == parent->_components.size()); // Make sure this is a valid comparison
-    byte missCount = 0;
-    for(auto& c : parent->_components)
-    {
-        if(!_components.contains(c))
-        {
-            if(++missCount == 2)
-                return false;
-            connectingComponent = c;
-        }
-    }
-    return true;
-}
-
 const ComponentSet& Archetype::components() const { return _components; }
 
-const std::vector<const ComponentDescription*>& Archetype::componentDescriptions() { return _componentDescriptions; }
+const std::vector<const ComponentDescription*>& Archetype::componentDescriptions() { return _columnIndex.components(); }
 
-std::unordered_map<ComponentID, Archetype*>& Archetype::addEdges() { return _addEdges; }
+size_t Archetype::columnIndex(ComponentID component) const { return _columnIndex.find(component); }
 
-std::unordered_map<ComponentID, Archetype*>& Archetype::removeEdges() { return _removeEdges; }
+std::vector<ArchetypeEdge>& Archetype::addEdges() { return _addEdges; }
+
+std::vector<ArchetypeEdge>& Archetype::removeEdges() { return _removeEdges; }
+
+static Archetype* findEdge(const std::vector<ArchetypeEdge>& edges, ComponentID component)
+{
+    for(const ArchetypeEdge& edge : edges)
+        if(edge.component == component)
+            return edge.archetype;
+    return nullptr;
+}
+
+Archetype* Archetype::addEdge(ComponentID component) const { return findEdge(_addEdges, component); }
+
+Archetype* Archetype::removeEdge(ComponentID component) const { return findEdge(_removeEdges, component); }
 
 size_t Archetype::size() const { return _size; }
 
 size_t Archetype::createEntity()
 {
-    size_t chunk = chunkIndex(_size);
-    if(chunk >= _chunks.size())
-    {
-        _chunks.resize(_chunks.size() + 1);
-        *_chunkAllocator >> _chunks[_chunks.size() - 1];
-        _chunks[_chunks.size() - 1]->setComponents(_componentDescriptions);
-    }
-
-    assert(chunk < _chunks.size());
-    _chunks[chunk]->createEntity();
+    reserveChunk(_size);
+    _chunks[chunkIndex(_size)]->createEntity();
 
     return _size++;
 }
@@ -142,10 +232,109 @@ size_t Archetype::moveEntity(size_t index, Archetype* destination)
     return newIndex;
 }
 
+size_t Archetype::createEntities(size_t count)
+{
+    size_t first = _size;
+    while(count > 0)
+    {
+        reserveChunk(_size);
+        Chunk* c = _chunks[chunkIndex(_size)].get();
+        size_t created = std::min(count, c->maxCapacity() - c->size());
+        c->createEntities(created);
+        _size += created;
+        count -= created;
+    }
+    return first;
+}
+
+void Archetype::moveRange(size_t index, Archetype* dest, size_t destIndex, size_t count)
+{
+    while(count > 0)
+    {
+        size_t srcChunkIndex = chunkIndex(index);
+        size_t destChunkIndex = dest->chunkIndex(destIndex);
+        Chunk* src = _chunks[srcChunkIndex].get();
+        Chunk* destChunk = dest->_chunks[destChunkIndex].get();
+
+        size_t srcEntityIndex = index - srcChunkIndex * src->maxCapacity();
+        size_t destEntityIndex = destIndex - destChunkIndex * destChunk->maxCapacity();
+        size_t moved = std::min({count, src->size() - srcEntityIndex, destChunk->size() - destEntityIndex});
+
+        src->moveEntities(destChunk, srcEntityIndex, destEntityIndex, moved);
+        index += moved;
+        destIndex += moved;
+        count -= moved;
+    }
+}
+
+size_t Archetype::moveEntities(size_t index, size_t count, Archetype* dest)
+{
+    assert(index + count <= _size);
+    size_t newIndex = dest->createEntities(count);
+    moveRange(index, dest, newIndex, count);
+    removeEntities(index, count);
+    return newIndex;
+}
+
+void Archetype::removeEntities(size_t index, size_t count)
+{
+    assert(index + count <= _size);
+    // Fill the hole with entities from the back that aren't part of it, the ranges never overlap
+    size_t tailStart = std::max(index + count, _size - count);
+    moveRange(tailStart, this, index, _size - tailStart);
+
+    while(count > 0)
+    {
+        Chunk* lastChunk = _chunks[_chunks.size() - 1].get();
+        size_t removed = std::min(count, lastChunk->size());
+        lastChunk->removeEntities(removed);
+        _size -= removed;
+        count -= removed;
+        if(lastChunk->size() == 0)
+            releaseLastChunk();
+    }
+}
+
+void Archetype::forEachChunkRange(size_t index, size_t count, const ChunkRangeFunction& f)
+{
+    assert(index + count <= _size);
+    size_t rangeOffset = 0;
+    while(count > 0)
+    {
+        size_t c = chunkIndex(index);
+        Chunk* chunk = _chunks[c].get();
+        size_t chunkOffset = index - c * chunk->maxCapacity();
+        size_t n = std::min(count, chunk->size() - chunkOffset);
+        f(chunk, chunkOffset, rangeOffset, n);
+        index += n;
+        rangeOffset += n;
+        count -= n;
+    }
+}
+
 Chunk* Archetype::getChunk(size_t entity) const { return _chunks[chunkIndex(entity)].get(); }
 
 size_t Archetype::entitySize() const { return _entitySize; }
 
+const ChunkLayout& Archetype::chunkLayout() const { return _layout; }
+
+ArchetypeMemoryStats Archetype::memoryStats() const
+{
+    ArchetypeMemoryStats stats;
+    stats.entities = _size;
+    stats.chunks = _chunks.size();
+    stats.usedBytes = _size * _entitySize;
+    for(auto& chunk : _chunks)
+    {
+        stats.capacity += chunk->maxCapacity();
+        stats.allocatedBytes += chunk->allocationSize();
+        stats.partialChunks += chunk->size() < chunk->maxCapacity();
+    }
+    if(size_t budget = shrinkBudget())
+        stats.reclaimableBytes = _chunks[0]->allocationSize() - chunkAllocationSize(budget);
+    return stats;
+}
+
 void Archetype::removeEntity(size_t index)
 {
     assert(index < _size);
@@ -164,15 +353,39 @@ void Archetype::removeEntity(size_t index)
     assert(lastChunk->size() % lastChunk->maxCapacity() == _size % lastChunk->maxCapacity());
 
     if(lastChunk->size() == 0)
-    {
-        *_chunkAllocator << _chunks[_chunks.size() - 1];
-        _chunks.resize(_chunks.size() - 1);
-    }
+        releaseLastChunk();
 }
 
 const std::vector<std::unique_ptr<Chunk>>& Archetype::chunks() const { return _chunks; }
 
 void Archetype::setComponentVersion(size_t entity, ComponentID component, uint32_t version)
 {
-    getChunk(entity)->getComponent(component).version = version;
+    size_t chunk = chunkIndex(entity);
+    ChunkComponentView& view = _chunks[chunk]->column(_columnIndex.find(component));
+    view.version = version;
+    size_t index = entity - chunk * _chunks[0]->maxCapacity();
+    view.markRowsChanged(index, index + 1);
+}
+
+void Archetype::setComponentVersion(size_t begin, size_t end, ComponentID component, uint32_t version)
+{
+    if(begin >= end)
+        return;
+    size_t capacity = _chunks[0]->maxCapacity();
+    for(size_t chunk = chunkIndex(begin); chunk <= chunkIndex(end - 1); ++chunk)
+    {
+        ChunkComponentView& view = _chunks[chunk]->column(_columnIndex.find(component));
+        view.version = version;
+        size_t chunkStart = chunk * capacity;
+        size_t chunkEnd = chunkStart + capacity;
+        view.markRowsChanged(std::max(begin, chunkStart) - chunkStart, std::min(end, chunkEnd) - chunkStart);
+    }
+}
+
+void Archetype::rotateChangedRows(uint32_t periodStart)
+{
+    if(!_tracksRowChanges)
+        return;
+    for(auto& chunk : _chunks)
+        chunk->rotateChangedRows(periodStart);
 }
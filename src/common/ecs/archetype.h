@@ -19,6 +19,23 @@ class EntitySet;
 
 class ComponentFilter;
 
+struct ArchetypeMemoryStats
+{
+    size_t entities = 0;
+    size_t chunks = 0;
+    // Entities the allocated chunks have room for
+    size_t capacity = 0;
+    size_t allocatedBytes = 0;
+    // Bytes holding live components, the rest is free rows, alignment padding or the unusable tail of a chunk
+    size_t usedBytes = 0;
+    // Chunks with free rows. Entities are kept packed, so at most one per archetype outside of a compaction pass.
+    size_t partialChunks = 0;
+    // Bytes a compaction pass would give back by shrinking the archetype's chunk
+    size_t reclaimableBytes = 0;
+
+    float utilisation() const;
+};
+
 struct ArchetypeEdge
 {
     ComponentID component;
@@ -33,20 +50,51 @@ class Archetype
     size_t _size = 0;
     size_t _entitySize;
 
-    std::unordered_map<ComponentID, Archetype*> _addEdges;
-    std::unordered_map<ComponentID, Archetype*> _removeEdges;
+    // Archetypes one component away, filled in by ArchetypeManager the first time each transition is taken. Only a
+    // few of the possible edges are ever used, so small flat tables are cheaper to scan than a hash map.
+    std::vector<ArchetypeEdge> _addEdges;
+    std::vector<ArchetypeEdge> _removeEdges;
 
     ComponentSet _components;
-    std::vector<const ComponentDescription*> _componentDescriptions;
+    // Shared by every chunk, so it must stay put for as long as they exist
+    ColumnIndex _columnIndex;
     std::vector<std::unique_ptr<Chunk>> _chunks;
     std::shared_ptr<ChunkPool> _chunkAllocator;
+    ChunkLayout _layout;
+    // Capacity of every chunk, the first one may be smaller while it's the only one
+    size_t _chunkCapacity = 0;
+    bool _tracksRowChanges = false;
 
     size_t chunkIndex(size_t entity) const;
 
+    // Bytes allocateChunk(budget) allocates
+    size_t chunkAllocationSize(size_t budget) const;
+
+    // Allocates a chunk with at most budget bytes, trimmed to the size its columns need
+    std::unique_ptr<Chunk> allocateChunk(size_t budget);
+
+    // Swaps the only chunk for one allocated with budget bytes, entities keep their indices
+    void replaceFirstChunk(size_t budget);
+
+    // Budget shrinkToFit would use, or 0 if it wouldn't shrink anything
+    size_t shrinkBudget() const;
+
+    // Adds chunks until the one entity would be in exists, growing the first chunk while it's smaller than the rest
+    void reserveChunk(size_t entity);
+
+    void releaseLastChunk();
+
     Chunk* getChunk(size_t entity) const;
 
+    // Moves a range of entities into already created slots of dest, splitting the range on chunk boundaries
+    void moveRange(size_t index, Archetype* dest, size_t destIndex, size_t count);
+
   public:
-    Archetype(const std::vector<const ComponentDescription*>& components, std::shared_ptr<ChunkPool>& _chunkAllocator);
+    using ChunkRangeFunction = std::function<void(Chunk* chunk, size_t chunkOffset, size_t rangeOffset, size_t count)>;
+
+    Archetype(const std::vector<const ComponentDescription*>& components,
+              std::shared_ptr<ChunkPool>& _chunkAllocator,
+              const ChunkLayout& layout = {});
 
     ~Archetype();
 
@@ -58,21 +106,33 @@ class Archetype
 
     VirtualComponentView getComponent(size_t entity, ComponentID component) const;
 
+    // Sets the version of the chunks holding the entities and marks the entities' rows as changed
     void setComponentVersion(size_t entity, ComponentID component, uint32_t version);
 
+    void setComponentVersion(size_t begin, size_t end, ComponentID component, uint32_t version);
+
+    // See ChunkComponentView::rotateChangedRows
+    void rotateChangedRows(uint32_t periodStart);
+
     void setComponent(size_t entity, VirtualComponent&& component);
 
     void setComponent(size_t entity, VirtualComponentView component);
 
-    bool isChildOf(const Archetype* parent, ComponentID& connectingComponent) const;
-
     const ComponentSet& components() const;
 
     const std::vector<const ComponentDescription*>& componentDescriptions();
 
-    std::unordered_map<ComponentID, Archetype*>& addEdges();
+    // Column of component in every chunk of this archetype, or ColumnIndex::none
+    size_t columnIndex(ComponentID component) const;
+
+    std::vector<ArchetypeEdge>& addEdges();
 
-    std::unordered_map<ComponentID, Archetype*>& removeEdges();
+    std::vector<ArchetypeEdge>& removeEdges();
+
+    // Archetype reached by adding or removing component, or nullptr if that edge hasn't been built yet
+    Archetype* addEdge(ComponentID component) const;
+
+    Archetype* removeEdge(ComponentID component) const;
 
     const std::vector<std::unique_ptr<Chunk>>& chunks() const;
 
@@ -84,7 +144,30 @@ class Archetype
 
     void removeEntity(size_t index);
 
+    // Returns the index of the first created entity, the rest follow contiguously
+    size_t createEntities(size_t count);
+
+    // Moves a contiguous range of entities to dest and returns the index of the first one there. Like moveEntity the
+    // hole is filled from the back of this archetype, so entities in [index, min(index + count, size())) will have
+    // moved afterwards.
+    size_t moveEntities(size_t index, size_t count, Archetype* dest);
+
+    void removeEntities(size_t index, size_t count);
+
+    // Calls f once per chunk overlapping [index, index + count), with where the range starts in that chunk and how far
+    // into the range the chunk starts
+    void forEachChunkRange(size_t index, size_t count, const ChunkRangeFunction& f);
+
     size_t entitySize() const;
 
+    const ChunkLayout& chunkLayout() const;
+
+    ArchetypeMemoryStats memoryStats() const;
+
+    // Moves the entities into a smaller chunk when they use less than about a quarter of the only chunk, leaving room
+    // for them to double before it has to grow again. Entities keep their indices, so the entity table stays valid.
+    // Returns how many bytes smaller the chunk got.
+    size_t shrinkToFit();
+
     friend class ArchetypeView;
 };
@@ -4,6 +4,7 @@
 
 #include "archetypeManager.h"
 #include "componentManager.h"
+#include <algorithm>
 #include <unordered_set>
 
 ArchetypeManager::ArchetypeManager(ComponentManager& componentManager) : _componentManager(componentManager)
@@ -14,51 +15,10 @@ ArchetypeManager::ArchetypeManager(ComponentManager& componentManager) : _compon
 Archetype* ArchetypeManager::getArchetype(const ComponentSet& components)
 {
     ASSERT_MAIN_THREAD();
-    size_t numComps = components.size();
-    assert(numComps > 0);
-    if(numComps > _archetypes.size())
-        return makeArchetype(components);
-    std::vector<std::unordered_set<Archetype*>*> archesWithComponent;
-    for(ComponentID c : components)
-    {
-        if(_compToArch.count(c))
-            archesWithComponent.push_back(&_compToArch[c]);
-        else
-            return makeArchetype(components);
-    }
-
-    // Find smallest, (basically we never want to use entityID as the iterator in the next for-each
-    size_t smallest = 0;
-    for(size_t i = 1; i < archesWithComponent.size(); ++i)
-        if(archesWithComponent[smallest]->size() > archesWithComponent[i]->size())
-            smallest = i;
-
-    Archetype* foundArch = nullptr;
-    for(auto* arch : *archesWithComponent[smallest])
-    {
-        if(arch->components().size() != components.size())
-            continue;
-        bool isFound = true;
-        for(size_t i = 0; i < archesWithComponent.size(); ++i)
-        {
-            if(i == smallest)
-                continue;
-            if(!archesWithComponent[i]->contains(arch))
-            {
-                isFound = false;
-                break;
-            }
-        }
-        if(isFound)
-        {
-            foundArch = arch;
-            break;
-        }
-    }
-
-    if(foundArch)
-        return foundArch;
-
+    assert(components.size() > 0);
+    auto archetype = _archetypeLookup.find(components);
+    if(archetype != _archetypeLookup.end())
+        return archetype->second;
     return makeArchetype(components);
 }
 
@@ -66,6 +26,7 @@ Archetype* ArchetypeManager::makeArchetype(const ComponentSet& components)
 {
     ASSERT_MAIN_THREAD();
     assert(components.size() > 0);
+    assert(!_archetypeLookup.contains(components));
     size_t numComps = components.size();
 
     // We want to keep archetypes of the same size in groups
@@ -81,57 +42,75 @@ Archetype* ArchetypeManager::makeArchetype(const ComponentSet& components)
         descriptions.push_back(_componentManager.getComponentDef(id));
 
     size_t newIndex = _archetypes[numComps - 1].size();
-    _archetypes[numComps - 1].push_back(std::make_unique<Archetype>(descriptions, _chunkAllocator));
+    _archetypes[numComps - 1].push_back(std::make_unique<Archetype>(descriptions, _chunkAllocator, _chunkLayout));
 
     Archetype* newArch = _archetypes[numComps - 1][newIndex].get();
 
-    // find edges to other archetypes lower than this one
-    if(numComps > 1)
-    {
-        ComponentID connectingComponent;
-        for(size_t i = 0; i < _archetypes[numComps - 2].size(); i++)
-        {
-            if(_archetypes[numComps - 2][i]->isChildOf(newArch, connectingComponent))
-            {
-                Archetype* otherArch = _archetypes[numComps - 2][i].get();
-                otherArch->addEdges().insert({connectingComponent, newArch});
-                newArch->removeEdges().insert({connectingComponent, otherArch});
-            }
-        }
-    }
-
-    // find edges to other archetypes higher than this one
-    if(_archetypes.size() > numComps)
-    {
-        for(size_t i = 0; i < _archetypes[numComps].size(); i++)
-        {
-            ComponentID connectingComponent;
-            if(newArch->isChildOf(_archetypes[numComps][i].get(), connectingComponent))
-            {
-                Archetype* otherArch = _archetypes[numComps][i].get();
-                newArch->addEdges().insert({connectingComponent, otherArch});
-                otherArch->removeEdges().insert({connectingComponent, newArch});
-            }
-        }
-    }
-
     for(auto c : components)
         _compToArch[c].insert(newArch);
+    _archetypeLookup.insert({components, newArch});
 
+    _queryCacheLock.lock();
+    for(auto& query : _queryCache)
+        if(query.first.matches(newArch))
+            query.second.push_back(newArch);
+    _queryCacheLock.unlock();
+
+    ++_generation;
     return newArch;
 }
 
+Archetype* ArchetypeManager::addTransition(Archetype* from, ComponentID component)
+{
+    ASSERT_MAIN_THREAD();
+    assert(!from->hasComponent(component));
+    if(Archetype* to = from->addEdge(component))
+        return to;
+
+    ComponentSet components = from->components();
+    components.add(component);
+    Archetype* to = getArchetype(components);
+    from->addEdges().push_back({component, to});
+    to->removeEdges().push_back({component, from});
+    return to;
+}
+
+Archetype* ArchetypeManager::removeTransition(Archetype* from, ComponentID component)
+{
+    ASSERT_MAIN_THREAD();
+    assert(from->hasComponent(component));
+    if(Archetype* to = from->removeEdge(component))
+        return to;
+
+    ComponentSet components = from->components();
+    components.remove(component);
+    if(components.size() == 0)
+        return nullptr;
+    Archetype* to = getArchetype(components);
+    from->removeEdges().push_back({component, to});
+    to->addEdges().push_back({component, from});
+    return to;
+}
+
 void ArchetypeManager::destroyArchetype(Archetype* archetype)
 {
     assert(archetype);
     ASSERT_MAIN_THREAD();
     for(auto c : archetype->components())
         _compToArch[c].erase(archetype);
+    _archetypeLookup.erase(archetype->components());
+
+    _queryCacheLock.lock();
+    for(auto& query : _queryCache)
+        std::erase(query.second, archetype);
+    _queryCacheLock.unlock();
 
+    // Edges are always built in pairs, so only the archetypes this one links to can link back to it
+    auto pointsHere = [archetype](const ArchetypeEdge& edge) { return edge.archetype == archetype; };
     for(auto& edge : archetype->addEdges())
-        edge.second->removeEdges().erase(edge.first);
+        std::erase_if(edge.archetype->removeEdges(), pointsHere);
     for(auto& edge : archetype->removeEdges())
-        edge.second->addEdges().erase(edge.first);
+        std::erase_if(edge.archetype->addEdges(), pointsHere);
     auto& archesOfSameSize = _archetypes[archetype->components().size() - 1];
     auto i = archesOfSameSize.begin();
     auto end = archesOfSameSize.end();
@@ -140,6 +119,7 @@ void ArchetypeManager::destroyArchetype(Archetype* archetype)
         if(i->get() == archetype)
         {
             archesOfSameSize.erase(i);
+            ++_generation;
             return;
         }
         ++i;
@@ -151,24 +131,56 @@ void ArchetypeManager::clear()
 {
     ASSERT_MAIN_THREAD();
     _archetypes.resize(0);
+    _compToArch.clear();
+    _archetypeLookup.clear();
+    _queryCacheLock.lock();
+    _queryCache.clear();
+    _queryCacheLock.unlock();
+    ++_generation;
+}
+
+size_t ArchetypeManager::generation() const { return _generation; }
+
+void ArchetypeManager::rotateChangedRows(uint32_t periodStart)
+{
+    ASSERT_MAIN_THREAD();
+    for(auto& archetypes : _archetypes)
+        for(auto& archetype : archetypes)
+            archetype->rotateChangedRows(periodStart);
 }
 
 std::vector<Archetype*> ArchetypeManager::getArchetypes(const ComponentFilter& filter)
 {
     assert(filter.components().size() > 0);
+    QuerySignature signature(filter);
+
+    std::scoped_lock lock(_queryCacheLock);
+    auto cached = _queryCache.find(signature);
+    if(cached != _queryCache.end())
+    {
+        ++_queryCacheStats.hits;
+        return cached->second;
+    }
+    ++_queryCacheStats.misses;
+
+    std::vector<Archetype*> archetypes = findArchetypes(signature);
+    _queryCache.insert({std::move(signature), archetypes});
+    return archetypes;
+}
+
+std::vector<Archetype*> ArchetypeManager::findArchetypes(const QuerySignature& signature)
+{
+    assert(signature.required.size() > 0);
     std::vector<Archetype*> archetypes;
     archetypes.reserve(64);
 
     std::vector<std::unordered_set<Archetype*>*> archesWithDesiredComponents;
-    archesWithDesiredComponents.reserve(filter.components().size());
+    archesWithDesiredComponents.reserve(signature.required.size());
     std::vector<std::unordered_set<Archetype*>*> archesWithExcludedComponents;
-    for(auto c : filter.components())
-    {
-        if(c.flags & ComponentFilterFlags_Exclude)
-            archesWithExcludedComponents.push_back(&_compToArch[c.id]);
-        else
-            archesWithDesiredComponents.push_back(&_compToArch[c.id]);
-    }
+    for(auto c : signature.required)
+        archesWithDesiredComponents.push_back(&_compToArch[c]);
+    for(auto c : signature.excluded)
+        archesWithExcludedComponents.push_back(&_compToArch[c]);
 
     // Find smallest, (basically we never want to use entityID as the iterator in the next for loop)
     uint32_t s = 0;
@@ -194,6 +206,108 @@ std::vector<Archetype*> ArchetypeManager::getArchetypes(const ComponentFilter& f
     return archetypes;
 }
 
+ArchetypeManager::QueryCacheStats ArchetypeManager::queryCacheStats()
+{
+    std::scoped_lock lock(_queryCacheLock);
+    QueryCacheStats stats = _queryCacheStats;
+    stats.entries = _queryCache.size();
+    return stats;
+}
+
+void ArchetypeManager::setChunkLayout(const ChunkLayout& layout)
+{
+    assert(layout.columnAlignment <= Chunk::maxAlignment && std::has_single_bit(layout.columnAlignment));
+    // Chunk budgets grow by doubling from minChunkSize up to chunkSize, so it can't be zero or past the full size
+    if(layout.chunkSize == 0 || layout.minChunkSize == 0)
+        throw std::runtime_error("Chunk sizes must be greater than zero");
+    if(layout.minChunkSize > layout.chunkSize)
+        throw std::runtime_error("minChunkSize can't be larger than chunkSize");
+    _chunkLayout = layout;
+}
+
+const ChunkLayout& ArchetypeManager::chunkLayout() const { return _chunkLayout; }
+
+size_t ArchetypeManager::pooledChunkBytes() const { return _chunkAllocator->unusedBytes(); }
+
+void ArchetypeManager::setPoolHighWaterMark(size_t bytes) { _poolHighWaterMark = bytes; }
+
+size_t ArchetypeManager::poolHighWaterMark() const { return _poolHighWaterMark; }
+
+ArchetypeManager::CompactionStats ArchetypeManager::compact(size_t maxArchetypes)
+{
+    ASSERT_MAIN_THREAD();
+    CompactionStats stats;
+    size_t archetypeCount = 0;
+    for(auto& archetypes : _archetypes)
+        archetypeCount += archetypes.size();
+    if(_compactionCursor >= archetypeCount)
+        _compactionCursor = 0;
+
+    // The cursor is a position in iteration order, archetypes created or destroyed in between only shift it a little
+    size_t skip = _compactionCursor;
+    for(auto& archetypes : _archetypes)
+    {
+        if(skip >= archetypes.size())
+        {
+            skip -= archetypes.size();
+            continue;
+        }
+        for(size_t i = skip; i < archetypes.size() && stats.archetypesVisited < maxArchetypes; ++i)
+        {
+            size_t reclaimed = archetypes[i]->shrinkToFit();
+            stats.chunksShrunk += reclaimed != 0;
+            stats.bytesReclaimed += reclaimed;
+            ++stats.archetypesVisited;
+            ++_compactionCursor;
+        }
+        skip = 0;
+        if(stats.archetypesVisited == maxArchetypes)
+            break;
+    }
+
+    if(_chunkAllocator->unusedBytes() > _poolHighWaterMark)
+        stats.pooledBytesFreed = _chunkAllocator->trim(_poolHighWaterMark);
+    return stats;
+}
+
+ArchetypeManager::MemoryStats ArchetypeManager::memoryStats()
+{
+    MemoryStats stats;
+    for(auto& archetype : *this)
+    {
+        ArchetypeMemoryStats a = archetype.memoryStats();
+        stats.archetypes.entities += a.entities;
+        stats.archetypes.chunks += a.chunks;
+        stats.archetypes.capacity += a.capacity;
+        stats.archetypes.allocatedBytes += a.allocatedBytes;
+        stats.archetypes.usedBytes += a.usedBytes;
+        stats.archetypes.partialChunks += a.partialChunks;
+        stats.archetypes.reclaimableBytes += a.reclaimableBytes;
+        ++stats.archetypeCount;
+    }
+    stats.pooledBytes = _chunkAllocator->unusedBytes();
+    return stats;
+}
+
+ArchetypeManager::QuerySignature::QuerySignature(const ComponentFilter& filter)
+    : required(filter.required()), excluded(filter.excluded())
+{}
+
+bool ArchetypeManager::QuerySignature::matches(const Archetype* archetype) const
+{
+    return archetype->components().contains(required) && !archetype->components().intersects(excluded);
+}
+
+bool ArchetypeManager::QuerySignature::operator==(const QuerySignature& o) const
+{
+    return required == o.required && excluded == o.excluded;
+}
+
+size_t ArchetypeManager::QuerySignatureHash::operator()(const QuerySignature& signature) const
+{
+    return signature.required.signature() ^ (signature.excluded.signature() * 31);
+}
+
 ArchetypeManager::iterator ArchetypeManager::begin() { return {0, 0, *this}; }
 
 ArchetypeManager::iterator ArchetypeManager::end() { return {_archetypes.size(), 0, *this}; }
@@ -13,15 +13,76 @@ class ComponentManager;
 
 class ArchetypeManager
 {
+  public:
+    // The parts of a ComponentFilter that decide which archetypes it matches, order and const/changed flags are
+    // ignored so that equivalent filters share a cache entry
+    struct QuerySignature
+    {
+        ComponentSet required;
+        ComponentSet excluded;
+
+        QuerySignature(const ComponentFilter& filter);
+
+        bool matches(const Archetype* archetype) const;
+
+        bool operator==(const QuerySignature& o) const;
+    };
+
+    struct QuerySignatureHash
+    {
+        size_t operator()(const QuerySignature& signature) const;
+    };
+
+    struct QueryCacheStats
+    {
+        size_t hits = 0;
+        size_t misses = 0;
+        size_t entries = 0;
+    };
+
+    struct MemoryStats
+    {
+        // Summed over every archetype
+        ArchetypeMemoryStats archetypes;
+        size_t archetypeCount = 0;
+        size_t pooledBytes = 0;
+    };
+
+    struct CompactionStats
+    {
+        size_t archetypesVisited = 0;
+        size_t chunksShrunk = 0;
+        // Bytes shrunk chunks no longer hold, and bytes of pooled chunks freed to get under the high-water mark
+        size_t bytesReclaimed = 0;
+        size_t pooledBytesFreed = 0;
+    };
+
 #ifdef TEST_BUILD
   public:
+#else
+  private:
 #endif
 
     std::shared_ptr<ChunkPool> _chunkAllocator;
+    ChunkLayout _chunkLayout;
     // Index 1: number of components, Index 2: archetype
     std::vector<std::vector<std::unique_ptr<Archetype>>> _archetypes;
     std::unordered_map<ComponentID, std::unordered_set<Archetype*>> _compToArch;
+    std::unordered_map<ComponentSet, Archetype*> _archetypeLookup;
     ComponentManager& _componentManager;
+    // Incremented every time an archetype is created or destroyed, used to invalidate cached archetype lists
+    size_t _generation = 0;
+
+    // Archetype lists of previously seen queries, kept up to date as archetypes are created and destroyed
+    std::mutex _queryCacheLock;
+    std::unordered_map<QuerySignature, std::vector<Archetype*>, QuerySignatureHash> _queryCache;
+    QueryCacheStats _queryCacheStats;
+
+    // Pooled chunk bytes kept for reuse by compact(), and where the incremental pass stopped
+    size_t _poolHighWaterMark = 4 * 1024 * 1024;
+    size_t _compactionCursor = 0;
+
+    std::vector<Archetype*> findArchetypes(const QuerySignature& signature);
 
   public:
     class iterator
@@ -50,12 +111,44 @@ class ArchetypeManager
 
     Archetype* makeArchetype(const ComponentSet& components);
 
+    // Archetype reached by adding or removing one component. Edges are only built the first time a transition is taken
+    // and are linked in both directions, so the way back is free. Removing the last component gives nullptr.
+    Archetype* addTransition(Archetype* from, ComponentID component);
+
+    Archetype* removeTransition(Archetype* from, ComponentID component);
+
     void destroyArchetype(Archetype* archetype);
 
     std::vector<Archetype*> getArchetypes(const ComponentFilter& filter);
 
     void clear();
 
+    size_t generation() const;
+
+    // Starts a new row change tracking period for every archetype, called once per frame
+    void rotateChangedRows(uint32_t periodStart);
+
+    QueryCacheStats queryCacheStats();
+
+    // Only affects archetypes created afterwards. Throws if a chunk size is zero or minChunkSize is above chunkSize.
+    void setChunkLayout(const ChunkLayout& layout);
+
+    const ChunkLayout& chunkLayout() const;
+
+    // Bytes of chunks waiting in the pool to be reused
+    size_t pooledChunkBytes() const;
+
+    void setPoolHighWaterMark(size_t bytes);
+
+    size_t poolHighWaterMark() const;
+
+    // One step of the incremental compaction pass. Shrinks archetypes whose only chunk is mostly empty, visiting at
+    // most maxArchetypes and carrying on where the previous step stopped, then frees pooled chunks above the high-water
+    // mark. Moves component data, so it must not run at the same time as systems.
+    CompactionStats compact(size_t maxArchetypes = 16);
+
+    MemoryStats memoryStats();
+
     iterator begin();
 
     iterator end();
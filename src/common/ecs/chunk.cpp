@@ -1,30 +1,195 @@
 #include "chunk.h"
 #include "component.h"
 
-void operator>>(ChunkPool& pool, std::unique_ptr<Chunk>& dest)
+#include <algorithm>
+#include <functional>
+#include <new>
+
+void ColumnLock::waitShared()
+{
+    // The writer may be this thread reading a column it's writing
+    if(_owner.load(std::memory_order_relaxed) == std::this_thread::get_id())
+        return;
+    while(true)
+    {
+        _state.fetch_sub(1, std::memory_order_relaxed);
+        while(_state.load(std::memory_order_relaxed) & writerBit)
+            std::this_thread::yield();
+        if(!(_state.fetch_add(1, std::memory_order_acquire) & writerBit))
+            return;
+    }
+}
+
+void ColumnLock::lock()
+{
+    if(_owner.load(std::memory_order_relaxed) == std::this_thread::get_id())
+    {
+        ++_writeDepth;
+        return;
+    }
+    waitExclusive();
+    _owner.store(std::this_thread::get_id(), std::memory_order_relaxed);
+    _writeDepth = 1;
+}
+
+void ColumnLock::waitExclusive()
 {
-    std::scoped_lock lock(pool._m);
-    if(!pool._unused.empty())
+    uint32_t expected = 0;
+    while(!_state.compare_exchange_weak(expected, writerBit, std::memory_order_acquire, std::memory_order_relaxed))
     {
-        dest = std::move(pool._unused[pool._unused.size() - 1]);
-        pool._unused.erase(pool._unused.end() - 1);
+        expected = 0;
+        std::this_thread::yield();
     }
-    else
-        dest = std::make_unique<Chunk>();
 }
 
-void operator<<(ChunkPool& pool, std::unique_ptr<Chunk>& src)
+void ColumnLock::unlock()
 {
-    std::scoped_lock lock(pool._m);
-    src->clear();
-    pool._unused.emplace_back(std::move(src));
+    assert(_writeDepth > 0 && _owner.load(std::memory_order_relaxed) == std::this_thread::get_id());
+    if(--_writeDepth > 0)
+        return;
+    _owner.store(std::thread::id(), std::memory_order_relaxed);
+    _state.fetch_and(~writerBit, std::memory_order_release);
+}
+
+size_t ChunkLayout::columnsSize(const std::vector<const ComponentDescription*>& components, size_t capacity) const
+{
+    size_t offset = 0;
+    for(auto& c : components)
+        offset = alignColumn(offset, columnAlignment) + c->size() * capacity;
+    return offset;
+}
+
+size_t ChunkLayout::capacity(const std::vector<const ComponentDescription*>& components, size_t allocationSize) const
+{
+    size_t entitySize = 0;
+    for(auto& c : components)
+        entitySize += c->size();
+    // Start from the estimate that ignores padding, every column loses at most columnAlignment - 1 bytes to it
+    size_t capacity = allocationSize / entitySize;
+    while(capacity > 0 && columnsSize(components, capacity) > allocationSize)
+        --capacity;
+    return capacity;
+}
+
+ColumnIndex::ColumnIndex(const std::vector<const ComponentDescription*>& components) : _components(components)
+{
+    assert(components.size() < noColumn);
+    for(size_t i = 0; i < components.size(); ++i)
+    {
+        ComponentID id = components[i]->id;
+        if(id >= _columns.size())
+            _columns.resize(id + 1, noColumn);
+        _columns[id] = static_cast<uint16_t>(i);
+    }
 }
 
-ChunkComponentView::ChunkComponentView(byte* data, size_t maxSize, const ComponentDescription* def)
-    : _data(data), _maxSize(maxSize), _description(def)
+Chunk::Chunk(size_t allocationSize) : _size(0), _maxCapacity(0), _allocationSize(allocationSize)
+{
+    _data = static_cast<byte*>(::operator new(allocationSize, std::align_val_t(maxAlignment)));
+}
+
+Chunk::~Chunk()
+{
+    clear();
+    ::operator delete(_data, std::align_val_t(maxAlignment));
+}
+
+void Chunk::setComponents(const ColumnIndex& index, const ChunkLayout& layout)
+{
+    clear();
+    assert(layout.columnAlignment <= maxAlignment && std::has_single_bit(layout.columnAlignment));
+    const auto& components = index.components();
+    _index = &index;
+    _maxCapacity = layout.capacity(components, _allocationSize);
+    if(_lockCount < components.size())
+    {
+        _locks = std::make_unique<ColumnLock[]>(components.size());
+        _lockCount = components.size();
+    }
+    _columns.reserve(components.size());
+
+    size_t offset = 0;
+    for(size_t i = 0; i < components.size(); ++i)
+    {
+        offset = alignColumn(offset, layout.columnAlignment);
+        _columns.emplace_back(_data + offset, _maxCapacity, components[i], &_locks[i]);
+        offset += components[i]->size() * _maxCapacity;
+    }
+}
+
+std::unique_ptr<Chunk> ChunkPool::allocate(size_t allocationSize)
+{
+    std::scoped_lock lock(_m);
+    auto unused = _unused.find(allocationSize);
+    if(unused == _unused.end() || unused->second.empty())
+        return std::make_unique<Chunk>(allocationSize);
+    std::unique_ptr<Chunk> chunk = std::move(unused->second.back());
+    unused->second.pop_back();
+    _unusedBytes -= allocationSize;
+    return chunk;
+}
+
+void ChunkPool::release(std::unique_ptr<Chunk> chunk)
+{
+    chunk->clear();
+    std::scoped_lock lock(_m);
+    _unusedBytes += chunk->allocationSize();
+    _unused[chunk->allocationSize()].push_back(std::move(chunk));
+}
+
+size_t ChunkPool::unusedBytes()
+{
+    std::scoped_lock lock(_m);
+    return _unusedBytes;
+}
+
+size_t ChunkPool::trim(size_t maxUnusedBytes)
+{
+    // Chunks are freed once the lock is released
+    std::vector<std::unique_ptr<Chunk>> freed;
+    size_t freedBytes = 0;
+    {
+        std::scoped_lock lock(_m);
+        if(_unusedBytes <= maxUnusedBytes)
+            return 0;
+        std::vector<size_t> sizes;
+        for(auto& [size, chunks] : _unused)
+            sizes.push_back(size);
+        std::sort(sizes.begin(), sizes.end(), std::greater<>());
+        for(size_t size : sizes)
+        {
+            auto& chunks = _unused[size];
+            while(_unusedBytes > maxUnusedBytes && !chunks.empty())
+            {
+                freed.push_back(std::move(chunks.back()));
+                chunks.pop_back();
+                _unusedBytes -= size;
+                freedBytes += size;
+            }
+            if(chunks.empty())
+                _unused.erase(size);
+        }
+    }
+    return freedBytes;
+}
+
+void operator>>(ChunkPool& pool, std::unique_ptr<Chunk>& dest) { dest = pool.allocate(ChunkLayout().chunkSize); }
+
+void operator<<(ChunkPool& pool, std::unique_ptr<Chunk>& src) { pool.release(std::move(src)); }
+
+ChunkComponentView::ChunkComponentView(byte* data,
+                                       size_t maxSize,
+                                       const ComponentDescription* def,
+                                       ColumnLock* lock)
+    : _data(data), _maxSize(maxSize), _description(def), _lock(lock)
 {
     _size = 0;
     version = 0;
+    if(def->trackRowChanges)
+    {
+        _changedRows.resize((maxSize + 63) / 64, 0);
+        _previousChangedRows.resize(_changedRows.size(), 0);
+    }
 }
 
 ChunkComponentView::ChunkComponentView(const ChunkComponentView& o)
@@ -33,7 +198,12 @@ ChunkComponentView::ChunkComponentView(const ChunkComponentView& o)
     _data = o._data;
     _size = o._size;
     _maxSize = o._maxSize;
+    _lock = o._lock;
     version = o.version;
+    _changedRows = o._changedRows;
+    _previousChangedRows = o._previousChangedRows;
+    _changedSince = o._changedSince;
+    _previousChangedSince = o._previousChangedSince;
 }
 
 ChunkComponentView& ChunkComponentView::operator=(const ChunkComponentView& o)
@@ -42,7 +212,12 @@ ChunkComponentView& ChunkComponentView::operator=(const ChunkComponentView& o)
     _data = o._data;
     _size = o._size;
     _maxSize = o._maxSize;
+    _lock = o._lock;
     version = o.version;
+    _changedRows = o._changedRows;
+    _previousChangedRows = o._previousChangedRows;
+    _changedSince = o._changedSince;
+    _previousChangedSince = o._previousChangedSince;
     return *this;
 }
 
@@ -52,7 +227,12 @@ ChunkComponentView::ChunkComponentView(ChunkComponentView&& o)
     _data = o._data;
     _size = o._size;
     _maxSize = o._maxSize;
+    _lock = o._lock;
     version = o.version;
+    _changedRows = std::move(o._changedRows);
+    _previousChangedRows = std::move(o._previousChangedRows);
+    _changedSince = o._changedSince;
+    _previousChangedSince = o._previousChangedSince;
     o._data = nullptr;
     o._size = 0;
     o.version = 0;
@@ -60,8 +240,8 @@ ChunkComponentView::ChunkComponentView(ChunkComponentView&& o)
 
 ChunkComponentView::~ChunkComponentView()
 {
-    for(size_t i = 0; i < _size; ++i)
-        _description->deconstruct(dataIndex(i));
+    if(_size > 0)
+        _description->deconstruct(_data, _size);
 }
 
 VirtualComponentView ChunkComponentView::operator[](size_t index) const
@@ -76,15 +256,52 @@ void ChunkComponentView::createComponent()
 {
     assert(_size < _maxSize);
     _description->construct(dataIndex(_size));
+    markRowsChanged(_size, _size + 1);
     ++_size;
 }
 
+void ChunkComponentView::createComponents(size_t count)
+{
+    assert(_size + count <= _maxSize);
+    _description->construct(dataIndex(_size), count);
+    markRowsChanged(_size, _size + count);
+    _size += count;
+}
+
+void ChunkComponentView::truncate(size_t size)
+{
+    assert(size <= _size);
+    _description->deconstruct(dataIndex(size), _size - size);
+    _size = size;
+}
+
+void ChunkComponentView::moveComponents(ChunkComponentView& dest, size_t srcIndex, size_t destIndex, size_t count)
+{
+    assert(srcIndex + count <= _size);
+    assert(destIndex + count <= dest._size);
+    assert(_description == dest._description);
+    dest.markRowsChanged(destIndex, destIndex + count);
+    _description->move(dataIndex(srcIndex), dest.dataIndex(destIndex), count);
+}
+
 void ChunkComponentView::erase(size_t index)
 {
     assert(index < _size);
     --_size;
-    if(_size > 0)
+    if(index != _size)
+    {
         _description->move(dataIndex(_size), dataIndex(index));
+        // The last row takes over the erased one, so it has to bring its changes with it
+        if(!_changedRows.empty())
+        {
+            uint64_t lastBit = uint64_t(1) << (_size % 64);
+            uint64_t indexBit = uint64_t(1) << (index % 64);
+            if(_changedRows[_size / 64] & lastBit)
+                _changedRows[index / 64] |= indexBit;
+            if(_previousChangedRows[_size / 64] & lastBit)
+                _previousChangedRows[index / 64] |= indexBit;
+        }
+    }
     _description->deconstruct(dataIndex(_size));
 }
 
@@ -98,12 +315,14 @@ void ChunkComponentView::setComponent(size_t index, const VirtualComponentView c
 {
     assert(index < _size);
     _description->copy(component.data(), dataIndex(index));
+    markRowsChanged(index, index + 1);
 }
 
 void ChunkComponentView::setComponent(size_t index, VirtualComponent&& component)
 {
     assert(index < _size);
     _description->move(component.data(), dataIndex(index));
+    markRowsChanged(index, index + 1);
 }
 
 byte* ChunkComponentView::getComponentData(size_t index)
@@ -112,10 +331,70 @@ byte* ChunkComponentView::getComponentData(size_t index)
     return dataIndex(index);
 }
 
-void ChunkComponentView::lockShared() { _mutex.lock_shared(); }
+bool ChunkComponentView::tracksRowChanges() const { return !_changedRows.empty(); }
+
+void ChunkComponentView::markRowsChanged(size_t begin, size_t end)
+{
+    if(_changedRows.empty())
+        return;
+    assert(end <= _maxSize);
+    while(begin < end)
+    {
+        size_t bit = begin % 64;
+        size_t count = std::min<size_t>(64 - bit, end - begin);
+        uint64_t bits = count == 64 ? ~uint64_t(0) : ((uint64_t(1) << count) - 1) << bit;
+        _changedRows[begin / 64] |= bits;
+        begin += count;
+    }
+}
+
+void ChunkComponentView::markRowsChanged(const uint64_t* rows)
+{
+    if(_changedRows.empty())
+        return;
+    for(size_t word = 0; word * 64 < _size; ++word)
+        _changedRows[word] |= rows[word];
+}
+
+void ChunkComponentView::rotateChangedRows(uint32_t periodStart)
+{
+    if(_changedRows.empty())
+        return;
+    std::swap(_changedRows, _previousChangedRows);
+    std::fill(_changedRows.begin(), _changedRows.end(), 0);
+    _previousChangedSince = _changedSince;
+    _changedSince = periodStart;
+}
+
+void ChunkComponentView::copyChangesFrom(const ChunkComponentView& src)
+{
+    assert(_description == src._description);
+    version = src.version;
+    if(_changedRows.empty())
+        return;
+    size_t words = std::min(_changedRows.size(), src._changedRows.size());
+    std::fill(_changedRows.begin(), _changedRows.end(), 0);
+    std::fill(_previousChangedRows.begin(), _previousChangedRows.end(), 0);
+    std::copy_n(src._changedRows.begin(), words, _changedRows.begin());
+    std::copy_n(src._previousChangedRows.begin(), words, _previousChangedRows.begin());
+    _changedSince = src._changedSince;
+    _previousChangedSince = src._previousChangedSince;
+}
+
+bool ChunkComponentView::intersectChangedRows(uint32_t since, uint64_t* rows) const
+{
+    // Changes made at since + 1 or later are needed, the previous period only covers those from its start onwards
+    if(_changedRows.empty() || since + 1 < _previousChangedSince)
+        return false;
+    for(size_t word = 0; word * 64 < _size; ++word)
+        rows[word] &= _changedRows[word] | _previousChangedRows[word];
+    return true;
+}
+
+void ChunkComponentView::lockShared() { _lock->lockShared(); }
 
-void ChunkComponentView::unlockShared() { _mutex.unlock_shared(); }
+void ChunkComponentView::unlockShared() { _lock->unlockShared(); }
 
-void ChunkComponentView::lock() { _mutex.lock(); }
+void ChunkComponentView::lock() { _lock->lock(); }
 
-void ChunkComponentView::unlock() { _mutex.unlock(); }
+void ChunkComponentView::unlock() { _lock->unlock(); }
@@ -1,11 +1,49 @@
 #pragma once
 
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <limits>
+#include <memory>
+#include <thread>
 #include <vector>
 #include "virtualType.h"
 
 #include "component.h"
-#include "utility/sharedRecursiveMutex.h"
+
+// Reader-writer lock for a chunk column. Taking a shared lock is a single atomic add when no writer holds the lock, so
+// concurrent readers never wait on each other. Like SharedRecursiveMutex, writers wait until there are no readers
+// rather than holding new ones back, so a thread can nest shared locks safely, and the thread holding the write lock
+// may lock the column again in either mode.
+class ColumnLock
+{
+    static constexpr uint32_t writerBit = 1u << 31;
+
+    // Reader count, plus writerBit while a writer holds the lock
+    std::atomic<uint32_t> _state = 0;
+    std::atomic<std::thread::id> _owner;
+    uint32_t _writeDepth = 0;
+
+    void waitShared();
+
+    void waitExclusive();
+
+  public:
+    void lockShared()
+    {
+        if(!(_state.fetch_add(1, std::memory_order_acquire) & writerBit))
+            return;
+        waitShared();
+    }
+
+    void unlockShared() { _state.fetch_sub(1, std::memory_order_release); }
+
+    void lock();
+
+    void unlock();
+};
 
 class ChunkComponentView
 {
@@ -16,14 +54,22 @@ class ChunkComponentView
 
     byte* dataIndex(size_t index) const;
 
-    SharedRecursiveMutex _mutex;
+    // Owned by the chunk, so views stay small and cheap to move around
+    ColumnLock* _lock = nullptr;
+
+    // Rows changed since _changedSince, and in the tracking period before that. Empty unless the component has
+    // trackRowChanges set.
+    std::vector<uint64_t> _changedRows;
+    std::vector<uint64_t> _previousChangedRows;
+    uint32_t _changedSince = 0;
+    uint32_t _previousChangedSince = 0;
 
   public:
     uint32_t version = 0;
 
     ChunkComponentView() = default;
 
-    ChunkComponentView(byte* data, size_t maxSize, const ComponentDescription* def);
+    ChunkComponentView(byte* data, size_t maxSize, const ComponentDescription* def, ColumnLock* lock);
 
     ChunkComponentView(const ChunkComponentView&);
 
@@ -37,14 +83,39 @@ class ChunkComponentView
 
     void createComponent();
 
+    void createComponents(size_t count);
+
     void erase(size_t index);
 
+    // Destroys all components from index size onwards
+    void truncate(size_t size);
+
+    // Moves count components starting at srcIndex into already constructed slots of dest
+    void moveComponents(ChunkComponentView& dest, size_t srcIndex, size_t destIndex, size_t count);
+
     void setComponent(size_t index, VirtualComponentView component);
 
     void setComponent(size_t index, VirtualComponent&& component);
 
     byte* getComponentData(size_t index);
 
+    bool tracksRowChanges() const;
+
+    void markRowsChanged(size_t begin, size_t end);
+
+    // Marks every row set in rows, which holds a bit per row up to size()
+    void markRowsChanged(const uint64_t* rows);
+
+    // Starts a new tracking period, rows changed before the previous period are forgotten
+    void rotateChangedRows(uint32_t periodStart);
+
+    // Clears the bits in rows of every row not changed after since. Returns false and leaves rows alone if changes
+    // that old aren't tracked anymore, in which case any row may have changed.
+    bool intersectChangedRows(uint32_t since, uint64_t* rows) const;
+
+    // Takes over the version and changed rows of src, for rows that were moved here without being modified
+    void copyChangesFrom(const ChunkComponentView& src);
+
     void lockShared();
 
     void unlockShared();
@@ -60,84 +131,228 @@ class ChunkComponentView
     const ComponentDescription* def();
 };
 
-template<size_t N>
-class ChunkBase
+// Calls f with the index of every set bit in rows below count
+template<class F>
+void forEachSetRow(const uint64_t* rows, size_t count, F&& f)
+{
+    for(size_t word = 0; word * 64 < count; ++word)
+    {
+        uint64_t bits = rows[word];
+        while(bits)
+        {
+            size_t row = word * 64 + std::countr_zero(bits);
+            if(row >= count)
+                return;
+            f(row);
+            bits &= bits - 1;
+        }
+    }
+}
+
+// Calls f(begin, end) for every run of consecutive set bits in the first count bits of rows
+template<class F>
+void forEachSetRange(const uint64_t* rows, size_t count, F&& f)
+{
+    auto find = [rows, count](size_t from, bool set) {
+        for(size_t word = from / 64; word * 64 < count; ++word)
+        {
+            uint64_t bits = set ? rows[word] : ~rows[word];
+            if(word == from / 64)
+                bits &= ~uint64_t(0) << (from % 64);
+            if(bits)
+                return std::min(count, word * 64 + std::countr_zero(bits));
+        }
+        return count;
+    };
+    for(size_t begin = find(0, true); begin < count;)
+    {
+        size_t end = find(begin, false);
+        f(begin, end);
+        begin = find(end, true);
+    }
+}
+
+inline size_t alignColumn(size_t offset, size_t alignment) { return (offset + alignment - 1) & ~(alignment - 1); }
+
+// How an ArchetypeManager lays out the chunks of its archetypes
+struct ChunkLayout
+{
+    // Most bytes a chunk of component data may take, chunks are trimmed down to what their columns actually use
+    size_t chunkSize = 16384;
+    // Every column starts on a multiple of this, at most Chunk::maxAlignment. 64 gives each column its own cache
+    // lines, 16 or 32 is enough for aligned SIMD loads.
+    size_t columnAlignment = 64;
+    // When smaller than chunkSize, an archetype's first chunk starts out this big and doubles every time it fills up,
+    // so archetypes with only a few entities don't each hold on to a full chunk
+    size_t minChunkSize = 16384;
+
+    // Bytes needed for capacity entities with the columns aligned
+    size_t columnsSize(const std::vector<const ComponentDescription*>& components, size_t capacity) const;
+
+    // Most entities that fit in allocationSize bytes
+    size_t capacity(const std::vector<const ComponentDescription*>& components, size_t allocationSize) const;
+};
+
+// Which column of an archetype's chunks holds each component. The archetype owns one and its chunks point to it, so
+// finding a column is an array lookup instead of a hash map search in every chunk.
+class ColumnIndex
+{
+    static constexpr uint16_t noColumn = std::numeric_limits<uint16_t>::max();
+
+    std::vector<const ComponentDescription*> _components;
+    // Column of each component by ComponentID, noColumn for components not in the archetype
+    std::vector<uint16_t> _columns;
+
+  public:
+    static constexpr size_t none = std::numeric_limits<size_t>::max();
+
+    ColumnIndex() = default;
+
+    explicit ColumnIndex(const std::vector<const ComponentDescription*>& components);
+
+    // Column holding id, or none
+    size_t find(ComponentID id) const
+    {
+        if(id >= _columns.size() || _columns[id] == noColumn)
+            return none;
+        return _columns[id];
+    }
+
+    const std::vector<const ComponentDescription*>& components() const { return _components; }
+
+    size_t size() const { return _components.size(); }
+};
+
+class Chunk
 {
 #ifdef TEST_BUILD
   public:
 #endif
     size_t _size;
     size_t _maxCapacity;
-    std::array<byte, N> _data;
-    std::unordered_map<ComponentID, ChunkComponentView> _components;
+    size_t _allocationSize;
+    byte* _data;
+    const ColumnIndex* _index = nullptr;
+    std::vector<ChunkComponentView> _columns;
+    // One per column, kept while the chunk sits in a pool so reusing it doesn't reallocate them
+    std::unique_ptr<ColumnLock[]> _locks;
+    size_t _lockCount = 0;
 
   public:
-    ChunkBase() { _size = 0; }
+    static constexpr size_t maxAlignment = 64;
 
-    ChunkBase(const ChunkBase&) = delete;
+    Chunk(size_t allocationSize = ChunkLayout().chunkSize);
 
-    ~ChunkBase() { clear(); }
+    Chunk(const Chunk&) = delete;
 
-    void setComponents(std::vector<const ComponentDescription*> components)
-    {
-        clear();
-        _components.reserve(components.size());
-        byte* componentDataStart = _data.data();
-        size_t entitySize = 0;
-        for(auto& c : components)
-            entitySize += c->size();
-        _maxCapacity = N / entitySize;
+    ~Chunk();
 
-        for(auto& c : components)
-        {
-            _components.insert({c->id, ChunkComponentView{componentDataStart, _maxCapacity, c}});
-            componentDataStart += c->size() * _maxCapacity;
-        }
+    // Lays out a column for each component of index, aligned as the layout asks. index must outlive the chunk's use
+    // of it, which lasts until the next clear().
+    void setComponents(const ColumnIndex& index, const ChunkLayout& layout = {});
+
+    const ColumnIndex& columnIndex() const
+    {
+        assert(_index);
+        return *_index;
     }
 
-    const std::unordered_map<ComponentID, ChunkComponentView>& components() { return _components; }
+    // Columns in the order of columnIndex().components()
+    std::vector<ChunkComponentView>& columns() { return _columns; }
 
-    bool hasComponent(uint32_t id) { return _components.contains(id); }
+    ChunkComponentView& column(size_t index)
+    {
+        assert(index < _columns.size());
+        return _columns[index];
+    }
+
+    bool hasComponent(uint32_t id) const { return _index && _index->find(id) != ColumnIndex::none; }
 
     ChunkComponentView& getComponent(uint32_t id)
     {
-        auto c = _components.find(id);
-        if(c != _components.end())
-            return c->second;
+        size_t c = _index ? _index->find(id) : ColumnIndex::none;
+        if(c != ColumnIndex::none)
+            return _columns[c];
         throw std::runtime_error("Tried to access component not contained by chunk");
     }
 
     bool tryGetComponent(uint32_t id, ChunkComponentView*& view)
     {
-        auto c = _components.find(id);
-        bool found = c != _components.end();
-        if(found)
-            view = &c->second;
-        return found;
+        size_t c = _index ? _index->find(id) : ColumnIndex::none;
+        if(c == ColumnIndex::none)
+            return false;
+        view = &_columns[c];
+        return true;
     }
 
     size_t createEntity()
     {
         assert(_size < _maxCapacity);
-        for(auto& c : _components)
+        for(auto& c : _columns)
         {
-            c.second.createComponent();
-            c.second.version++;
+            c.createComponent();
+            c.version++;
         }
         return _size++;
     }
 
-    void moveEntity(ChunkBase* dest, size_t sIndex, size_t dIndex)
+    size_t createEntities(size_t count)
+    {
+        assert(_size + count <= _maxCapacity);
+        for(auto& c : _columns)
+        {
+            c.createComponents(count);
+            c.version++;
+        }
+        size_t first = _size;
+        _size += count;
+        return first;
+    }
+
+    // Moves a contiguous range of entities, dest may be this chunk as long as the ranges don't overlap
+    void moveEntities(Chunk* dest, size_t sIndex, size_t dIndex, size_t count)
+    {
+        assert(sIndex + count <= _size);
+        assert(dIndex + count <= dest->_size);
+        bool sameColumns = dest->_index == _index;
+        for(size_t i = 0; i < _columns.size(); ++i)
+        {
+            ChunkComponentView& c = _columns[i];
+            ChunkComponentView* oc = sameColumns ? &dest->_columns[i] : nullptr;
+            if(oc || dest->tryGetComponent(c.compID(), oc))
+            {
+                c.moveComponents(*oc, sIndex, dIndex, count);
+                oc->version = std::max(oc->version, c.version);
+            }
+        }
+    }
+
+    // Removes the last count entities
+    void removeEntities(size_t count)
+    {
+        assert(count <= _size);
+        _size -= count;
+        for(auto& c : _columns)
+        {
+            c.truncate(_size);
+            assert(_size == c.size());
+        }
+    }
+
+    void moveEntity(Chunk* dest, size_t sIndex, size_t dIndex)
     {
         assert(sIndex < _size);
         assert(dIndex < dest->_size);
-        for(auto& c : _components)
+        bool sameColumns = dest->_index == _index;
+        for(size_t i = 0; i < _columns.size(); ++i)
         {
-            ChunkComponentView* oc = nullptr;
-            if(dest->tryGetComponent(c.second.compID(), oc))
+            ChunkComponentView& c = _columns[i];
+            ChunkComponentView* oc = sameColumns ? &dest->_columns[i] : nullptr;
+            if(oc || dest->tryGetComponent(c.compID(), oc))
             {
-                c.second.def()->move(c.second[sIndex].data(), (*oc)[dIndex].data());
-                oc->version = std::max(oc->version, c.second.version);
+                c.def()->move(c[sIndex].data(), (*oc)[dIndex].data());
+                oc->version = std::max(oc->version, c.version);
+                oc->markRowsChanged(dIndex, dIndex + 1);
             }
         }
     }
@@ -146,33 +361,35 @@ class ChunkBase
     {
         assert(index < _size);
         --_size;
-        for(auto& c : _components)
+        for(auto& c : _columns)
         {
-            c.second.erase(index);
-            assert(_size == c.second.size());
+            c.erase(index);
+            assert(_size == c.size());
         }
     }
 
     void clear()
     {
-        _components.clear();
+        _columns.clear();
+        _index = nullptr;
         _size = 0;
         _maxCapacity = 0;
     }
 
-    size_t size() { return _size; }
-
-    size_t maxCapacity() { return _maxCapacity; }
+    void rotateChangedRows(uint32_t periodStart)
+    {
+        for(auto& c : _columns)
+            c.rotateChangedRows(periodStart);
+    }
 
-    byte* data() { return _data.data(); }
+    size_t size() const { return _size; }
 
-    static size_t allocationSize() { return N; }
-};
+    size_t maxCapacity() const { return _maxCapacity; }
 
-template<size_t>
-class ChunkBase;
+    byte* data() { return _data; }
 
-using Chunk = ChunkBase<16384>;
+    size_t allocationSize() const { return _allocationSize; }
+};
 
 class ChunkPool
 {
@@ -180,10 +397,24 @@ class ChunkPool
   public:
 #endif
     std::mutex _m;
-    std::vector<std::unique_ptr<Chunk>> _unused;
+    // Unused chunks by allocation size
+    std::unordered_map<size_t, std::vector<std::unique_ptr<Chunk>>> _unused;
+    // Total size of the chunks in _unused, so checking it against a limit doesn't walk the map
+    size_t _unusedBytes = 0;
 
   public:
+    std::unique_ptr<Chunk> allocate(size_t allocationSize);
+
+    void release(std::unique_ptr<Chunk> chunk);
+
+    // Allocates a chunk of the default size
     friend void operator>>(ChunkPool& pool, std::unique_ptr<Chunk>& dest);
 
     friend void operator<<(ChunkPool& pool, std::unique_ptr<Chunk>& src);
+
+    // Bytes held by chunks waiting to be reused
+    size_t unusedBytes();
+
+    // Frees unused chunks, biggest first, until at most maxUnusedBytes are left. Returns the bytes freed.
+    size_t trim(size_t maxUnusedBytes);
 };
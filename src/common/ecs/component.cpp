@@ -18,20 +18,66 @@ ComponentDescription::ComponentDescription(const std::vector<VirtualType::Type>&
 ComponentDescription::ComponentDescription(const std::vector<VirtualType::Type>& members,
                                            const std::vector<size_t>& offsets,
                                            size_t size)
-    : ComponentDescription(members, offsets)
+    : _size(size)
 {
-    _size = size;
+    setMembers(members, offsets);
+    buildCopyPlan();
 }
 
 ComponentDescription::ComponentDescription(const std::vector<VirtualType::Type>& members,
                                            const std::vector<size_t>& offsets)
+{
+    setMembers(members, offsets);
+    buildCopyPlan();
+}
+
+void ComponentDescription::setMembers(const std::vector<VirtualType::Type>& members, const std::vector<size_t>& offsets)
 {
     _members.resize(members.size());
     for(size_t i = 0; i < members.size(); i++)
     {
         _members[i].type = members[i];
         _members[i].offset = offsets[i];
+        _pod &= VirtualType::triviallyRelocatable(members[i]);
+    }
+}
+
+void ComponentDescription::buildCopyPlan()
+{
+    _plainRanges.clear();
+    _complexMembers.clear();
+    if(_pod)
+        _plainRanges.push_back({0, _size});
+    else
+    {
+        std::vector<Member> sorted = _members;
+        std::sort(sorted.begin(), sorted.end(), [](const Member& a, const Member& b) { return a.offset < b.offset; });
+        bool extendRange = false;
+        for(auto& m : sorted)
+        {
+            if(!VirtualType::triviallyRelocatable(m.type))
+            {
+                _complexMembers.push_back(m);
+                extendRange = false;
+                continue;
+            }
+            // Neighbouring plain members share a range, along with any padding between them
+            size_t end = m.offset + VirtualType::size(m.type);
+            if(extendRange)
+                _plainRanges.back().size = end - _plainRanges.back().offset;
+            else
+                _plainRanges.push_back({m.offset, end - m.offset});
+            extendRange = true;
+        }
+    }
+
+    _defaultValue.assign(_size, 0);
+    for(auto& m : _members)
+    {
+        if(VirtualType::triviallyRelocatable(m.type))
+            VirtualType::construct(m.type, _defaultValue.data() + m.offset);
     }
+    _zeroDefault = std::all_of(_defaultValue.begin(), _defaultValue.end(), [](byte b) { return b == 0; });
 }
 
 std::vector<size_t> ComponentDescription::generateOffsets(const std::vector<VirtualType::Type>& members)
@@ -56,18 +102,34 @@ std::vector<size_t> ComponentDescription::generateOffsets(const std::vector<Virt
 
 void ComponentDescription::construct(byte* component) const
 {
-    for(auto& m : _members)
-    {
+    std::memcpy(component, _defaultValue.data(), _size);
+    for(auto& m : _complexMembers)
         VirtualType::construct(m.type, component + m.offset);
-    }
 }
 
 void ComponentDescription::deconstruct(byte* component) const
 {
-    for(auto& m : _members)
-    {
+    for(auto& m : _complexMembers)
         VirtualType::deconstruct(m.type, component + m.offset);
+}
+
+void ComponentDescription::construct(byte* components, size_t count) const
+{
+    if(_pod && _zeroDefault)
+    {
+        std::memset(components, 0, _size * count);
+        return;
     }
+    for(size_t i = 0; i < count; ++i)
+        construct(components + _size * i);
+}
+
+void ComponentDescription::deconstruct(byte* components, size_t count) const
+{
+    if(_pod)
+        return;
+    for(size_t i = 0; i < count; ++i)
+        deconstruct(components + _size * i);
 }
 
 void ComponentDescription::serialize(OutputSerializer& sData, byte* component) const
@@ -88,24 +150,48 @@ void ComponentDescription::deserialize(InputSerializer& sData, byte* component)
 
 void ComponentDescription::copy(byte* src, byte* dest) const
 {
-    for(auto& m : _members)
-    {
+    for(auto& r : _plainRanges)
+        std::memcpy(dest + r.offset, src + r.offset, r.size);
+    for(auto& m : _complexMembers)
         VirtualType::copy(m.type, dest + m.offset, src + m.offset);
-    }
 }
 
 void ComponentDescription::move(byte* src, byte* dest) const
 {
-    for(auto& m : _members)
-    {
+    for(auto& r : _plainRanges)
+        std::memcpy(dest + r.offset, src + r.offset, r.size);
+    for(auto& m : _complexMembers)
         VirtualType::move(m.type, dest + m.offset, src + m.offset);
+}
+
+void ComponentDescription::copy(byte* src, byte* dest, size_t count) const
+{
+    if(_pod)
+    {
+        std::memcpy(dest, src, _size * count);
+        return;
     }
+    for(size_t i = 0; i < count; ++i)
+        copy(src + _size * i, dest + _size * i);
+}
+
+void ComponentDescription::move(byte* src, byte* dest, size_t count) const
+{
+    if(_pod)
+    {
+        std::memcpy(dest, src, _size * count);
+        return;
+    }
+    for(size_t i = 0; i < count; ++i)
+        move(src + _size * i, dest + _size * i);
 }
 
 const std::vector<ComponentDescription::Member>& ComponentDescription::members() const { return _members; }
 
 size_t ComponentDescription::size() const { return _size; }
 
+bool ComponentDescription::pod() const { return _pod; }
+
 size_t ComponentDescription::serializationSize() const
 {
     size_t ss = 0;
@@ -118,22 +204,16 @@ VirtualComponent::VirtualComponent(const VirtualComponent& source)
 {
     _description = source._description;
     _data = new byte[_description->size()];
-    for(auto& member : _description->members())
-    {
-        VirtualType::construct(member.type, _data + member.offset);
-        VirtualType::copy(member.type, _data + member.offset, source._data + member.offset);
-    }
+    _description->construct(_data);
+    _description->copy(source._data, _data);
 }
 
 VirtualComponent::VirtualComponent(const VirtualComponentView& source)
 {
     _description = source.description();
     _data = new byte[_description->size()];
-    for(auto& member : _description->members())
-    {
-        VirtualType::construct(member.type, _data + member.offset);
-        VirtualType::copy(member.type, _data + member.offset, source.data() + member.offset);
-    }
+    _description->construct(_data);
+    _description->copy(source.data(), _data);
 }
 
 VirtualComponent::VirtualComponent(VirtualComponent&& source)
@@ -147,31 +227,22 @@ VirtualComponent::VirtualComponent(const ComponentDescription* definition)
 {
     _description = definition;
     _data = new byte[_description->size()];
-    for(auto& member : _description->members())
-    {
-        VirtualType::construct(member.type, _data + member.offset);
-    }
+    _description->construct(_data);
 }
 
 VirtualComponent::VirtualComponent(const ComponentDescription* definition, const byte* data)
 {
     _description = definition;
     _data = new byte[_description->size()];
-    for(auto& member : _description->members())
-    {
-        VirtualType::construct(member.type, _data + member.offset);
-        VirtualType::copy(member.type, _data + member.offset, data + member.offset);
-    }
+    _description->construct(_data);
+    _description->copy(const_cast<byte*>(data), _data);
 }
 
 VirtualComponent::~VirtualComponent()
 {
     if(_data)
     {
-        for(auto& member : _description->members())
-        {
-            VirtualType::deconstruct(member.type, _data + member.offset);
-        }
+        _description->deconstruct(_data);
         delete[] _data;
     }
 }
@@ -185,8 +256,7 @@ VirtualComponent& VirtualComponent::operator=(const VirtualComponent& source)
     {
         if(_data)
         {
-            for(auto& member : _description->members())
-                VirtualType::deconstruct(member.type, _data + member.offset);
+            _description->deconstruct(_data);
         }
         if(_description->size() != source._description->size())
         {
@@ -195,12 +265,10 @@ VirtualComponent& VirtualComponent::operator=(const VirtualComponent& source)
             _data = new byte[source._description->size()];
         }
         _description = source._description;
-        for(auto& member : _description->members())
-            VirtualType::construct(member.type, _data + member.offset);
+        _description->construct(_data);
     }
 
-    for(auto& member : _description->members())
-        VirtualType::copy(member.type, _data + member.offset, source._data + member.offset);
+    _description->copy(source._data, _data);
     return *this;
 }
 
@@ -213,8 +281,7 @@ VirtualComponent& VirtualComponent::operator=(const VirtualComponentView& source
     {
         if(_data)
         {
-            for(auto& member : _description->members())
-                VirtualType::deconstruct(member.type, _data + member.offset);
+            _description->deconstruct(_data);
         }
         if(_description->size() != source.description()->size())
         {
@@ -223,12 +290,10 @@ VirtualComponent& VirtualComponent::operator=(const VirtualComponentView& source
             _data = new byte[source.description()->size()];
         }
         _description = source.description();
-        for(auto& member : _description->members())
-            VirtualType::construct(member.type, _data + member.offset);
+        _description->construct(_data);
     }
 
-    for(auto& member : _description->members())
-        VirtualType::copy(member.type, _data + member.offset, source.data() + member.offset);
+    _description->copy(source.data(), _data);
     return *this;
 }
 
@@ -32,15 +32,38 @@ class ComponentDescription
         size_t offset;
     };
 
+    struct ByteRange
+    {
+        size_t offset;
+        size_t size;
+    };
+
     std::vector<Member> _members;
     size_t _size;
+    // True when no member owns memory, then the whole component is copied, moved and destroyed as plain bytes
+    bool _pod = true;
+
+    // Precomputed so copies don't switch on the type of every member: runs of plain members are copied with memcpy,
+    // only the members in _complexMembers go through VirtualType
+    std::vector<ByteRange> _plainRanges;
+    std::vector<Member> _complexMembers;
+    // Plain members as construct leaves them, complex members are constructed on top of it
+    std::vector<byte> _defaultValue;
+    bool _zeroDefault = true;
 
     std::vector<size_t> generateOffsets(const std::vector<VirtualType::Type>&);
 
+    void setMembers(const std::vector<VirtualType::Type>& members, const std::vector<size_t>& offsets);
+
+    void buildCopyPlan();
+
   public:
     ComponentID id;
     std::string name;
     const ComponentAsset* asset = nullptr;
+    // Track changes per entity instead of only per chunk, so Changed queries can skip unchanged entities. Costs two
+    // bits per entity, and only applies to chunks created after it is set.
+    bool trackRowChanges = false;
 
     ComponentDescription(const ComponentAsset* asset);
 
@@ -56,6 +79,15 @@ class ComponentDescription
 
     void deconstruct(byte* component) const;
 
+    // Range versions of the above for count components stored back to back, whole ranges at once for POD components
+    void construct(byte* components, size_t count) const;
+
+    void deconstruct(byte* components, size_t count) const;
+
+    void copy(byte* src, byte* dest, size_t count) const;
+
+    void move(byte* src, byte* dest, size_t count) const;
+
     void serialize(OutputSerializer& sData, byte* component) const;
 
     void deserialize(InputSerializer& sData, byte* component) const;
@@ -69,6 +101,10 @@ class ComponentDescription
     size_t size() const;
 
     size_t serializationSize() const;
+
+    // True if the component has no string, AssetID or inline array members, so its columns can be copied and
+    // relocated between chunks with memcpy
+    bool pod() const;
 };
 
 class VirtualComponentView;
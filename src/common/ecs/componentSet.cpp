@@ -1,45 +1,135 @@
 #include "componentSet.h"
 #include <algorithm>
+#include <bit>
 #include <vector>
 
-void ComponentSet::add(ComponentID id) { _components.insert(id); }
+uint64_t ComponentSet::idSignature(ComponentID id)
+{
+    // splitmix64 finalizer, signatures of sets are the xor of the signatures of their members
+    uint64_t z = static_cast<uint64_t>(id) + 0x9e3779b97f4a7c15;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    return z ^ (z >> 31);
+}
+
+size_t ComponentSet::wordCount() const { return inlineWords + _overflow.size(); }
+
+uint64_t ComponentSet::word(size_t index) const
+{
+    if(index < inlineWords)
+        return _inline[index];
+    index -= inlineWords;
+    return index < _overflow.size() ? _overflow[index] : 0;
+}
+
+uint64_t& ComponentSet::wordRef(size_t index)
+{
+    if(index < inlineWords)
+        return _inline[index];
+    index -= inlineWords;
+    if(index >= _overflow.size())
+        _overflow.resize(index + 1, 0);
+    return _overflow[index];
+}
+
+void ComponentSet::add(ComponentID id)
+{
+    uint64_t& w = wordRef(id / 64);
+    uint64_t bit = uint64_t(1) << (id % 64);
+    if(w & bit)
+        return;
+    w |= bit;
+    ++_size;
+    _signature ^= idSignature(id);
+}
 
 void ComponentSet::remove(ComponentID id)
 {
-    assert(_components.contains(id));
-    _components.erase(id);
+    assert(contains(id));
+    wordRef(id / 64) &= ~(uint64_t(1) << (id % 64));
+    --_size;
+    _signature ^= idSignature(id);
 }
 
-bool ComponentSet::contains(ComponentID id) const { return _components.contains(id); }
+bool ComponentSet::contains(ComponentID id) const { return word(id / 64) & (uint64_t(1) << (id % 64)); }
 
 bool ComponentSet::contains(const ComponentSet& subset) const
 {
-    if(subset.size() == 0)
+    if(subset.size() == 0 || subset.size() > size())
         return false;
-    for(auto c : subset)
-        if(!_components.contains(c))
+    for(size_t i = 0; i < subset.wordCount(); ++i)
+    {
+        uint64_t w = subset.word(i);
+        if((word(i) & w) != w)
             return false;
+    }
     return true;
 }
 
-size_t ComponentSet::size() const { return _components.size(); }
+bool ComponentSet::intersects(const ComponentSet& other) const
+{
+    size_t words = std::min(wordCount(), other.wordCount());
+    for(size_t i = 0; i < words; ++i)
+        if(word(i) & other.word(i))
+            return true;
+    return false;
+}
+
+size_t ComponentSet::size() const { return _size; }
+
+uint64_t ComponentSet::signature() const { return _signature; }
 
-typename std::unordered_set<ComponentID>::const_iterator ComponentSet::begin() const { return _components.begin(); }
+ComponentSet::iterator ComponentSet::begin() const { return {this, 0}; }
 
-typename std::unordered_set<ComponentID>::const_iterator ComponentSet::end() const { return _components.end(); }
+ComponentSet::iterator ComponentSet::end() const { return {this, wordCount()}; }
 
 ComponentSet::ComponentSet(const std::vector<ComponentID>& components)
 {
     for(auto c : components)
-        _components.insert(c);
+        add(c);
 }
 
 bool ComponentSet::operator==(const ComponentSet& o) const
 {
-    if(o.size() != size())
+    if(o._signature != _signature || o.size() != size())
         return false;
-    for(auto c : _components)
-        if(!o.contains(c))
+    size_t words = std::max(wordCount(), o.wordCount());
+    for(size_t i = 0; i < words; ++i)
+        if(word(i) != o.word(i))
             return false;
     return true;
 }
+
+ComponentSet::iterator::iterator(const ComponentSet* set, size_t word) : _set(set), _word(word)
+{
+    _remaining = _word < _set->wordCount() ? _set->word(_word) : 0;
+    findNext();
+}
+
+void ComponentSet::iterator::findNext()
+{
+    while(_remaining == 0 && _word < _set->wordCount())
+    {
+        if(++_word < _set->wordCount())
+            _remaining = _set->word(_word);
+    }
+}
+
+ComponentID ComponentSet::iterator::operator*() const
+{
+    return static_cast<ComponentID>(_word * 64 + std::countr_zero(_remaining));
+}
+
+ComponentSet::iterator& ComponentSet::iterator::operator++()
+{
+    _remaining &= _remaining - 1;
+    findNext();
+    return *this;
+}
+
+bool ComponentSet::iterator::operator==(const iterator& o) const
+{
+    return _word == o._word && _remaining == o._remaining;
+}
+
+bool ComponentSet::iterator::operator!=(const iterator& o) const { return !(*this == o); }
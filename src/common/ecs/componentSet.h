@@ -1,20 +1,62 @@
 #pragma once
 
+#include <array>
 #include <cassert>
 #include <cstddef>
-#include <set>
+#include <cstdint>
+#include <iterator>
 #include <vector>
 #include "assets/types/componentAsset.h"
-#include <unordered_map>
-#include <unordered_set>
 
-// Class that always has components sorted
+// Bitset of component ids, always iterates in sorted order.
+// Keeps an order independent 64 bit signature up to date as components are added and removed, so sets can be
+// hashed and compared without walking their contents.
 class ComponentSet
 {
-  private:
-    std::unordered_set<ComponentID> _components;
+    // Ids below inlineWords * 64 never allocate
+    static constexpr size_t inlineWords = 4;
+    std::array<uint64_t, inlineWords> _inline = {};
+    std::vector<uint64_t> _overflow;
+    size_t _size = 0;
+    uint64_t _signature = 0;
+
+    static uint64_t idSignature(ComponentID id);
+
+    size_t wordCount() const;
+
+    uint64_t word(size_t index) const;
+
+    uint64_t& wordRef(size_t index);
 
   public:
+    class iterator
+    {
+        const ComponentSet* _set;
+        size_t _word;
+        uint64_t _remaining;
+
+        void findNext();
+
+      public:
+        iterator(const ComponentSet* set, size_t word);
+
+        ComponentID operator*() const;
+
+        iterator& operator++();
+
+        bool operator==(const iterator& o) const;
+
+        bool operator!=(const iterator& o) const;
+
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = ComponentID;
+        using difference_type = std::ptrdiff_t;
+        using reference = ComponentID;
+        using pointer = const ComponentID*;
+    };
+
+    using const_iterator = iterator;
+
     ComponentSet() = default;
 
     ComponentSet(const std::vector<ComponentID>& components);
@@ -27,11 +69,24 @@ class ComponentSet
 
     bool contains(const ComponentSet& subset) const;
 
+    bool intersects(const ComponentSet& other) const;
+
     size_t size() const;
 
+    uint64_t signature() const;
+
     bool operator==(const ComponentSet&) const;
 
-    std::unordered_set<ComponentID>::const_iterator begin() const;
+    iterator begin() const;
 
-    std::unordered_set<ComponentID>::const_iterator end() const;
+    iterator end() const;
 };
+
+namespace std
+{
+    template<>
+    struct hash<ComponentSet>
+    {
+        size_t operator()(const ComponentSet& componentSet) const { return componentSet.signature(); }
+    };
+} // namespace std
@@ -3,7 +3,17 @@
 EntityManager::EntityManager() : _components(), _archetypes(_components)
 {
     Runtime::timeline().addTask(
-        "systems", [this]() { _systems.runSystems(*this); }, "main");
+        "systems",
+        [this]() {
+        _systems.runSystems(*this);
+        _commands.playback(*this);
+        // Nothing else touches the chunks between frames, give back memory churn left behind. Only needed when chunks
+        // grow from minChunkSize, which setChunkLayout may change after construction.
+        const ChunkLayout& layout = _archetypes.chunkLayout();
+        if(layout.minChunkSize < layout.chunkSize)
+            _archetypes.compact();
+        },
+        "main");
 }
 
 EntityManager::~EntityManager() {}
@@ -21,34 +31,57 @@ EntityID EntityManager::createEntity(ComponentSet components)
     components.add(EntityIDComponent::def()->id);
     Archetype* arch = getArchetype(components);
     EntityIDComponent id{};
-    id.id = EntityID{static_cast<uint32_t>(_entities.push(EntityIndex())), ++_globalEntityVersion};
-
-    // id.id.id.id.id.id.etc lol
-    EntityIndex& eIndex = _entities[id.id.id];
-    eIndex.archetype = arch;
-    eIndex.index = arch->createEntity();
-    eIndex.version = _globalEntityVersion;
-    arch->setComponent(eIndex.index, id.toVirtual());
-    assert(eIndex.index < arch->size());
-    for(auto& e : _entities)
-        assert(e.index < e.archetype->size());
+    size_t index = arch->createEntity();
+    id.id = _entities.create(arch, static_cast<uint32_t>(index));
+    arch->setComponent(index, id.toVirtual());
+    ECS_VALIDATE(*this);
 
     return id.id;
 }
 
-void EntityManager::createEntities(const ComponentSet& components, size_t count)
+std::vector<EntityID> EntityManager::createEntities(ComponentSet components, size_t count, const ColumnWriter& writer)
 {
+    components.add(EntityIDComponent::def()->id);
     Archetype* arch = getArchetype(components);
+    size_t first = arch->createEntities(count);
 
-    for(size_t i = 0; i < count; i++)
-    {
-        EntityIDComponent id{};
-        id.id = EntityID{static_cast<uint32_t>(_entities.push(EntityIndex())), ++_globalEntityVersion};
-        _entities[id.id.id].archetype = arch;
-        _entities[id.id.id].index = arch->createEntity();
-        _entities[id.id.id].version = _globalEntityVersion;
-        assert(_entities[id.id.id].index < arch->size());
-    }
+    std::vector<EntityID> ids(count);
+    for(size_t i = 0; i < count; ++i)
+        ids[i] = _entities.create(arch, static_cast<uint32_t>(first + i));
+
+    ComponentID idComponent = EntityIDComponent::def()->id;
+    arch->forEachChunkRange(first, count, [&](Chunk* chunk, size_t chunkOffset, size_t rangeOffset, size_t n) {
+        for(ChunkComponentView& column : chunk->columns())
+        {
+            const ComponentDescription* def = column.def();
+            if(def->id == idComponent)
+            {
+                for(size_t i = 0; i < n; ++i)
+                    column[chunkOffset + i].setVar<EntityID>(0, ids[rangeOffset + i]);
+            }
+            else if(writer)
+                writer(def, rangeOffset, n, column.getComponentData(chunkOffset));
+        }
+    });
+    ECS_VALIDATE(*this);
+    return ids;
+}
+
+std::vector<EntityID> EntityManager::createEntities(const std::vector<VirtualComponent>& prototype, size_t count)
+{
+    ComponentSet components;
+    for(auto& c : prototype)
+        components.add(c.description()->id);
+    auto copyPrototype = [&prototype](const ComponentDescription* def, size_t, size_t n, byte* dest) {
+        for(auto& c : prototype)
+        {
+            if(c.description() != def)
+                continue;
+            for(size_t i = 0; i < n; ++i)
+                def->copy(c.data(), dest + def->size() * i);
+        }
+    };
+    return createEntities(components, count, copyPrototype);
 }
 
 void EntityManager::destroyEntity(EntityID entity)
@@ -67,13 +100,9 @@ void EntityManager::destroyEntity(EntityID entity)
         _entities[swappedEntity.id].index = index;
     }
 
-    for(auto& e : _entities)
-    {
-        assert(e.index < e.archetype->size());
-    }
-
     if(archetype->size() == 0)
         _archetypes.destroyArchetype(archetype);
+    ECS_VALIDATE(*this);
 }
 
 Archetype* EntityManager::getEntityArchetype(EntityID entity) const
@@ -98,8 +127,9 @@ bool EntityManager::hasComponent(EntityID entity, ComponentID component) const
 VirtualComponentView EntityManager::getComponent(EntityID entity, ComponentID component) const
 {
     assert(entityExists(entity));
-    assert(getEntityArchetype(entity)->hasComponent(component));
-    return getEntityArchetype(entity)->getComponent(_entities[entity.id].index, component);
+    const EntityIndex& eIndex = _entities[entity.id];
+    assert(eIndex.archetype->hasComponent(component));
+    return eIndex.archetype->getComponent(eIndex.index, component);
 }
 
 void EntityManager::setComponent(EntityID entity, const VirtualComponent& component)
@@ -128,16 +158,7 @@ void EntityManager::addComponent(EntityID entity, ComponentID component)
         Archetype* currentArchetype = getEntityArchetype(entity);
         assert(!currentArchetype->hasComponent(component)); // can't add a component that we already have
         assert(_entities[entity.id].index < currentArchetype->size());
-        // See if there's already an archetype we know about:
-        if(currentArchetype->addEdges().count(component))
-            destArchetype = currentArchetype->addEdges().at(component);
-        else
-        {
-            // Otherwise create one
-            ComponentSet compDefs = currentArchetype->components();
-            compDefs.add(component);
-            destArchetype = _archetypes.makeArchetype(compDefs);
-        }
+        destArchetype = _archetypes.addTransition(currentArchetype, component);
     }
     else
     {
@@ -173,6 +194,7 @@ void EntityManager::addComponent(EntityID entity, ComponentID component)
     _entities[entity.id].index = newIndex;
     _entities[entity.id].archetype = destArchetype;
     destArchetype->setComponentVersion(newIndex, component, _systems.globalVersion++);
+    ECS_VALIDATE(*this);
 }
 
 void EntityManager::removeComponent(EntityID entity, ComponentID component)
@@ -187,21 +209,7 @@ void EntityManager::removeComponent(EntityID entity, ComponentID component)
     assert(currentArchetype);
 
     assert(currentArchetype->hasComponent(component)); // can't remove a component that isn't there
-    // See if there's already an archetype we know about:
-    if(currentArchetype->removeEdges().count(component))
-    {
-        assert(_entities[entity.id].archetype->components().size() >= 2); // Must be an archetype level beneath this one
-        destArchetype = currentArchetype->removeEdges().at(component);
-    }
-    else
-    {
-        // Otherwise create one
-        ComponentSet compDefs = currentArchetype->components();
-        // Remove the component definition for the component that we want to remove
-        compDefs.remove(component);
-        if(compDefs.size() > 0)
-            destArchetype = _archetypes.makeArchetype(compDefs);
-    }
+    destArchetype = _archetypes.removeTransition(currentArchetype, component);
     size_t oldIndex = _entities[entity.id].index;
     size_t newIndex = 0;
 
@@ -223,11 +231,121 @@ void EntityManager::removeComponent(EntityID entity, ComponentID component)
 
     _entities[entity.id].index = newIndex;
     _entities[entity.id].archetype = destArchetype;
+    ECS_VALIDATE(*this);
+}
+
+void EntityManager::addComponents(std::span<const EntityID> entities, ComponentID component)
+{
+    migrateEntities(entities, component, true);
+}
+
+void EntityManager::removeComponents(std::span<const EntityID> entities, ComponentID component)
+{
+    assert(component != EntityIDComponent::def()->id);
+    migrateEntities(entities, component, false);
+}
+
+void EntityManager::migrateEntities(std::span<const EntityID> entities, ComponentID component, bool add)
+{
+    assert(_components._components.hasIndex(component));
+    struct Migration
+    {
+        Archetype* source;
+        size_t index;
+        EntityID entity;
+    };
+    std::vector<Migration> migrations;
+    migrations.reserve(entities.size());
+    for(EntityID entity : entities)
+    {
+        assert(entityExists(entity));
+        const EntityIndex& eIndex = _entities[entity.id];
+        if(!eIndex.archetype)
+        {
+            // Entities without any components have nothing to move
+            if(add)
+                addComponent(entity, component);
+            continue;
+        }
+        if(eIndex.archetype->hasComponent(component) != add)
+            migrations.push_back({eIndex.archetype, eIndex.index, entity});
+    }
+
+    std::sort(migrations.begin(), migrations.end(), [](const Migration& a, const Migration& b) {
+        if(a.source != b.source)
+            return a.source < b.source;
+        return a.index < b.index;
+    });
+    auto sameSlot = [](const Migration& a, const Migration& b) { return a.source == b.source && a.index == b.index; };
+    migrations.erase(std::unique(migrations.begin(), migrations.end(), sameSlot), migrations.end());
+
+    uint32_t version = _systems.globalVersion++;
+    size_t groupEnd = migrations.size();
+    while(groupEnd > 0)
+    {
+        Archetype* source = migrations[groupEnd - 1].source;
+        size_t groupStart = groupEnd - 1;
+        while(groupStart > 0 && migrations[groupStart - 1].source == source)
+            --groupStart;
+
+        // One archetype lookup per source archetype instead of per entity
+        Archetype* dest =
+            add ? _archetypes.addTransition(source, component) : _archetypes.removeTransition(source, component);
+
+        // Move runs of consecutive entities back to front, so the entities swapped into each hole always come from
+        // behind every run that's still waiting to be moved.
+        size_t runEnd = groupEnd;
+        while(runEnd > groupStart)
+        {
+            size_t runStart = runEnd - 1;
+            while(runStart > groupStart && migrations[runStart - 1].index + 1 == migrations[runStart].index)
+                --runStart;
+
+            size_t index = migrations[runStart].index;
+            size_t count = runEnd - runStart;
+            size_t newIndex = 0;
+            if(dest)
+                newIndex = source->moveEntities(index, count, dest);
+            else
+                source->removeEntities(index, count);
+            refreshIndices(source, index, std::min(index + count, source->size()));
+
+            for(size_t i = 0; i < count; ++i)
+            {
+                EntityIndex& eIndex = _entities[migrations[runStart + i].entity.id];
+                eIndex.archetype = dest;
+                eIndex.index = dest ? newIndex + i : 0;
+            }
+            if(dest && add)
+                dest->setComponentVersion(newIndex, newIndex + count, component, version);
+            runEnd = runStart;
+        }
+
+        if(source->size() == 0)
+            _archetypes.destroyArchetype(source);
+        groupEnd = groupStart;
+    }
+    ECS_VALIDATE(*this);
+}
+
+void EntityManager::refreshIndices(Archetype* archetype, size_t begin, size_t end)
+{
+    ComponentID idComponent = EntityIDComponent::def()->id;
+    for(size_t i = begin; i < end; ++i)
+    {
+        EntityID entity = *archetype->getComponent(i, idComponent).getVar<EntityID>(0);
+        assert(_entities[entity.id].archetype == archetype);
+        _entities[entity.id].index = i;
+    }
 }
 
 const char* EntityManager::name() { return "entityManager"; }
 
-void EntityManager::stop() { _archetypes.clear(); }
+void EntityManager::stop()
+{
+    _commands.clear();
+    _archetypes.clear();
+}
 
 ComponentManager& EntityManager::components() { return _components; }
 
@@ -235,11 +353,54 @@ SystemManager& EntityManager::systems() { return _systems; }
 
 ArchetypeManager& EntityManager::archetypes() { return _archetypes; }
 
+EntityCommandBuffer& EntityManager::commands() { return _commands; }
+
 EntitySet EntityManager::getEntities(ComponentFilter filter) { return {_archetypes.getArchetypes(filter), filter}; }
 
 bool EntityManager::entityExists(EntityID entity) const
 {
-    return _entities.hasIndex(entity.id) && entity.version == _entities[entity.id].version;
+    return _entities.exists(entity);
+}
+
+bool EntityManager::validate() const
+{
+    ComponentID idComponent = EntityIDComponent::def()->id;
+    std::unordered_map<const Archetype*, size_t> referenced;
+    for(auto e = _entities.begin(); e != _entities.end(); ++e)
+    {
+        const EntityIndex& eIndex = *e;
+        if(!eIndex.archetype)
+            continue;
+        if(!eIndex.archetype->hasComponent(idComponent))
+        {
+            Runtime::error("Entity " + std::to_string(e.index()) + " is in an archetype without an id component");
+            return false;
+        }
+        if(eIndex.index >= eIndex.archetype->size())
+        {
+            Runtime::error("Entity " + std::to_string(e.index()) + " has index " + std::to_string(eIndex.index) +
+                           " past the end of its archetype");
+            return false;
+        }
+        EntityID stored = eIndex.archetype->getComponent(eIndex.index, idComponent).readVar<EntityID>(0);
+        if(stored.id != e.index() || stored.version != eIndex.version)
+        {
+            Runtime::error("Entity " + std::to_string(e.index()) + " points at a slot holding entity " +
+                           std::to_string(stored.id));
+            return false;
+        }
+        ++referenced[eIndex.archetype];
+    }
+    for(auto& [archetype, count] : referenced)
+    {
+        if(archetype->size() != count)
+        {
+            Runtime::error("Archetype holds " + std::to_string(archetype->size()) + " entities but only " +
+                           std::to_string(count) + " point at it");
+            return false;
+        }
+    }
+    return true;
 }
 
 bool EntityManager::tryGetEntity(size_t index, EntityID& id) const
@@ -3,15 +3,19 @@
 #include "archetypeManager.h"
 #include "chunk.h"
 #include "componentManager.h"
+#include "entityCommandBuffer.h"
+#include "entityTable.h"
 #include "nativeComponent.h"
 #include "systemManager.h"
 #include "utility/sharedRecursiveMutex.h"
 
 #include <algorithm>
 #include <cstdint>
+#include <cstdlib>
 #include <functional>
 #include <memory>
 #include <queue>
+#include <span>
 #include <stdexcept>
 #include <vector>
 #include "common/runtime/runtime.h"
@@ -19,6 +23,22 @@
 #include <unordered_map>
 #include <unordered_set>
 
+// With BRANE_ECS_PARANOID defined the whole entity table is checked after every structural change. That's O(N) per
+// change, so it's off even in debug builds. It doesn't depend on assert, so it also works in release builds.
+#ifdef BRANE_ECS_PARANOID
+#define ECS_VALIDATE(em)                                                                                               \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        if(!(em).validate())                                                                                           \
+        {                                                                                                              \
+            Runtime::error("ECS validation failed at " __FILE__ ":" + std::to_string(__LINE__));                      \
+            std::abort();                                                                                              \
+        }                                                                                                              \
+    } while(false)
+#else
+#define ECS_VALIDATE(em)
+#endif
+
 class EntityIDComponent : public NativeComponent<EntityIDComponent>
 {
     REGISTER_MEMBERS_1("EntityID", id, "id")
@@ -35,13 +55,6 @@ class EntityName : public NativeComponent<EntityName>
     std::string name;
 };
 
-struct EntityIndex
-{
-    Archetype* archetype;
-    size_t index;
-    uint32_t version;
-};
-
 class EntityManager : public Module
 {
     struct SystemContext
@@ -54,14 +67,27 @@ class EntityManager : public Module
 #else
   private:
 #endif
-    uint32_t _globalEntityVersion = 0;
-    staticIndexVector<EntityIndex> _entities;
+    EntityTable _entities;
 
     ComponentManager _components;
     ArchetypeManager _archetypes;
     SystemManager _systems;
+    EntityCommandBuffer _commands;
+
+    friend class EntityCommandBuffer;
+
+    // Moves every entity that doesn't match the requested state to the archetype with component added or removed
+    void migrateEntities(std::span<const EntityID> entities, ComponentID component, bool add);
+
+    // Points the index table at the entities currently in [begin, end) of archetype
+    void refreshIndices(Archetype* archetype, size_t begin, size_t end);
 
   public:
+    // Fills count already constructed components of one column, starting at dest, for entities [first, first + count)
+    // of a bulk spawn. Called once per column per chunk the spawn touches.
+    using ColumnWriter =
+        std::function<void(const ComponentDescription* component, size_t first, size_t count, byte* dest)>;
+
     EntityManager();
 
     EntityManager(const EntityManager&) = delete;
@@ -76,7 +102,12 @@ class EntityManager : public Module
 
     bool tryGetEntity(size_t index, EntityID& id) const;
 
-    void createEntities(const ComponentSet& components, size_t count);
+    // Bulk spawns count entities. Slots are reserved across as many chunks as needed and every column is written in a
+    // single pass per chunk, entities are returned in the order they were laid out.
+    std::vector<EntityID> createEntities(ComponentSet components, size_t count, const ColumnWriter& writer = nullptr);
+
+    // Bulk spawns count copies of prototype
+    std::vector<EntityID> createEntities(const std::vector<VirtualComponent>& prototype, size_t count);
 
     void destroyEntity(EntityID entity);
 
@@ -102,6 +133,16 @@ class EntityManager : public Module
         addComponent(entity, T::def()->id);
     };
 
+    // Adds component to every entity in entities that doesn't already have it. Entities are migrated in contiguous
+    // runs per archetype instead of one at a time.
+    void addComponents(std::span<const EntityID> entities, ComponentID component);
+
+    template<class T>
+    void addComponents(std::span<const EntityID> entities)
+    {
+        addComponents(entities, T::def()->id);
+    }
+
     VirtualComponentView getComponent(EntityID entity, ComponentID component) const;
 
     template<class T>
@@ -124,14 +165,31 @@ class EntityManager : public Module
 
     void removeComponent(EntityID entity, ComponentID component);
 
+    // Removes component from every entity in entities that has it
+    void removeComponents(std::span<const EntityID> entities, ComponentID component);
+
+    template<class T>
+    void removeComponents(std::span<const EntityID> entities)
+    {
+        removeComponents(entities, T::def()->id);
+    }
+
     ComponentManager& components();
 
     SystemManager& systems();
 
     ArchetypeManager& archetypes();
 
+    // Shared command buffer, played back every frame after systems have run
+    EntityCommandBuffer& commands();
+
     EntitySet getEntities(ComponentFilter filter);
 
+    // Checks that every entity's index points at a slot holding that entity, and that archetypes don't hold any slots
+    // that no entity points at. Logs the first problem found and returns false. O(N), so only call this when debugging
+    // or from tests.
+    bool validate() const;
+
     static const char* name();
 
     void stop() override;
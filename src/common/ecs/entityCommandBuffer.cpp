@@ -0,0 +1,329 @@
+#include "entityCommandBuffer.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <unordered_map>
+#include "entity.h"
+
+EntityCommandBuffer::~EntityCommandBuffer()
+{
+    for(auto& block : _blocks)
+        delete[] block.load(std::memory_order_relaxed);
+}
+
+EntityCommandBuffer::Command& EntityCommandBuffer::reserve()
+{
+    // Only claim a slot that exists, so an overflow doesn't leave the count pointing past the last block
+    size_t index = _count.load(std::memory_order_relaxed);
+    do
+    {
+        if(index / blockSize >= maxBlocks)
+            throw std::runtime_error("Entity command buffer overflowed");
+    } while(!_count.compare_exchange_weak(index, index + 1, std::memory_order_relaxed));
+    size_t blockIndex = index / blockSize;
+
+    Command* block = _blocks[blockIndex].load(std::memory_order_acquire);
+    if(!block)
+    {
+        // Several threads may race to allocate the same block, only one of them gets to keep it
+        auto* newBlock = new Command[blockSize];
+        if(_blocks[blockIndex].compare_exchange_strong(block, newBlock, std::memory_order_acq_rel))
+            block = newBlock;
+        else
+            delete[] newBlock;
+    }
+    return block[index % blockSize];
+}
+
+EntityCommandBuffer::Command& EntityCommandBuffer::at(size_t index) const
+{
+    return _blocks[index / blockSize].load(std::memory_order_acquire)[index % blockSize];
+}
+
+void EntityCommandBuffer::createEntity(ComponentSet components)
+{
+    Command& cmd = reserve();
+    cmd.type = CommandType::CreateEntity;
+    cmd.components = std::move(components);
+}
+
+void EntityCommandBuffer::createEntity(std::vector<VirtualComponent> components)
+{
+    Command& cmd = reserve();
+    cmd.type = CommandType::CreateEntity;
+    cmd.components = ComponentSet();
+    for(auto& c : components)
+        cmd.components.add(c.description()->id);
+    cmd.values = std::move(components);
+}
+
+void EntityCommandBuffer::destroyEntity(EntityID entity)
+{
+    Command& cmd = reserve();
+    cmd.type = CommandType::DestroyEntity;
+    cmd.entity = entity;
+}
+
+void EntityCommandBuffer::addComponent(EntityID entity, ComponentID component)
+{
+    Command& cmd = reserve();
+    cmd.type = CommandType::AddComponent;
+    cmd.entity = entity;
+    cmd.component = component;
+}
+
+void EntityCommandBuffer::removeComponent(EntityID entity, ComponentID component)
+{
+    assert(component != EntityIDComponent::def()->id);
+    Command& cmd = reserve();
+    cmd.type = CommandType::RemoveComponent;
+    cmd.entity = entity;
+    cmd.component = component;
+}
+
+void EntityCommandBuffer::setComponent(EntityID entity, VirtualComponent component)
+{
+    Command& cmd = reserve();
+    cmd.type = CommandType::SetComponent;
+    cmd.entity = entity;
+    cmd.component = component.description()->id;
+    cmd.values.clear();
+    cmd.values.push_back(std::move(component));
+}
+
+size_t EntityCommandBuffer::size() const { return _count.load(std::memory_order_acquire); }
+
+bool EntityCommandBuffer::empty() const { return size() == 0; }
+
+void EntityCommandBuffer::playback(EntityManager& em)
+{
+    ASSERT_MAIN_THREAD();
+    size_t count = size();
+    if(count == 0)
+        return;
+
+    // Resolve each entity's commands into the archetype it should end up in. Each command follows an archetype
+    // transition edge, which are cached, so runs of entities getting the same change only look the edge up.
+    struct PendingEntity
+    {
+        EntityID entity;
+        Archetype* source;
+        Archetype* target;
+        bool destroy = false;
+        std::vector<Command*> sets;
+    };
+    std::vector<PendingEntity> pending;
+    pending.reserve(count);
+    if(_pendingSlots.size() < em._entities.slotCount())
+        _pendingSlots.resize(em._entities.slotCount(), noPending);
+    // Creates grouped by component set in first-seen order, so entity ids are handed out in recording order
+    std::vector<std::pair<const ComponentSet*, std::vector<Command*>>> creates;
+    std::unordered_map<ComponentSet, size_t> createGroups;
+    size_t lastCreateGroup = 0;
+
+    for(size_t i = 0; i < count; ++i)
+    {
+        Command& cmd = at(i);
+        if(cmd.type == CommandType::CreateEntity)
+        {
+            // Creates tend to come in runs of the same set, which skip the lookup
+            if(creates.empty() || *creates[lastCreateGroup].first != cmd.components)
+            {
+                auto [group, inserted] = createGroups.try_emplace(cmd.components, creates.size());
+                if(inserted)
+                    creates.push_back({&cmd.components, {}});
+                lastCreateGroup = group->second;
+            }
+            creates[lastCreateGroup].second.push_back(&cmd);
+            continue;
+        }
+        if(!em.entityExists(cmd.entity))
+            continue;
+
+        uint32_t& slot = _pendingSlots[cmd.entity.id];
+        if(slot == noPending)
+        {
+            slot = static_cast<uint32_t>(pending.size());
+            Archetype* source = em._entities[cmd.entity.id].archetype;
+            pending.push_back({cmd.entity, source, source, false, {}});
+        }
+        PendingEntity& p = pending[slot];
+        switch(cmd.type)
+        {
+            case CommandType::DestroyEntity:
+                p.destroy = true;
+                break;
+            case CommandType::SetComponent:
+                p.sets.push_back(&cmd);
+                [[fallthrough]];
+            case CommandType::AddComponent:
+                if(!p.target)
+                    p.target = em._archetypes.getArchetype(ComponentSet({cmd.component}));
+                else if(!p.target->hasComponent(cmd.component))
+                    p.target = em._archetypes.addTransition(p.target, cmd.component);
+                break;
+            case CommandType::RemoveComponent:
+                // The component might never have been there, or an earlier command already removed it
+                if(p.target && p.target->hasComponent(cmd.component))
+                    p.target = em._archetypes.removeTransition(p.target, cmd.component);
+                break;
+            default:
+                break;
+        }
+    }
+
+    struct Move
+    {
+        Archetype* source;
+        Archetype* dest;
+        size_t index;
+        PendingEntity* entity;
+    };
+    std::vector<Move> moves;
+    moves.reserve(pending.size());
+    for(auto& p : pending)
+    {
+        _pendingSlots[p.entity.id] = noPending;
+        if(!p.destroy && p.target == p.source)
+            continue;
+        Archetype* dest = p.destroy ? nullptr : p.target;
+        moves.push_back({p.source, dest, em._entities[p.entity.id].index, &p});
+    }
+
+    // Group by source archetype and sort each group by row, so runs of consecutive rows headed to the same
+    // destination can be moved with one call. Entities without an archetype have no rows, they're grouped by
+    // destination instead.
+    auto moveOrder = [](const Move& a, const Move& b) {
+        if(a.source != b.source)
+            return a.source < b.source;
+        if(!a.source)
+            return a.dest < b.dest;
+        return a.index < b.index;
+    };
+    // Commands recorded by a single loop over a query are usually in order already
+    if(!std::is_sorted(moves.begin(), moves.end(), moveOrder))
+        std::sort(moves.begin(), moves.end(), moveOrder);
+
+    uint32_t version = em._systems.globalVersion++;
+    std::vector<ComponentID> addedComponents;
+    Archetype* addedSource = nullptr;
+    Archetype* addedDest = nullptr;
+    size_t groupEnd = moves.size();
+    while(groupEnd > 0)
+    {
+        Archetype* source = moves[groupEnd - 1].source;
+        size_t groupStart = groupEnd - 1;
+        while(groupStart > 0 && moves[groupStart - 1].source == source)
+            --groupStart;
+
+        // Runs are moved back to front, so the entities swapped into each hole always come from behind every run
+        // that's still waiting to be moved and the recorded rows stay valid.
+        size_t runEnd = groupEnd;
+        while(runEnd > groupStart)
+        {
+            size_t runStart = runEnd - 1;
+            Archetype* dest = moves[runStart].dest;
+            while(runStart > groupStart && moves[runStart - 1].dest == dest &&
+                  (!source || moves[runStart - 1].index + 1 == moves[runStart].index))
+                --runStart;
+
+            size_t index = moves[runStart].index;
+            size_t count = runEnd - runStart;
+            size_t newIndex = 0;
+            if(source)
+            {
+                if(dest)
+                    newIndex = source->moveEntities(index, count, dest);
+                else
+                    source->removeEntities(index, count);
+                em.refreshIndices(source, index, std::min(index + count, source->size()));
+            }
+            else if(dest)
+                newIndex = dest->createEntities(count);
+
+            for(size_t i = 0; i < count; ++i)
+            {
+                PendingEntity* p = moves[runStart + i].entity;
+                if(p->destroy)
+                {
+                    em._entities.remove(p->entity.id);
+                    continue;
+                }
+                EntityIndex& eIndex = em._entities[p->entity.id];
+                eIndex.archetype = dest;
+                eIndex.index = dest ? newIndex + i : 0;
+            }
+
+            if(dest)
+            {
+                if(source != addedSource || dest != addedDest)
+                {
+                    addedSource = source;
+                    addedDest = dest;
+                    addedComponents.clear();
+                    for(ComponentID c : dest->components())
+                        if(!source || !source->hasComponent(c))
+                            addedComponents.push_back(c);
+                }
+                for(ComponentID c : addedComponents)
+                    dest->setComponentVersion(newIndex, newIndex + count, c, version);
+            }
+            runEnd = runStart;
+        }
+        groupEnd = groupStart;
+    }
+
+    for(auto& p : pending)
+    {
+        if(p.destroy)
+            continue;
+        const EntityIndex& eIndex = em._entities[p.entity.id];
+        for(Command* cmd : p.sets)
+        {
+            // A later command may have removed the component again
+            if(eIndex.archetype->hasComponent(cmd->component))
+                eIndex.archetype->setComponent(eIndex.index, std::move(cmd->values[0]));
+        }
+    }
+
+    for(auto& [components, commands] : creates)
+    {
+        // Values are moved straight into the columns of the whole group
+        auto writeValues = [&commands](const ComponentDescription* def, size_t first, size_t n, byte* dest) {
+            for(size_t i = 0; i < n; ++i)
+            {
+                for(auto& value : commands[first + i]->values)
+                {
+                    if(value.description() == def)
+                        def->move(value.data(), dest + def->size() * i);
+                }
+            }
+        };
+        em.createEntities(*components, commands.size(), writeValues);
+    }
+
+    // Sources are sorted, so each one is only checked once
+    for(size_t i = 0; i < moves.size(); ++i)
+    {
+        Archetype* source = moves[i].source;
+        if(!source || (i > 0 && moves[i - 1].source == source))
+            continue;
+        if(source->size() == 0)
+            em._archetypes.destroyArchetype(source);
+    }
+    ECS_VALIDATE(em);
+
+    clear();
+}
+
+void EntityCommandBuffer::clear()
+{
+    size_t count = size();
+    for(size_t i = 0; i < count; ++i)
+    {
+        Command& cmd = at(i);
+        cmd.components = ComponentSet();
+        cmd.values.clear();
+    }
+    _count.store(0, std::memory_order_release);
+}
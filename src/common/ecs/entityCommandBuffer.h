@@ -0,0 +1,110 @@
+#ifndef BRANEENGINE_ENTITYCOMMANDBUFFER_H
+#define BRANEENGINE_ENTITYCOMMANDBUFFER_H
+
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+#include "component.h"
+#include "componentSet.h"
+#include "entityID.h"
+
+class EntityManager;
+
+// Records structural changes so they can be made from inside (parallel) iteration and applied later at a sync point.
+// Recording is lock free and safe from any number of threads, playback must happen on the main thread once all
+// recording threads are done.
+//
+// Playback resolves every command for an entity into a single destination archetype, then moves runs of adjacent rows
+// sharing a source and destination with one call each, the same way EntityManager::addComponents does. Creates are
+// spawned in bulk per component set. Commands targeting entities that no longer exist by the time of playback are
+// ignored.
+class EntityCommandBuffer
+{
+  public:
+    enum class CommandType : uint8_t
+    {
+        CreateEntity,
+        DestroyEntity,
+        AddComponent,
+        RemoveComponent,
+        SetComponent
+    };
+
+  private:
+    struct Command
+    {
+        CommandType type;
+        EntityID entity;
+        ComponentID component;
+        ComponentSet components;
+        std::vector<VirtualComponent> values;
+    };
+
+    // Commands are stored in lazily allocated fixed size blocks so that reserving a slot is a single atomic increment
+    // and already recorded commands never move.
+    static constexpr size_t blockSize = 1024;
+    static constexpr size_t maxBlocks = 4096;
+
+    std::atomic<size_t> _count = 0;
+    std::array<std::atomic<Command*>, maxBlocks> _blocks = {};
+
+    // Playback's index of each entity's pending changes, by entity id. Kept between playbacks and only reset where it
+    // was used, so finding an entity's changes is a single load instead of a hash lookup.
+    static constexpr uint32_t noPending = UINT32_MAX;
+    std::vector<uint32_t> _pendingSlots;
+
+    Command& reserve();
+
+    Command& at(size_t index) const;
+
+  public:
+    EntityCommandBuffer() = default;
+
+    EntityCommandBuffer(const EntityCommandBuffer&) = delete;
+
+    ~EntityCommandBuffer();
+
+    void createEntity(ComponentSet components);
+
+    // Creates an entity with the components of the passed values, initialized to those values
+    void createEntity(std::vector<VirtualComponent> components);
+
+    void destroyEntity(EntityID entity);
+
+    void addComponent(EntityID entity, ComponentID component);
+
+    template<class T>
+    void addComponent(EntityID entity)
+    {
+        addComponent(entity, T::def()->id);
+    }
+
+    void removeComponent(EntityID entity, ComponentID component);
+
+    template<class T>
+    void removeComponent(EntityID entity)
+    {
+        removeComponent(entity, T::def()->id);
+    }
+
+    // Adds the component if the entity doesn't have it yet
+    void setComponent(EntityID entity, VirtualComponent component);
+
+    template<class T>
+    void setComponent(EntityID entity, const T& component)
+    {
+        setComponent(entity, VirtualComponent(component.toVirtual()));
+    }
+
+    size_t size() const;
+
+    bool empty() const;
+
+    // Applies all recorded commands to em and clears the buffer
+    void playback(EntityManager& em);
+
+    void clear();
+};
+
+#endif // BRANEENGINE_ENTITYCOMMANDBUFFER_H
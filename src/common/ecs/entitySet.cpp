@@ -6,16 +6,26 @@
 #include "archetype.h"
 #include "archetypeManager.h"
 #include "system.h"
+#include "utility/stackAllocate.h"
+#include "utility/threadPool.h"
 
 void ComponentFilter::addComponent(ComponentID id, ComponentFilterFlags flags)
 {
     _components.push_back({id, flags});
     if(ComponentFilterFlags_Changed & flags || ComponentFilterFlags_Exclude & flags)
         _chunkFlags = true;
+    if(ComponentFilterFlags_Exclude & flags)
+        _excluded.add(id);
+    else
+        _required.add(id);
 }
 
 const std::vector<ComponentFilter::Component>& ComponentFilter::components() const { return _components; }
 
+const ComponentSet& ComponentFilter::required() const { return _required; }
+
+const ComponentSet& ComponentFilter::excluded() const { return _excluded; }
+
 ComponentFilter::ComponentFilter(SystemContext* system) { _system = system; }
 
 SystemContext* ComponentFilter::system() const { return _system; }
@@ -35,16 +45,35 @@ bool ComponentFilter::checkChunk(Chunk* chunk) const
     return true;
 }
 
-bool ComponentFilter::checkArchetype(Archetype* arch) const
+bool ComponentFilter::changedRows(Chunk* chunk, std::vector<uint64_t>& rows) const
 {
-    for(auto& c : _components)
+    if(!_chunkFlags)
+        return false;
+    bool filtered = false;
+    for(auto& comp : _components)
     {
-        bool hasComponent = arch->hasComponent(c.id);
-        bool exclude = c.flags & ComponentFilterFlags_Exclude;
-        if(hasComponent == exclude)
-            return false;
+        if(comp.flags & ComponentFilterFlags_Exclude || !(comp.flags & ComponentFilterFlags_Changed))
+            continue;
+        ChunkComponentView& view = chunk->getComponent(comp.id);
+        if(!view.tracksRowChanges())
+            continue;
+        if(!filtered)
+            rows.assign((chunk->size() + 63) / 64, ~uint64_t(0));
+        filtered |= view.intersectChangedRows(_system->lastVersion, rows.data());
     }
-    return true;
+    return filtered;
+}
+
+bool ComponentFilter::checkArchetype(Archetype* arch) const
+{
+    const ComponentSet& components = arch->components();
+    return (_required.size() == 0 || components.contains(_required)) && !components.intersects(_excluded);
+}
+
+// Whether iterating c can skip its column locks, see SystemContext::unlockedReads
+static bool readUnlocked(const ComponentFilter::Component& c, const SystemContext* ctx)
+{
+    return (c.flags & ComponentFilterFlags_Const) && ctx->unlockedReads.contains(c.id);
 }
 
 EntitySet::EntitySet(std::vector<Archetype*> archetypes, ComponentFilter filter)
@@ -53,16 +82,19 @@ EntitySet::EntitySet(std::vector<Archetype*> archetypes, ComponentFilter filter)
 
 void EntitySet::forEachNative(const std::function<void(byte** components)>& f)
 {
-    std::vector<ComponentID> itrComponents;
-    for(auto& c : _filter.components())
-        if(!(c.flags & ComponentFilterFlags_Exclude))
-            itrComponents.push_back(c.id);
-
+    auto itrComponents = iteratedComponents();
+    std::vector<size_t> columns(itrComponents.size());
+    std::vector<bool> unlocked(itrComponents.size());
+    for(size_t i = 0; i < itrComponents.size(); ++i)
+        unlocked[i] = readUnlocked(itrComponents[i], _filter.system());
     std::vector<ChunkComponentView*> componentViews(itrComponents.size());
     std::vector<byte*> data(itrComponents.size());
+    std::vector<uint64_t> rows;
 
     for(auto* arch : _archetypes)
     {
+        for(size_t i = 0; i < itrComponents.size(); ++i)
+            columns[i] = arch->columnIndex(itrComponents[i].id);
         for(auto& chunk : arch->chunks())
         {
             if(!_filter.checkChunk(chunk.get()))
@@ -70,22 +102,140 @@ void EntitySet::forEachNative(const std::function<void(byte** components)>& f)
 
             for(size_t i = 0; i < itrComponents.size(); ++i)
             {
-                componentViews[i] = &chunk->getComponent(itrComponents[i]);
-                componentViews[i]->lock();
+                componentViews[i] = &chunk->column(columns[i]);
+                if(unlocked[i])
+                    continue;
+                if(itrComponents[i].flags & ComponentFilterFlags_Const)
+                    componentViews[i]->lockShared();
+                else
+                    componentViews[i]->lock();
             }
-            for(size_t i = 0; i < chunk->size(); ++i)
-            {
+            auto visit = [&](size_t i) {
                 for(size_t d = 0; d < itrComponents.size(); ++d)
                     data[d] = componentViews[d]->getComponentData(i);
                 f(data.data());
+            };
+            bool filtered = _filter.changedRows(chunk.get(), rows);
+            if(filtered)
+                forEachSetRow(rows.data(), chunk->size(), visit);
+            else
+            {
+                for(size_t i = 0; i < chunk->size(); ++i)
+                    visit(i);
             }
-            for(auto c : componentViews)
+            for(size_t i = 0; i < itrComponents.size(); ++i)
             {
-                c->version = _filter.system()->version;
-                c->unlock();
+                if(itrComponents[i].flags & ComponentFilterFlags_Const)
+                {
+                    if(!unlocked[i])
+                        componentViews[i]->unlockShared();
+                    continue;
+                }
+                componentViews[i]->version = _filter.system()->version;
+                if(filtered)
+                    componentViews[i]->markRowsChanged(rows.data());
+                else
+                    componentViews[i]->markRowsChanged(0, chunk->size());
+                componentViews[i]->unlock();
             }
         }
     }
 }
 
+std::vector<ComponentFilter::Component> EntitySet::iteratedComponents() const
+{
+    std::vector<ComponentFilter::Component> itrComponents;
+    for(auto& c : _filter.components())
+        if(!(c.flags & ComponentFilterFlags_Exclude))
+            itrComponents.push_back(c);
+    return itrComponents;
+}
+
+void EntitySet::forEachChunkView(const std::vector<ComponentFilter::Component>& components,
+                                 const std::function<void(Chunk* chunk, ChunkComponentView** views)>& f,
+                                 bool parallel)
+{
+    std::vector<bool> unlocked(components.size());
+    for(size_t i = 0; i < components.size(); ++i)
+        unlocked[i] = readUnlocked(components[i], _filter.system());
+    auto visitChunk = [this, &f, &components, &unlocked](Chunk* chunk) {
+        auto** views = (ChunkComponentView**)STACK_ALLOCATE(sizeof(ChunkComponentView*) * components.size());
+        for(size_t i = 0; i < components.size(); ++i)
+        {
+            views[i] = &chunk->getComponent(components[i].id);
+            if(unlocked[i])
+                continue;
+            if(components[i].flags & ComponentFilterFlags_Const)
+                views[i]->lockShared();
+            else
+                views[i]->lock();
+        }
+
+        f(chunk, views);
+
+        for(size_t i = 0; i < components.size(); ++i)
+        {
+            if(components[i].flags & ComponentFilterFlags_Const)
+            {
+                if(!unlocked[i])
+                    views[i]->unlockShared();
+            }
+            else
+            {
+                views[i]->version = _filter.system()->version;
+                views[i]->markRowsChanged(0, chunk->size());
+                views[i]->unlock();
+            }
+        }
+    };
+
+    std::vector<Chunk*> chunks;
+    for(auto* arch : _archetypes)
+    {
+        for(auto& chunk : arch->chunks())
+        {
+            if(chunk->size() == 0 || !_filter.checkChunk(chunk.get()))
+                continue;
+            if(parallel)
+                chunks.push_back(chunk.get());
+            else
+                visitChunk(chunk.get());
+        }
+    }
+
+    ThreadPool::parallelFor(0, chunks.size(), 1, [&](size_t begin, size_t end) {
+        for(size_t i = begin; i < end; ++i)
+            visitChunk(chunks[i]);
+    });
+}
+
+void EntitySet::forEachParallel(const std::function<void(byte** components)>& f)
+{
+    auto components = iteratedComponents();
+    size_t componentCount = components.size();
+    auto iterate = [&f, componentCount](Chunk* chunk, ChunkComponentView** views) {
+        auto** data = (byte**)STACK_ALLOCATE(sizeof(byte*) * componentCount);
+        for(size_t i = 0; i < chunk->size(); ++i)
+        {
+            for(size_t d = 0; d < componentCount; ++d)
+                data[d] = views[d]->getComponentData(i);
+            f(data);
+        }
+    };
+    forEachChunkView(components, iterate, true);
+}
+
+void EntitySet::forEachChunkParallel(const std::function<void(byte** components, size_t count)>& f)
+{
+    auto components = iteratedComponents();
+    size_t componentCount = components.size();
+    auto iterate = [&f, componentCount](Chunk* chunk, ChunkComponentView** views) {
+        auto** data = (byte**)STACK_ALLOCATE(sizeof(byte*) * componentCount);
+        for(size_t d = 0; d < componentCount; ++d)
+            data[d] = views[d]->getComponentData(0);
+        f(data, chunk->size());
+    };
+    forEachChunkView(components, iterate, true);
+}
+
 size_t EntitySet::archetypeCount() const { return _archetypes.size(); }
@@ -6,10 +6,14 @@
 #define BRANEENGINE_ENTITYSET_H
 
 #include <cstdint>
+#include <span>
+#include <tuple>
+#include <type_traits>
 #include <vector>/*
 #include "archetype.h"
 #include "system.h"*/
 #include "chunk.h"
+#include "componentSet.h"
 
 using ComponentID = uint32_t;
 struct SystemContext;
@@ -34,6 +38,8 @@ class ComponentFilter
 {
     SystemContext* _system;
     bool _chunkFlags = false;
+    ComponentSet _required;
+    ComponentSet _excluded;
 
   public:
     struct Component
@@ -52,23 +58,126 @@ class ComponentFilter
 
     const std::vector<ComponentFilter::Component>& components() const;
 
+    const ComponentSet& required() const;
+
+    const ComponentSet& excluded() const;
+
     SystemContext* system() const;
 
     bool checkArchetype(Archetype* arch) const;
 
     bool checkChunk(Chunk* chunk) const;
+
+    // Fills rows with a bit per entity of chunk, set for entities whose Changed components have all changed since the
+    // system last ran. Returns false if none of those components track row changes, in which case every entity in the
+    // chunk has to be visited.
+    bool changedRows(Chunk* chunk, std::vector<uint64_t>& rows) const;
+};
+
+// Typed view of the component columns of a single chunk, every column is a contiguous array of size() components.
+// Components declared const only take a shared lock, or none for reads the scheduler vouches for, and don't have their
+// version bumped.
+template<class... Ts>
+class ChunkSpan
+{
+    std::tuple<Ts*...> _columns;
+    size_t _size;
+
+    template<size_t... I>
+    ChunkSpan(ChunkComponentView** views, size_t size, std::index_sequence<I...>)
+        : _columns((Ts*)views[I]->getComponentData(0)...), _size(size)
+    {}
+
+  public:
+    ChunkSpan(ChunkComponentView** views, size_t size) : ChunkSpan(views, size, std::index_sequence_for<Ts...>()) {}
+
+    static std::vector<ComponentFilter::Component> columns()
+    {
+        return {{std::remove_const_t<Ts>::def()->id,
+                 static_cast<ComponentFilterFlags>(std::is_const_v<Ts> ? ComponentFilterFlags_Const
+                                                                       : ComponentFilterFlags_None)}...};
+    }
+
+    template<class T>
+    std::span<T> get() const
+    {
+        return {std::get<T*>(_columns), _size};
+    }
+
+    size_t size() const { return _size; }
+};
+
+// Extracts the ChunkSpan type from the argument of a chunk callback
+template<class F, class = void>
+struct ChunkSpanCallback
+{};
+
+template<class F>
+struct ChunkSpanCallback<F, std::void_t<decltype(&F::operator())>> : ChunkSpanCallback<decltype(&F::operator())>
+{};
+
+template<class C, class R, class... Ts>
+struct ChunkSpanCallback<R (C::*)(ChunkSpan<Ts...>&) const>
+{
+    using Span = ChunkSpan<Ts...>;
 };
 
+template<class C, class R, class... Ts>
+struct ChunkSpanCallback<R (C::*)(ChunkSpan<Ts...>&)>
+{
+    using Span = ChunkSpan<Ts...>;
+};
+
+template<class F>
+concept ChunkSpanFunction = requires { typename ChunkSpanCallback<std::remove_cvref_t<F>>::Span; };
+
 class EntitySet
 {
     ComponentFilter _filter;
     std::vector<Archetype*> _archetypes;
 
+    std::vector<ComponentFilter::Component> iteratedComponents() const;
+
+    void forEachChunkView(const std::vector<ComponentFilter::Component>& components,
+                          const std::function<void(Chunk* chunk, ChunkComponentView** views)>& f,
+                          bool parallel);
+
   public:
     EntitySet(std::vector<Archetype*> archetypes, ComponentFilter filter);
 
     void forEachNative(const std::function<void(byte** components)>& f);
 
+    // Splits matching chunks across the thread pool and returns once every chunk has been processed
+    void forEachParallel(const std::function<void(byte** components)>& f);
+
+    // Called once per chunk with the start of each component column, columns are tightly packed arrays of count
+    // components
+    void forEachChunkParallel(const std::function<void(byte** components, size_t count)>& f);
+
+    // Calls f once per chunk with a ChunkSpan, the span's component types select the columns, e.g.
+    // forEachChunk([](ChunkSpan<Transform, const LocalTransform>& s){ ... });
+    template<ChunkSpanFunction F>
+    void forEachChunk(F&& f)
+    {
+        using Span = typename ChunkSpanCallback<std::remove_cvref_t<F>>::Span;
+        auto iterate = [&f](Chunk* chunk, ChunkComponentView** views) {
+            Span span(views, chunk->size());
+            f(span);
+        };
+        forEachChunkView(Span::columns(), iterate, false);
+    }
+
+    template<ChunkSpanFunction F>
+    void forEachChunkParallel(F&& f)
+    {
+        using Span = typename ChunkSpanCallback<std::remove_cvref_t<F>>::Span;
+        auto iterate = [&f](Chunk* chunk, ChunkComponentView** views) {
+            Span span(views, chunk->size());
+            f(span);
+        };
+        forEachChunkView(Span::columns(), iterate, true);
+    }
+
     size_t archetypeCount() const;
 };
 
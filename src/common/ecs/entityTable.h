@@ -0,0 +1,147 @@
+#ifndef BRANEENGINE_ENTITYTABLE_H
+#define BRANEENGINE_ENTITYTABLE_H
+
+#include <cassert>
+#include <cstdint>
+#include <iterator>
+#include <vector>
+#include "entityID.h"
+
+class Archetype;
+
+// 16 bytes, so four slots share a cache line
+struct EntityIndex
+{
+    Archetype* archetype = nullptr;
+    uint32_t index = 0;
+    // Generation of the slot, matches EntityID::version while the entity is alive
+    uint32_t version = 0;
+};
+
+// Dense table of entity slots. Free slots are chained through their index field instead of a separate stack, and have
+// the free bit set in their version so that checking an EntityID is a single load and compare.
+class EntityTable
+{
+    static constexpr uint32_t freeBit = 1u << 31;
+    static constexpr uint32_t endOfList = UINT32_MAX;
+
+    std::vector<EntityIndex> _slots;
+    uint32_t _firstFree = endOfList;
+    size_t _size = 0;
+
+  public:
+    EntityID create(Archetype* archetype, uint32_t index)
+    {
+        uint32_t id;
+        if(_firstFree != endOfList)
+        {
+            id = _firstFree;
+            EntityIndex& slot = _slots[id];
+            _firstFree = slot.index;
+            slot.version &= ~freeBit;
+        }
+        else
+        {
+            id = static_cast<uint32_t>(_slots.size());
+            _slots.emplace_back();
+        }
+        EntityIndex& slot = _slots[id];
+        slot.archetype = archetype;
+        slot.index = index;
+        ++_size;
+        return EntityID{id, slot.version};
+    }
+
+    void remove(uint32_t id)
+    {
+        assert(hasIndex(id));
+        EntityIndex& slot = _slots[id];
+        // Generations wrap before reaching the free bit, and never produce the all ones version of a null EntityID
+        slot.version = ((slot.version + 1) % (freeBit - 1)) | freeBit;
+        slot.archetype = nullptr;
+        slot.index = _firstFree;
+        _firstFree = id;
+        --_size;
+    }
+
+    bool exists(EntityID entity) const
+    {
+        return entity.id < _slots.size() && _slots[entity.id].version == entity.version;
+    }
+
+    bool hasIndex(size_t id) const { return id < _slots.size() && !(_slots[id].version & freeBit); }
+
+    void reserve(size_t count) { _slots.reserve(count); }
+
+    size_t size() const { return _size; }
+
+    // One past the highest id handed out so far
+    size_t slotCount() const { return _slots.size(); }
+
+    void clear()
+    {
+        _slots.clear();
+        _firstFree = endOfList;
+        _size = 0;
+    }
+
+    const EntityIndex& operator[](size_t id) const
+    {
+        assert(hasIndex(id));
+        return _slots[id];
+    }
+
+    EntityIndex& operator[](size_t id)
+    {
+        assert(hasIndex(id));
+        return _slots[id];
+    }
+
+    // Iterates over live slots only
+    template<class Table, class T>
+    class Iterator
+    {
+        Table* _table;
+        size_t _index;
+
+        void skipFree()
+        {
+            while(_index != _table->_slots.size() && (_table->_slots[_index].version & freeBit))
+                ++_index;
+        }
+
+      public:
+        Iterator(Table* table, size_t index) : _table(table), _index(index) { skipFree(); }
+
+        void operator++()
+        {
+            ++_index;
+            skipFree();
+        }
+
+        bool operator!=(const Iterator& o) const { return _index != o._index; }
+
+        bool operator==(const Iterator& o) const { return _index == o._index; }
+
+        T& operator*() const { return _table->_slots[_index]; }
+
+        size_t index() const { return _index; }
+
+        using iterator_category = std::forward_iterator_tag;
+        using reference = T&;
+        using pointer = T*;
+    };
+
+    using iterator = Iterator<EntityTable, EntityIndex>;
+    using const_iterator = Iterator<const EntityTable, const EntityIndex>;
+
+    iterator begin() { return {this, 0}; }
+
+    iterator end() { return {this, _slots.size()}; }
+
+    const_iterator begin() const { return {this, 0}; }
+
+    const_iterator end() const { return {this, _slots.size()}; }
+};
+
+#endif // BRANEENGINE_ENTITYTABLE_H
@@ -0,0 +1,264 @@
+#ifndef BRANEENGINE_QUERY_H
+#define BRANEENGINE_QUERY_H
+
+#include <array>
+#include <tuple>
+#include <type_traits>
+#include <utility>
+#include <vector>
+#include "entity.h"
+#include "system.h"
+
+// Query terms, Read and Write are passed to the callback in the order they are declared, Changed and Without only
+// filter chunks and archetypes.
+template<class T>
+struct Read
+{
+    using Component = T;
+    using Column = const T;
+    using Iterated = std::tuple<Read<T>>;
+    static constexpr ComponentFilterFlags flags = ComponentFilterFlags_Const;
+};
+
+template<class T>
+struct Write
+{
+    using Component = T;
+    using Column = T;
+    using Iterated = std::tuple<Write<T>>;
+    static constexpr ComponentFilterFlags flags = ComponentFilterFlags_None;
+};
+
+template<class T>
+struct Changed
+{
+    using Component = T;
+    using Iterated = std::tuple<>;
+    static constexpr ComponentFilterFlags flags = ComponentFilterFlags_Changed;
+};
+
+template<class T>
+struct Without
+{
+    using Component = T;
+    using Iterated = std::tuple<>;
+    static constexpr ComponentFilterFlags flags = ComponentFilterFlags_Exclude;
+};
+
+// Statically typed alternative to ComponentFilter + forEachNative for native components, e.g.
+// Query<Read<Transform>, Write<TRS>, Changed<TRS>, Without<LocalTransform>>.
+// Component ids are resolved on construction and the matching archetypes are cached until the archetype manager
+// creates or destroys an archetype.
+template<class... Terms>
+class Query
+{
+    using Iterated = decltype(std::tuple_cat(std::declval<typename Terms::Iterated>()...));
+    static constexpr size_t columnCount = std::tuple_size_v<Iterated>;
+
+    template<size_t I>
+    using Column = typename std::tuple_element_t<I, Iterated>::Column;
+
+    ComponentFilter _filter;
+    std::array<ComponentID, columnCount> _columnIDs;
+
+    std::vector<Archetype*> _archetypes;
+    // Column of each iterated component in the chunks of _archetypes[i]
+    std::vector<std::array<size_t, columnCount>> _columns;
+    const ArchetypeManager* _cachedManager = nullptr;
+    size_t _cachedGeneration = 0;
+    // Changed rows of the chunk being iterated
+    std::vector<uint64_t> _rows;
+    // Rows the callback reported writing to, when it returns bool
+    std::vector<uint64_t> _written;
+
+    template<size_t... I>
+    void initColumns(std::index_sequence<I...>)
+    {
+        _columnIDs = {std::tuple_element_t<I, Iterated>::Component::def()->id...};
+    }
+
+    void updateArchetypes(ArchetypeManager& archetypes)
+    {
+        if(_cachedManager == &archetypes && _cachedGeneration == archetypes.generation())
+            return;
+        _archetypes = archetypes.getArchetypes(_filter);
+        _columns.resize(_archetypes.size());
+        for(size_t a = 0; a < _archetypes.size(); ++a)
+        {
+            for(size_t c = 0; c < columnCount; ++c)
+                _columns[a][c] = _archetypes[a]->columnIndex(_columnIDs[c]);
+        }
+        _cachedManager = &archetypes;
+        _cachedGeneration = archetypes.generation();
+    }
+
+    template<class T>
+    void acquireColumn(ChunkComponentView* view, bool unlocked)
+    {
+        if constexpr(std::is_const_v<T>)
+        {
+            if(!unlocked)
+                view->lockShared();
+        }
+        else
+            view->lock();
+    }
+
+    // written is null if every row may have been written
+    template<class T>
+    void releaseColumn(ChunkComponentView* view, bool unlocked, const uint64_t* written, size_t size)
+    {
+        if constexpr(std::is_const_v<T>)
+        {
+            if(!unlocked)
+                view->unlockShared();
+        }
+        else
+        {
+            if(written)
+            {
+                bool any = false;
+                for(size_t w = 0; w * 64 < size; ++w)
+                    any |= written[w] != 0;
+                if(any)
+                {
+                    view->version = _filter.system()->version;
+                    view->markRowsChanged(written);
+                }
+            }
+            else
+            {
+                view->version = _filter.system()->version;
+                view->markRowsChanged(0, size);
+            }
+            view->unlock();
+        }
+    }
+
+    // Whether f is a per entity callback that returns which rows it wrote
+    template<bool Runs, class F, size_t... I>
+    static constexpr bool reportsWrites()
+    {
+        if constexpr(Runs)
+            return false;
+        else
+            return std::is_same_v<std::invoke_result_t<F&, Column<I>&...>, bool>;
+    }
+
+    // Runs passes f contiguous runs of rows instead of single entities
+    template<bool Runs, class F, size_t... I>
+    void iterate(F& f, std::index_sequence<I...>)
+    {
+        std::array<ChunkComponentView*, columnCount> views;
+        // Reads the scheduler has already made safe
+        const ComponentSet& unlockedReads = _filter.system()->unlockedReads;
+        std::array<bool, columnCount> unlocked{
+            (std::is_const_v<Column<I>> && unlockedReads.contains(_columnIDs[I]))...};
+        for(size_t a = 0; a < _archetypes.size(); ++a)
+        {
+            const auto& columnIndices = _columns[a];
+            for(auto& chunk : _archetypes[a]->chunks())
+            {
+                size_t size = chunk->size();
+                if(size == 0 || !_filter.checkChunk(chunk.get()))
+                    continue;
+
+                ((views[I] = &chunk->column(columnIndices[I])), ...);
+                (acquireColumn<Column<I>>(views[I], unlocked[I]), ...);
+
+                std::tuple<Column<I>*...> columns{(Column<I>*)views[I]->getComponentData(0)...};
+                bool filtered = _filter.changedRows(chunk.get(), _rows);
+                // Only the visited rows may have been written
+                const uint64_t* written = filtered ? _rows.data() : nullptr;
+                if constexpr(reportsWrites<Runs, F, I...>())
+                {
+                    _written.assign((size + 63) / 64, 0);
+                    auto visit = [&](size_t e) {
+                        if(f(std::get<I>(columns)[e]...))
+                            _written[e / 64] |= uint64_t(1) << (e % 64);
+                    };
+                    if(filtered)
+                        forEachSetRow(_rows.data(), size, visit);
+                    else
+                    {
+                        for(size_t e = 0; e < size; ++e)
+                            visit(e);
+                    }
+                    written = _written.data();
+                }
+                else if constexpr(Runs)
+                {
+                    if(filtered)
+                    {
+                        forEachSetRange(_rows.data(), size, [&](size_t begin, size_t end) {
+                            f(end - begin, (std::get<I>(columns) + begin)...);
+                        });
+                    }
+                    else
+                        f(size, std::get<I>(columns)...);
+                }
+                else if(filtered)
+                    forEachSetRow(_rows.data(), size, [&](size_t e) { f(std::get<I>(columns)[e]...); });
+                else
+                {
+                    for(size_t e = 0; e < size; ++e)
+                        f(std::get<I>(columns)[e]...);
+                }
+
+                (releaseColumn<Column<I>>(views[I], unlocked[I], written, size), ...);
+            }
+        }
+    }
+
+  public:
+    Query(SystemContext* ctx) : _filter(ctx)
+    {
+        (_filter.addComponent(Terms::Component::def()->id, Terms::flags), ...);
+        initColumns(std::make_index_sequence<columnCount>());
+    }
+
+    // f is called once per entity with a reference to every Read (const) and Write component. If a Changed component
+    // tracks row changes only entities that changed are visited, otherwise every entity in a changed chunk is.
+    // Every visited row counts as written, unless f returns bool, then only rows it returned true for do.
+    template<class F>
+    void forEach(EntityManager& em, F&& f)
+    {
+        updateArchetypes(em.archetypes());
+        iterate<false>(f, std::make_index_sequence<columnCount>());
+    }
+
+    // Same as forEach, but f is called with a row count and a pointer to the first of those rows in every column, so
+    // whole chunks can be handed to batched code. Chunks where only some rows changed are passed as several runs.
+    template<class F>
+    void forEachChunk(EntityManager& em, F&& f)
+    {
+        updateArchetypes(em.archetypes());
+        iterate<true>(f, std::make_index_sequence<columnCount>());
+    }
+
+    size_t archetypeCount(EntityManager& em)
+    {
+        updateArchetypes(em.archetypes());
+        return _archetypes.size();
+    }
+
+    const ComponentFilter& filter() const { return _filter; }
+
+    // Components this query reads and writes, for systems to declare their access with. Changed terms count as reads,
+    // Without terms don't touch any data.
+    SystemAccess access() const
+    {
+        SystemAccess access;
+        (
+            [&access]() {
+            if constexpr(Terms::flags == ComponentFilterFlags_None)
+                access.writes.add(Terms::Component::def()->id);
+            else if constexpr(Terms::flags != ComponentFilterFlags_Exclude)
+                access.reads.add(Terms::Component::def()->id);
+        }(),
+            ...);
+        return access;
+    }
+};
+
+#endif // BRANEENGINE_QUERY_H
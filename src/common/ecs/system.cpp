@@ -3,3 +3,26 @@
 //
 
 #include "system.h"
+
+bool SystemAccess::conflicts(const SystemAccess& o) const
+{
+    if(exclusive || o.exclusive)
+        return true;
+    return writes.intersects(o.writes) || writes.intersects(o.reads) || reads.intersects(o.writes);
+}
+
+void SystemAccess::merge(const SystemAccess& o)
+{
+    for(ComponentID c : o.reads)
+        reads.add(c);
+    for(ComponentID c : o.writes)
+        writes.add(c);
+    exclusive |= o.exclusive;
+}
+
+SystemAccess System::access() const
+{
+    SystemAccess access;
+    access.exclusive = true;
+    return access;
+}
@@ -7,6 +7,7 @@
 
 #include <cstdint>
 #include <functional>
+#include "componentSet.h"
 
 class EntityManager;
 
@@ -14,6 +15,23 @@ struct SystemContext
 {
     uint32_t version = 0;
     uint32_t lastVersion = 0;
+    // Set by the scheduler while the system runs to the components it declared as read and not written. Nothing
+    // running at the same time may write those, so queries read them without taking column locks.
+    ComponentSet unlockedReads;
+};
+
+// Components a system touches. The scheduler lets systems run at the same time as long as neither writes anything the
+// other reads or writes.
+struct SystemAccess
+{
+    ComponentSet reads;
+    ComponentSet writes;
+    // Exclusive systems may do anything, including structural changes, so they run alone on the main thread
+    bool exclusive = false;
+
+    bool conflicts(const SystemAccess& o) const;
+
+    void merge(const SystemAccess& o);
 };
 
 class System
@@ -29,6 +47,9 @@ class System
     virtual ~System() = default;
 
     virtual void run(EntityManager& em) = 0;
+
+    // Systems that don't declare what they access are exclusive
+    virtual SystemAccess access() const;
 };
 
 #endif // BRANEENGINE_SYSTEM_H
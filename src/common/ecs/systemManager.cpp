@@ -3,23 +3,153 @@
 //
 
 #include "systemManager.h"
+#include <algorithm>
+#include <chrono>
+#include "entity.h"
 #include "runtime/runtime.h"
+#include "utility/threadPool.h"
+
+static uint64_t nanosecondsSince(std::chrono::steady_clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
 
 void SystemManager::runSystems(EntityManager& em)
 {
-    for(auto& system : _systems)
+    if(_scheduleDirty)
+        buildSchedule();
+    // Every system has run since the start of the previous period, so row changes older than that can be dropped
+    em.archetypes().rotateChangedRows(globalVersion);
+
+    auto start = std::chrono::steady_clock::now();
+    // Versions are handed out up front in schedule order, so they're ordered the same way the systems are
+    for(auto* node : _schedule)
+        node->system->_ctx.version = globalVersion++;
+
+    _runningEm = &em;
+    for(auto& segment : _segments)
+    {
+        // Not worth a trip through the pool for one system
+        if(segment.end - segment.begin == 1)
+            runSystem(_schedule[segment.begin]);
+        else
+            segment.graph->runAndWait();
+    }
+    _runningEm = nullptr;
+
+    _stats.wallTime = nanosecondsSince(start);
+    _stats.systemTime = 0;
+    for(auto* node : _schedule)
+        _stats.systemTime += node->runTime;
+}
+
+void SystemManager::runSystem(SystemNode* node)
+{
+    auto start = std::chrono::steady_clock::now();
+    node->system->_ctx.unlockedReads = node->unlockedReads;
+    node->system->run(*_runningEm);
+    node->system->_ctx.unlockedReads = {};
+    node->system->_ctx.lastVersion = node->system->_ctx.version;
+    node->runTime = nanosecondsSince(start);
+}
+
+void SystemManager::buildSegments()
+{
+    _segments.clear();
+    size_t begin = 0;
+    while(begin < _schedule.size())
     {
-        system.second->hasRun = false;
-        system.second->isRunning = false;
+        size_t end = begin + 1;
+        if(!_schedule[begin]->access.exclusive)
+        {
+            while(end < _schedule.size() && !_schedule[end]->access.exclusive)
+                ++end;
+        }
+        Segment segment{begin, end, nullptr};
+        if(end - begin > 1)
+        {
+            // Task ids match positions in the segment. Edges leaving the segment are already satisfied by running the
+            // segments in order.
+            segment.graph = std::make_unique<TaskGraph>();
+            for(size_t i = begin; i < end; ++i)
+                segment.graph->addTask([this, node = _schedule[i]]() { runSystem(node); });
+            for(size_t i = begin; i < end; ++i)
+                for(auto* dependent : _schedule[i]->dependents)
+                    if(dependent->scheduleIndex < end)
+                        segment.graph->addDependency(i - begin, dependent->scheduleIndex - begin);
+        }
+        _segments.push_back(std::move(segment));
+        begin = end;
     }
-    for(auto& system : _systems)
-        system.second->run(em, globalVersion);
+}
+
+void SystemManager::buildSchedule()
+{
+    // Explicit dependencies decide the order first, registration order breaks ties
+    _schedule.clear();
+    std::unordered_map<SystemNode*, bool> visiting;
+    std::function<void(SystemNode*)> visit = [&](SystemNode* node) {
+        auto state = visiting.find(node);
+        if(state != visiting.end())
+        {
+            if(state->second)
+                Runtime::warn("Circular dependency in systems!");
+            return;
+        }
+        visiting[node] = true;
+        for(auto* dep : node->dependencies)
+            visit(dep);
+        visiting[node] = false;
+        _schedule.push_back(node);
+    };
+    for(auto* node : _registrationOrder)
+        visit(node);
+
+    _stats = {};
+    _stats.systems = _schedule.size();
+    for(size_t i = 0; i < _schedule.size(); ++i)
+    {
+        SystemNode* node = _schedule[i];
+        node->scheduleIndex = i;
+        node->access = node->system->access();
+        // Exclusive systems don't say what they read, so they keep taking locks
+        node->unlockedReads = {};
+        if(!node->access.exclusive)
+        {
+            for(ComponentID c : node->access.reads)
+                if(!node->access.writes.contains(c))
+                    node->unlockedReads.add(c);
+        }
+        node->dependents.clear();
+        _stats.exclusiveSystems += node->access.exclusive;
+    }
+
+    // A system waits on every earlier system it conflicts with or explicitly depends on
+    std::vector<size_t> depth(_schedule.size(), 1);
+    for(size_t i = 0; i < _schedule.size(); ++i)
+    {
+        SystemNode* node = _schedule[i];
+        for(size_t j = 0; j < i; ++j)
+        {
+            SystemNode* earlier = _schedule[j];
+            bool dependency =
+                std::find(node->dependencies.begin(), node->dependencies.end(), earlier) != node->dependencies.end();
+            if(!dependency && !node->access.conflicts(earlier->access))
+                continue;
+            earlier->dependents.push_back(node);
+            ++_stats.edges;
+            depth[i] = std::max(depth[i], depth[j] + 1);
+        }
+        _stats.criticalPath = std::max(_stats.criticalPath, depth[i]);
+    }
+    buildSegments();
+    _scheduleDirty = false;
 }
 
 void SystemManager::runUnmanagedSystem(const std::string& name, const std::function<void(SystemContext* data)>& f)
 {
     if(!_unmanagedSystems.count(name))
-        _unmanagedSystems.insert({name, {0, 0}});
+        _unmanagedSystems.insert({name, SystemContext{}});
     SystemContext* data = &_unmanagedSystems.at(name);
     data->version = globalVersion++;
     f(data);
@@ -28,7 +158,10 @@ void SystemManager::runUnmanagedSystem(const std::string& name, const std::funct
 
 void SystemManager::addSystem(const std::string& name, std::unique_ptr<System> system)
 {
-    _systems.insert({name, std::make_unique<SystemNode>(std::move(system))});
+    auto [node, inserted] = _systems.insert({name, std::make_unique<SystemNode>(name, std::move(system))});
+    if(inserted)
+        _registrationOrder.push_back(node->second.get());
+    _scheduleDirty = true;
 }
 
 bool SystemManager::addDependency(const std::string& systemName, const std::string& dependencyName)
@@ -36,28 +169,14 @@ bool SystemManager::addDependency(const std::string& systemName, const std::stri
     if(!_systems.count(systemName) || !_systems.count(dependencyName))
         return false;
     _systems.at(systemName)->dependencies.push_back(_systems.at(dependencyName).get());
+    _scheduleDirty = true;
     return true;
 }
 
-SystemManager::SystemNode::SystemNode(std::unique_ptr<System> s) { system = std::move(s); }
+void SystemManager::invalidateSchedule() { _scheduleDirty = true; }
 
-void SystemManager::SystemNode::run(EntityManager& em, uint32_t& version)
-{
-    if(hasRun)
-        return;
-    if(isRunning)
-    {
-        Runtime::warn("Circular dependency in systems!");
-        return;
-    }
-    isRunning = true;
-    for(auto* dep : dependencies)
-        dep->run(em, version);
-
-    system->_ctx.version = version++;
-    system->run(em);
-    system->_ctx.lastVersion = system->_ctx.version;
+const SystemManager::ScheduleStats& SystemManager::scheduleStats() const { return _stats; }
 
-    isRunning = false;
-    hasRun = true;
-}
+SystemManager::SystemNode::SystemNode(std::string name, std::unique_ptr<System> s)
+    : name(std::move(name)), system(std::move(s))
+{}
@@ -5,38 +5,94 @@
 #ifndef BRANEENGINE_SYSTEMMANAGER_H
 #define BRANEENGINE_SYSTEMMANAGER_H
 
+#include <atomic>
 #include <memory>
 #include <string>
+#include <unordered_map>
+#include <vector>
 #include "system.h"
+#include "utility/taskGraph.h"
 
 class SystemManager
 {
     struct SystemNode
     {
-        bool hasRun = false;
-        bool isRunning = false;
+        std::string name;
         std::vector<SystemNode*> dependencies;
         std::unique_ptr<System> system;
 
-        SystemNode(std::unique_ptr<System> s);
+        // Filled in when the schedule is built
+        SystemAccess access;
+        ComponentSet unlockedReads;
+        std::vector<SystemNode*> dependents;
+        size_t scheduleIndex = 0;
+        // Nanoseconds the system took in the last runSystems call
+        uint64_t runTime = 0;
 
-        void run(EntityManager& em, uint32_t& version);
+        SystemNode(std::string name, std::unique_ptr<System> s);
     };
 
+  public:
+    struct ScheduleStats
+    {
+        size_t systems = 0;
+        // Ordering edges between systems, from explicit dependencies or conflicting access
+        size_t edges = 0;
+        // Longest chain of systems that have to run one after another
+        size_t criticalPath = 0;
+        size_t exclusiveSystems = 0;
+        // Nanoseconds spent in the last runSystems call, and summed over every system it ran. Their ratio is how much
+        // parallelism the schedule achieved.
+        uint64_t wallTime = 0;
+        uint64_t systemTime = 0;
+    };
+
+  private:
     std::unordered_map<std::string, std::unique_ptr<SystemNode>> _systems;
+    std::vector<SystemNode*> _registrationOrder;
     std::unordered_map<std::string, SystemContext> _unmanagedSystems;
 
+    // Exclusive systems conflict with everything, so they split the schedule into segments. Everything else in a
+    // segment runs as a task graph on the thread pool, built along with the schedule and replayed every run.
+    struct Segment
+    {
+        size_t begin;
+        size_t end;
+        std::unique_ptr<TaskGraph> graph;
+    };
+
+    // Systems in an order that respects every edge, rebuilt when systems or dependencies change
+    std::vector<SystemNode*> _schedule;
+    std::vector<Segment> _segments;
+    bool _scheduleDirty = true;
+    ScheduleStats _stats;
+
+    // Only valid during runSystems, for the graph tasks
+    EntityManager* _runningEm = nullptr;
+
+    void buildSchedule();
+
+    void buildSegments();
+
+    void runSystem(SystemNode* node);
+
   public:
     uint32_t globalVersion = 0;
 
-    // TODO: have an actual scheduling system in here
     void runUnmanagedSystem(const std::string& name, const std::function<void(SystemContext* data)>& f);
 
+    // Runs every system once. Systems whose declared access doesn't conflict run concurrently on the thread pool,
+    // conflicting ones run in the order they were added unless explicit dependencies say otherwise.
     void runSystems(EntityManager& em);
 
     void addSystem(const std::string& name, std::unique_ptr<System> system);
 
     bool addDependency(const std::string& systemName, const std::string& dependencyName);
+
+    // Forces the schedule to be rebuilt, for when a system's access changes after it was added
+    void invalidateSchedule();
+
+    const ScheduleStats& scheduleStats() const;
 };
 
 #endif // BRANEENGINE_SYSTEMMANAGER_H
@@ -74,6 +74,23 @@ namespace VirtualType
         return 0;
     }
 
+    bool triviallyRelocatable(Type type)
+    {
+        assert(type != virtualUnknown);
+        switch(type)
+        {
+            case virtualString:
+            case virtualAssetID:
+            case virtualFloatArray:
+            case virtualIntArray:
+            case virtualUIntArray:
+            case virtualEntityIDArray:
+                return false;
+            default:
+                return true;
+        }
+    }
+
     void construct(Type type, byte* var)
     {
         assert(type != virtualUnknown);
@@ -75,6 +75,9 @@ namespace VirtualType
 
     size_t size(Type type);
 
+    // True if values of this type can be moved with a plain memcpy, leaving nothing behind that needs destroying
+    bool triviallyRelocatable(Type type);
+
     void construct(Type type, byte* var);
 
     void deconstruct(Type type, byte* var);
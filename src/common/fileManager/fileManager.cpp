@@ -76,7 +76,8 @@ void FileManager::writeFile(const std::filesystem::path& filename, const Json::V
 AsyncData<Asset*> FileManager::async_readUnknownAsset(const std::filesystem::path& filename)
 {
     AsyncData<Asset*> asset;
-    ThreadPool::enqueue([this, filename, asset] { asset.setData(readUnknownAsset(filename)); });
+    ThreadPool::enqueueDetached([this, filename, asset] { asset.setData(readUnknownAsset(filename)); },
+                                JobPriority::streaming);
     return asset;
 }
 
@@ -182,6 +183,16 @@ std::string FileManager::fileHash(const std::filesystem::path& filename)
     return toHex(hash);
 }
 
+std::vector<std::string> FileManager::fileHashes(const std::vector<std::filesystem::path>& filenames)
+{
+    std::vector<std::string> hashes(filenames.size());
+    ThreadPool::parallelFor(0, filenames.size(), 1, [&](size_t begin, size_t end) {
+        for(size_t i = begin; i < end; ++i)
+            hashes[i] = fileHash(filenames[i]);
+    });
+    return hashes;
+}
+
 std::filesystem::path FileManager::Directory::path() const
 {
     if(parent)
@@ -89,7 +89,8 @@ class FileManager : public Module
     AsyncData<T*> async_readAsset(const std::filesystem::path& filename)
     {
         AsyncData<T*> asset;
-        ThreadPool::enqueue([this, filename, asset] { asset.setData(readAsset<T>(filename)); });
+        ThreadPool::enqueueDetached([this, filename, asset] { asset.setData(readAsset<T>(filename)); },
+                                    JobPriority::streaming);
         return asset;
     }
 
@@ -97,6 +98,9 @@ class FileManager : public Module
 
     static std::string fileHash(const std::filesystem::path& filename);
 
+    // Hashes of every file, in the same order, computed across the thread pool
+    static std::vector<std::string> fileHashes(const std::vector<std::filesystem::path>& filenames);
+
     static bool readFile(const std::filesystem::path& filename, std::string& data);
 
     static bool readFile(const std::filesystem::path& filename, Json::Value& data);
@@ -56,11 +56,12 @@ namespace graphics
             ComponentFilter filter(ctx);
             filter.addComponent(Transform::def()->id, ComponentFilterFlags_Const);
             filter.addComponent(PointLightComponent::def()->id, ComponentFilterFlags_Const);
-            _em.getEntities(filter).forEachNative([&pointLights](byte** components) {
-                Transform* transform = Transform::fromVirtual(components[0]);
-                PointLightComponent* light = PointLightComponent::fromVirtual(components[1]);
-                PointLightData data{transform->value[3], light->color};
-                pointLights.push_back(data);
+            _em.getEntities(filter).forEachChunk(
+                [&pointLights](ChunkSpan<const Transform, const PointLightComponent>& chunk) {
+                auto transforms = chunk.get<const Transform>();
+                auto lights = chunk.get<const PointLightComponent>();
+                for(size_t i = 0; i < chunk.size(); ++i)
+                    pointLights.push_back({transforms[i].value[3], lights[i].color});
             });
         });
         updateLights(_swapChain.currentFrame(), pointLights);
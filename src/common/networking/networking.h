@@ -17,8 +17,7 @@
 #include <shared_mutex>
 #include <utility/asyncData.h>
 #include <utility/serializedData.h>
-
-class JobHandle;
+#include <utility/threadPool.h>
 
 class Asset;
 
@@ -48,7 +47,7 @@ class NetworkManager : public Module
 {
     asio::io_context _context;
 
-    std::shared_ptr<JobHandle> _threadHandle;
+    JobHandlePtr _threadHandle;
     asio::ssl::context _ssl_context;
     asio::ip::tcp::resolver _tcpResolver;
 
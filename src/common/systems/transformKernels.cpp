@@ -0,0 +1,321 @@
+#include "transformKernels.h"
+
+#include <cstddef>
+#include <type_traits>
+#include <glm/gtc/type_ptr.hpp>
+#include "transforms.h"
+
+#if defined(__x86_64__) || defined(_M_X64)
+#define BRANE_X86_KERNELS
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+// MSVC can emit any instruction set without per function attributes
+#define TARGET_AVX2
+#else
+#define TARGET_AVX2 __attribute__((target("avx2,fma")))
+#endif
+#endif
+
+static float* matrixAt(glm::mat4* base, size_t stride, size_t index)
+{
+    return glm::value_ptr(*reinterpret_cast<glm::mat4*>(reinterpret_cast<char*>(base) + stride * index));
+}
+
+// Expands translate(t) * scale(s) * mat4_cast(r) by hand, skipping the two full matrix multiplies and all the terms
+// that are known to be zero.
+static void composeTRSScalar(const TRS* trs, glm::mat4* out, size_t outStride, size_t count)
+{
+    for(size_t i = 0; i < count; ++i)
+    {
+        const glm::quat& q = trs[i].rotation;
+        const glm::vec3& s = trs[i].scale;
+        const glm::vec3& t = trs[i].translation;
+        float xx = q.x * q.x, yy = q.y * q.y, zz = q.z * q.z;
+        float xy = q.x * q.y, xz = q.x * q.z, yz = q.y * q.z;
+        float wx = q.w * q.x, wy = q.w * q.y, wz = q.w * q.z;
+
+        float* m = matrixAt(out, outStride, i);
+        m[0] = s.x * (1 - 2 * (yy + zz));
+        m[1] = s.y * (2 * (xy + wz));
+        m[2] = s.z * (2 * (xz - wy));
+        m[3] = 0;
+        m[4] = s.x * (2 * (xy - wz));
+        m[5] = s.y * (1 - 2 * (xx + zz));
+        m[6] = s.z * (2 * (yz + wx));
+        m[7] = 0;
+        m[8] = s.x * (2 * (xz + wy));
+        m[9] = s.y * (2 * (yz - wx));
+        m[10] = s.z * (1 - 2 * (xx + yy));
+        m[11] = 0;
+        m[12] = t.x;
+        m[13] = t.y;
+        m[14] = t.z;
+        m[15] = 1;
+    }
+}
+
+static void multiplyScalar(const glm::mat4* const* a, const glm::mat4* const* b, glm::mat4* out, size_t count)
+{
+    for(size_t i = 0; i < count; ++i)
+        out[i] = *a[i] * *b[i];
+}
+
+static const TransformKernels scalarKernels = {"scalar", composeTRSScalar, multiplyScalar};
+
+#ifdef BRANE_X86_KERNELS
+
+// TRS is read as vectors in the SSE and AVX2 paths, which relies on its members being packed back to back and on glm
+// storing quaternions as x, y, z, w. Defining GLM_FORCE_QUAT_DATA_WXYZ would silently break that.
+static_assert(sizeof(TRS) == 10 * sizeof(float));
+static_assert(std::is_standard_layout_v<TRS>);
+static_assert(offsetof(TRS, translation) == 0);
+static_assert(offsetof(TRS, rotation) == 3 * sizeof(float));
+static_assert(offsetof(TRS, scale) == 7 * sizeof(float));
+static_assert(sizeof(glm::quat) == 4 * sizeof(float));
+static_assert(offsetof(glm::quat, x) == 0 && offsetof(glm::quat, y) == sizeof(float) &&
+              offsetof(glm::quat, z) == 2 * sizeof(float) && offsetof(glm::quat, w) == 3 * sizeof(float));
+
+static __m128 loadTranslation(const TRS* trs) { return _mm_loadu_ps(&trs->translation.x); }
+
+static __m128 loadRotation(const TRS* trs) { return _mm_loadu_ps(&trs->rotation.x); }
+
+// Starts one float early so it doesn't read past the end of the last TRS in a column
+static __m128 loadScale(const TRS* trs) { return _mm_loadu_ps(&trs->rotation.w); }
+
+// Rows hold one element of a column for four entities, transposed they hold that column of each entity
+static void storeColumn(glm::mat4* out, size_t stride, size_t first, int column, __m128 r0, __m128 r1, __m128 r2,
+                        __m128 r3)
+{
+    _MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+    _mm_storeu_ps(matrixAt(out, stride, first) + column * 4, r0);
+    _mm_storeu_ps(matrixAt(out, stride, first + 1) + column * 4, r1);
+    _mm_storeu_ps(matrixAt(out, stride, first + 2) + column * 4, r2);
+    _mm_storeu_ps(matrixAt(out, stride, first + 3) + column * 4, r3);
+}
+
+// Four TRS components at a time, one per lane
+static void composeTRSSSE(const TRS* trs, glm::mat4* out, size_t outStride, size_t count)
+{
+    const __m128 one = _mm_set1_ps(1);
+    const __m128 two = _mm_set1_ps(2);
+    const __m128 zero = _mm_setzero_ps();
+    size_t i = 0;
+    for(; i + 4 <= count; i += 4)
+    {
+        // The extra float loaded with translation and scale belongs to the rotation and is ignored
+        __m128 qx = loadRotation(trs + i), qy = loadRotation(trs + i + 1);
+        __m128 qz = loadRotation(trs + i + 2), qw = loadRotation(trs + i + 3);
+        _MM_TRANSPOSE4_PS(qx, qy, qz, qw);
+        __m128 tx = loadTranslation(trs + i), ty = loadTranslation(trs + i + 1);
+        __m128 tz = loadTranslation(trs + i + 2), tw = loadTranslation(trs + i + 3);
+        _MM_TRANSPOSE4_PS(tx, ty, tz, tw);
+        __m128 sw = loadScale(trs + i), sx = loadScale(trs + i + 1);
+        __m128 sy = loadScale(trs + i + 2), sz = loadScale(trs + i + 3);
+        _MM_TRANSPOSE4_PS(sw, sx, sy, sz);
+
+        __m128 xx = _mm_mul_ps(qx, qx), yy = _mm_mul_ps(qy, qy), zz = _mm_mul_ps(qz, qz);
+        __m128 xy = _mm_mul_ps(qx, qy), xz = _mm_mul_ps(qx, qz), yz = _mm_mul_ps(qy, qz);
+        __m128 wx = _mm_mul_ps(qw, qx), wy = _mm_mul_ps(qw, qy), wz = _mm_mul_ps(qw, qz);
+
+        storeColumn(out,
+                    outStride,
+                    i,
+                    0,
+                    _mm_mul_ps(sx, _mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(yy, zz)))),
+                    _mm_mul_ps(sy, _mm_mul_ps(two, _mm_add_ps(xy, wz))),
+                    _mm_mul_ps(sz, _mm_mul_ps(two, _mm_sub_ps(xz, wy))),
+                    zero);
+        storeColumn(out,
+                    outStride,
+                    i,
+                    1,
+                    _mm_mul_ps(sx, _mm_mul_ps(two, _mm_sub_ps(xy, wz))),
+                    _mm_mul_ps(sy, _mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, zz)))),
+                    _mm_mul_ps(sz, _mm_mul_ps(two, _mm_add_ps(yz, wx))),
+                    zero);
+        storeColumn(out,
+                    outStride,
+                    i,
+                    2,
+                    _mm_mul_ps(sx, _mm_mul_ps(two, _mm_add_ps(xz, wy))),
+                    _mm_mul_ps(sy, _mm_mul_ps(two, _mm_sub_ps(yz, wx))),
+                    _mm_mul_ps(sz, _mm_sub_ps(one, _mm_mul_ps(two, _mm_add_ps(xx, yy)))),
+                    zero);
+        storeColumn(out, outStride, i, 3, tx, ty, tz, one);
+    }
+    composeTRSScalar(trs + i, reinterpret_cast<glm::mat4*>(matrixAt(out, outStride, i)), outStride, count - i);
+}
+
+// Each column of the result is a sum of the columns of a, weighted by the matching column of b
+static void multiplySSE(const glm::mat4* const* a, const glm::mat4* const* b, glm::mat4* out, size_t count)
+{
+    for(size_t i = 0; i < count; ++i)
+    {
+        const float* pa = glm::value_ptr(*a[i]);
+        const float* pb = glm::value_ptr(*b[i]);
+        float* po = glm::value_ptr(out[i]);
+        __m128 a0 = _mm_loadu_ps(pa);
+        __m128 a1 = _mm_loadu_ps(pa + 4);
+        __m128 a2 = _mm_loadu_ps(pa + 8);
+        __m128 a3 = _mm_loadu_ps(pa + 12);
+        for(int c = 0; c < 4; ++c)
+        {
+            const float* column = pb + c * 4;
+            __m128 r = _mm_mul_ps(a0, _mm_set1_ps(column[0]));
+            r = _mm_add_ps(r, _mm_mul_ps(a1, _mm_set1_ps(column[1])));
+            r = _mm_add_ps(r, _mm_mul_ps(a2, _mm_set1_ps(column[2])));
+            r = _mm_add_ps(r, _mm_mul_ps(a3, _mm_set1_ps(column[3])));
+            _mm_storeu_ps(po + c * 4, r);
+        }
+    }
+}
+
+static const TransformKernels sseKernels = {"sse", composeTRSSSE, multiplySSE};
+
+// Entities first to first + 3 go in the low half and first + 4 to first + 7 in the high half
+template<class Load>
+TARGET_AVX2 static __m256 loadLanes(const TRS* trs, Load load)
+{
+    return _mm256_insertf128_ps(_mm256_castps128_ps256(load(trs)), load(trs + 4), 1);
+}
+
+// _MM_TRANSPOSE4_PS on both halves at once
+TARGET_AVX2 static void transposeHalves(__m256& r0, __m256& r1, __m256& r2, __m256& r3)
+{
+    __m256 t0 = _mm256_unpacklo_ps(r0, r1), t1 = _mm256_unpacklo_ps(r2, r3);
+    __m256 t2 = _mm256_unpackhi_ps(r0, r1), t3 = _mm256_unpackhi_ps(r2, r3);
+    r0 = _mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(1, 0, 1, 0));
+    r1 = _mm256_shuffle_ps(t0, t1, _MM_SHUFFLE(3, 2, 3, 2));
+    r2 = _mm256_shuffle_ps(t2, t3, _MM_SHUFFLE(1, 0, 1, 0));
+    r3 = _mm256_shuffle_ps(t2, t3, _MM_SHUFFLE(3, 2, 3, 2));
+}
+
+TARGET_AVX2 static void storeColumn(glm::mat4* out, size_t stride, size_t first, int column, __m256 r0, __m256 r1,
+                                    __m256 r2, __m256 r3)
+{
+    transposeHalves(r0, r1, r2, r3);
+    __m256 rows[4] = {r0, r1, r2, r3};
+    for(int e = 0; e < 4; ++e)
+    {
+        _mm_storeu_ps(matrixAt(out, stride, first + e) + column * 4, _mm256_castps256_ps128(rows[e]));
+        _mm_storeu_ps(matrixAt(out, stride, first + e + 4) + column * 4, _mm256_extractf128_ps(rows[e], 1));
+    }
+}
+
+// Same as the SSE version, eight components at a time
+TARGET_AVX2 static void composeTRSAVX2(const TRS* trs, glm::mat4* out, size_t outStride, size_t count)
+{
+    const __m256 one = _mm256_set1_ps(1);
+    const __m256 two = _mm256_set1_ps(2);
+    const __m256 zero = _mm256_setzero_ps();
+    size_t i = 0;
+    for(; i + 8 <= count; i += 8)
+    {
+        const TRS* v = trs + i;
+        __m256 qx = loadLanes(v, loadRotation), qy = loadLanes(v + 1, loadRotation);
+        __m256 qz = loadLanes(v + 2, loadRotation), qw = loadLanes(v + 3, loadRotation);
+        transposeHalves(qx, qy, qz, qw);
+        __m256 tx = loadLanes(v, loadTranslation), ty = loadLanes(v + 1, loadTranslation);
+        __m256 tz = loadLanes(v + 2, loadTranslation), tw = loadLanes(v + 3, loadTranslation);
+        transposeHalves(tx, ty, tz, tw);
+        __m256 sw = loadLanes(v, loadScale), sx = loadLanes(v + 1, loadScale);
+        __m256 sy = loadLanes(v + 2, loadScale), sz = loadLanes(v + 3, loadScale);
+        transposeHalves(sw, sx, sy, sz);
+
+        __m256 xx = _mm256_mul_ps(qx, qx), yy = _mm256_mul_ps(qy, qy), zz = _mm256_mul_ps(qz, qz);
+        __m256 wx = _mm256_mul_ps(qw, qx), wy = _mm256_mul_ps(qw, qy), wz = _mm256_mul_ps(qw, qz);
+        __m256 xyPlusWz = _mm256_fmadd_ps(qx, qy, wz), xyMinusWz = _mm256_fmsub_ps(qx, qy, wz);
+        __m256 xzPlusWy = _mm256_fmadd_ps(qx, qz, wy), xzMinusWy = _mm256_fmsub_ps(qx, qz, wy);
+        __m256 yzPlusWx = _mm256_fmadd_ps(qy, qz, wx), yzMinusWx = _mm256_fmsub_ps(qy, qz, wx);
+
+        storeColumn(out,
+                    outStride,
+                    i,
+                    0,
+                    _mm256_mul_ps(sx, _mm256_fnmadd_ps(two, _mm256_add_ps(yy, zz), one)),
+                    _mm256_mul_ps(sy, _mm256_mul_ps(two, xyPlusWz)),
+                    _mm256_mul_ps(sz, _mm256_mul_ps(two, xzMinusWy)),
+                    zero);
+        storeColumn(out,
+                    outStride,
+                    i,
+                    1,
+                    _mm256_mul_ps(sx, _mm256_mul_ps(two, xyMinusWz)),
+                    _mm256_mul_ps(sy, _mm256_fnmadd_ps(two, _mm256_add_ps(xx, zz), one)),
+                    _mm256_mul_ps(sz, _mm256_mul_ps(two, yzPlusWx)),
+                    zero);
+        storeColumn(out,
+                    outStride,
+                    i,
+                    2,
+                    _mm256_mul_ps(sx, _mm256_mul_ps(two, xzPlusWy)),
+                    _mm256_mul_ps(sy, _mm256_mul_ps(two, yzMinusWx)),
+                    _mm256_mul_ps(sz, _mm256_fnmadd_ps(two, _mm256_add_ps(xx, yy), one)),
+                    zero);
+        storeColumn(out, outStride, i, 3, tx, ty, tz, one);
+    }
+    composeTRSScalar(trs + i, reinterpret_cast<glm::mat4*>(matrixAt(out, outStride, i)), outStride, count - i);
+}
+
+// Two result columns per instruction, a is duplicated into both halves of the registers
+TARGET_AVX2 static void multiplyAVX2(const glm::mat4* const* a, const glm::mat4* const* b, glm::mat4* out, size_t count)
+{
+    for(size_t i = 0; i < count; ++i)
+    {
+        const float* pa = glm::value_ptr(*a[i]);
+        const float* pb = glm::value_ptr(*b[i]);
+        float* po = glm::value_ptr(out[i]);
+        __m256 a0 = _mm256_broadcast_ps(reinterpret_cast<const __m128*>(pa));
+        __m256 a1 = _mm256_broadcast_ps(reinterpret_cast<const __m128*>(pa + 4));
+        __m256 a2 = _mm256_broadcast_ps(reinterpret_cast<const __m128*>(pa + 8));
+        __m256 a3 = _mm256_broadcast_ps(reinterpret_cast<const __m128*>(pa + 12));
+        for(int c = 0; c < 4; c += 2)
+        {
+            __m256 columns = _mm256_loadu_ps(pb + c * 4);
+            __m256 r = _mm256_mul_ps(a0, _mm256_shuffle_ps(columns, columns, 0x00));
+            r = _mm256_fmadd_ps(a1, _mm256_shuffle_ps(columns, columns, 0x55), r);
+            r = _mm256_fmadd_ps(a2, _mm256_shuffle_ps(columns, columns, 0xAA), r);
+            r = _mm256_fmadd_ps(a3, _mm256_shuffle_ps(columns, columns, 0xFF), r);
+            _mm256_storeu_ps(po + c * 4, r);
+        }
+    }
+}
+
+static const TransformKernels avx2Kernels = {"avx2", composeTRSAVX2, multiplyAVX2};
+
+static bool cpuSupportsAVX2()
+{
+#if defined(_MSC_VER) && !defined(__clang__)
+    int info[4];
+    __cpuid(info, 1);
+    bool fma = info[2] & (1 << 12);
+    bool osxsave = info[2] & (1 << 27);
+    if(!fma || !osxsave || (_xgetbv(0) & 0x6) != 0x6)
+        return false;
+    __cpuidex(info, 7, 0);
+    return info[1] & (1 << 5);
+#else
+    return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+}
+
+#endif
+
+std::vector<const TransformKernels*> TransformKernels::available()
+{
+    std::vector<const TransformKernels*> kernels = {&scalarKernels};
+#ifdef BRANE_X86_KERNELS
+    // SSE2 is part of x86-64
+    kernels.push_back(&sseKernels);
+    if(cpuSupportsAVX2())
+        kernels.push_back(&avx2Kernels);
+#endif
+    return kernels;
+}
+
+const TransformKernels& TransformKernels::active()
+{
+    static const TransformKernels& kernels = *available().back();
+    return kernels;
+}
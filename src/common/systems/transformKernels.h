@@ -0,0 +1,26 @@
+#ifndef BRANEENGINE_TRANSFORMKERNELS_H
+#define BRANEENGINE_TRANSFORMKERNELS_H
+
+#include <cstddef>
+#include <vector>
+#include <glm/glm.hpp>
+
+class TRS;
+
+// Batched matrix math for the transform system. There is one implementation per instruction set, and the best one the
+// CPU supports is picked the first time active() is called. All of them agree with glm to within float rounding.
+struct TransformKernels
+{
+    const char* name;
+    // out[i] = trs[i].toMat(). Matrices are outStride bytes apart so that out can point into a component column.
+    void (*composeTRS)(const TRS* trs, glm::mat4* out, size_t outStride, size_t count);
+    // out[i] = *a[i] * *b[i], out must not overlap any of the inputs
+    void (*multiply)(const glm::mat4* const* a, const glm::mat4* const* b, glm::mat4* out, size_t count);
+
+    static const TransformKernels& active();
+
+    // Every implementation this CPU can run, from slowest to fastest
+    static std::vector<const TransformKernels*> available();
+};
+
+#endif // BRANEENGINE_TRANSFORMKERNELS_H
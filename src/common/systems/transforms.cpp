@@ -3,6 +3,9 @@
 //
 
 #include "transforms.h"
+#include "transformKernels.h"
+
+#include <unordered_map>
 
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
@@ -24,6 +27,8 @@ void TRS::fromMat(const glm::mat4& t)
 void Transforms::start()
 {
     _em = Runtime::getModule<EntityManager>();
+    // Only a small part of a scene moves each frame, so the transform system skips unchanged entities
+    TRS::constructDescription()->trackRowChanges = true;
     _em->systems().addSystem("transform", std::make_unique<TransformSystem>());
 }
 
@@ -215,55 +220,206 @@ void Transforms::setDirty(EntityID entity, EntityManager& em)
     }
 }
 
+TransformSystem::TransformSystem()
+    : _globalTRS(&_ctx), _localTRS(&_ctx), _parented(&_ctx), _parentedTransforms(&_ctx)
+{}
+
+static constexpr uint32_t invalidSlot = UINT32_MAX;
+
 void TransformSystem::run(EntityManager& _em)
 {
+    const TransformKernels& kernels = TransformKernels::active();
+
     // Update trs for TRS components on unparented entities
-    ComponentFilter globalTRS(&_ctx);
-    globalTRS.addComponent(EntityIDComponent::def()->id, ComponentFilterFlags_Const);
-    globalTRS.addComponent(TRS::def()->id, ComponentFilterFlags_Changed);
-    globalTRS.addComponent(Transform::def()->id);
-    globalTRS.addComponent(LocalTransform::def()->id, ComponentFilterFlags_Exclude);
-
-    _em.getEntities(globalTRS).forEachNative([&_em](byte** components) {
-        EntityIDComponent* idc = EntityIDComponent::fromVirtual(components[0]);
-        TRS* trs = TRS::fromVirtual(components[1]);
-        Transform* t = Transform::fromVirtual(components[2]);
-        t->value = trs->toMat();
-        t->dirty = true;
-        Transforms::setDirty(idc->id, _em);
+    _globalTRS.forEachChunk(_em, [&kernels](size_t count, const TRS* trs, Transform* t) {
+        kernels.composeTRS(trs, &t->value, sizeof(Transform), count);
+        for(size_t i = 0; i < count; ++i)
+            t[i].dirty = true;
     });
 
     // Update trs on parented entities
-    ComponentFilter localTRS(&_ctx);
-    localTRS.addComponent(EntityIDComponent::def()->id, ComponentFilterFlags_Const);
-    localTRS.addComponent(TRS::def()->id, ComponentFilterFlags_Changed);
-    localTRS.addComponent(LocalTransform::def()->id);
-    localTRS.addComponent(Transform::def()->id);
-
-    _em.getEntities(localTRS).forEachNative([&_em](byte** components) {
-        EntityIDComponent* idc = EntityIDComponent::fromVirtual(components[0]);
-        TRS* trs = TRS::fromVirtual(components[1]);
-        LocalTransform* t = LocalTransform::fromVirtual(components[2]);
-        Transform* gt = Transform::fromVirtual(components[3]);
-        t->value = trs->toMat();
-        Transforms::setDirty(idc->id, _em);
+    _localTRS.forEachChunk(_em, [&kernels](size_t count, const TRS* trs, LocalTransform* t) {
+        kernels.composeTRS(trs, &t->value, sizeof(LocalTransform), count);
     });
 
-    // Update transform for parented entities
-    ComponentFilter localTransforms(&_ctx);
-    localTransforms.addComponent(Transform::def()->id);
-    localTransforms.addComponent(LocalTransform::def()->id, ComponentFilterFlags_Const);
+    if(!gatherComponents(_em))
+    {
+        rebuildHierarchy(_em);
+        gatherComponents(_em);
+    }
+    if(_nodes.empty())
+        return;
 
-    _em.getEntities(localTransforms).forEachNative([&_em](byte** components) {
-        auto* gt = Transform::fromVirtual(components[0]);
-        auto* lt = LocalTransform::fromVirtual(components[1]);
-        glm::mat4 pt = Transforms::getParentTransform(lt->parent, _em);
+    for(size_t i = 0; i < rootCount(); ++i)
+    {
+        EntityID root = _nodes[i].entity;
+        if(_em.entityExists(root) && _em.hasComponent<Transform>(root))
+            _world[i] = _em.getComponent<Transform>(root)->value;
+        else
+            _world[i] = glm::mat4(1);
+    }
+
+    // Each level only depends on the one above it, so large levels are split across the thread pool
+    constexpr size_t batchSize = 4096;
+    for(size_t level = 1; level < _levelStarts.size(); ++level)
+    {
+        size_t begin = _levelStarts[level];
+        size_t end = level + 1 < _levelStarts.size() ? _levelStarts[level + 1] : _nodes.size();
+        if(end - begin <= batchSize)
+        {
+            propagateLevel(begin, end);
+            continue;
+        }
+        ThreadPool::parallelFor(begin, end, batchSize, [this](size_t b, size_t e) { propagateLevel(b, e); });
+    }
 
-        gt->value = pt * lt->value;
-        gt->dirty = false;
+    // Written back with the columns locked, and only rows that actually moved are marked changed
+    _parentedTransforms.forEach(_em, [this](const EntityIDComponent& id, const LocalTransform&, Transform& t) {
+        const glm::mat4& world = _world[_slots[id.id.id]];
+        if(!t.dirty && t.value == world)
+            return false;
+        t.value = world;
+        t.dirty = false;
+        return true;
     });
 }
 
+size_t TransformSystem::rootCount() const { return _levelStarts.size() > 1 ? _levelStarts[1] : _nodes.size(); }
+
+void TransformSystem::propagateLevel(size_t begin, size_t end)
+{
+    const TransformKernels& kernels = TransformKernels::active();
+    constexpr size_t blockSize = 64;
+    const glm::mat4* parents[blockSize];
+    const glm::mat4* locals[blockSize];
+    for(size_t block = begin; block < end; block += blockSize)
+    {
+        size_t count = std::min(blockSize, end - block);
+        for(size_t i = 0; i < count; ++i)
+        {
+            parents[i] = &_world[_nodes[block + i].parentSlot];
+            locals[i] = &_local[block + i];
+        }
+        kernels.multiply(parents, locals, &_world[block], count);
+    }
+}
+
+bool TransformSystem::gatherComponents(EntityManager& em)
+{
+    // Doubles as a check that the hierarchy hasn't changed since it was flattened
+    bool valid = !_levelStarts.empty();
+    size_t visited = 0;
+    _parented.forEach(em, [&](const EntityIDComponent& id, const LocalTransform& lt, const Transform&) {
+        uint32_t slot = id.id.id < _slots.size() ? _slots[id.id.id] : invalidSlot;
+        if(slot == invalidSlot || _nodes[slot].entity != id.id || _nodes[slot].parent != lt.parent)
+        {
+            valid = false;
+            return;
+        }
+        _local[slot] = lt.value;
+        ++visited;
+    });
+    return valid && visited == _nodes.size() - rootCount();
+}
+
+void TransformSystem::rebuildHierarchy(EntityManager& em)
+{
+    struct Parented
+    {
+        EntityID entity;
+        EntityID parent;
+        uint32_t depth = 0;
+    };
+    std::vector<Parented> parented;
+    uint32_t maxID = 0;
+    _parented.forEach(em, [&](const EntityIDComponent& id, const LocalTransform& lt, const Transform&) {
+        parented.push_back({id.id, lt.parent});
+        maxID = std::max(maxID, id.id.id);
+    });
+
+    // Parents are looked up through this instead of the entity manager
+    std::vector<uint32_t> index(parented.empty() ? 0 : maxID + 1, invalidSlot);
+    for(uint32_t i = 0; i < parented.size(); ++i)
+        index[parented[i].entity.id] = i;
+    auto parentIndex = [&](const Parented& p) {
+        if(p.parent.id >= index.size())
+            return invalidSlot;
+        uint32_t i = index[p.parent.id];
+        return i != invalidSlot && parented[i].entity == p.parent ? i : invalidSlot;
+    };
+
+    // Walk up from each entity until reaching one with a known depth, then fill in depths on the way back down
+    constexpr uint32_t visiting = UINT32_MAX;
+    std::vector<uint32_t> chain;
+    uint32_t maxDepth = 0;
+    for(uint32_t i = 0; i < parented.size(); ++i)
+    {
+        uint32_t current = i;
+        while(current != invalidSlot && parented[current].depth == 0)
+        {
+            parented[current].depth = visiting;
+            chain.push_back(current);
+            current = parentIndex(parented[current]);
+        }
+        uint32_t depth = 0;
+        if(current != invalidSlot)
+        {
+            if(parented[current].depth == visiting)
+                Runtime::warn("Transform hierarchy contains a cycle");
+            else
+                depth = parented[current].depth;
+        }
+        for(auto c = chain.rbegin(); c != chain.rend(); ++c)
+            parented[*c].depth = ++depth;
+        maxDepth = std::max(maxDepth, depth);
+        chain.clear();
+    }
+
+    // Parents that aren't parented themselves are the roots, they may not exist or have a Transform
+    std::unordered_map<uint64_t, uint32_t> rootSlots;
+    auto rootKey = [](EntityID e) { return (uint64_t(e.id) << 32) | e.version; };
+    _nodes.clear();
+    for(auto& p : parented)
+    {
+        if(parentIndex(p) == invalidSlot && rootSlots.try_emplace(rootKey(p.parent), (uint32_t)_nodes.size()).second)
+            _nodes.push_back({p.parent, EntityID(), invalidSlot});
+    }
+
+    std::vector<size_t> levelSizes(maxDepth + 1, 0);
+    levelSizes[0] = _nodes.size();
+    for(auto& p : parented)
+        ++levelSizes[p.depth];
+    _levelStarts.assign(maxDepth + 1, 0);
+    for(size_t level = 1; level <= maxDepth; ++level)
+        _levelStarts[level] = _levelStarts[level - 1] + levelSizes[level - 1];
+
+    std::vector<size_t> nextSlot = _levelStarts;
+    _slots.assign(index.size(), invalidSlot);
+    for(auto& p : parented)
+        _slots[p.entity.id] = static_cast<uint32_t>(nextSlot[p.depth]++);
+
+    _nodes.resize(_nodes.size() + parented.size());
+    _world.resize(_nodes.size());
+    _local.resize(_nodes.size());
+    for(auto& p : parented)
+    {
+        uint32_t parent = parentIndex(p);
+        uint32_t parentSlot = parent != invalidSlot ? _slots[parented[parent].entity.id] : rootSlots[rootKey(p.parent)];
+        _nodes[_slots[p.entity.id]] = {p.entity, p.parent, parentSlot};
+    }
+}
+
+size_t TransformSystem::hierarchyLevels() const { return _levelStarts.size(); }
+
+SystemAccess TransformSystem::access() const
+{
+    SystemAccess access = _globalTRS.access();
+    access.merge(_localTRS.access());
+    access.merge(_parented.access());
+    access.merge(_parentedTransforms.access());
+    return access;
+}
+
 glm::vec3 Transform::pos() const { return value[3]; }
 
 glm::quat Transform::rot() const { return glm::quat_cast(value); }
@@ -6,6 +6,7 @@
 #define BRANEENGINE_TRANSFORMS_H
 
 #include "common/ecs/entity.h"
+#include "common/ecs/query.h"
 #include <runtime/module.h>
 
 class Transform : public NativeComponent<Transform>
@@ -79,10 +80,55 @@ class Transforms : public Module
     static const char* name();
 };
 
+// Updates Transform from TRS, then propagates world transforms down the hierarchy one level at a time. The hierarchy
+// is flattened into level order, roots first, so each level only reads world matrices of the level above from a
+// contiguous buffer and can be processed as one batch. The flattened hierarchy is kept between runs and rebuilt when
+// an entity is parented, unparented or destroyed.
 class TransformSystem : public System
 {
+#ifdef TEST_BUILD
   public:
+#endif
+    struct HierarchyNode
+    {
+        EntityID entity;
+        EntityID parent;
+        uint32_t parentSlot;
+    };
+
+    Query<Read<TRS>, Changed<TRS>, Write<Transform>, Without<LocalTransform>> _globalTRS;
+    Query<Read<TRS>, Changed<TRS>, Write<LocalTransform>> _localTRS;
+    // Reads the hierarchy, Transform is only there so both queries visit the same entities
+    Query<Read<EntityIDComponent>, Read<LocalTransform>, Read<Transform>> _parented;
+    Query<Read<EntityIDComponent>, Read<LocalTransform>, Write<Transform>> _parentedTransforms;
+
+    // Level order, _levelStarts[i] is the first slot of level i and level 0 holds the roots
+    std::vector<HierarchyNode> _nodes;
+    std::vector<size_t> _levelStarts;
+    // Slot of each parented entity, indexed by EntityID::id
+    std::vector<uint32_t> _slots;
+    std::vector<glm::mat4> _world;
+    // Local transform of each slot, copied while the columns are locked
+    std::vector<glm::mat4> _local;
+
+    size_t rootCount() const;
+
+    void rebuildHierarchy(EntityManager& em);
+
+    // Copies the local transform of every slot, returns false if the hierarchy changed and needs to be rebuilt
+    bool gatherComponents(EntityManager& em);
+
+    void propagateLevel(size_t begin, size_t end);
+
+  public:
+    TransformSystem();
+
     void run(EntityManager& _em) override;
+
+    SystemAccess access() const override;
+
+    // Number of levels in the flattened hierarchy, including the roots
+    size_t hierarchyLevels() const;
 };
 
 #endif // BRANEENGINE_TRANSFORMS_H
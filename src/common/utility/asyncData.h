@@ -52,7 +52,8 @@ class AsyncData
             else
             {
                 const auto& data = std::move(*_instance->_data);
-                ThreadPool::enqueueMain([callback, data = std::move(data)] { callback(std::move(data)); });
+                ThreadPool::enqueueMain([callback, data = std::move(data)] { callback(std::move(data)); },
+                                        JobPriority::streaming);
             }
         }
         else
@@ -82,7 +83,7 @@ class AsyncData
                 else
                 {
                     const auto& callback = _instance->_callback;
-                    ThreadPool::enqueueMain([callback, data] { callback(data); });
+                    ThreadPool::enqueueMain([callback, data] { callback(data); }, JobPriority::streaming);
                 }
             }
             else
@@ -0,0 +1,146 @@
+#ifndef BRANEENGINE_FREELIST_H
+#define BRANEENGINE_FREELIST_H
+
+#include <cstddef>
+#include <mutex>
+
+// Recycles objects of one type through a list per thread, so taking or returning one never touches the allocator or a
+// lock. Jobs are usually created by one thread and freed by another, so when a thread's list grows to two batches one
+// is handed to a shared depot, and a thread that runs dry takes a batch from there before falling back to new.
+// T needs a T* nextFree member, which belongs to the list while the object is free.
+template<typename T, size_t BatchSize = 64>
+class FreeList
+{
+    struct List
+    {
+        T* head = nullptr;
+        size_t count = 0;
+
+        // Unlinks up to max objects from the front
+        T* take(size_t max, size_t& taken)
+        {
+            T* first = head;
+            T* last = nullptr;
+            taken = 0;
+            while(head && taken < max)
+            {
+                last = head;
+                head = head->nextFree;
+                ++taken;
+            }
+            if(last)
+                last->nextFree = nullptr;
+            count -= taken;
+            return first;
+        }
+
+        // Links a null terminated chain of count objects onto the front
+        void give(T* first, size_t chainCount)
+        {
+            if(!first)
+                return;
+            T* last = first;
+            while(last->nextFree)
+                last = last->nextFree;
+            last->nextFree = head;
+            head = first;
+            count += chainCount;
+        }
+
+        void clear()
+        {
+            while(head)
+            {
+                T* next = head->nextFree;
+                delete head;
+                head = next;
+            }
+            count = 0;
+        }
+    };
+
+    struct Depot
+    {
+        std::mutex mutex;
+        List list;
+
+        ~Depot() { list.clear(); }
+    };
+
+    struct Cache
+    {
+        List list;
+
+        ~Cache()
+        {
+            // Give everything back so objects aren't lost with the thread, and make sure nothing touches the list
+            // again if an object is released during thread shutdown
+            Depot& d = depot();
+            std::scoped_lock lock(d.mutex);
+            size_t count;
+            T* chain = list.take(list.count, count);
+            d.list.give(chain, count);
+            cacheDestroyed() = true;
+        }
+    };
+
+    static Depot& depot()
+    {
+        static Depot d;
+        return d;
+    }
+
+    static Cache& cache()
+    {
+        thread_local Cache c;
+        return c;
+    }
+
+    static bool& cacheDestroyed()
+    {
+        thread_local bool destroyed = false;
+        return destroyed;
+    }
+
+  public:
+    static T* acquire()
+    {
+        if(cacheDestroyed())
+            return new T();
+        List& list = cache().list;
+        if(!list.head)
+        {
+            Depot& d = depot();
+            std::scoped_lock lock(d.mutex);
+            size_t taken;
+            T* batch = d.list.take(BatchSize, taken);
+            list.give(batch, taken);
+        }
+        if(!list.head)
+            return new T();
+        size_t taken;
+        return list.take(1, taken);
+    }
+
+    static void release(T* object)
+    {
+        if(cacheDestroyed())
+        {
+            delete object;
+            return;
+        }
+        List& list = cache().list;
+        object->nextFree = nullptr;
+        list.give(object, 1);
+        if(list.count >= 2 * BatchSize)
+        {
+            size_t taken;
+            T* batch = list.take(BatchSize, taken);
+            Depot& d = depot();
+            std::scoped_lock lock(d.mutex);
+            d.list.give(batch, taken);
+        }
+    }
+};
+
+#endif // BRANEENGINE_FREELIST_H
@@ -0,0 +1,113 @@
+#ifndef BRANEENGINE_INLINEFUNCTION_H
+#define BRANEENGINE_INLINEFUNCTION_H
+
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// Move-only void() callable that keeps anything up to Capacity bytes inline instead of allocating like std::function
+// does for most lambdas. Bigger callables still work, they're just boxed on the heap.
+template<size_t Capacity>
+class InlineFunction
+{
+    struct Ops
+    {
+        void (*invoke)(void* storage);
+        // Move constructs into to and destroys from
+        void (*relocate)(void* from, void* to);
+        void (*destroy)(void* storage);
+    };
+
+    template<typename F>
+    static constexpr bool fitsInline =
+        sizeof(F) <= Capacity && alignof(F) <= alignof(std::max_align_t) && std::is_nothrow_move_constructible_v<F>;
+
+    template<typename F>
+    static constexpr Ops inlineOps = {
+        [](void* storage) { (*static_cast<F*>(storage))(); },
+        [](void* from, void* to) {
+        new(to) F(std::move(*static_cast<F*>(from)));
+        static_cast<F*>(from)->~F();
+        },
+        [](void* storage) { static_cast<F*>(storage)->~F(); }};
+
+    template<typename F>
+    static constexpr Ops boxedOps = {
+        [](void* storage) { (**static_cast<F**>(storage))(); },
+        [](void* from, void* to) { *static_cast<F**>(to) = *static_cast<F**>(from); },
+        [](void* storage) { delete *static_cast<F**>(storage); }};
+
+    alignas(std::max_align_t) std::byte _storage[Capacity];
+    const Ops* _ops = nullptr;
+
+  public:
+    static constexpr size_t capacity = Capacity;
+
+    InlineFunction() = default;
+
+    template<typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, InlineFunction>>>
+    InlineFunction(F&& f)
+    {
+        using Fn = std::decay_t<F>;
+        if constexpr(fitsInline<Fn>)
+        {
+            new(_storage) Fn(std::forward<F>(f));
+            _ops = &inlineOps<Fn>;
+        }
+        else
+        {
+            static_assert(sizeof(Fn*) <= Capacity);
+            *reinterpret_cast<Fn**>(_storage) = new Fn(std::forward<F>(f));
+            _ops = &boxedOps<Fn>;
+        }
+    }
+
+    InlineFunction(const InlineFunction&) = delete;
+
+    InlineFunction(InlineFunction&& o) noexcept
+    {
+        if(o._ops)
+        {
+            o._ops->relocate(o._storage, _storage);
+            _ops = o._ops;
+            o._ops = nullptr;
+        }
+    }
+
+    InlineFunction& operator=(InlineFunction&& o) noexcept
+    {
+        if(this == &o)
+            return *this;
+        reset();
+        if(o._ops)
+        {
+            o._ops->relocate(o._storage, _storage);
+            _ops = o._ops;
+            o._ops = nullptr;
+        }
+        return *this;
+    }
+
+    ~InlineFunction() { reset(); }
+
+    void reset()
+    {
+        if(_ops)
+            _ops->destroy(_storage);
+        _ops = nullptr;
+    }
+
+    void operator()() { _ops->invoke(_storage); }
+
+    explicit operator bool() const { return _ops != nullptr; }
+
+    // True if a callable of type F would be stored without allocating
+    template<typename F>
+    static constexpr bool storesInline()
+    {
+        return fitsInline<std::decay_t<F>>;
+    }
+};
+
+#endif // BRANEENGINE_INLINEFUNCTION_H
@@ -0,0 +1,114 @@
+#include "taskGraph.h"
+#include <cassert>
+#include <stdexcept>
+
+TaskGraph::TaskID TaskGraph::addTask(std::function<void()> f)
+{
+    assert(!running());
+    auto task = std::make_unique<Task>();
+    task->f = std::move(f);
+    task->index = _tasks.size();
+    _tasks.push_back(std::move(task));
+    _dirty = true;
+    return _tasks.size() - 1;
+}
+
+void TaskGraph::addDependency(TaskID before, TaskID after)
+{
+    assert(!running());
+    assert(before < _tasks.size() && after < _tasks.size());
+    _tasks[before]->dependents.push_back(_tasks[after].get());
+    ++_tasks[after]->predecessors;
+    _dirty = true;
+}
+
+void TaskGraph::prepare()
+{
+    _roots.clear();
+    for(auto& task : _tasks)
+        if(task->predecessors == 0)
+            _roots.push_back(task.get());
+
+    // Walk the graph the same way a run would, anything left unvisited is part of a cycle and would never start
+    std::vector<Task*> ready = _roots;
+    std::vector<size_t> remaining;
+    remaining.reserve(_tasks.size());
+    for(auto& task : _tasks)
+        remaining.push_back(task->predecessors);
+    size_t visited = 0;
+    while(!ready.empty())
+    {
+        Task* task = ready.back();
+        ready.pop_back();
+        ++visited;
+        for(Task* dependent : task->dependents)
+            if(--remaining[dependent->index] == 0)
+                ready.push_back(dependent);
+    }
+    if(visited != _tasks.size())
+        throw std::runtime_error("Task graph contains a cycle");
+    _dirty = false;
+}
+
+void TaskGraph::enqueueTask(Task* task)
+{
+    // Dependents are enqueued before this job completes, so the run's handle can't finish early
+    ThreadPool::enqueue(
+        [this, task]() {
+        if(!_failed.load(std::memory_order_relaxed))
+        {
+            try
+            {
+                task->f();
+            }
+            catch(...)
+            {
+                std::scoped_lock lock(_errorMutex);
+                if(!_error)
+                    _error = std::current_exception();
+                _failed.store(true, std::memory_order_relaxed);
+            }
+        }
+        for(Task* dependent : task->dependents)
+            if(dependent->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1)
+                enqueueTask(dependent);
+        },
+        _handle);
+}
+
+JobHandlePtr TaskGraph::run()
+{
+    assert(!running());
+    if(_dirty)
+        prepare();
+    for(auto& task : _tasks)
+        task->remaining.store(task->predecessors, std::memory_order_relaxed);
+    _error = nullptr;
+    _failed.store(false, std::memory_order_relaxed);
+
+    _handle = JobHandle::create();
+    // Counted as an instance until every root is enqueued, otherwise the first root finishing could complete the run
+    _handle->_instances = 1;
+    for(Task* root : _roots)
+        enqueueTask(root);
+    if(_handle->_instances.fetch_sub(1) == 1)
+        _handle->enqueueNext();
+    return _handle;
+}
+
+void TaskGraph::runAndWait()
+{
+    run()->finish();
+    rethrowError();
+}
+
+void TaskGraph::rethrowError() const
+{
+    assert(!running());
+    if(_error)
+        std::rethrow_exception(_error);
+}
+
+bool TaskGraph::running() const { return _handle && !_handle->finished(); }
+
+size_t TaskGraph::size() const { return _tasks.size(); }
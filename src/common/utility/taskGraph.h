@@ -0,0 +1,67 @@
+#pragma once
+
+#include <atomic>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "threadPool.h"
+
+// A set of jobs with ordering between them, built once and then run as many times as needed. Every task keeps an
+// atomic count of the predecessors it's still waiting on, and the predecessor that brings it to zero enqueues it, so
+// a run costs one pooled job per task and nothing is rebuilt between runs.
+class TaskGraph
+{
+  public:
+    using TaskID = size_t;
+
+  private:
+    struct Task
+    {
+        std::function<void()> f;
+        std::vector<Task*> dependents;
+        size_t index = 0;
+        size_t predecessors = 0;
+        std::atomic<size_t> remaining = 0;
+    };
+
+    std::vector<std::unique_ptr<Task>> _tasks;
+    std::vector<Task*> _roots;
+    bool _dirty = true;
+    JobHandlePtr _handle;
+    // First exception a task of the current run threw. Once set, the remaining tasks are skipped but still release
+    // their dependents so the run finishes.
+    std::mutex _errorMutex;
+    std::exception_ptr _error;
+    std::atomic_bool _failed = false;
+
+    // Finds the roots and checks there are no cycles
+    void prepare();
+
+    void enqueueTask(Task* task);
+
+  public:
+    TaskGraph() = default;
+
+    TaskGraph(const TaskGraph&) = delete;
+
+    TaskID addTask(std::function<void()> f);
+
+    // after won't start until before has finished, in every run
+    void addDependency(TaskID before, TaskID after);
+
+    // Starts a run and returns a handle that finishes once every task has. A graph can't be changed or started again
+    // while a run is in progress.
+    JobHandlePtr run();
+
+    // Runs the graph, helping out on the calling thread until it's done, then rethrows the first exception a task threw
+    void runAndWait();
+
+    // Rethrows the first exception a task of the last run threw, if any. Only valid once its handle has finished.
+    void rethrowError() const;
+
+    bool running() const;
+
+    size_t size() const;
+};
@@ -3,62 +3,273 @@
 
 #include <memory>
 
-BraneJob::BraneJob(std::function<void()> f, std::shared_ptr<JobHandle> handle)
-    : f(std::move(f)), handle(std::move(handle))
+BraneJob::BraneJob(Function f, JobHandlePtr handle, JobPriority priority)
+    : f(std::move(f)), handle(std::move(handle)), priority(priority)
 {}
 
+static uint64_t steadyNanoseconds()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
 std::thread::id ThreadPool::main_thread_id;
 size_t ThreadPool::_instances;
 std::vector<std::thread> ThreadPool::_threads;
-size_t ThreadPool::_staticThreads;
+std::vector<std::unique_ptr<ThreadPool::Worker>> ThreadPool::_workers;
 size_t ThreadPool::_minThreads;
 
 std::atomic<bool> ThreadPool::_running = true;
-std::queue<BraneJob> ThreadPool::_jobs;
-std::mutex ThreadPool::_queueMutex;
+std::mutex ThreadPool::_injectionMutex;
+std::array<ThreadPool::InjectionQueue, jobPriorityCount> ThreadPool::_injected;
+
+std::mutex ThreadPool::_parkMutex;
 std::condition_variable ThreadPool::_workAvailable;
+std::atomic<size_t> ThreadPool::_sleepingWorkers = 0;
+std::atomic<size_t> ThreadPool::_searchingWorkers = 0;
+size_t ThreadPool::_wakeups = 0;
 
 std::mutex ThreadPool::_mainQueueMutex;
-std::queue<BraneJob> ThreadPool::_mainThreadJobs;
+std::array<std::queue<BraneJob>, jobPriorityCount> ThreadPool::_mainThreadJobs;
+// A quarter of a 60hz frame
+std::chrono::nanoseconds ThreadPool::_mainBudget = std::chrono::microseconds(4000);
+uint64_t ThreadPool::_lastMainTime = 0;
+
+std::array<ThreadPool::LatencyCounters, jobPriorityCount> ThreadPool::_workerLatency;
+std::array<ThreadPool::LatencyCounters, jobPriorityCount> ThreadPool::_mainLatency;
 
-int ThreadPool::threadRuntime()
+thread_local ThreadPool::Worker* ThreadPool::_currentWorker = nullptr;
+thread_local JobPriority ThreadPool::_currentPriority = JobPriority::frameCritical;
+
+int ThreadPool::threadRuntime(Worker* worker)
 {
+    _currentWorker = worker;
+    bool searching = false;
     while(_running)
     {
-
-        BraneJob job;
+        BraneJob* job = findJob(worker, JobPriority::background);
+        if(searching)
         {
-            std::unique_lock<std::mutex> lock(_queueMutex);
-            if(_workAvailable.wait_until(lock, std::chrono::system_clock::now() + std::chrono::milliseconds(200), [] {
-                   return !_jobs.empty();
-               }))
-            {
-                job = std::move(_jobs.front());
-                _jobs.pop();
-            }
-            else
-                continue;
+            // Hand off to the next sleeper once we've found something, if the last searcher found nothing there's
+            // nothing left to wake anyone for
+            searching = false;
+            if(_searchingWorkers.fetch_sub(1) == 1 && job)
+                wake(false);
         }
+        if(job)
+            runJob(job);
+        else
+            searching = park();
+    }
+    return 0;
+}
+
+bool ThreadPool::runPendingJob()
+{
+    // A thread waiting on something only helps with work at least as urgent as what it's running, otherwise a frame
+    // critical wait could end up stuck behind a long background job. Without workers nobody else would run the rest.
+    JobPriority lowest = _workers.empty() ? JobPriority::background : _currentPriority;
+    BraneJob* job = findJob(_currentWorker, lowest);
+    if(!job)
+        return false;
+    runJob(job);
+    return true;
+}
+
+size_t ThreadPool::workerCount() { return _workers.size(); }
+
+bool ThreadPool::shouldSplit()
+{
+    return !_currentWorker || _currentWorker->jobs[static_cast<size_t>(_currentPriority)].empty();
+}
+
+JobPriority ThreadPool::currentPriority() { return _currentPriority; }
+
+void ThreadPool::runJob(BraneJob* job)
+{
+    auto priority = static_cast<size_t>(job->priority);
+    if(job->enqueueTime)
+        _workerLatency[priority].record(steadyNanoseconds() - job->enqueueTime);
+    // Restored afterwards, a job can run others while it waits on a handle
+    JobPriority outerPriority = _currentPriority;
+    _currentPriority = job->priority;
 #if NDEBUG
-        try
-        {
+    try
+    {
 #endif
-            job.f();
+        job->f();
 #if NDEBUG
-        }
-        catch(const std::exception& e)
+    }
+    catch(const std::exception& e)
+    {
+        std::cerr << "Thread Error: " << e.what() << std::endl;
+    }
+#endif
+    _currentPriority = outerPriority;
+    if(job->handle && job->handle->_instances.fetch_sub(1) == 1)
+        job->handle->enqueueNext();
+    job->f.reset();
+    job->handle = nullptr;
+    FreeList<BraneJob>::release(job);
+}
+
+BraneJob* ThreadPool::makeJob(BraneJob::Function&& function, JobHandlePtr handle, JobPriority priority)
+{
+    BraneJob* job = FreeList<BraneJob>::acquire();
+    job->f = std::move(function);
+    job->handle = std::move(handle);
+    job->priority = priority;
+    static thread_local uint32_t sampleCounter = 0;
+    job->enqueueTime = ++sampleCounter % latencySampleRate == 0 ? steadyNanoseconds() : 0;
+    return job;
+}
+
+BraneJob* ThreadPool::findJob(Worker* worker, JobPriority lowest)
+{
+    static thread_local uint32_t externalRng = 0x2545F491;
+    uint32_t& rng = worker ? worker->rng : externalRng;
+    // A lower priority job is only taken once there are no higher priority ones anywhere
+    for(size_t priority = 0; priority <= static_cast<size_t>(lowest); ++priority)
+    {
+        if(worker)
         {
-            std::cerr << "Thread Error: " << e.what() << std::endl;
+            if(BraneJob* job = worker->jobs[priority].pop())
+                return job;
         }
-#endif
-        job.handle->_instances -= 1;
-        if(job.handle->_instances == 0)
-            job.handle->enqueueNext();
+        if(BraneJob* job = takeInjected(priority))
+            return job;
+        if(BraneJob* job = steal(worker, priority, rng))
+            return job;
     }
-    return 0;
+    return nullptr;
+}
+
+BraneJob* ThreadPool::takeInjected(size_t priority)
+{
+    InjectionQueue& queue = _injected[priority];
+    if(queue.count.load(std::memory_order_relaxed) == 0)
+        return nullptr;
+    std::scoped_lock lock(_injectionMutex);
+    BraneJob* job = queue.head;
+    if(!job)
+        return nullptr;
+    queue.head = job->nextFree;
+    if(!queue.head)
+        queue.tail = nullptr;
+    job->nextFree = nullptr;
+    queue.count.fetch_sub(1, std::memory_order_relaxed);
+    return job;
+}
+
+BraneJob* ThreadPool::steal(Worker* thief, size_t priority, uint32_t& rng)
+{
+    if(_workers.empty())
+        return nullptr;
+    // Start at a random victim so thieves don't all pile onto the same deque
+    rng ^= rng << 13;
+    rng ^= rng >> 17;
+    rng ^= rng << 5;
+    size_t start = rng % _workers.size();
+    for(size_t i = 0; i < _workers.size(); ++i)
+    {
+        Worker* victim = _workers[(start + i) % _workers.size()].get();
+        if(victim == thief)
+            continue;
+        if(BraneJob* job = victim->jobs[priority].steal())
+            return job;
+    }
+    return nullptr;
 }
 
-void ThreadPool::init(size_t minThreads)
+bool ThreadPool::hasWork()
+{
+    for(auto& queue : _injected)
+        if(queue.count.load(std::memory_order_relaxed) != 0)
+            return true;
+    for(auto& worker : _workers)
+        for(auto& jobs : worker->jobs)
+            if(!jobs.empty())
+                return true;
+    return false;
+}
+
+bool ThreadPool::park()
+{
+    std::unique_lock lock(_parkMutex);
+    size_t wakeups = _wakeups;
+    _sleepingWorkers.fetch_add(1);
+    lock.unlock();
+
+    // Pairs with the fence in wake(), either we see the new job here or the submitter sees us sleeping
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    bool slept = false;
+    if(!hasWork() && _running)
+    {
+        lock.lock();
+        _workAvailable.wait(lock, [wakeups] { return _wakeups != wakeups; });
+        _searchingWorkers.fetch_add(1);
+        slept = true;
+    }
+    _sleepingWorkers.fetch_sub(1);
+    return slept;
+}
+
+void ThreadPool::wake(bool all)
+{
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if(_sleepingWorkers.load(std::memory_order_relaxed) == 0)
+        return;
+    // A worker that was just woken will wake the next one when it finds work, so a burst of single submits doesn't
+    // wake every worker at once
+    if(!all && _searchingWorkers.load(std::memory_order_relaxed) != 0)
+        return;
+    _parkMutex.lock();
+    ++_wakeups;
+    _parkMutex.unlock();
+    if(all)
+        _workAvailable.notify_all();
+    else
+        _workAvailable.notify_one();
+}
+
+void ThreadPool::submit(BraneJob* job)
+{
+    if(_currentWorker)
+        _currentWorker->jobs[static_cast<size_t>(job->priority)].push(job);
+    else
+        inject(job, job, 1);
+    wake(false);
+}
+
+void ThreadPool::inject(BraneJob* first, BraneJob* last, size_t count)
+{
+    InjectionQueue& queue = _injected[static_cast<size_t>(first->priority)];
+    std::scoped_lock lock(_injectionMutex);
+    if(queue.tail)
+        queue.tail->nextFree = first;
+    else
+        queue.head = first;
+    queue.tail = last;
+    queue.count.fetch_add(count, std::memory_order_relaxed);
+}
+
+void ThreadPool::submitBatch(std::vector<BraneJob*>& jobs)
+{
+    if(_currentWorker)
+    {
+        for(BraneJob* job : jobs)
+            _currentWorker->jobs[static_cast<size_t>(job->priority)].push(job);
+    }
+    else if(!jobs.empty())
+    {
+        for(size_t i = 1; i < jobs.size(); ++i)
+            jobs[i - 1]->nextFree = jobs[i];
+        inject(jobs.front(), jobs.back(), jobs.size());
+    }
+    wake(jobs.size() > 1);
+}
+
+void ThreadPool::init(size_t minThreads, size_t maxThreads)
 {
     _minThreads = minThreads;
     main_thread_id = std::this_thread::get_id();
@@ -66,11 +277,18 @@ void ThreadPool::init(size_t minThreads)
     if(_instances == 1)
     {
         _running = true;
-        size_t threadCount = std::max<size_t>(std::thread::hardware_concurrency(), minThreads);
+        size_t threadCount = std::clamp<size_t>(std::thread::hardware_concurrency(), minThreads, maxThreads);
+        // Every worker has to exist before any thread starts stealing from them
+        _workers.reserve(threadCount);
+        for(size_t i = 0; i < threadCount; i++)
+        {
+            _workers.push_back(std::make_unique<Worker>());
+            _workers.back()->rng = static_cast<uint32_t>(i * 0x9E3779B9u + 1);
+        }
         _threads.reserve(threadCount);
         for(size_t i = 0; i < threadCount; i++)
         {
-            _threads.emplace_back(threadRuntime);
+            _threads.emplace_back(threadRuntime, _workers[i].get());
         }
         Runtime::log("Started up thread pool with " + std::to_string(threadCount) + " threads");
     }
@@ -82,6 +300,10 @@ void ThreadPool::cleanup()
     if(_instances == 0)
     {
         _running = false;
+        _parkMutex.lock();
+        ++_wakeups;
+        _parkMutex.unlock();
+        _workAvailable.notify_all();
         for(auto& _thread : _threads)
         {
             try
@@ -95,64 +317,66 @@ void ThreadPool::cleanup()
             }
         }
         _threads.clear();
-    }
-}
+        // Workers woken for shutdown exit without finishing their search
+        _searchingWorkers = 0;
 
-std::shared_ptr<JobHandle> ThreadPool::enqueue(std::function<void()> function)
-{
-    std::shared_ptr<JobHandle> handle = std::make_shared<JobHandle>();
-    handle->_instances = 1;
-    _queueMutex.lock();
-    _jobs.emplace(std::move(function), handle);
-    _queueMutex.unlock();
-    _workAvailable.notify_one();
-    return handle;
+        // Jobs nobody got to before shutdown
+        auto discard = [](BraneJob* job) {
+            job->f.reset();
+            job->handle = nullptr;
+            FreeList<BraneJob>::release(job);
+        };
+        for(auto& worker : _workers)
+            for(auto& jobs : worker->jobs)
+                while(BraneJob* job = jobs.pop())
+                    discard(job);
+        _workers.clear();
+        for(auto& queue : _injected)
+        {
+            while(BraneJob* job = queue.head)
+            {
+                queue.head = job->nextFree;
+                job->nextFree = nullptr;
+                discard(job);
+            }
+            queue.tail = nullptr;
+            queue.count = 0;
+        }
+    }
 }
 
-void ThreadPool::enqueueMain(std::function<void()> function)
+void ThreadPool::enqueueMain(BraneJob::Function function, JobPriority priority)
 {
     _mainQueueMutex.lock();
-    _mainThreadJobs.emplace(std::move(function), nullptr);
+    auto& job = _mainThreadJobs[static_cast<size_t>(priority)].emplace(std::move(function), nullptr, priority);
+    job.enqueueTime = steadyNanoseconds();
     _mainQueueMutex.unlock();
 }
 
-void ThreadPool::enqueue(std::function<void()> function, std::shared_ptr<JobHandle>& sharedHandle)
+JobHandlePtr ThreadPool::enqueueBatch(std::vector<std::function<void()>> functions, JobPriority priority)
 {
-    sharedHandle->_instances += 1;
-    _queueMutex.lock();
-    _jobs.emplace(std::move(function), sharedHandle);
-    _queueMutex.unlock();
-    _workAvailable.notify_one();
-}
+    JobHandlePtr handle = JobHandle::create();
+    handle->_instances = functions.size();
 
-std::shared_ptr<JobHandle> ThreadPool::enqueueBatch(std::vector<std::function<void()>> functions)
-{
-    std::shared_ptr<JobHandle> handle = std::make_shared<JobHandle>();
-
-    _queueMutex.lock();
+    std::vector<BraneJob*> jobs;
+    jobs.reserve(functions.size());
     for(auto& function : functions)
-    {
-        handle->_instances += 1;
-        _jobs.emplace(std::move(function), handle);
-    }
-    _queueMutex.unlock();
-
-    _workAvailable.notify_one();
+        jobs.push_back(makeJob(std::move(function), handle, priority));
+    submitBatch(jobs);
     return handle;
 }
 
-std::shared_ptr<JobHandle> ThreadPool::addStaticThread(std::function<void()> function)
+JobHandlePtr ThreadPool::addStaticThread(std::function<void()> function)
 {
-    std::shared_ptr<JobHandle> handle = std::make_shared<JobHandle>();
-
-    _staticThreads++;
-    if(_threads.size() - _staticThreads < _minThreads)
-    {
-        _threads.emplace_back(function);
-        _workAvailable.notify_one();
-    }
-    else
-        enqueue(std::move(function), handle);
+    // These never return while the engine runs, so they always get their own thread. Left in the queue, a thread
+    // helping out while it waits on a handle could pick one up and never come back.
+    JobHandlePtr handle = JobHandle::create();
+    handle->_instances = 1;
+    _threads.emplace_back([function = std::move(function), handle]() mutable {
+        function();
+        if(handle->_instances.fetch_sub(1) == 1)
+            handle->enqueueNext();
+    });
     return handle;
 }
 
@@ -172,53 +396,166 @@ void ThreadPool::addStaticTimedThread(std::function<void()> function, std::chron
 std::shared_ptr<ConditionJob> ThreadPool::conditionalEnqueue(std::function<void()> function, size_t conditionCount)
 {
     assert(conditionCount != 0);
-    return std::make_shared<ConditionJob>(ConditionJob{std::move(function), conditionCount});
+    auto job = std::make_shared<ConditionJob>();
+    job->f = std::move(function);
+    job->conditionCount = conditionCount;
+    return job;
 }
 
 void ThreadPool::runMainJobs()
 {
-    _mainQueueMutex.lock();
-    while(!_mainThreadJobs.empty())
+    auto start = std::chrono::steady_clock::now();
+    // Frame critical jobs always run, including any they enqueue, and don't count against the budget
+    while(runMainJob(JobPriority::frameCritical))
+        ;
+    auto budgetStart = std::chrono::steady_clock::now();
+
+    // Everything else shares the budget, in priority order. The first job always runs, so a budget smaller than one
+    // job can't stall streaming completely.
+    bool ranAny = false;
+    for(JobPriority priority : {JobPriority::streaming, JobPriority::background})
     {
-        auto job = std::move(_mainThreadJobs.front());
-        _mainThreadJobs.pop();
-        _mainQueueMutex.unlock();
+        while((!ranAny || std::chrono::steady_clock::now() - budgetStart < _mainBudget) && runMainJob(priority))
+            ranAny = true;
+    }
+    _lastMainTime =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - start).count();
+}
 
-        job.f();
+bool ThreadPool::runMainJob(JobPriority priority)
+{
+    auto index = static_cast<size_t>(priority);
+    std::unique_lock lock(_mainQueueMutex);
+    if(_mainThreadJobs[index].empty())
+        return false;
+    BraneJob job = std::move(_mainThreadJobs[index].front());
+    _mainThreadJobs[index].pop();
+    lock.unlock();
+
+    _mainLatency[index].record(steadyNanoseconds() - job.enqueueTime);
+    job.f();
+    return true;
+}
 
-        _mainQueueMutex.lock();
+void ThreadPool::setMainThreadBudget(std::chrono::nanoseconds budget) { _mainBudget = budget; }
+
+ThreadPoolStats ThreadPool::stats()
+{
+    ThreadPoolStats stats;
+    for(size_t p = 0; p < jobPriorityCount; ++p)
+    {
+        stats.workers[p].depth = _injected[p].count.load(std::memory_order_relaxed);
+        for(auto& worker : _workers)
+            stats.workers[p].depth += worker->jobs[p].size();
+        _workerLatency[p].read(stats.workers[p]);
+        _mainLatency[p].read(stats.main[p]);
     }
-    _mainQueueMutex.unlock();
+    {
+        std::scoped_lock lock(_mainQueueMutex);
+        for(size_t p = 0; p < jobPriorityCount; ++p)
+            stats.main[p].depth = _mainThreadJobs[p].size();
+    }
+    stats.mainTime = _lastMainTime;
+    return stats;
+}
+
+void ThreadPool::resetStats()
+{
+    for(size_t p = 0; p < jobPriorityCount; ++p)
+    {
+        _workerLatency[p].reset();
+        _mainLatency[p].reset();
+    }
+}
+
+void ThreadPool::LatencyCounters::record(uint64_t latency)
+{
+    samples.fetch_add(1, std::memory_order_relaxed);
+    total.fetch_add(latency, std::memory_order_relaxed);
+    uint64_t currentMax = max.load(std::memory_order_relaxed);
+    while(latency > currentMax && !max.compare_exchange_weak(currentMax, latency, std::memory_order_relaxed))
+        ;
+}
+
+void ThreadPool::LatencyCounters::read(JobQueueStats& stats) const
+{
+    stats.samples = samples.load(std::memory_order_relaxed);
+    stats.averageLatency = stats.samples ? total.load(std::memory_order_relaxed) / stats.samples : 0;
+    stats.maxLatency = max.load(std::memory_order_relaxed);
+}
+
+void ThreadPool::LatencyCounters::reset()
+{
+    samples = 0;
+    total = 0;
+    max = 0;
 }
 
 bool JobHandle::finished() { return _instances == 0; }
 
 void JobHandle::finish()
 {
+    // Help run queued jobs instead of idling, the ones we're waiting on are likely among them
     while(!finished())
     {
-        std::this_thread::yield();
+        if(!ThreadPool::runPendingJob())
+            std::this_thread::yield();
     }
 }
 
-JobHandle::JobHandle() { _instances = 0; }
+JobHandle::JobHandle()
+{
+    _instances = 0;
+    _references = 0;
+}
 
-std::shared_ptr<JobHandle> JobHandle::then(std::function<void()> f)
+JobHandlePtr JobHandle::create()
 {
-    _next = std::move(f);
+    JobHandle* handle = FreeList<JobHandle>::acquire();
+    handle->_instances = 0;
+    return JobHandlePtr(handle);
+}
+
+void JobHandle::release()
+{
+    if(_references.fetch_sub(1, std::memory_order_acq_rel) != 1)
+        return;
+    _next.clear();
+    _nextHandle = nullptr;
+    FreeList<JobHandle>::release(this);
+}
+
+JobHandlePtr JobHandle::then(std::function<void()> f)
+{
+    std::scoped_lock lock(_nextLock);
     if(!_nextHandle)
-        _nextHandle = std::make_shared<JobHandle>();
+        _nextHandle = JobHandle::create();
+    if(finished())
+    {
+        ThreadPool::enqueue(std::move(f), _nextHandle);
+        return _nextHandle;
+    }
+    // Counted on the next handle from now on, so waiting on it also waits for this handle to finish
+    _nextHandle->_instances += 1;
+    _next.push_back(std::move(f));
     return _nextHandle;
 }
 
 void JobHandle::enqueueNext()
 {
-    if(_next)
-        ThreadPool::enqueue(_next, _nextHandle);
+    std::scoped_lock lock(_nextLock);
+    for(auto& f : _next)
+    {
+        // The enqueue adds the instance that actually tracks the job before the reserved one is dropped
+        ThreadPool::enqueue(std::move(f), _nextHandle);
+        if(_nextHandle->_instances.fetch_sub(1) == 1)
+            _nextHandle->enqueueNext();
+    }
+    _next.clear();
 }
 
 void ConditionJob::signal()
 {
-    if(--conditionCount == 0)
-        ThreadPool::enqueue(std::move(f));
+    if(conditionCount.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        ThreadPool::enqueueDetached(std::move(f));
 }
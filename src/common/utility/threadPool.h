@@ -1,44 +1,175 @@
 #pragma once
 
+#include <algorithm>
+#include <array>
 #include <atomic>
 #include <cassert>
+#include <chrono>
 #include <functional>
+#include <limits>
 #include <memory>
 #include <mutex>
 #include <queue>
 #include <thread>
 #include <vector>
 #include <condition_variable>
+#include <exception>
 #include <system_error>
 
 #include <iostream>
 
+#include "freeList.h"
+#include "inlineFunction.h"
+#include "workStealingDeque.h"
+
 // Eventually I might want to move this into the runtime class
 
+class JobHandle;
+
+// Reference counted pointer to a pooled JobHandle. The count lives in the handle itself, so copies don't allocate and
+// the handle goes back to its pool when the last reference is dropped.
+class JobHandlePtr
+{
+    JobHandle* _handle = nullptr;
+
+  public:
+    JobHandlePtr() = default;
+
+    JobHandlePtr(std::nullptr_t) {}
+
+    explicit JobHandlePtr(JobHandle* handle);
+
+    JobHandlePtr(const JobHandlePtr& o);
+
+    JobHandlePtr(JobHandlePtr&& o) noexcept;
+
+    JobHandlePtr& operator=(const JobHandlePtr& o);
+
+    JobHandlePtr& operator=(JobHandlePtr&& o) noexcept;
+
+    ~JobHandlePtr();
+
+    JobHandle* get() const { return _handle; }
+
+    JobHandle* operator->() const { return _handle; }
+
+    JobHandle& operator*() const { return *_handle; }
+
+    explicit operator bool() const { return _handle != nullptr; }
+
+    bool operator==(const JobHandlePtr& o) const { return _handle == o._handle; }
+};
+
 class JobHandle
 {
     std::atomic<size_t> _instances;
-    std::function<void()> _next;
-    std::shared_ptr<JobHandle> _nextHandle;
+    std::atomic<uint32_t> _references;
+    // Continuations registered with then(), all of them run under _nextHandle
+    std::mutex _nextLock;
+    std::vector<std::function<void()>> _next;
+    JobHandlePtr _nextHandle;
+    // Used by FreeList while the handle is pooled
+    JobHandle* nextFree = nullptr;
 
     friend class ThreadPool;
+    friend class TaskGraph;
+    friend class JobHandlePtr;
+    friend class FreeList<JobHandle>;
 
     void enqueueNext();
 
+    void release();
+
   public:
+    // Takes a handle from the calling thread's pool
+    static JobHandlePtr create();
+
     bool finished();
 
     void finish();
 
-    std::shared_ptr<JobHandle> then(std::function<void()> f);
+    // Runs f once every job on this handle has finished. Can be called any number of times, every continuation runs
+    // and they all share the returned handle. If the handle has already finished f is enqueued straight away.
+    JobHandlePtr then(std::function<void()> f);
 
     JobHandle();
 };
 
+inline JobHandlePtr::JobHandlePtr(JobHandle* handle) : _handle(handle)
+{
+    if(_handle)
+        _handle->_references.fetch_add(1, std::memory_order_relaxed);
+}
+
+inline JobHandlePtr::JobHandlePtr(const JobHandlePtr& o) : JobHandlePtr(o._handle) {}
+
+inline JobHandlePtr::JobHandlePtr(JobHandlePtr&& o) noexcept : _handle(o._handle) { o._handle = nullptr; }
+
+inline JobHandlePtr& JobHandlePtr::operator=(const JobHandlePtr& o)
+{
+    JobHandlePtr copy(o);
+    std::swap(_handle, copy._handle);
+    return *this;
+}
+
+inline JobHandlePtr& JobHandlePtr::operator=(JobHandlePtr&& o) noexcept
+{
+    std::swap(_handle, o._handle);
+    return *this;
+}
+
+inline JobHandlePtr::~JobHandlePtr()
+{
+    if(_handle)
+        _handle->release();
+}
+
+// Every queue, on the workers and the main thread, is split by priority and the highest priority job is always taken
+// first. Jobs enqueued without a priority inherit the one of the job enqueueing them, or frameCritical from outside
+// the pool.
+enum class JobPriority : uint8_t
+{
+    // Work the current frame is waiting on
+    frameCritical = 0,
+    // Asset loading and its callbacks, which should land within a few frames
+    streaming = 1,
+    // Anything that can take as long as it needs
+    background = 2
+};
+
+constexpr size_t jobPriorityCount = 3;
+
+struct JobQueueStats
+{
+    // Jobs waiting when the stats were taken
+    size_t depth = 0;
+    // Time from enqueue to the start of the job in nanoseconds, over the jobs measured since the last resetStats()
+    uint64_t samples = 0;
+    uint64_t averageLatency = 0;
+    uint64_t maxLatency = 0;
+};
+
+struct ThreadPoolStats
+{
+    std::array<JobQueueStats, jobPriorityCount> workers;
+    std::array<JobQueueStats, jobPriorityCount> main;
+    // Nanoseconds the last runMainJobs call took
+    uint64_t mainTime = 0;
+};
+
+// Captures up to Function::capacity bytes are stored inline, and the records handed to the workers are pooled, so
+// submitting a typical lambda doesn't allocate at all.
 struct BraneJob
 {
-    std::function<void()> f;
-    std::shared_ptr<JobHandle> handle;
+    using Function = InlineFunction<40>;
+
+    Function f;
+    JobHandlePtr handle;
+    // Links the record into the injection queue while it waits, and into its FreeList once it has run
+    BraneJob* nextFree = nullptr;
+    // Steady clock nanoseconds when the job was enqueued, 0 if its latency isn't being measured
+    uint64_t enqueueTime = 0;
+    JobPriority priority = JobPriority::frameCritical;
 
     BraneJob(const BraneJob&) = delete;
 
@@ -48,56 +179,289 @@ struct BraneJob
 
     BraneJob() = default;
 
-    BraneJob(std::function<void()> f, std::shared_ptr<JobHandle> handle);
+    BraneJob(Function f, JobHandlePtr handle, JobPriority priority);
 };
 
 struct ConditionJob
 {
     std::function<void()> f;
-    size_t conditionCount;
+    std::atomic<size_t> conditionCount;
 
     void signal();
 };
 
 class ThreadPool
 {
+    // Jobs spawned by a worker go to the bottom of its own deque and are popped newest first, so a job's children
+    // usually run on the same thread while their data is still in cache. Idle workers steal the oldest jobs from the
+    // top of other deques, which tend to be the biggest pieces of work left. Jobs from any other thread go through the
+    // injection queue.
+    struct Worker
+    {
+        std::array<WorkStealingDeque<BraneJob>, jobPriorityCount> jobs;
+        uint32_t rng;
+    };
+
+    // Linked through BraneJob::nextFree
+    struct InjectionQueue
+    {
+        BraneJob* head = nullptr;
+        BraneJob* tail = nullptr;
+        std::atomic<size_t> count = 0;
+    };
+
+    struct LatencyCounters
+    {
+        std::atomic<uint64_t> samples = 0;
+        std::atomic<uint64_t> total = 0;
+        std::atomic<uint64_t> max = 0;
+
+        void record(uint64_t latency);
+
+        void read(JobQueueStats& stats) const;
+
+        void reset();
+    };
+
     static size_t _instances;
     static std::vector<std::thread> _threads;
-    static size_t _staticThreads;
+    static std::vector<std::unique_ptr<Worker>> _workers;
+    // Worker owned by this thread, null on the main thread and static threads
+    static thread_local Worker* _currentWorker;
+    // Priority of the job this thread is running
+    static thread_local JobPriority _currentPriority;
     static size_t _minThreads;
 
-    static std::mutex _queueMutex;
+    static std::mutex _injectionMutex;
+    static std::array<InjectionQueue, jobPriorityCount> _injected;
+
+    // Workers with nothing to do sleep on _workAvailable until _wakeups changes. Searching workers have just woken up
+    // and not found a job yet.
+    static std::mutex _parkMutex;
     static std::condition_variable _workAvailable;
-    static std::queue<BraneJob> _jobs;
+    static std::atomic<size_t> _sleepingWorkers;
+    static std::atomic<size_t> _searchingWorkers;
+    static size_t _wakeups;
+
     static std::mutex _mainQueueMutex;
-    static std::queue<BraneJob> _mainThreadJobs;
+    static std::array<std::queue<BraneJob>, jobPriorityCount> _mainThreadJobs;
+    static std::chrono::nanoseconds _mainBudget;
+    static uint64_t _lastMainTime;
     static std::atomic_bool _running;
 
-    static int threadRuntime();
+    // Worker jobs have one in latencySampleRate of their latencies measured, so the clock isn't read for every job
+    static constexpr uint32_t latencySampleRate = 64;
+    static std::array<LatencyCounters, jobPriorityCount> _workerLatency;
+    static std::array<LatencyCounters, jobPriorityCount> _mainLatency;
+
+    static int threadRuntime(Worker* worker);
+
+    static void submit(BraneJob* job);
+
+    static void submitBatch(std::vector<BraneJob*>& jobs);
+
+    // Appends a chain of jobs of the same priority linked through nextFree to the injection queue
+    static void inject(BraneJob* first, BraneJob* last, size_t count);
+
+    // Takes the highest priority job it can find, ignoring any of a lower priority than lowest
+    static BraneJob* findJob(Worker* worker, JobPriority lowest);
+
+    static BraneJob* takeInjected(size_t priority);
+
+    static BraneJob* steal(Worker* thief, size_t priority, uint32_t& rng);
+
+    static bool hasWork();
+
+    // Sleeps until there might be work, returns true if this worker is now searching
+    static bool park();
+
+    static void wake(bool all);
+
+    static BraneJob* makeJob(BraneJob::Function&& function, JobHandlePtr handle, JobPriority priority);
+
+    static void runJob(BraneJob* job);
+
+    // Runs the oldest main thread job of one priority, returns false if there wasn't one
+    static bool runMainJob(JobPriority priority);
+
+    // Lazy binary splitting: a thread only hands off half of its range when its deque is empty, which means the last
+    // half it handed off was stolen and other threads are looking for work. Otherwise it runs a grain and checks again.
+    static bool shouldSplit();
+
+    // Shared by the pieces of a parallelFor, holds the first exception one of them threw so the caller can rethrow it
+    // once every piece is done
+    struct RangeErrors
+    {
+        std::mutex m;
+        std::exception_ptr first;
+        std::atomic_bool failed = false;
+
+        void capture() noexcept
+        {
+            std::scoped_lock lock(m);
+            if(!first)
+                first = std::current_exception();
+            failed.store(true, std::memory_order_relaxed);
+        }
+    };
+
+    template<typename F>
+    static void splitRange(size_t begin, size_t end, size_t grain, F& fn, JobHandlePtr& handle, RangeErrors& errors);
 
   public:
     static std::thread::id main_thread_id;
 
-    static void init(size_t minThreads);
+    // Starts one worker per hardware thread, clamped to [minThreads, maxThreads]
+    static void init(size_t minThreads, size_t maxThreads = std::numeric_limits<size_t>::max());
 
+    // Runs every frameCritical main thread job, then streaming and background ones until the frame budget is spent.
+    // Whatever doesn't fit stays queued for the next call.
     static void runMainJobs();
 
+    // Time runMainJobs may spend on streaming and background jobs, one of them always runs if any are queued
+    static void setMainThreadBudget(std::chrono::nanoseconds budget);
+
     static void cleanup();
 
-    static std::shared_ptr<JobHandle> addStaticThread(std::function<void()> function);
+    static JobHandlePtr addStaticThread(std::function<void()> function);
 
     static void addStaticTimedThread(std::function<void()> function, std::chrono::seconds interval);
 
-    static std::shared_ptr<JobHandle> enqueue(std::function<void()> function);
+    template<typename F>
+    static JobHandlePtr enqueue(F&& function, JobPriority priority = currentPriority());
+
+    // Fire and forget, skips creating a handle since nothing can wait on the job
+    template<typename F>
+    static void enqueueDetached(F&& function, JobPriority priority = currentPriority());
+
+    template<typename F>
+    static void enqueue(F&& function, JobHandlePtr& sharedHandle, JobPriority priority = currentPriority());
+
+    static void enqueueMain(BraneJob::Function function, JobPriority priority = JobPriority::frameCritical);
+
+    static JobHandlePtr enqueueBatch(std::vector<std::function<void()>> functions,
+                                     JobPriority priority = currentPriority());
+
+    // Calls fn(rangeBegin, rangeEnd) for pieces of [begin, end) of at most grain indices, spread over the pool and the
+    // calling thread, and returns once they're all done. A grain of 0 picks one based on the number of workers. If fn
+    // throws, pieces that haven't started yet are skipped and the first exception is rethrown once the rest are done.
+    template<typename F>
+    static void parallelFor(size_t begin, size_t end, size_t grain, F&& fn);
+
+    // Calls map(rangeBegin, rangeEnd) for pieces of exactly grain indices and folds the results in index order, so the
+    // result doesn't depend on scheduling. combine only has to be associative.
+    template<typename T, typename Map, typename Combine>
+    static T parallelReduce(size_t begin, size_t end, size_t grain, T identity, Map&& map, Combine&& combine);
+
+    // Runs one queued job on the calling thread, returns false if there was nothing to run
+    static bool runPendingJob();
 
-    static void enqueueMain(std::function<void()> function);
+    static size_t workerCount();
 
-    static void enqueue(std::function<void()> function, std::shared_ptr<JobHandle>& sharedHandle);
+    static JobPriority currentPriority();
 
-    static std::shared_ptr<JobHandle> enqueueBatch(std::vector<std::function<void()>> functions);
+    static ThreadPoolStats stats();
+
+    static void resetStats();
 
     static std::shared_ptr<ConditionJob> conditionalEnqueue(std::function<void()> function, size_t conditionCount);
 };
 
+template<typename F>
+JobHandlePtr ThreadPool::enqueue(F&& function, JobPriority priority)
+{
+    JobHandlePtr handle = JobHandle::create();
+    handle->_instances = 1;
+    submit(makeJob(std::forward<F>(function), handle, priority));
+    return handle;
+}
+
+template<typename F>
+void ThreadPool::enqueueDetached(F&& function, JobPriority priority)
+{
+    submit(makeJob(std::forward<F>(function), nullptr, priority));
+}
+
+template<typename F>
+void ThreadPool::enqueue(F&& function, JobHandlePtr& sharedHandle, JobPriority priority)
+{
+    sharedHandle->_instances += 1;
+    submit(makeJob(std::forward<F>(function), sharedHandle, priority));
+}
+
+template<typename F>
+void ThreadPool::splitRange(size_t begin, size_t end, size_t grain, F& fn, JobHandlePtr& handle, RangeErrors& errors)
+{
+    // Pieces reference fn, handle and errors on the caller's stack, so nothing may unwind past parallelFor's finish()
+    try
+    {
+        while(!errors.failed.load(std::memory_order_relaxed))
+        {
+            if(end - begin <= grain)
+            {
+                fn(begin, end);
+                return;
+            }
+            if(shouldSplit())
+            {
+                size_t mid = begin + (end - begin) / 2;
+                enqueue([mid, end, grain, &fn, &handle, &errors]() { splitRange(mid, end, grain, fn, handle, errors); },
+                        handle);
+                end = mid;
+            }
+            else
+            {
+                fn(begin, begin + grain);
+                begin += grain;
+            }
+        }
+    }
+    catch(...)
+    {
+        errors.capture();
+    }
+}
+
+template<typename F>
+void ThreadPool::parallelFor(size_t begin, size_t end, size_t grain, F&& fn)
+{
+    if(begin >= end)
+        return;
+    if(grain == 0)
+        grain = std::max<size_t>((end - begin) / (4 * (workerCount() + 1)), 1);
+    RangeErrors errors;
+    JobHandlePtr handle = JobHandle::create();
+    splitRange(begin, end, grain, fn, handle, errors);
+    handle->finish();
+    if(errors.first)
+        std::rethrow_exception(errors.first);
+}
+
+template<typename T, typename Map, typename Combine>
+T ThreadPool::parallelReduce(size_t begin, size_t end, size_t grain, T identity, Map&& map, Combine&& combine)
+{
+    if(begin >= end)
+        return identity;
+    grain = std::max<size_t>(grain, 1);
+    // Wrapped so that T = bool doesn't get the packed vector<bool>, which can't be written from several threads
+    struct Partial
+    {
+        T value;
+    };
+    size_t pieces = (end - begin + grain - 1) / grain;
+    std::vector<Partial> partials(pieces, Partial{identity});
+    parallelFor(0, pieces, 1, [&](size_t first, size_t last) {
+        for(size_t p = first; p < last; ++p)
+        {
+            size_t pieceBegin = begin + p * grain;
+            partials[p].value = map(pieceBegin, std::min(pieceBegin + grain, end));
+        }
+    });
+    T result = std::move(identity);
+    for(auto& partial : partials)
+        result = combine(std::move(result), std::move(partial.value));
+    return result;
+}
+
 #define IS_MAIN_THREAD() std::this_thread::get_id() == ThreadPool::main_thread_id
 #define ASSERT_MAIN_THREAD() assert(IS_MAIN_THREAD())
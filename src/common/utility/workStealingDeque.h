@@ -0,0 +1,116 @@
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+// Chase-Lev deque, following "Correct and Efficient Work-Stealing for Weak Memory Models" (Lê et al. 2013). Only the
+// owning thread may push() and pop(), which work on the bottom end, any thread may steal() from the top. The buffer
+// grows when full and old buffers are kept until the deque is destroyed, since a thief might still be reading one.
+template<typename T>
+class WorkStealingDeque
+{
+    class Buffer
+    {
+        int64_t _mask;
+        std::unique_ptr<std::atomic<T*>[]> _items;
+
+      public:
+        explicit Buffer(int64_t capacity) : _mask(capacity - 1), _items(new std::atomic<T*>[capacity]) {}
+
+        int64_t capacity() const { return _mask + 1; }
+
+        T* get(int64_t index) const { return _items[index & _mask].load(std::memory_order_relaxed); }
+
+        void put(int64_t index, T* item) { _items[index & _mask].store(item, std::memory_order_relaxed); }
+    };
+
+    alignas(64) std::atomic<int64_t> _top = 0;
+    alignas(64) std::atomic<int64_t> _bottom = 0;
+    std::atomic<Buffer*> _buffer;
+    std::vector<std::unique_ptr<Buffer>> _buffers;
+
+    Buffer* grow(Buffer* old, int64_t top, int64_t bottom)
+    {
+        auto buffer = std::make_unique<Buffer>(old->capacity() * 2);
+        for(int64_t i = top; i < bottom; ++i)
+            buffer->put(i, old->get(i));
+        Buffer* raw = buffer.get();
+        _buffers.push_back(std::move(buffer));
+        _buffer.store(raw, std::memory_order_release);
+        return raw;
+    }
+
+  public:
+    // capacity must be a power of two
+    explicit WorkStealingDeque(int64_t capacity = 1024)
+    {
+        _buffers.push_back(std::make_unique<Buffer>(capacity));
+        _buffer.store(_buffers.back().get(), std::memory_order_relaxed);
+    }
+
+    WorkStealingDeque(const WorkStealingDeque&) = delete;
+
+    void push(T* item)
+    {
+        int64_t bottom = _bottom.load(std::memory_order_relaxed);
+        int64_t top = _top.load(std::memory_order_acquire);
+        Buffer* buffer = _buffer.load(std::memory_order_relaxed);
+        if(bottom - top > buffer->capacity() - 1)
+            buffer = grow(buffer, top, bottom);
+        buffer->put(bottom, item);
+        std::atomic_thread_fence(std::memory_order_release);
+        _bottom.store(bottom + 1, std::memory_order_relaxed);
+    }
+
+    // Newest item first, nullptr if empty
+    T* pop()
+    {
+        int64_t bottom = _bottom.load(std::memory_order_relaxed) - 1;
+        Buffer* buffer = _buffer.load(std::memory_order_relaxed);
+        _bottom.store(bottom, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t top = _top.load(std::memory_order_relaxed);
+        if(top > bottom)
+        {
+            _bottom.store(bottom + 1, std::memory_order_relaxed);
+            return nullptr;
+        }
+        T* item = buffer->get(bottom);
+        if(top == bottom)
+        {
+            // Last item, race any thieves for it
+            if(!_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+                item = nullptr;
+            _bottom.store(bottom + 1, std::memory_order_relaxed);
+        }
+        return item;
+    }
+
+    // Oldest item first, nullptr if empty or another thread got there first
+    T* steal()
+    {
+        int64_t top = _top.load(std::memory_order_acquire);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        int64_t bottom = _bottom.load(std::memory_order_acquire);
+        if(top >= bottom)
+            return nullptr;
+        T* item = _buffer.load(std::memory_order_acquire)->get(top);
+        if(!_top.compare_exchange_strong(top, top + 1, std::memory_order_seq_cst, std::memory_order_relaxed))
+            return nullptr;
+        return item;
+    }
+
+    bool empty() const
+    {
+        return _top.load(std::memory_order_acquire) >= _bottom.load(std::memory_order_acquire);
+    }
+
+    // Only a snapshot when other threads are using the deque
+    size_t size() const
+    {
+        int64_t size = _bottom.load(std::memory_order_acquire) - _top.load(std::memory_order_acquire);
+        return size > 0 ? static_cast<size_t>(size) : 0;
+    }
+};
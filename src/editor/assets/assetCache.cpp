@@ -46,3 +46,12 @@ Asset* AssetCache::getAsset(const AssetID& asset)
 bool AssetCache::hasAsset(const AssetID& asset) { return std::filesystem::exists(getPath(asset)); }
 
 std::string AssetCache::getAssetHash(const AssetID& asset) { return FileManager::fileHash(getPath(asset)); }
+
+std::vector<std::string> AssetCache::getAssetHashes(const std::vector<AssetID>& assets)
+{
+    std::vector<std::filesystem::path> paths;
+    paths.reserve(assets.size());
+    for(auto& asset : assets)
+        paths.push_back(getPath(asset));
+    return FileManager::fileHashes(paths);
+}
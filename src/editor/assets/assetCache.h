@@ -7,6 +7,7 @@
 
 #include <filesystem>
 #include <string>
+#include <vector>
 #include "json/value.h"
 
 class Asset;
@@ -33,6 +34,8 @@ class AssetCache
     void deleteCachedAsset(const AssetID& asset);
 
     std::string getAssetHash(const AssetID& asset);
+
+    std::vector<std::string> getAssetHashes(const std::vector<AssetID>& assets);
 };
 
 #endif // BRANEENGINE_ASSETCACHE_H
@@ -70,13 +70,17 @@ void EditorAsset::save()
 }
 
 std::string EditorAsset::hash(const AssetID& id)
+{
+    updateCache(id);
+    return _project.editor().cache().getAssetHash(id);
+}
+
+void EditorAsset::updateCache(const AssetID& id)
 {
     if(unsavedChanges())
         save();
     if(!_project.editor().cache().hasAsset(id))
         _project.editor().cache().cacheAsset(buildAsset(id));
-
-    return _project.editor().cache().getAssetHash(id);
 }
 
 VersionedJson& EditorAsset::json() { return _json; }
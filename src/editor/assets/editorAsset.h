@@ -39,6 +39,9 @@ class EditorAsset
 
     std::string hash(const AssetID& id);
 
+    // Saves any changes and makes sure the cached copy of id exists, so it can be hashed
+    void updateCache(const AssetID& id);
+
     const AssetType& type() const;
 
     const std::string& name() const;
@@ -5,7 +5,10 @@
 #include "gltfLoader.h"
 #include <filesystem>
 #include <iostream>
+#include <mutex>
+#include <utility>
 #include "runtime/runtime.h"
+#include "utility/threadPool.h"
 
 bool GLTFLoader::loadGltfFromFile(const std::filesystem::path& gltfFilename)
 {
@@ -158,13 +161,13 @@ void GLTFLoader::printPositions(int meshIndex, int primitiveIndex)
     std::cout << "vertices: " << positionAccessor["count"].asInt() << std::endl;
 }
 
-std::vector<uint16_t> GLTFLoader::readShortScalarBuffer(uint32_t accessorIndex)
+std::vector<uint16_t> GLTFLoader::readShortScalarBuffer(uint32_t accessorIndex) const
 {
-    Json::Value& accessor = _json["accessors"][accessorIndex];
+    const Json::Value& accessor = _json["accessors"][accessorIndex];
     if(accessor["type"].asString() != "SCALAR" || accessor["componentType"].asUInt() != 5123)
         throw std::runtime_error("Mismatched accessor type for reading Scalar");
 
-    Json::Value& bufferView = _json["bufferViews"][accessor["bufferView"].asUInt()];
+    const Json::Value& bufferView = _json["bufferViews"][accessor["bufferView"].asUInt()];
     uint32_t count = accessor["count"].asUInt();
     uint32_t offset = bufferView["byteOffset"].asUInt() + accessor["byteOffset"].asUInt();
 
@@ -175,13 +178,13 @@ std::vector<uint16_t> GLTFLoader::readShortScalarBuffer(uint32_t accessorIndex)
     return buffer;
 }
 
-std::vector<uint32_t> GLTFLoader::readScalarBuffer(uint32_t accessorIndex)
+std::vector<uint32_t> GLTFLoader::readScalarBuffer(uint32_t accessorIndex) const
 {
-    Json::Value& accessor = _json["accessors"][accessorIndex];
+    const Json::Value& accessor = _json["accessors"][accessorIndex];
     if(accessor["type"].asString() != "SCALAR")
         throw std::runtime_error("Mismatched accessor type for reading Scalar");
 
-    Json::Value& bufferView = _json["bufferViews"][accessor["bufferView"].asUInt()];
+    const Json::Value& bufferView = _json["bufferViews"][accessor["bufferView"].asUInt()];
     uint32_t count = accessor["count"].asUInt();
     uint32_t offset = bufferView["byteOffset"].asUInt() + accessor["byteOffset"].asUInt();
 
@@ -206,13 +209,13 @@ std::vector<uint32_t> GLTFLoader::readScalarBuffer(uint32_t accessorIndex)
     throw std::runtime_error("Unknown accessor component type");
 }
 
-std::vector<glm::vec2> GLTFLoader::readVec2Buffer(uint32_t accessorIndex)
+std::vector<glm::vec2> GLTFLoader::readVec2Buffer(uint32_t accessorIndex) const
 {
-    Json::Value& accessor = _json["accessors"][accessorIndex];
+    const Json::Value& accessor = _json["accessors"][accessorIndex];
     if(accessor["componentType"].asUInt() != 5126 || accessor["type"].asString() != "VEC2")
         throw std::runtime_error("Mismatched accessor values for reading Vec2");
 
-    Json::Value& bufferView = _json["bufferViews"][accessor["bufferView"].asUInt()];
+    const Json::Value& bufferView = _json["bufferViews"][accessor["bufferView"].asUInt()];
     uint32_t count = accessor["count"].asUInt();
     uint32_t stride = bufferView.get("byteStride", sizeof(float) * 2).asUInt();
     uint32_t offset = bufferView["byteOffset"].asUInt() + accessor["byteOffset"].asUInt();
@@ -228,15 +231,15 @@ std::vector<glm::vec2> GLTFLoader::readVec2Buffer(uint32_t accessorIndex)
     return buffer;
 }
 
-std::vector<glm::vec3> GLTFLoader::readVec3Buffer(uint32_t accessorIndex)
+std::vector<glm::vec3> GLTFLoader::readVec3Buffer(uint32_t accessorIndex) const
 {
-    Json::Value& accessor = _json["accessors"][accessorIndex];
+    const Json::Value& accessor = _json["accessors"][accessorIndex];
     std::string type = accessor["type"].asString();
     // We can read vec4 values as vec 3 as the stride will account for the unread value.
     if(accessor["componentType"].asUInt() != 5126 || !(type == "VEC3" || type == "VEC4"))
         throw std::runtime_error("Mismatched accessor values for reading Vec3");
 
-    Json::Value& bufferView = _json["bufferViews"][accessor["bufferView"].asUInt()];
+    const Json::Value& bufferView = _json["bufferViews"][accessor["bufferView"].asUInt()];
     uint32_t count = accessor["count"].asUInt();
     uint32_t stride = bufferView.get("byteStride", sizeof(float) * 3).asUInt();
     uint32_t offset = bufferView["byteOffset"].asUInt() + accessor["byteOffset"].asUInt();
@@ -253,15 +256,15 @@ std::vector<glm::vec3> GLTFLoader::readVec3Buffer(uint32_t accessorIndex)
     return buffer;
 }
 
-std::vector<glm::vec4> GLTFLoader::readVec4Buffer(uint32_t accessorIndex)
+std::vector<glm::vec4> GLTFLoader::readVec4Buffer(uint32_t accessorIndex) const
 {
-    Json::Value& accessor = _json["accessors"][accessorIndex];
+    const Json::Value& accessor = _json["accessors"][accessorIndex];
     std::string type = accessor["type"].asString();
     // We can read vec4 values as vec 3 as the stride will account for the unread value.
     if(accessor["componentType"].asUInt() != 5126 || !(type == "VEC4"))
         throw std::runtime_error("Mismatched accessor values for reading Vec3");
 
-    Json::Value& bufferView = _json["bufferViews"][accessor["bufferView"].asUInt()];
+    const Json::Value& bufferView = _json["bufferViews"][accessor["bufferView"].asUInt()];
     uint32_t count = accessor["count"].asUInt();
     uint32_t stride = bufferView.get("byteStride", sizeof(float) * 4).asUInt();
     uint32_t offset = bufferView["byteOffset"].asUInt() + accessor["byteOffset"].asUInt();
@@ -281,50 +284,75 @@ std::vector<glm::vec4> GLTFLoader::readVec4Buffer(uint32_t accessorIndex)
 
 std::vector<MeshAsset*> GLTFLoader::extractAllMeshes()
 {
-    std::vector<MeshAsset*> meshAssets;
-    for(auto& meshData : _json["meshes"])
-    {
-        MeshAsset* mesh = new MeshAsset();
-        mesh->name = meshData["name"].asString();
-
-        for(auto& primitive : meshData["primitives"])
+    // Meshes are independent, so they're extracted in parallel. Only const json access from here on, the non-const
+    // operator[] inserts missing keys.
+    const Json::Value& meshes = std::as_const(_json)["meshes"];
+    std::vector<MeshAsset*> meshAssets(meshes.size(), nullptr);
+    std::mutex errorLock;
+    std::exception_ptr error;
+    ThreadPool::parallelFor(0, meshes.size(), 1, [&](size_t begin, size_t end) {
+        for(size_t m = begin; m < end; ++m)
         {
-            auto positions = readVec3Buffer(primitive["attributes"]["POSITION"].asUInt());
-            size_t pIndex;
-            auto indexBufferType = accessorComponentType(primitive["indices"].asUInt());
-            if(indexBufferType == 5123) // UNSIGNED_SHORT
-                pIndex = mesh->addPrimitive(readShortScalarBuffer(primitive["indices"].asUInt()),
-                                            static_cast<uint32_t>(positions.size()));
-            else // UNSIGNED_INT
-                pIndex = mesh->addPrimitive(readScalarBuffer(primitive["indices"].asUInt()),
-                                            static_cast<uint32_t>(positions.size()));
-            mesh->addAttribute(pIndex, "POSITION", positions);
-
-            if(primitive["attributes"].isMember("NORMAL"))
+            try
             {
-                auto v = readVec3Buffer(primitive["attributes"]["NORMAL"].asUInt());
-                mesh->addAttribute(pIndex, "NORMAL", v);
+                meshAssets[m] = extractMesh(meshes[static_cast<Json::ArrayIndex>(m)]);
             }
-
-            if(primitive["attributes"].isMember("TANGENT"))
+            catch(...)
             {
-                auto v = readVec4Buffer(primitive["attributes"]["TANGENT"].asUInt());
-                mesh->addAttribute(pIndex, "TANGENT", v);
+                std::scoped_lock lock(errorLock);
+                error = std::current_exception();
             }
+        }
+    });
+    if(error)
+    {
+        for(MeshAsset* mesh : meshAssets)
+            delete mesh;
+        std::rethrow_exception(error);
+    }
+    return meshAssets;
+}
 
-            // TODO  make it so that we automatically detect all texcoords
-            if(primitive["attributes"].isMember("TEXCOORD_0"))
-            {
-                auto v = readVec2Buffer(primitive["attributes"]["TEXCOORD_0"].asUInt());
-                mesh->addAttribute(pIndex, "TEXCOORD_0", v);
-            }
+MeshAsset* GLTFLoader::extractMesh(const Json::Value& meshData) const
+{
+    auto mesh = std::make_unique<MeshAsset>();
+    mesh->name = meshData["name"].asString();
+
+    for(auto& primitive : meshData["primitives"])
+    {
+        auto positions = readVec3Buffer(primitive["attributes"]["POSITION"].asUInt());
+        size_t pIndex;
+        auto indexBufferType = accessorComponentType(primitive["indices"].asUInt());
+        if(indexBufferType == 5123) // UNSIGNED_SHORT
+            pIndex = mesh->addPrimitive(readShortScalarBuffer(primitive["indices"].asUInt()),
+                                        static_cast<uint32_t>(positions.size()));
+        else // UNSIGNED_INT
+            pIndex = mesh->addPrimitive(readScalarBuffer(primitive["indices"].asUInt()),
+                                        static_cast<uint32_t>(positions.size()));
+        mesh->addAttribute(pIndex, "POSITION", positions);
+
+        if(primitive["attributes"].isMember("NORMAL"))
+        {
+            auto v = readVec3Buffer(primitive["attributes"]["NORMAL"].asUInt());
+            mesh->addAttribute(pIndex, "NORMAL", v);
+        }
 
-            // TODO: Remove vertices unused by indices array, since primitives reuse buffers
+        if(primitive["attributes"].isMember("TANGENT"))
+        {
+            auto v = readVec4Buffer(primitive["attributes"]["TANGENT"].asUInt());
+            mesh->addAttribute(pIndex, "TANGENT", v);
         }
 
-        meshAssets.push_back(mesh);
+        // TODO  make it so that we automatically detect all texcoords
+        if(primitive["attributes"].isMember("TEXCOORD_0"))
+        {
+            auto v = readVec2Buffer(primitive["attributes"]["TEXCOORD_0"].asUInt());
+            mesh->addAttribute(pIndex, "TEXCOORD_0", v);
+        }
+
+        // TODO: Remove vertices unused by indices array, since primitives reuse buffers
     }
-    return meshAssets;
+    return mesh.release();
 }
 
 Json::Value& GLTFLoader::nodes() { return _json["nodes"]; }
@@ -342,8 +370,8 @@ bool GLTFLoader::loadFromFile(const std::filesystem::path& filename)
     return false;
 }
 
-uint32_t GLTFLoader::accessorComponentType(uint32_t accessorIndex)
+uint32_t GLTFLoader::accessorComponentType(uint32_t accessorIndex) const
 {
-    Json::Value& accessor = _json["accessors"][accessorIndex];
+    const Json::Value& accessor = _json["accessors"][accessorIndex];
     return accessor["componentType"].asUInt();
 }
@@ -44,20 +44,22 @@ class GLTFLoader
 
     void printPositions(int mesh, int primitive);
 
-    uint32_t accessorComponentType(uint32_t accessor);
+    uint32_t accessorComponentType(uint32_t accessor) const;
 
-    std::vector<uint16_t> readShortScalarBuffer(uint32_t accessor);
+    std::vector<uint16_t> readShortScalarBuffer(uint32_t accessor) const;
 
-    std::vector<uint32_t> readScalarBuffer(uint32_t accessor);
+    std::vector<uint32_t> readScalarBuffer(uint32_t accessor) const;
 
-    std::vector<glm::vec2> readVec2Buffer(uint32_t accessor);
+    std::vector<glm::vec2> readVec2Buffer(uint32_t accessor) const;
 
-    std::vector<glm::vec3> readVec3Buffer(uint32_t accessor);
+    std::vector<glm::vec3> readVec3Buffer(uint32_t accessor) const;
 
-    std::vector<glm::vec4> readVec4Buffer(uint32_t accessor);
+    std::vector<glm::vec4> readVec4Buffer(uint32_t accessor) const;
 
     std::vector<MeshAsset*> extractAllMeshes();
 
+    MeshAsset* extractMesh(const Json::Value& meshData) const;
+
     Json::Value& json();
 
     Json::Value& nodes();
@@ -368,12 +368,19 @@ std::string BraneProject::getAssetName(const AssetID& id)
 
 std::vector<std::pair<AssetID, std::string>> BraneProject::getAssetHashes()
 {
-    std::vector<std::pair<AssetID, std::string>> hashes;
-    auto ids = _file["assets"].getMemberNames();
-    for(auto& idStr : ids)
+    // Saving and building assets has to happen here, but hashing the cached files can be spread over the thread pool
+    std::vector<AssetID> ids;
+    for(auto& idStr : _file["assets"].getMemberNames())
     {
         AssetID id(idStr);
-        hashes.emplace_back(std::move(id), getEditorAsset(id)->hash(id));
+        getEditorAsset(id)->updateCache(id);
+        ids.push_back(std::move(id));
     }
+    auto fileHashes = _editor.cache().getAssetHashes(ids);
+
+    std::vector<std::pair<AssetID, std::string>> hashes;
+    hashes.reserve(ids.size());
+    for(size_t i = 0; i < ids.size(); ++i)
+        hashes.emplace_back(std::move(ids[i]), std::move(fileHashes[i]));
     return hashes;
 }
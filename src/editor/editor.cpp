@@ -209,7 +209,8 @@ AsyncData<Asset*> AssetManager::fetchAssetInternal(const AssetID& id, bool incre
 
     if(editor->cache().hasAsset(id))
     {
-        ThreadPool::enqueue([this, editor, asset, id]() {
+        ThreadPool::enqueueDetached(
+            [this, editor, asset, id]() {
             Asset* cachedAsset = editor->cache().getAsset(id);
             fetchDependencies(cachedAsset, [asset, cachedAsset](bool success) mutable {
                 if(success)
@@ -217,14 +218,16 @@ AsyncData<Asset*> AssetManager::fetchAssetInternal(const AssetID& id, bool incre
                 else
                     asset.setError("Failed to load dependency for: " + cachedAsset->name);
             });
-        });
+            },
+            JobPriority::streaming);
         return asset;
     }
 
     std::shared_ptr<EditorAsset> editorAsset = editor->project().getEditorAsset(id);
     if(editorAsset)
     {
-        ThreadPool::enqueue([this, editorAsset, editor, asset, id]() {
+        ThreadPool::enqueueDetached(
+            [this, editorAsset, editor, asset, id]() {
             Asset* a = editorAsset->buildAsset(id);
             if(!a)
             {
@@ -243,7 +246,8 @@ AsyncData<Asset*> AssetManager::fetchAssetInternal(const AssetID& id, bool incre
                 else
                     asset.setError("Failed to load dependency for: " + a->name);
             });
-        });
+            },
+            JobPriority::streaming);
         return asset;
     }
 
@@ -151,7 +151,8 @@ void CreateAssetWindow::createAsset()
             }
             _uploadContext = std::make_unique<AssetUploadContext>();
             _uploadContext->status = "compiling...";
-            ThreadPool::enqueue([this, fs]() {
+            ThreadPool::enqueueDetached(
+                [this, fs]() {
                 ShaderAsset shaderAsset;
                 shaderAsset.name = _assetName;
                 std::string fileSuffix = _importFile.substr(_importFile.find_last_of('.'));
@@ -185,7 +186,8 @@ void CreateAssetWindow::createAsset()
                     _uploadContext->status = "Uploaded!";
                     _uploadContext->done = true;
                 });
-            });
+                },
+                JobPriority::streaming);
             break;
         }
         case AssetType::material:
@@ -20,7 +20,8 @@ void MemoryManagerWindow::displayContent()
     {
         for(auto& arch : _em->archetypes())
         {
-            ecsMemory += arch.chunks().size() * Chunk::allocationSize();
+            ArchetypeMemoryStats stats = arch.memoryStats();
+            ecsMemory += stats.allocatedBytes;
             std::string name = "| ";
             for(auto& c : arch.componentDescriptions())
             {
@@ -30,6 +31,10 @@ void MemoryManagerWindow::displayContent()
                     name += std::to_string(c->id) + "(ID) | ";
             }
             name += " x" + std::to_string(arch.size());
+            name += " (" + std::to_string(static_cast<int>(stats.utilisation() * 100)) + "% used";
+            if(stats.reclaimableBytes)
+                name += ", " + std::to_string(stats.reclaimableBytes / 1024) + "KB reclaimable";
+            name += ")";
             ImGui::Selectable(name.c_str());
         }
     }
@@ -62,4 +67,5 @@ void MemoryManagerWindow::displayContent()
     }
 
     ImGui::Text("Estimated ECS Memory: %fMB", static_cast<float>(ecsMemory) / 1000000);
+    ImGui::Text("Pooled chunks: %fMB", static_cast<float>(_em->archetypes().pooledChunkBytes()) / 1000000);
 }
@@ -141,7 +141,8 @@ void SyncWindow::syncAssets()
 {
     if(_assetDiffSynced == -1)
     {
-        ThreadPool::enqueue([this] {
+        ThreadPool::enqueueDetached(
+            [this] {
             SerializedData assetHashes;
             OutputSerializer s(assetHashes);
             std::vector<std::pair<AssetID, std::string>> hashes = _editor.project().getAssetHashes();
@@ -171,7 +172,8 @@ void SyncWindow::syncAssets()
                     res >> _assetDiffs[i].id;
                 _assetDiffSynced = 1;
             });
-        });
+            },
+            JobPriority::background);
         _assetDiffSynced = 0;
     }
     if(_assetDiffSynced == 0)
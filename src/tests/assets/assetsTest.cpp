@@ -1,6 +1,9 @@
+#include "assets/assembly.h"
 #include "assets/assetManager.h"
 #include "testing.h"
 #include <assets/asset.h>
+#include <ecs/entity.h>
+#include <systems/transforms.h>
 
 // Edit this function if we need to "load" any assets for testing
 AsyncData<Asset*> AssetManager::fetchAssetInternal(const AssetID& id, bool incremental)
@@ -52,3 +55,60 @@ TEST(assets, AssetIDTest)
     );
     EXPECT_EQ(aa, null);
 }
+
+TEST(assets, AssemblyInjectOrderTest)
+{
+    Runtime::init();
+    Runtime::timeline().addBlock("main");
+    EntityManager em;
+    em.components().registerComponent(EntityIDComponent::constructDescription());
+    em.components().registerComponent(EntityName::constructDescription());
+    em.components().registerComponent(TRS::constructDescription());
+
+    // Interleave two component sets so the bulk path has to regroup them
+    Assembly assembly;
+    for(size_t i = 0; i < 6; ++i)
+    {
+        Assembly::EntityAsset entity;
+        EntityName name;
+        name.name = "entity " + std::to_string(i);
+        entity.components.emplace_back(name.toVirtual());
+        if(i % 2)
+        {
+            TRS trs;
+            trs.translation.x = static_cast<float>(i);
+            entity.components.emplace_back(trs.toVirtual());
+        }
+        assembly.entities.push_back(std::move(entity));
+    }
+    assembly.rootIndex = 3;
+
+    std::vector<EntityID> firstMap;
+    for(size_t round = 0; round < 2; ++round)
+    {
+        std::vector<EntityID> entityMap;
+        EntityID root = assembly.inject(em, &entityMap);
+        ASSERT_EQ(entityMap.size(), assembly.entities.size());
+        EXPECT_EQ(root, entityMap[assembly.rootIndex]);
+        for(size_t i = 0; i < entityMap.size(); ++i)
+        {
+            EXPECT_EQ(em.getComponent<EntityName>(entityMap[i])->name, "entity " + std::to_string(i));
+            EXPECT_EQ(em.hasComponent<TRS>(entityMap[i]), i % 2 == 1);
+            if(i % 2)
+                EXPECT_EQ(em.getComponent<TRS>(entityMap[i])->translation.x, static_cast<float>(i));
+        }
+
+        // The group of the first entity spawns first, and each group keeps the asset's order
+        EXPECT_LT(entityMap[0].id, entityMap[1].id);
+        for(size_t i = 2; i < entityMap.size(); ++i)
+            EXPECT_LT(entityMap[i - 2].id, entityMap[i].id);
+
+        // Injecting again lays the new entities out the same way
+        if(round == 0)
+            firstMap = entityMap;
+        else
+            for(size_t i = 0; i < entityMap.size(); ++i)
+                EXPECT_EQ(entityMap[i].id - entityMap[0].id, firstMap[i].id - firstMap[0].id);
+    }
+    Runtime::cleanup();
+}
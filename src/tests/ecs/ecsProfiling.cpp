@@ -6,24 +6,29 @@
 #include <random>
 #include "assets/assetManager.h"
 #include "ecs/entity.h"
+#include "ecs/query.h"
+#include "systems/transformKernels.h"
+#include "systems/transforms.h"
 #include "testing.h"
 #include "unordered_set"
 #include "utility/clock.h"
+#include "utility/sharedRecursiveMutex.h"
 
-namespace std
+class ProfilingPosition : public NativeComponent<ProfilingPosition>
 {
-    template<>
-    struct hash<ComponentSet>
-    {
-        size_t operator()(const ComponentSet& componentSet) const
-        {
-            size_t h = 17;
-            for(auto id : componentSet)
-                h = h * 31 + hash<ComponentID>()(id);
-            return h;
-        }
-    };
-} // namespace std
+    REGISTER_MEMBERS_1("ProfilingPosition", value, "value")
+
+  public:
+    glm::vec3 value;
+};
+
+class ProfilingVelocity : public NativeComponent<ProfilingVelocity>
+{
+    REGISTER_MEMBERS_1("ProfilingVelocity", value, "value")
+
+  public:
+    glm::vec3 value;
+};
 
 void allPossibleComponentSets(const ComponentSet& set, std::unordered_set<ComponentSet>& results)
 {
@@ -432,4 +437,1092 @@ TEST(ECS_Profiling, QueryCreation_PlausableCase)
     }
 
     Runtime::cleanup();
-}
\ No newline at end of file
+}
+TEST(ECS_Profiling, ParallelIteration)
+{
+    std::vector<VirtualType::Type> variables = {VirtualType::virtualMat4, VirtualType::virtualVec3};
+    ComponentDescription component(variables);
+
+    Runtime::init();
+    Runtime::timeline().addBlock("main");
+    Runtime::addModule<EntityManager>();
+
+    auto& em = *Runtime::getModule<EntityManager>();
+    em.components().registerComponent(EntityIDComponent::constructDescription());
+    em.components().registerComponent(&component);
+
+    SystemContext ctx;
+    ComponentFilter filter(&ctx);
+    filter.addComponent(component.id);
+
+    size_t created = 0;
+    for(size_t count : {10000, 100000, 1000000})
+    {
+        em.createEntities(ComponentSet({component.id}), count - created);
+        created = count;
+
+        auto work = [&component](byte* data) {
+            glm::mat4& m = *(glm::mat4*)data;
+            glm::vec3& v = *(glm::vec3*)(data + component.members()[1].offset);
+            m = glm::translate(m, v);
+            v = glm::vec3(m[3]);
+        };
+
+        Stopwatch serialTime;
+        em.getEntities(filter).forEachNative([&](byte** components) { work(components[0]); });
+        auto serialResult = serialTime.time<std::chrono::microseconds>();
+
+        Stopwatch parallelTime;
+        em.getEntities(filter).forEachParallel([&](byte** components) { work(components[0]); });
+        auto parallelResult = parallelTime.time<std::chrono::microseconds>();
+
+        Stopwatch chunkTime;
+        em.getEntities(filter).forEachChunkParallel([&](byte** components, size_t chunkSize) {
+            for(size_t i = 0; i < chunkSize; ++i)
+                work(components[0] + component.size() * i);
+        });
+        auto chunkResult = chunkTime.time<std::chrono::microseconds>();
+
+        std::cout << count << " entities:\n"
+                  << "  forEachNative: " << serialResult << "us\n"
+                  << "  forEachParallel: " << parallelResult << "us\n"
+                  << "  forEachChunkParallel: " << chunkResult << "us" << std::endl;
+    }
+
+    Runtime::cleanup();
+}
+
+TEST(ECS_Profiling, TypedQuery)
+{
+    Runtime::init();
+    Runtime::timeline().addBlock("main");
+    Runtime::addModule<EntityManager>();
+
+    auto& em = *Runtime::getModule<EntityManager>();
+    em.components().registerComponent(EntityIDComponent::constructDescription());
+    em.components().registerComponent(ProfilingPosition::constructDescription());
+    em.components().registerComponent(ProfilingVelocity::constructDescription());
+
+    ComponentSet components;
+    components.add(ProfilingPosition::def()->id);
+    components.add(ProfilingVelocity::def()->id);
+    size_t count = 1000000;
+    em.createEntities(components, count);
+
+    SystemContext ctx;
+    constexpr size_t iterations = 10;
+
+    Stopwatch filterTime;
+    for(size_t i = 0; i < iterations; ++i)
+    {
+        ComponentFilter filter(&ctx);
+        filter.addComponent(ProfilingPosition::def()->id);
+        filter.addComponent(ProfilingVelocity::def()->id, ComponentFilterFlags_Const);
+        em.getEntities(filter).forEachNative([](byte** components) {
+            auto* p = ProfilingPosition::fromVirtual(components[0]);
+            auto* v = ProfilingVelocity::fromVirtual(components[1]);
+            p->value = p->value + v->value;
+        });
+    }
+    auto filterResult = filterTime.time<std::chrono::microseconds>() / iterations;
+
+    Query<Write<ProfilingPosition>, Read<ProfilingVelocity>> query(&ctx);
+    Stopwatch queryTime;
+    for(size_t i = 0; i < iterations; ++i)
+    {
+        query.forEach(em, [](ProfilingPosition& p, const ProfilingVelocity& v) { p.value = p.value + v.value; });
+    }
+    auto queryResult = queryTime.time<std::chrono::microseconds>() / iterations;
+
+    std::cout << "Iterating " << count << " entities:\n"
+              << "  ComponentFilter + forEachNative: " << filterResult << "us\n"
+              << "  Query<Write<ProfilingPosition>, Read<ProfilingVelocity>>: " << queryResult << "us" << std::endl;
+
+    Runtime::cleanup();
+}
+
+TEST(ECS_Profiling, QueryCache_SteadyState)
+{
+    std::set<std::shared_ptr<ComponentDescription>> components;
+    for(size_t i = 0; i < 12; ++i)
+        components.insert(
+            std::make_unique<ComponentDescription>(std::vector<VirtualType::Type>{VirtualType::virtualBool}));
+
+    Runtime::init();
+    Runtime::timeline().addBlock("main");
+    Runtime::addModule<EntityManager>();
+
+    auto& em = *Runtime::getModule<EntityManager>();
+    em.components().registerComponent(EntityIDComponent::constructDescription());
+
+    ComponentSet allComponents;
+    for(auto& c : components)
+    {
+        em.components().registerComponent(c.get());
+        allComponents.add(c->id);
+    }
+
+    std::unordered_set<ComponentSet> allSets;
+    allPossibleComponentSets(allComponents, allSets);
+    std::unordered_set<ComponentSet> randomSets = selectRandom(allSets, 650, 1234);
+    for(const ComponentSet& set : randomSets)
+        em.createEntity(set);
+
+    std::cout << "Running test with " << em.archetypes().queryCacheStats().entries << " cached queries and "
+              << randomSets.size() << " archetypes" << std::endl;
+
+    SystemContext ctx;
+    std::vector<ComponentFilter> filters;
+    for(auto ids : std::vector<std::vector<ComponentID>>{{1}, {8}, {11}, {1, 2, 3}, {1, 5, 10}, {0, 9, 10}})
+    {
+        ComponentFilter filter(&ctx);
+        for(auto id : ids)
+            filter.addComponent(id);
+        filters.push_back(filter);
+    }
+
+    Stopwatch missTime;
+    size_t found = 0;
+    for(auto& filter : filters)
+        found += em.getEntities(filter).archetypeCount();
+    auto missResult = missTime.time<std::chrono::nanoseconds>() / filters.size();
+
+    constexpr size_t frames = 1000;
+    Stopwatch hitTime;
+    for(size_t f = 0; f < frames; ++f)
+        for(auto& filter : filters)
+            found += em.getEntities(filter).archetypeCount();
+    auto hitResult = hitTime.time<std::chrono::nanoseconds>() / (filters.size() * frames);
+
+    auto stats = em.archetypes().queryCacheStats();
+    std::cout << "First query (scan): " << missResult << " nanoseconds average\n"
+              << "Cached query: " << hitResult << " nanoseconds average\n"
+              << "Cache hits: " << stats.hits << ", misses: " << stats.misses << ", entries: " << stats.entries
+              << std::endl;
+    printCallsPerFrame(hitResult, 144);
+    EXPECT_EQ(stats.misses, filters.size());
+    EXPECT_EQ(stats.hits, filters.size() * frames);
+    EXPECT_GT(found, 0);
+
+    Runtime::cleanup();
+}
+
+TEST(ECS_Profiling, BatchedMigration)
+{
+    Runtime::init();
+    Runtime::timeline().addBlock("main");
+    Runtime::addModule<EntityManager>();
+
+    auto& em = *Runtime::getModule<EntityManager>();
+    em.components().registerComponent(EntityIDComponent::constructDescription());
+    em.components().registerComponent(ProfilingPosition::constructDescription());
+    em.components().registerComponent(ProfilingVelocity::constructDescription());
+
+    constexpr size_t count = 100000;
+    ComponentSet components({ProfilingPosition::def()->id});
+    std::vector<EntityID> entities;
+    entities.reserve(count);
+    for(size_t i = 0; i < count; ++i)
+        entities.push_back(em.createEntity(components));
+
+    Stopwatch singleTime;
+    for(EntityID entity : entities)
+        em.addComponent<ProfilingVelocity>(entity);
+    auto singleResult = singleTime.time<std::chrono::microseconds>();
+
+    Stopwatch singleRemoveTime;
+    for(EntityID entity : entities)
+        em.removeComponent<ProfilingVelocity>(entity);
+    auto singleRemoveResult = singleRemoveTime.time<std::chrono::microseconds>();
+
+    Stopwatch batchTime;
+    em.addComponents<ProfilingVelocity>(entities);
+    auto batchResult = batchTime.time<std::chrono::microseconds>();
+
+    Stopwatch batchRemoveTime;
+    em.removeComponents<ProfilingVelocity>(entities);
+    auto batchRemoveResult = batchRemoveTime.time<std::chrono::microseconds>();
+
+    // Every other entity, so no two entities in a run are adjacent
+    std::vector<EntityID> scattered;
+    for(size_t i = 0; i < count; i += 2)
+        scattered.push_back(entities[i]);
+    Stopwatch scatteredTime;
+    em.addComponents<ProfilingVelocity>(scattered);
+    auto scatteredResult = scatteredTime.time<std::chrono::microseconds>();
+
+    std::cout << count << " migrations:\n"
+              << "  addComponent: " << singleResult << "us\n"
+              << "  removeComponent: " << singleRemoveResult << "us\n"
+              << "  addComponents: " << batchResult << "us\n"
+              << "  removeComponents: " << batchRemoveResult << "us\n"
+              << "  addComponents, every other entity: " << scatteredResult << "us" << std::endl;
+    EXPECT_TRUE(em.hasComponent<ProfilingVelocity>(entities[0]));
+    EXPECT_FALSE(em.hasComponent<ProfilingVelocity>(entities[1]));
+
+    Runtime::cleanup();
+}
+
+TEST(ECS_Profiling, CommandBufferPlayback)
+{
+    Runtime::init();
+    Runtime::timeline().addBlock("main");
+    Runtime::addModule<EntityManager>();
+
+    auto& em = *Runtime::getModule<EntityManager>();
+    em.components().registerComponent(EntityIDComponent::constructDescription());
+    em.components().registerComponent(ProfilingPosition::constructDescription());
+    em.components().registerComponent(ProfilingVelocity::constructDescription());
+
+    constexpr size_t count = 100000;
+    std::vector<EntityID> entities = em.createEntities(ComponentSet({ProfilingPosition::def()->id}), count);
+    EntityCommandBuffer commands;
+
+    // The same structural changes applied straight away one entity at a time, and recorded then played back. The
+    // first round fills the chunk pool and the entity table, the second is measured.
+    long long immediateAdd = 0, immediateRemove = 0, immediateCreate = 0;
+    long long playbackAdd = 0, playbackRemove = 0, playbackCreate = 0;
+    for(size_t round = 0; round < 2; ++round)
+    {
+        Stopwatch addTime;
+        for(EntityID entity : entities)
+            em.addComponent<ProfilingVelocity>(entity);
+        immediateAdd = addTime.time<std::chrono::microseconds>();
+
+        Stopwatch removeTime;
+        for(EntityID entity : entities)
+            em.removeComponent<ProfilingVelocity>(entity);
+        immediateRemove = removeTime.time<std::chrono::microseconds>();
+
+        for(EntityID entity : entities)
+            commands.addComponent<ProfilingVelocity>(entity);
+        Stopwatch addPlaybackTime;
+        commands.playback(em);
+        playbackAdd = addPlaybackTime.time<std::chrono::microseconds>();
+
+        for(EntityID entity : entities)
+            commands.removeComponent<ProfilingVelocity>(entity);
+        Stopwatch removePlaybackTime;
+        commands.playback(em);
+        playbackRemove = removePlaybackTime.time<std::chrono::microseconds>();
+
+        std::vector<EntityID> created;
+        created.reserve(count);
+        Stopwatch createTime;
+        for(size_t i = 0; i < count; ++i)
+        {
+            ProfilingVelocity velocity;
+            velocity.value = glm::vec3(static_cast<float>(i));
+            EntityID entity = em.createEntity(ComponentSet({ProfilingVelocity::def()->id}));
+            em.setComponent(entity, velocity.toVirtual());
+            created.push_back(entity);
+        }
+        immediateCreate = createTime.time<std::chrono::microseconds>();
+        for(EntityID entity : created)
+            commands.destroyEntity(entity);
+        commands.playback(em);
+
+        for(size_t i = 0; i < count; ++i)
+        {
+            ProfilingVelocity velocity;
+            velocity.value = glm::vec3(static_cast<float>(i));
+            commands.createEntity(std::vector<VirtualComponent>{VirtualComponent(velocity.toVirtual())});
+        }
+        Stopwatch createPlaybackTime;
+        commands.playback(em);
+        playbackCreate = createPlaybackTime.time<std::chrono::microseconds>();
+        size_t playedBack = 0;
+        SystemContext ctx;
+        Query<Read<EntityIDComponent>, Read<ProfilingVelocity>, Without<ProfilingPosition>> spawned(&ctx);
+        spawned.forEach(em, [&](const EntityIDComponent& id, const ProfilingVelocity&) {
+            commands.destroyEntity(id.id);
+            ++playedBack;
+        });
+        EXPECT_EQ(playedBack, count);
+        commands.playback(em);
+    }
+
+    std::cout << count << " entities:\n"
+              << "  addComponent: " << immediateAdd << "us\n"
+              << "  playback of addComponent: " << playbackAdd << "us\n"
+              << "  removeComponent: " << immediateRemove << "us\n"
+              << "  playback of removeComponent: " << playbackRemove << "us\n"
+              << "  createEntity + setComponent: " << immediateCreate << "us\n"
+              << "  playback of createEntity: " << playbackCreate << "us" << std::endl;
+    EXPECT_FALSE(em.hasComponent<ProfilingVelocity>(entities[0]));
+    EXPECT_TRUE(em.validate());
+
+    Runtime::cleanup();
+}
+
+TEST(ECS_Profiling, BulkSpawn)
+{
+    Runtime::init();
+    Runtime::timeline().addBlock("main");
+    Runtime::addModule<EntityManager>();
+
+    auto& em = *Runtime::getModule<EntityManager>();
+    em.components().registerComponent(EntityIDComponent::constructDescription());
+    em.components().registerComponent(ProfilingPosition::constructDescription());
+    em.components().registerComponent(ProfilingVelocity::constructDescription());
+
+    // Roughly what loading a large assembly looks like, every entity has its own component values
+    constexpr size_t count = 50000;
+    std::vector<VirtualComponent> positions;
+    std::vector<VirtualComponent> velocities;
+    positions.reserve(count);
+    velocities.reserve(count);
+    for(size_t i = 0; i < count; ++i)
+    {
+        ProfilingPosition p;
+        p.value = glm::vec3(i);
+        positions.emplace_back(p.toVirtual());
+        ProfilingVelocity v;
+        v.value = glm::vec3(1, 0, 0);
+        velocities.emplace_back(v.toVirtual());
+    }
+    ComponentSet components({ProfilingPosition::def()->id, ProfilingVelocity::def()->id});
+
+    Stopwatch singleTime;
+    for(size_t i = 0; i < count; ++i)
+    {
+        EntityID entity = em.createEntity(components);
+        em.setComponent(entity, positions[i]);
+        em.setComponent(entity, velocities[i]);
+    }
+    auto singleResult = singleTime.time<std::chrono::microseconds>();
+
+    Stopwatch bulkTime;
+    auto ids = em.createEntities(
+        components, count, [&](const ComponentDescription* def, size_t first, size_t n, byte* dest) {
+        auto& source = def == ProfilingPosition::def() ? positions : velocities;
+        for(size_t i = 0; i < n; ++i)
+            def->copy(source[first + i].data(), dest + def->size() * i);
+    });
+    auto bulkResult = bulkTime.time<std::chrono::microseconds>();
+
+    std::cout << "Spawning " << count << " entities:\n"
+              << "  createEntity + setComponent: " << singleResult << "us\n"
+              << "  createEntities: " << bulkResult << "us" << std::endl;
+    EXPECT_EQ(ids.size(), count);
+    EXPECT_EQ(em.getComponent<ProfilingPosition>(ids[count - 1])->value, glm::vec3(count - 1));
+
+    Runtime::cleanup();
+}
+
+TEST(ECS_Profiling, CreateDestroyThroughput)
+{
+    Runtime::init();
+    Runtime::timeline().addBlock("main");
+    Runtime::addModule<EntityManager>();
+
+    auto& em = *Runtime::getModule<EntityManager>();
+    em.components().registerComponent(EntityIDComponent::constructDescription());
+    em.components().registerComponent(ProfilingPosition::constructDescription());
+    ComponentSet components({ProfilingPosition::def()->id});
+
+#ifdef BRANE_ECS_PARANOID
+    std::cout << "Built with BRANE_ECS_PARANOID, every structural change validates the entity table" << std::endl;
+#endif
+    auto entitiesPerSecond = [](size_t count, uint64_t nanoseconds) {
+        return static_cast<uint64_t>(count * 1e9 / std::max<uint64_t>(nanoseconds, 1));
+    };
+
+    // validateEachChange emulates BRANE_ECS_PARANOID, which is what the old unconditional assert loops cost
+    for(bool validateEachChange : {false, true})
+    {
+        size_t count = validateEachChange ? 2000 : 100000;
+        std::vector<EntityID> entities;
+        entities.reserve(count);
+
+        Stopwatch createTime;
+        for(size_t i = 0; i < count; ++i)
+        {
+            entities.push_back(em.createEntity(components));
+            if(validateEachChange)
+                em.validate();
+        }
+        auto createResult = createTime.time<std::chrono::nanoseconds>();
+
+        Stopwatch destroyTime;
+        for(EntityID entity : entities)
+        {
+            em.destroyEntity(entity);
+            if(validateEachChange)
+                em.validate();
+        }
+        auto destroyResult = destroyTime.time<std::chrono::nanoseconds>();
+
+        std::cout << count << " entities" << (validateEachChange ? ", validating every change" : "") << ":\n"
+                  << "  create: " << entitiesPerSecond(count, createResult) << " entities/s\n"
+                  << "  destroy: " << entitiesPerSecond(count, destroyResult) << " entities/s" << std::endl;
+        EXPECT_TRUE(em.validate());
+    }
+
+    Runtime::cleanup();
+}
+
+TEST(ECS_Profiling, RandomAccessGetComponent)
+{
+    Runtime::init();
+    Runtime::timeline().addBlock("main");
+    Runtime::addModule<EntityManager>();
+
+    auto& em = *Runtime::getModule<EntityManager>();
+    em.components().registerComponent(EntityIDComponent::constructDescription());
+    em.components().registerComponent(ProfilingPosition::constructDescription());
+
+    constexpr size_t count = 1000000;
+    std::vector<EntityID> entities = em.createEntities(ComponentSet({ProfilingPosition::def()->id}), count);
+    // Leave some holes so recycled slots are part of the picture
+    for(size_t i = 0; i < count; i += 10)
+        em.destroyEntity(entities[i]);
+    for(size_t i = 0; i < count; i += 10)
+        entities[i] = em.createEntity(ComponentSet({ProfilingPosition::def()->id}));
+
+    std::mt19937 rng(1234);
+    std::shuffle(entities.begin(), entities.end(), rng);
+
+    Stopwatch existsTime;
+    size_t existing = 0;
+    for(EntityID entity : entities)
+        existing += em.entityExists(entity);
+    auto existsResult = existsTime.time<std::chrono::nanoseconds>() / count;
+
+    Stopwatch getTime;
+    float sum = 0;
+    for(EntityID entity : entities)
+        sum += em.getComponent<ProfilingPosition>(entity)->value.x;
+    auto getResult = getTime.time<std::chrono::nanoseconds>() / count;
+
+    std::cout << "Random access over " << count << " entities:\n"
+              << "  entityExists: " << existsResult << " nanoseconds average\n"
+              << "  getComponent<T>: " << getResult << " nanoseconds average" << std::endl;
+    EXPECT_EQ(existing, count);
+    EXPECT_EQ(sum, 0);
+
+    Runtime::cleanup();
+}
+
+TEST(ECS_Profiling, ChangedTRSRows)
+{
+    Runtime::init();
+    Runtime::timeline().addBlock("main");
+
+    // A static scene where 1% of the entities move each frame, with the transform system's TRS -> matrix pass
+    constexpr size_t count = 100000;
+    constexpr size_t moving = count / 100;
+    constexpr size_t frames = 50;
+    auto simulate = [&](bool trackRows, size_t& toMatCalls) {
+        TRS::constructDescription()->trackRowChanges = trackRows;
+        EntityManager em;
+        em.components().registerComponent(EntityIDComponent::constructDescription());
+        em.components().registerComponent(Transform::constructDescription());
+        em.components().registerComponent(TRS::constructDescription());
+        std::vector<EntityID> entities =
+            em.createEntities(ComponentSet({Transform::def()->id, TRS::def()->id}), count);
+
+        SystemContext ctx;
+        Query<Read<TRS>, Changed<TRS>, Write<Transform>> updateMatrices(&ctx);
+        auto frame = [&]() {
+            em.archetypes().rotateChangedRows(em.systems().globalVersion);
+            ctx.version = em.systems().globalVersion++;
+            updateMatrices.forEach(em, [&](const TRS& trs, Transform& t) {
+                t.value = trs.toMat();
+                ++toMatCalls;
+            });
+            ctx.lastVersion = ctx.version;
+        };
+        // Every entity is new on the first frame
+        frame();
+
+        std::mt19937 rng(1234);
+        std::uniform_int_distribution<size_t> pick(0, count - 1);
+        toMatCalls = 0;
+        Stopwatch sw;
+        for(size_t f = 0; f < frames; ++f)
+        {
+            for(size_t i = 0; i < moving; ++i)
+            {
+                EntityID entity = entities[pick(rng)];
+                em.getComponent<TRS>(entity)->translation.x += 1;
+                em.markComponentChanged(entity, TRS::def()->id);
+            }
+            frame();
+        }
+        return sw.time<std::chrono::microseconds>();
+    };
+
+    size_t chunkCalls;
+    size_t rowCalls;
+    auto chunkTime = simulate(false, chunkCalls);
+    auto rowTime = simulate(true, rowCalls);
+    TRS::constructDescription()->trackRowChanges = false;
+
+    std::cout << "Moving " << moving << " of " << count << " entities for " << frames << " frames:\n"
+              << "  chunk granularity: " << chunkCalls / frames << " TRS::toMat calls per frame, " << chunkTime
+              << "us\n"
+              << "  row granularity: " << rowCalls / frames << " TRS::toMat calls per frame, " << rowTime << "us"
+              << std::endl;
+    EXPECT_LT(rowCalls, chunkCalls);
+
+    Runtime::cleanup();
+}
+
+// Builds roots * (chain length) entities, each root has width chains of depth entities hanging off it
+static void buildHierarchy(EntityManager& em, size_t roots, size_t width, size_t depth)
+{
+    ComponentSet rootComponents({Transform::def()->id, TRS::def()->id});
+    ComponentSet childComponents({Transform::def()->id, LocalTransform::def()->id});
+    for(EntityID root : em.createEntities(rootComponents, roots))
+    {
+        em.getComponent<TRS>(root)->translation = {1, 0, 0};
+        std::vector<EntityID> children = em.createEntities(childComponents, width * depth);
+        for(size_t c = 0; c < width; ++c)
+        {
+            EntityID parent = root;
+            for(size_t d = 0; d < depth; ++d)
+            {
+                EntityID child = children[c * depth + d];
+                auto* lt = em.getComponent<LocalTransform>(child);
+                lt->parent = parent;
+                lt->value = glm::translate(glm::mat4(1), glm::vec3(0, 1, 0));
+                parent = child;
+            }
+        }
+    }
+}
+
+static void profileHierarchy(const std::string& name, size_t roots, size_t width, size_t depth)
+{
+    Runtime::init();
+    Runtime::timeline().addBlock("main");
+    EntityManager em;
+    em.components().registerComponent(EntityIDComponent::constructDescription());
+    em.components().registerComponent(Transform::constructDescription());
+    em.components().registerComponent(LocalTransform::constructDescription());
+    em.components().registerComponent(TRS::constructDescription());
+    buildHierarchy(em, roots, width, depth);
+    constexpr size_t runs = 10;
+
+    TransformSystem system;
+    Stopwatch buildTime;
+    system.run(em);
+    auto buildResult = buildTime.time<std::chrono::microseconds>();
+    Stopwatch levelTime;
+    for(size_t r = 0; r < runs; ++r)
+        system.run(em);
+    auto levelResult = levelTime.time<std::chrono::microseconds>() / runs;
+    EntityID last = EntityID{(uint32_t)(roots * (width * depth + 1) - 1), 0};
+    glm::mat4 expected = em.getComponent<Transform>(last)->value;
+
+    // What TransformSystem used to do, every transform is resolved through lookups up its parent chain
+    SystemContext ctx;
+    Query<Write<Transform>> markDirty(&ctx);
+    Query<Write<Transform>, Read<LocalTransform>> resolve(&ctx);
+    Stopwatch recursiveTime;
+    for(size_t r = 0; r < runs; ++r)
+    {
+        markDirty.forEach(em, [](Transform& t) { t.dirty = true; });
+        resolve.forEach(em, [&em](Transform& gt, const LocalTransform& lt) {
+            gt.value = Transforms::getParentTransform(lt.parent, em) * lt.value;
+            gt.dirty = false;
+        });
+    }
+    auto recursiveResult = recursiveTime.time<std::chrono::microseconds>() / runs;
+
+    std::cout << name << " hierarchy, " << roots * (width * depth + 1) << " entities, " << system.hierarchyLevels()
+              << " levels:\n"
+              << "  recursive lookups: " << recursiveResult << "us per run\n"
+              << "  level batches: " << levelResult << "us per run, " << buildResult << "us for the first run"
+              << std::endl;
+    EXPECT_EQ(system.hierarchyLevels(), depth + 1);
+    EXPECT_TRUE(em.getComponent<Transform>(last)->value == expected);
+
+    Runtime::cleanup();
+}
+
+TEST(ECS_Profiling, TransformHierarchy_Wide)
+{
+    profileHierarchy("Wide", 100, 1000, 1);
+}
+
+TEST(ECS_Profiling, TransformHierarchy_Deep)
+{
+    profileHierarchy("Deep", 1000, 1, 64);
+}
+
+TEST(ECS_Profiling, TransformKernels)
+{
+    constexpr size_t count = 2000;
+    constexpr size_t runs = 1000;
+    std::mt19937 rng(1234);
+    std::uniform_real_distribution<float> dist(-10, 10);
+    std::vector<TRS> trs(count);
+    for(auto& t : trs)
+    {
+        t.translation = {dist(rng), dist(rng), dist(rng)};
+        t.rotation = glm::normalize(glm::quat(dist(rng), dist(rng), dist(rng), dist(rng)));
+        t.scale = {dist(rng), dist(rng), dist(rng)};
+    }
+    std::vector<Transform> transforms(count);
+    std::vector<glm::mat4> products(count);
+    std::vector<const glm::mat4*> a(count), b(count);
+    for(size_t i = 0; i < count; ++i)
+    {
+        a[i] = &transforms[i].value;
+        b[i] = &transforms[(i * 7919) % count].value;
+    }
+
+    auto report = [&](const char* name, auto compose, auto multiply) {
+        Stopwatch composeTime;
+        for(size_t r = 0; r < runs; ++r)
+            compose();
+        auto composeResult = composeTime.time<std::chrono::microseconds>();
+        Stopwatch multiplyTime;
+        for(size_t r = 0; r < runs; ++r)
+            multiply();
+        auto multiplyResult = multiplyTime.time<std::chrono::microseconds>();
+        std::cout << "  " << name << ": " << count * runs / std::max<long long>(composeResult, 1)
+                  << " TRS composed/us, " << count * runs / std::max<long long>(multiplyResult, 1)
+                  << " matrices multiplied/us" << std::endl;
+    };
+
+    std::cout << count << " transforms, " << runs << " runs:" << std::endl;
+    report(
+        "glm",
+        [&]() {
+            for(size_t i = 0; i < count; ++i)
+                transforms[i].value = trs[i].toMat();
+        },
+        [&]() {
+            for(size_t i = 0; i < count; ++i)
+                products[i] = *a[i] * *b[i];
+        });
+    std::vector<glm::mat4> expected = products;
+
+    for(const TransformKernels* kernels : TransformKernels::available())
+    {
+        report(
+            kernels->name,
+            [&]() { kernels->composeTRS(trs.data(), &transforms[0].value, sizeof(Transform), count); },
+            [&]() { kernels->multiply(a.data(), b.data(), products.data(), count); });
+        for(size_t i = 0; i < count; i += 997)
+            EXPECT_NEAR(products[i][3][0], expected[i][3][0], 1e-2f);
+    }
+}
+
+TEST(ECS_Profiling, ChunkLayouts)
+{
+    Runtime::init();
+    Runtime::timeline().addBlock("main");
+    constexpr size_t count = 100000;
+    constexpr size_t runs = 20;
+
+    auto registerComponents = [](EntityManager& em) {
+        em.components().registerComponent(EntityIDComponent::constructDescription());
+        em.components().registerComponent(Transform::constructDescription());
+        em.components().registerComponent(TRS::constructDescription());
+        em.components().registerComponent(ProfilingPosition::constructDescription());
+        em.components().registerComponent(ProfilingVelocity::constructDescription());
+    };
+
+    // The transform system's TRS pass and a plain read-only walk over the matrices
+    std::cout << count << " entities with EntityIDComponent, Transform and TRS:" << std::endl;
+    for(size_t chunkSize : {4096, 16384, 65536, 262144})
+    {
+        for(size_t alignment : {1, 64})
+        {
+            EntityManager em;
+            registerComponents(em);
+            ChunkLayout layout;
+            layout.chunkSize = chunkSize;
+            layout.columnAlignment = alignment;
+            layout.minChunkSize = chunkSize;
+            em.archetypes().setChunkLayout(layout);
+            auto entities = em.createEntities(ComponentSet({Transform::def()->id, TRS::def()->id}), count);
+
+            SystemContext ctx;
+            Query<Read<TRS>, Write<Transform>> compose(&ctx);
+            Query<Read<Transform>> read(&ctx);
+            const TransformKernels& kernels = TransformKernels::active();
+            Stopwatch composeTime;
+            for(size_t r = 0; r < runs; ++r)
+            {
+                compose.forEachChunk(em, [&kernels](size_t n, const TRS* trs, Transform* t) {
+                    kernels.composeTRS(trs, &t->value, sizeof(Transform), n);
+                });
+            }
+            auto composeResult = composeTime.time<std::chrono::microseconds>() / runs;
+            float sum = 0;
+            Stopwatch readTime;
+            for(size_t r = 0; r < runs; ++r)
+                read.forEach(em, [&sum](const Transform& t) { sum += t.value[3][0]; });
+            auto readResult = readTime.time<std::chrono::microseconds>() / runs;
+
+            ArchetypeMemoryStats stats = em.getEntityArchetype(entities[0])->memoryStats();
+            std::cout << "  " << chunkSize << " byte chunks, " << alignment << " byte columns: " << composeResult
+                      << "us compose, " << readResult << "us read, " << stats.chunks << " chunks, "
+                      << stats.utilisation() * 100 << "% used" << std::endl;
+            EXPECT_EQ(sum, 0);
+        }
+    }
+
+    // Lots of archetypes with a handful of entities each, where full size chunks are mostly empty
+    std::vector<ComponentID> ids = {
+        Transform::def()->id, TRS::def()->id, ProfilingPosition::def()->id, ProfilingVelocity::def()->id};
+    for(size_t minChunkSize : {16384, 1024})
+    {
+        EntityManager em;
+        registerComponents(em);
+        ChunkLayout layout;
+        layout.minChunkSize = minChunkSize;
+        em.archetypes().setChunkLayout(layout);
+        for(size_t mask = 1; mask < (1u << ids.size()); ++mask)
+        {
+            ComponentSet components;
+            for(size_t c = 0; c < ids.size(); ++c)
+                if(mask & (1u << c))
+                    components.add(ids[c]);
+            em.createEntities(components, 4);
+        }
+        size_t allocated = 0;
+        size_t used = 0;
+        for(auto& arch : em.archetypes())
+        {
+            allocated += arch.memoryStats().allocatedBytes;
+            used += arch.memoryStats().usedBytes;
+        }
+        std::cout << "15 archetypes of 4 entities, first chunk of " << minChunkSize << " bytes: " << allocated
+                  << " bytes allocated for " << used << " used" << std::endl;
+    }
+
+    Runtime::cleanup();
+}
+
+TEST(ECS_Profiling, ColumnLookup)
+{
+    Runtime::init();
+    Runtime::timeline().addBlock("main");
+    Runtime::addModule<EntityManager>();
+
+    auto& em = *Runtime::getModule<EntityManager>();
+    em.components().registerComponent(EntityIDComponent::constructDescription());
+    em.components().registerComponent(ProfilingPosition::constructDescription());
+    em.components().registerComponent(ProfilingVelocity::constructDescription());
+    ComponentSet components({ProfilingPosition::def()->id, ProfilingVelocity::def()->id});
+    // Extra columns so finding a column isn't a lookup in a tiny table
+    for(size_t i = 0; i < 8; ++i)
+        components.add(em.components().createComponent({VirtualType::virtualFloat}, "filler"));
+    // Small chunks, so per chunk costs show up next to per entity ones
+    ChunkLayout layout;
+    layout.chunkSize = 2048;
+    layout.minChunkSize = 2048;
+    em.archetypes().setChunkLayout(layout);
+
+    constexpr size_t count = 100000;
+    constexpr size_t runs = 20;
+    std::vector<EntityID> entities;
+    entities.reserve(count);
+    Stopwatch createTime;
+    for(size_t i = 0; i < count; ++i)
+        entities.push_back(em.createEntity(components));
+    auto createResult = createTime.time<std::chrono::microseconds>();
+
+    SystemContext ctx;
+    ComponentFilter filter(&ctx);
+    filter.addComponent(ProfilingPosition::def()->id);
+    filter.addComponent(ProfilingVelocity::def()->id, ComponentFilterFlags_Const);
+    Stopwatch nativeTime;
+    for(size_t r = 0; r < runs; ++r)
+    {
+        em.getEntities(filter).forEachNative([](byte** c) {
+            auto* p = ProfilingPosition::fromVirtual(c[0]);
+            p->value = p->value + ProfilingVelocity::fromVirtual(c[1])->value;
+        });
+    }
+    auto nativeResult = nativeTime.time<std::chrono::microseconds>() / runs;
+
+    Query<Write<ProfilingPosition>, Read<ProfilingVelocity>> query(&ctx);
+    Stopwatch queryTime;
+    for(size_t r = 0; r < runs; ++r)
+        query.forEach(em, [](ProfilingPosition& p, const ProfilingVelocity& v) { p.value = p.value + v.value; });
+    auto queryResult = queryTime.time<std::chrono::microseconds>() / runs;
+
+    std::mt19937 rng(1234);
+    std::shuffle(entities.begin(), entities.end(), rng);
+    Stopwatch getTime;
+    float sum = 0;
+    for(EntityID entity : entities)
+        sum += em.getComponent<ProfilingVelocity>(entity)->value.x;
+    auto getResult = getTime.time<std::chrono::nanoseconds>() / count;
+    size_t columns = em.getEntityArchetype(entities[0])->components().size();
+
+    Stopwatch destroyTime;
+    for(EntityID entity : entities)
+        em.destroyEntity(entity);
+    auto destroyResult = destroyTime.time<std::chrono::microseconds>();
+
+    std::cout << count << " entities with " << columns << " components in "
+              << em.archetypes().chunkLayout().chunkSize << " byte chunks:\n"
+              << "  createEntity: " << createResult << "us\n"
+              << "  forEachNative: " << nativeResult << "us\n"
+              << "  Query::forEach: " << queryResult << "us\n"
+              << "  getComponent<T>: " << getResult << " nanoseconds average\n"
+              << "  destroyEntity: " << destroyResult << "us" << std::endl;
+    EXPECT_EQ(sum, 0);
+
+    Runtime::cleanup();
+}
+
+TEST(ECS_Profiling, ReadContention)
+{
+    constexpr size_t readers = 8;
+    auto runReaders = [](const std::function<void()>& read) {
+        std::vector<std::thread> threads;
+        Stopwatch time;
+        for(size_t t = 0; t < readers; ++t)
+            threads.emplace_back(read);
+        for(auto& thread : threads)
+            thread.join();
+        return time.time<std::chrono::microseconds>();
+    };
+
+    // Every reader hammering the same lock, the worst case for a column every system reads
+    constexpr size_t lockCount = 200000;
+    SharedRecursiveMutex mutex;
+    auto mutexResult = runReaders([&mutex]() {
+        for(size_t i = 0; i < lockCount; ++i)
+        {
+            mutex.lock_shared();
+            mutex.unlock_shared();
+        }
+    });
+    ColumnLock columnLock;
+    auto columnLockResult = runReaders([&columnLock]() {
+        for(size_t i = 0; i < lockCount; ++i)
+        {
+            columnLock.lockShared();
+            columnLock.unlockShared();
+        }
+    });
+
+    Runtime::init();
+    Runtime::timeline().addBlock("main");
+    Runtime::addModule<EntityManager>();
+
+    auto& em = *Runtime::getModule<EntityManager>();
+    em.components().registerComponent(EntityIDComponent::constructDescription());
+    em.components().registerComponent(ProfilingPosition::constructDescription());
+    em.components().registerComponent(ProfilingVelocity::constructDescription());
+    // Small chunks, so there are plenty of column locks to take
+    ChunkLayout layout;
+    layout.chunkSize = 2048;
+    layout.minChunkSize = 2048;
+    em.archetypes().setChunkLayout(layout);
+    constexpr size_t count = 100000;
+    constexpr size_t runs = 10;
+    em.createEntities(ComponentSet({ProfilingPosition::def()->id, ProfilingVelocity::def()->id}), count);
+
+    // Like a renderer and a replication pass reading the same components at once
+    auto queryReaders = [&em, &runReaders](bool scheduled) {
+        std::atomic<size_t> visited = 0;
+        auto time = runReaders([&em, &visited, scheduled]() {
+            SystemContext ctx;
+            if(scheduled)
+                ctx.unlockedReads = ComponentSet({ProfilingPosition::def()->id, ProfilingVelocity::def()->id});
+            Query<Read<ProfilingPosition>, Read<ProfilingVelocity>> query(&ctx);
+            size_t rows = 0;
+            float sum = 0;
+            for(size_t r = 0; r < runs; ++r)
+            {
+                query.forEachChunk(em, [&](size_t n, const ProfilingPosition* p, const ProfilingVelocity* v) {
+                    for(size_t i = 0; i < n; ++i)
+                        sum += p[i].value.x + v[i].value.x;
+                    rows += n;
+                });
+            }
+            EXPECT_EQ(sum, 0);
+            visited += rows;
+        });
+        EXPECT_EQ(visited, readers * runs * count);
+        return time;
+    };
+    auto lockedResult = queryReaders(false);
+    auto scheduledResult = queryReaders(true);
+
+    std::cout << readers << " readers, " << lockCount << " shared locks each on one lock:\n"
+              << "  SharedRecursiveMutex: " << mutexResult << "us\n"
+              << "  ColumnLock: " << columnLockResult << "us\n"
+              << readers << " readers, " << runs << " read-only queries each over " << count << " entities in "
+              << layout.chunkSize << " byte chunks:\n"
+              << "  column locks: " << lockedResult << "us\n"
+              << "  scheduled reads: " << scheduledResult << "us" << std::endl;
+
+    Runtime::cleanup();
+}
+
+TEST(ECS_Profiling, ComponentRelocation)
+{
+    Runtime::init();
+    Runtime::timeline().addBlock("main");
+    constexpr size_t count = 50000;
+
+    // Plain data only, and the same with a string column along for the ride
+    for(bool withString : {false, true})
+    {
+        EntityManager em;
+        em.components().registerComponent(EntityIDComponent::constructDescription());
+        em.components().registerComponent(Transform::constructDescription());
+        em.components().registerComponent(TRS::constructDescription());
+        em.components().registerComponent(ProfilingVelocity::constructDescription());
+        ComponentSet components({Transform::def()->id, TRS::def()->id});
+        if(withString)
+        {
+            components.add(
+                em.components().createComponent({VirtualType::virtualString, VirtualType::virtualFloat}, "Name"));
+        }
+
+        Stopwatch createTime;
+        std::vector<EntityID> entities = em.createEntities(components, count);
+        auto createResult = createTime.time<std::chrono::microseconds>();
+
+        // Every add and remove moves the entity to another archetype and fills its old slot from the back
+        Stopwatch migrateTime;
+        for(EntityID entity : entities)
+            em.addComponent<ProfilingVelocity>(entity);
+        for(EntityID entity : entities)
+            em.removeComponent(entity, ProfilingVelocity::def()->id);
+        auto migrateResult = migrateTime.time<std::chrono::microseconds>();
+
+        std::mt19937 rng(1234);
+        std::shuffle(entities.begin(), entities.end(), rng);
+        Stopwatch destroyTime;
+        for(EntityID entity : entities)
+            em.destroyEntity(entity);
+        auto destroyResult = destroyTime.time<std::chrono::microseconds>();
+
+        std::cout << count << " entities with Transform and TRS" << (withString ? " and a string" : "") << ":\n"
+                  << "  createEntities: " << createResult << "us\n"
+                  << "  add and remove a component: " << migrateResult << "us\n"
+                  << "  destroy in random order: " << destroyResult << "us" << std::endl;
+        EXPECT_TRUE(em.validate());
+    }
+
+    Runtime::cleanup();
+}
+
+TEST(ECS_Profiling, ChunkCompaction)
+{
+    Runtime::init();
+    Runtime::timeline().addBlock("main");
+    EntityManager em;
+    em.components().registerComponent(EntityIDComponent::constructDescription());
+    em.components().registerComponent(Transform::constructDescription());
+    em.components().registerComponent(TRS::constructDescription());
+    em.components().registerComponent(ProfilingPosition::constructDescription());
+    em.components().registerComponent(ProfilingVelocity::constructDescription());
+    ChunkLayout layout;
+    layout.minChunkSize = 1024;
+    em.archetypes().setChunkLayout(layout);
+
+    // A burst of entities across 15 archetypes that mostly dies off again, like a level unloading
+    std::vector<ComponentID> ids = {
+        Transform::def()->id, TRS::def()->id, ProfilingPosition::def()->id, ProfilingVelocity::def()->id};
+    std::vector<EntityID> entities;
+    for(size_t mask = 1; mask < (1u << ids.size()); ++mask)
+    {
+        ComponentSet components;
+        for(size_t c = 0; c < ids.size(); ++c)
+            if(mask & (1u << c))
+                components.add(ids[c]);
+        auto created = em.createEntities(components, 5000);
+        entities.insert(entities.end(), created.begin(), created.end());
+    }
+    for(size_t i = 0; i < entities.size(); ++i)
+        if(i % 500 != 0)
+            em.destroyEntity(entities[i]);
+
+    auto print = [&em](const char* when) {
+        auto stats = em.archetypes().memoryStats();
+        std::cout << "  " << when << ": " << stats.archetypes.allocatedBytes << " bytes in " << stats.archetypes.chunks
+                  << " chunks for " << stats.archetypes.usedBytes << " used, " << stats.archetypes.reclaimableBytes
+                  << " reclaimable, " << stats.pooledBytes << " pooled" << std::endl;
+    };
+    std::cout << entities.size() << " entities created, " << entities.size() / 500 << " kept:" << std::endl;
+    print("before compaction");
+    size_t steps = 0;
+    Stopwatch compactTime;
+    ArchetypeManager::CompactionStats stats;
+    do
+    {
+        stats = em.archetypes().compact(4);
+        ++steps;
+    } while(stats.chunksShrunk != 0 || stats.pooledBytesFreed != 0);
+    auto compactResult = compactTime.time<std::chrono::microseconds>();
+    print("after compaction");
+    std::cout << "  " << steps << " steps of 4 archetypes took " << compactResult << "us in total" << std::endl;
+    EXPECT_EQ(em.archetypes().memoryStats().archetypes.reclaimableBytes, 0);
+    ECS_VALIDATE(em);
+
+    Runtime::cleanup();
+}
+
+TEST(ECS_Profiling, ArchetypeTransitions)
+{
+    std::set<std::shared_ptr<ComponentDescription>> components;
+    for(size_t i = 0; i < 12; ++i)
+        components.insert(
+            std::make_unique<ComponentDescription>(std::vector<VirtualType::Type>{VirtualType::virtualBool}));
+
+    Runtime::init();
+    Runtime::timeline().addBlock("main");
+    EntityManager em;
+    em.components().registerComponent(EntityIDComponent::constructDescription());
+    ComponentSet allComponents;
+    std::vector<ComponentID> ids;
+    for(auto& c : components)
+    {
+        em.components().registerComponent(c.get());
+        allComponents.add(c->id);
+        ids.push_back(c->id);
+    }
+    std::unordered_set<ComponentSet> allSets;
+    allPossibleComponentSets(allComponents, allSets);
+
+    // One entity in every possible archetype, as in QueryCreation_WorstCase
+    Stopwatch createTime;
+    for(const ComponentSet& set : allSets)
+        em.createEntity(set);
+    auto createResult = createTime.time<std::chrono::microseconds>();
+    std::cout << "Creating " << allSets.size() << " archetypes took " << createResult << "us" << std::endl;
+
+    // Walk a single entity through the archetype graph by toggling random components. Every archetype it visits already
+    // holds an entity, so none are destroyed and the second walk only takes edges the first one built.
+    em.createEntity();
+    EntityID walker = em.createEntity();
+    std::vector<ComponentID> steps;
+    std::mt19937 gen(7);
+    std::uniform_int_distribution<size_t> pick(0, ids.size() - 1);
+    for(size_t i = 0; i < 100000; ++i)
+        steps.push_back(ids[pick(gen)]);
+
+    auto walk = [&]() {
+        Stopwatch walkTime;
+        for(ComponentID c : steps)
+        {
+            if(em.hasComponent(walker, c))
+                em.removeComponent(walker, c);
+            else
+                em.addComponent(walker, c);
+        }
+        return walkTime.time<std::chrono::microseconds>();
+    };
+    auto coldResult = walk();
+    auto warmResult = walk();
+    std::cout << steps.size() << " transitions took " << coldResult << "us on the first walk and " << warmResult
+              << "us on the second" << std::endl;
+    ECS_VALIDATE(em);
+
+    Runtime::cleanup();
+}
@@ -1,7 +1,12 @@
 #include <testing.h>
 #include <ecs/entity.h>
+#include <ecs/query.h>
 #include <ecs/structMembers.h>
+#include <systems/transformKernels.h>
+#include <systems/transforms.h>
 #include <utility/clock.h>
+#include <cstring>
+#include <random>
 
 TEST(ECS, VirtualComponentTest)
 {
@@ -39,6 +44,68 @@ TEST(ECS, VirtualComponentComplexTypesTest)
     EXPECT_EQ("Hello there! General Kenobi!", *vc.getVar<std::string>(0));
 }
 
+TEST(ECS, ComponentCopyPlanTest)
+{
+    ComponentDescription plain({VirtualType::virtualFloat, VirtualType::virtualQuat, VirtualType::virtualMat4});
+    ComponentDescription mixed({VirtualType::virtualFloat,
+                                VirtualType::virtualInt,
+                                VirtualType::virtualString,
+                                VirtualType::virtualVec3,
+                                VirtualType::virtualFloatArray});
+    EXPECT_TRUE(plain.pod());
+    EXPECT_FALSE(mixed.pod());
+
+    // Constructed in bulk, plain members still get their defaults
+    constexpr size_t count = 4;
+    std::vector<byte> plainColumn(plain.size() * count, 0xff);
+    plain.construct(plainColumn.data(), count);
+    for(size_t i = 0; i < count; ++i)
+    {
+        VirtualComponentView view(&plain, plainColumn.data() + plain.size() * i);
+        EXPECT_EQ(view.readVar<float>(0), 0);
+        EXPECT_EQ(view.readVar<glm::quat>(1), glm::quat(1, 0, 0, 0));
+        EXPECT_EQ(view.readVar<glm::mat4>(2), glm::mat4(1));
+    }
+
+    auto* columns = static_cast<byte*>(::operator new(mixed.size() * count * 2));
+    byte* src = columns;
+    byte* dest = columns + mixed.size() * count;
+    mixed.construct(src, count);
+    mixed.construct(dest, count);
+    for(size_t i = 0; i < count; ++i)
+    {
+        VirtualComponentView view(&mixed, src + mixed.size() * i);
+        EXPECT_EQ(view.readVar<float>(0), 0);
+        EXPECT_EQ(*view.getVar<std::string>(2), "");
+        view.setVar<float>(0, i);
+        view.setVar<int32_t>(1, -static_cast<int32_t>(i));
+        *view.getVar<std::string>(2) = "a string long enough to live on the heap " + std::to_string(i);
+        view.setVar(3, glm::vec3(i, 1, 2));
+        view.getVar<inlineFloatArray>(4)->push_back(i);
+    }
+    mixed.copy(src, dest, count);
+    for(size_t i = 0; i < count; ++i)
+    {
+        VirtualComponentView copied(&mixed, dest + mixed.size() * i);
+        EXPECT_EQ(copied.readVar<float>(0), i);
+        EXPECT_EQ(copied.readVar<int32_t>(1), -static_cast<int32_t>(i));
+        EXPECT_EQ(*copied.getVar<std::string>(2), "a string long enough to live on the heap " + std::to_string(i));
+        EXPECT_EQ(copied.readVar<glm::vec3>(3), glm::vec3(i, 1, 2));
+        EXPECT_EQ(copied.getVar<inlineFloatArray>(4)->size(), 1);
+        // A deep copy, the source keeps its own string
+        VirtualComponentView original(&mixed, src + mixed.size() * i);
+        EXPECT_NE(copied.getVar<std::string>(2)->data(), original.getVar<std::string>(2)->data());
+    }
+    mixed.deconstruct(dest, count);
+    mixed.construct(dest, count);
+    mixed.move(src, dest, count);
+    EXPECT_EQ(*VirtualComponentView(&mixed, dest + mixed.size() * 3).getVar<std::string>(2),
+              "a string long enough to live on the heap 3");
+    mixed.deconstruct(src, count);
+    mixed.deconstruct(dest, count);
+    ::operator delete(columns);
+}
+
 TEST(ECS, ArchetypeTest)
 {
     std::vector<VirtualType::Type> variables = {VirtualType::virtualString, VirtualType::virtualString};
@@ -105,6 +172,35 @@ TEST(ECS, NativeComponentTest)
     EXPECT_EQ(42 * 2, nc.var3);
 }
 
+TEST(ECS, ComponentSetTest)
+{
+    ComponentSet a({3, 700, 1, 64});
+    EXPECT_EQ(a.size(), 4);
+    std::vector<ComponentID> ids(a.begin(), a.end());
+    EXPECT_EQ(ids, (std::vector<ComponentID>{1, 3, 64, 700}));
+
+    // Signatures don't depend on insertion order
+    ComponentSet b;
+    for(ComponentID id : {64, 1, 700, 3})
+        b.add(id);
+    EXPECT_EQ(a.signature(), b.signature());
+    EXPECT_TRUE(a == b);
+
+    b.remove(700);
+    EXPECT_FALSE(a == b);
+    EXPECT_TRUE(a.contains(b));
+    EXPECT_FALSE(b.contains(a));
+    EXPECT_FALSE(b.contains(700));
+    b.add(700);
+    EXPECT_EQ(a.signature(), b.signature());
+
+    ComponentSet other({2, 701});
+    EXPECT_FALSE(a.intersects(other));
+    other.add(64);
+    EXPECT_TRUE(a.intersects(other));
+    EXPECT_FALSE(a.contains(ComponentSet()));
+}
+
 // TODO Create test for ChunkComponentView
 
 TEST(ECS, ChunkTest)
@@ -114,23 +210,208 @@ TEST(ECS, ChunkTest)
     std::shared_ptr<ChunkPool> cp = std::make_shared<ChunkPool>();
     *cp >> c;
 
-    TestNativeComponent::constructDescription();
-
-    TestNativeComponent2::constructDescription();
+    // Registering gives the components distinct ids
+    ComponentManager componentManager;
+    componentManager.registerComponent(TestNativeComponent::constructDescription());
+    componentManager.registerComponent(TestNativeComponent2::constructDescription());
 
     std::vector<const ComponentDescription*> components = {TestNativeComponent::def(), TestNativeComponent2::def()};
-    c->setComponents(components);
+    ColumnIndex index(components);
+    c->setComponents(index);
+
+    // Columns follow the order of the index
+    ASSERT_EQ(c->columns().size(), components.size());
+    for(size_t i = 0; i < components.size(); ++i)
+    {
+        EXPECT_EQ(index.find(components[i]->id), i);
+        EXPECT_EQ(&c->getComponent(components[i]->id), &c->column(i));
+    }
+    ComponentID missing = std::max(components[0]->id, components[1]->id) + 1;
+    EXPECT_EQ(index.find(missing), ColumnIndex::none);
+    EXPECT_FALSE(c->hasComponent(missing));
+    EXPECT_THROW(c->getComponent(missing), std::runtime_error);
+
+    // Columns start on cache lines, which can cost a few rows compared to packing them
+    ChunkLayout layout;
+    EXPECT_LE(c->maxCapacity(),
+              c->allocationSize() / (TestNativeComponent::def()->size() + TestNativeComponent2::def()->size()));
+    EXPECT_LE(layout.columnsSize(components, c->maxCapacity()), c->allocationSize());
+    EXPECT_GT(layout.columnsSize(components, c->maxCapacity() + 1), c->allocationSize());
+    c->createEntity();
+    for(auto& comp : components)
+        EXPECT_EQ((uintptr_t)c->getComponent(comp->id).getComponentData(0) % Chunk::maxAlignment, 0);
+    cp->release(std::move(c));
+}
 
-    EXPECT_EQ(c->
+TEST(ECS, ColumnLockTest)
+{
+    ColumnLock lock;
+    // The writer can lock again and read what it's writing
+    lock.lock();
+    lock.lock();
+    lock.lockShared();
+    lock.unlockShared();
+    lock.unlock();
+    lock.unlock();
+    // Readers nest
+    lock.lockShared();
+    lock.lockShared();
+    lock.unlockShared();
+    lock.unlockShared();
+
+    // Writers keep both values equal, readers must never see them differ
+    size_t a = 0;
+    size_t b = 0;
+    std::atomic<size_t> torn = 0;
+    std::vector<std::thread> threads;
+    for(size_t t = 0; t < 4; ++t)
+    {
+        threads.emplace_back([&, t]() {
+            for(size_t i = 0; i < 2000; ++i)
+            {
+                if(t % 2 == 0)
+                {
+                    lock.lock();
+                    ++a;
+                    std::this_thread::yield();
+                    ++b;
+                    lock.unlock();
+                }
+                else
+                {
+                    lock.lockShared();
+                    if(a != b)
+                        ++torn;
+                    lock.unlockShared();
+                }
+            }
+        });
+    }
+    for(auto& thread : threads)
+        thread.join();
+    EXPECT_EQ(torn, 0);
+    EXPECT_EQ(a, 4000);
+    EXPECT_EQ(b, 4000);
+}
 
-              maxCapacity(),
-              c
+TEST(ECS, ChunkLayoutTest)
+{
+    Runtime::init();
+    Runtime::timeline().addBlock("main");
+    EntityManager em;
+    em.components().registerComponent(EntityIDComponent::constructDescription());
+    em.components().registerComponent(TestNativeComponent::constructDescription());
+    em.components().registerComponent(TestNativeComponent2::constructDescription());
+
+    ChunkLayout layout;
+    layout.chunkSize = 8192;
+    layout.columnAlignment = 32;
+    layout.minChunkSize = 512;
+    em.archetypes().setChunkLayout(layout);
+
+    ComponentSet components({TestNativeComponent::def()->id, TestNativeComponent2::def()->id});
+    std::vector<EntityID> entities = em.createEntities(components, 3);
+    Archetype* arch = em.getEntityArchetype(entities[0]);
+    ASSERT_EQ(arch->chunks().size(), 1);
+    size_t firstSize = arch->chunks()[0]->allocationSize();
+    EXPECT_LE(firstSize, 512);
+    for(auto& view : arch->chunks()[0]->columns())
+        EXPECT_EQ((uintptr_t)view.getComponentData(0) % 32, 0);
+
+    // The only chunk grows in place until it reaches the full size, entities keep their values on the way
+    for(size_t i = 0; i < entities.size(); ++i)
+        em.getComponent<TestNativeComponent>(entities[i])->var2 = i;
+    std::vector<EntityID> more = em.createEntities(components, 500);
+    entities.insert(entities.end(), more.begin(), more.end());
+    EXPECT_GT(arch->chunks()[0]->allocationSize(), firstSize);
+    EXPECT_LE(arch->chunks()[0]->allocationSize(), layout.chunkSize);
+    for(size_t i = 0; i < 3; ++i)
+        EXPECT_EQ(em.getComponent<TestNativeComponent>(entities[i])->var2, i);
+    for(auto& chunk : arch->chunks())
+        EXPECT_EQ(chunk->maxCapacity(), arch->chunks()[0]->maxCapacity());
+
+    ArchetypeMemoryStats stats = arch->memoryStats();
+    EXPECT_EQ(stats.entities, entities.size());
+    EXPECT_EQ(stats.chunks, arch->chunks().size());
+    EXPECT_GE(stats.capacity, entities.size());
+    EXPECT_EQ(stats.usedBytes, entities.size() * arch->entitySize());
+    EXPECT_GT(stats.utilisation(), 0.5f);
+    EXPECT_LE(stats.utilisation(), 1.0f);
+    ECS_VALIDATE(em);
+
+    for(EntityID e : entities)
+        em.destroyEntity(e);
+    EXPECT_GT(em.archetypes().pooledChunkBytes(), 0);
+
+    // Layouts chunks can't grow through are rejected and leave the current one in place
+    ChunkLayout invalid = layout;
+    invalid.minChunkSize = 0;
+    EXPECT_THROW(em.archetypes().setChunkLayout(invalid), std::runtime_error);
+    invalid.minChunkSize = layout.chunkSize * 2;
+    EXPECT_THROW(em.archetypes().setChunkLayout(invalid), std::runtime_error);
+    EXPECT_EQ(em.archetypes().chunkLayout().minChunkSize, layout.minChunkSize);
 
-                      ->_data.
+    Runtime::cleanup();
+}
 
-                  size()
+TEST(ECS, CompactionTest)
+{
+    Runtime::init();
+    Runtime::timeline().addBlock("main");
+    EntityManager em;
+    em.components().registerComponent(EntityIDComponent::constructDescription());
+    em.components().registerComponent(TestNativeComponent::constructDescription());
+
+    ChunkLayout layout;
+    layout.chunkSize = 8192;
+    layout.minChunkSize = 512;
+    em.archetypes().setChunkLayout(layout);
+
+    std::vector<EntityID> entities = em.createEntities(ComponentSet({TestNativeComponent::def()->id}), 2000);
+    for(size_t i = 0; i < entities.size(); ++i)
+        em.getComponent<TestNativeComponent>(entities[i])->var2 = i;
+    Archetype* arch = em.getEntityArchetype(entities[0]);
+    EXPECT_GT(arch->chunks().size(), 1);
+    EXPECT_EQ(arch->memoryStats().reclaimableBytes, 0);
+
+    // Churn down to a handful of entities, which leaves one full size chunk behind
+    std::vector<EntityID> kept;
+    for(size_t i = 0; i < entities.size(); ++i)
+    {
+        if(i % 200 == 0)
+            kept.push_back(entities[i]);
+        else
+            em.destroyEntity(entities[i]);
+    }
+    ASSERT_EQ(arch->chunks().size(), 1);
+    EXPECT_EQ(arch->chunks()[0]->allocationSize(), arch->chunkAllocationSize(layout.chunkSize));
+    ArchetypeMemoryStats before = arch->memoryStats();
+    EXPECT_EQ(before.partialChunks, 1);
+    EXPECT_GT(before.reclaimableBytes, 0);
+    EXPECT_EQ(em.archetypes().memoryStats().archetypes.reclaimableBytes, before.reclaimableBytes);
+    EXPECT_GT(em.archetypes().pooledChunkBytes(), 0);
+
+    em.archetypes().setPoolHighWaterMark(0);
+    auto stats = em.archetypes().compact();
+    EXPECT_EQ(stats.chunksShrunk, 1);
+    EXPECT_EQ(stats.bytesReclaimed, before.reclaimableBytes);
+    EXPECT_GT(stats.pooledBytesFreed, 0);
+    EXPECT_EQ(em.archetypes().pooledChunkBytes(), 0);
+    EXPECT_EQ(arch->memoryStats().allocatedBytes, before.allocatedBytes - before.reclaimableBytes);
+    EXPECT_EQ(arch->memoryStats().reclaimableBytes, 0);
+    // The entities kept their slots and their values
+    ECS_VALIDATE(em);
+    for(size_t i = 0; i < kept.size(); ++i)
+        EXPECT_EQ(em.getComponent<TestNativeComponent>(kept[i])->var2, static_cast<int64_t>(i) * 200);
+
+    // Room to double before growing again, and nothing left to do on the next pass
+    EXPECT_GE(arch->chunks()[0]->maxCapacity(), kept.size() * 2);
+    EXPECT_EQ(em.archetypes().compact().chunksShrunk, 0);
+    em.createEntities(ComponentSet({TestNativeComponent::def()->id}), 1000);
+    ECS_VALIDATE(em);
+    EXPECT_EQ(em.getComponent<TestNativeComponent>(kept.back())->var2, static_cast<int64_t>(kept.size() - 1) * 200);
 
-                  / (TestNativeComponent::def()->size() + TestNativeComponent2::def()->size()));
+    Runtime::cleanup();
 }
 
 TEST(ECS, StructMembersTypesTest)
@@ -413,48 +694,1038 @@ TEST(ECS, ForEachTest)
     Runtime::cleanup();
 }
 
-// Revive this test when we once again add threading back into ECS, for now, let it rest in peace
-/*
+TEST(ECS, ForEachChunkTest)
+{
+    Runtime::init();
+    Runtime::timeline().addBlock("main");
+    EntityManager em;
+    em.components().registerComponent(EntityIDComponent::constructDescription());
+    em.components().registerComponent(TestNativeComponent::constructDescription());
+    em.components().registerComponent(TestNativeComponent2::constructDescription());
+
+    ComponentSet components;
+    components.add(TestNativeComponent::def()->id);
+    components.add(TestNativeComponent2::def()->id);
+    std::vector<EntityID> entities;
+    for(size_t i = 0; i < 1000; ++i)
+    {
+        EntityID e = em.createEntity(components);
+        em.getComponent<TestNativeComponent>(e)->var2 = i;
+        em.getComponent<TestNativeComponent2>(e)->var1 = i % 2;
+        entities.push_back(e);
+    }
+
+    SystemContext ctx;
+    ctx.version = 1;
+    ComponentFilter filter(&ctx);
+    filter.addComponent(TestNativeComponent::def()->id);
+    filter.addComponent(TestNativeComponent2::def()->id, ComponentFilterFlags_Const);
+
+    size_t visited = 0;
+    size_t chunks = 0;
+    em.getEntities(filter).forEachChunk([&](ChunkSpan<TestNativeComponent, const TestNativeComponent2>& span) {
+        auto c1 = span.get<TestNativeComponent>();
+        auto c2 = span.get<const TestNativeComponent2>();
+        EXPECT_EQ(c1.size(), span.size());
+        EXPECT_EQ(c2.size(), span.size());
+        for(size_t i = 0; i < span.size(); ++i)
+            c1[i].var3 = c2[i].var1 ? (float)c1[i].var2 : -1.0f;
+        visited += span.size();
+        ++chunks;
+    });
+    EXPECT_EQ(visited, entities.size());
+    EXPECT_GT(chunks, 1);
+
+    for(size_t i = 0; i < entities.size(); ++i)
+        EXPECT_EQ(em.getComponent<TestNativeComponent>(entities[i])->var3, i % 2 ? (float)i : -1.0f);
+
+    // Only the writable column should be marked as changed
+    Archetype* arch = em.getEntityArchetype(entities[0]);
+    for(auto& chunk : arch->chunks())
+    {
+        EXPECT_EQ(chunk->getComponent(TestNativeComponent::def()->id).version, 1);
+        EXPECT_NE(chunk->getComponent(TestNativeComponent2::def()->id).version, 1);
+    }
+
+    std::atomic<size_t> parallelVisited = 0;
+    em.getEntities(filter).forEachChunkParallel([&](ChunkSpan<TestNativeComponent, const TestNativeComponent2>& span) {
+        for(auto& c : span.get<TestNativeComponent>())
+            c.var2 *= 2;
+        parallelVisited += span.size();
+    });
+    EXPECT_EQ(parallelVisited, entities.size());
+    for(size_t i = 0; i < entities.size(); ++i)
+        EXPECT_EQ(em.getComponent<TestNativeComponent>(entities[i])->var2, i * 2);
+
+    Runtime::cleanup();
+}
+
+TEST(ECS, QueryTest)
+{
+    Runtime::init();
+    Runtime::timeline().addBlock("main");
+    EntityManager em;
+    em.components().registerComponent(EntityIDComponent::constructDescription());
+    em.components().registerComponent(TestNativeComponent::constructDescription());
+    em.components().registerComponent(TestNativeComponent2::constructDescription());
+
+    std::vector<EntityID> entities;
+    for(size_t i = 0; i < 100; ++i)
+    {
+        EntityID e = em.createEntity();
+        em.addComponent<TestNativeComponent>(e);
+        if(i % 2)
+            em.addComponent<TestNativeComponent2>(e);
+        em.getComponent<TestNativeComponent>(e)->var2 = i;
+        entities.push_back(e);
+    }
+
+    SystemContext ctx;
+    ctx.version = em.systems().globalVersion++;
+    Query<Read<EntityIDComponent>, Write<TestNativeComponent>, Without<TestNativeComponent2>> without(&ctx);
+    Query<Read<TestNativeComponent>, Write<TestNativeComponent2>> with(&ctx);
+    EXPECT_EQ(without.archetypeCount(em), 1);
+    EXPECT_EQ(with.archetypeCount(em), 1);
+
+    size_t visited = 0;
+    without.forEach(em, [&](const EntityIDComponent& id, TestNativeComponent& c) {
+        EXPECT_EQ(c.var2, (int64_t)id.id.id);
+        c.var3 = 1;
+        ++visited;
+    });
+    EXPECT_EQ(visited, 50);
+
+    with.forEach(em, [&](const TestNativeComponent& c, TestNativeComponent2& c2) { c2.var1 = c.var2 % 2; });
+    for(size_t i = 0; i < entities.size(); ++i)
+    {
+        if(i % 2)
+            EXPECT_TRUE(em.getComponent<TestNativeComponent2>(entities[i])->var1);
+        else
+            EXPECT_EQ(em.getComponent<TestNativeComponent>(entities[i])->var3, 1);
+    }
+
+    // Changed only matches chunks written to since the last run of the system
+    SystemContext changedCtx;
+    Query<Read<TestNativeComponent>, Changed<TestNativeComponent2>> changed(&changedCtx);
+    changedCtx.version = em.systems().globalVersion++;
+    visited = 0;
+    changed.forEach(em, [&](const TestNativeComponent&) { ++visited; });
+    EXPECT_EQ(visited, 50);
+    changedCtx.lastVersion = changedCtx.version;
+
+    changedCtx.version = em.systems().globalVersion++;
+    visited = 0;
+    changed.forEach(em, [&](const TestNativeComponent&) { ++visited; });
+    EXPECT_EQ(visited, 0);
+    changedCtx.lastVersion = changedCtx.version;
+
+    em.markComponentChanged(entities[1], TestNativeComponent2::def()->id);
+    changedCtx.version = em.systems().globalVersion++;
+    visited = 0;
+    changed.forEach(em, [&](const TestNativeComponent&) { ++visited; });
+    EXPECT_EQ(visited, 50);
+
+    // forEachChunk hands over whole chunks at once
+    visited = 0;
+    without.forEachChunk(em, [&](size_t count, const EntityIDComponent* ids, TestNativeComponent* c) {
+        for(size_t i = 0; i < count; ++i)
+            EXPECT_EQ(c[i].var2, (int64_t)ids[i].id.id);
+        visited += count;
+    });
+    EXPECT_EQ(visited, 50);
+
+    std::vector<std::pair<size_t, size_t>> runs;
+    uint64_t rows[2] = {0b0111'0000'0011ull | (1ull << 63), 0b1 | (0b11ull << 8)};
+    forEachSetRange(rows, 70, [&](size_t begin, size_t end) { runs.emplace_back(begin, end); });
+    EXPECT_EQ(runs, (std::vector<std::pair<size_t, size_t>>{{0, 2}, {8, 11}, {63, 65}}));
+
+    // The cached archetype list has to be refreshed once archetypes are created or destroyed
+    for(size_t i = 1; i < entities.size(); i += 2)
+        em.removeComponent<TestNativeComponent2>(entities[i]);
+    EXPECT_EQ(with.archetypeCount(em), 0);
+    visited = 0;
+    without.forEach(em, [&](const EntityIDComponent&, TestNativeComponent&) { ++visited; });
+    EXPECT_EQ(visited, 100);
+
+    Runtime::cleanup();
+}
+
+TEST(ECS, QueryCacheTest)
+{
+    Runtime::init();
+    Runtime::timeline().addBlock("main");
+    EntityManager em;
+    em.components().registerComponent(EntityIDComponent::constructDescription());
+    em.components().registerComponent(TestNativeComponent::constructDescription());
+    em.components().registerComponent(TestNativeComponent2::constructDescription());
+
+    EntityID e1 = em.createEntity();
+    em.addComponent<TestNativeComponent>(e1);
+
+    SystemContext ctx;
+    ComponentFilter filter(&ctx);
+    filter.addComponent(TestNativeComponent::def()->id);
+    ComponentFilter excludeFilter(&ctx);
+    excludeFilter.addComponent(TestNativeComponent::def()->id, ComponentFilterFlags_Const);
+    excludeFilter.addComponent(TestNativeComponent2::def()->id, ComponentFilterFlags_Exclude);
+
+    auto& archetypes = em.archetypes();
+    EXPECT_EQ(em.getEntities(filter).archetypeCount(), 1);
+    EXPECT_EQ(archetypes.queryCacheStats().misses, 1);
+    EXPECT_EQ(em.getEntities(filter).archetypeCount(), 1);
+    EXPECT_EQ(archetypes.queryCacheStats().hits, 1);
+
+    // Flags other than exclude don't change which archetypes match, so they shouldn't create a new entry
+    ComponentFilter constFilter(&ctx);
+    constFilter.addComponent(TestNativeComponent::def()->id, ComponentFilterFlags_Const);
+    EXPECT_EQ(em.getEntities(constFilter).archetypeCount(), 1);
+    EXPECT_EQ(archetypes.queryCacheStats().hits, 2);
+    EXPECT_EQ(em.getEntities(excludeFilter).archetypeCount(), 1);
+    EXPECT_EQ(archetypes.queryCacheStats().misses, 2);
+    EXPECT_EQ(archetypes.queryCacheStats().entries, 2);
+
+    // New archetypes are added to the cached lists they match
+    EntityID e2 = em.createEntity();
+    em.addComponent<TestNativeComponent>(e2);
+    em.addComponent<TestNativeComponent2>(e2);
+    EXPECT_EQ(em.getEntities(filter).archetypeCount(), 2);
+    EXPECT_EQ(em.getEntities(excludeFilter).archetypeCount(), 1);
+
+    // And removed when destroyed
+    em.destroyEntity(e1);
+    EXPECT_EQ(em.getEntities(filter).archetypeCount(), 1);
+    EXPECT_EQ(em.getEntities(excludeFilter).archetypeCount(), 0);
+    EXPECT_EQ(archetypes.queryCacheStats().misses, 2);
+
+    Runtime::cleanup();
+}
+
+TEST(ECS, ArchetypeEdgeTest)
+{
+    Runtime::init();
+    Runtime::timeline().addBlock("main");
+    EntityManager em;
+    em.components().registerComponent(EntityIDComponent::constructDescription());
+    em.components().registerComponent(TestNativeComponent::constructDescription());
+    em.components().registerComponent(TestNativeComponent2::constructDescription());
+    ComponentID c1 = TestNativeComponent::def()->id;
+    ComponentID c2 = TestNativeComponent2::def()->id;
+
+    // Creating archetypes doesn't link them, even when they're only one component apart
+    EntityID base = em.createEntity();
+    EntityID other = em.createEntity(ComponentSet({c1}));
+    Archetype* baseArch = em.getEntityArchetype(base);
+    Archetype* c1Arch = em.getEntityArchetype(other);
+    EXPECT_TRUE(baseArch->addEdges().empty());
+    EXPECT_TRUE(c1Arch->removeEdges().empty());
+
+    // The first transition builds the edge in both directions
+    EntityID e = em.createEntity();
+    em.addComponent(e, c1);
+    EXPECT_EQ(em.getEntityArchetype(e), c1Arch);
+    ASSERT_EQ(baseArch->addEdges().size(), 1);
+    EXPECT_EQ(baseArch->addEdge(c1), c1Arch);
+    ASSERT_EQ(c1Arch->removeEdges().size(), 1);
+    EXPECT_EQ(c1Arch->removeEdge(c1), baseArch);
+    EXPECT_EQ(em.archetypes().removeTransition(c1Arch, c1), baseArch);
+    EXPECT_EQ(em.archetypes().addTransition(baseArch, c1), c1Arch);
+
+    // Transitions to new archetypes create them
+    em.addComponent(e, c2);
+    Archetype* bothArch = em.getEntityArchetype(e);
+    EXPECT_EQ(c1Arch->addEdge(c2), bothArch);
+    EXPECT_EQ(bothArch->removeEdge(c2), c1Arch);
+
+    // Destroying an archetype unlinks every edge that points at it
+    em.removeComponent(e, c2);
+    EXPECT_EQ(c1Arch->addEdge(c2), nullptr);
+    em.destroyEntity(base);
+    EXPECT_TRUE(c1Arch->removeEdges().empty());
+    EXPECT_TRUE(c1Arch->addEdges().empty());
+    ECS_VALIDATE(em);
+
+    // Removing the last component leads nowhere
+    EntityID empty = em.createEntity();
+    EXPECT_EQ(em.archetypes().removeTransition(em.getEntityArchetype(empty), EntityIDComponent::def()->id), nullptr);
+
+    Runtime::cleanup();
+}
+
+TEST(ECS, EntityCommandBufferTest)
+{
+    Runtime::init();
+    Runtime::timeline().addBlock("main");
+
+    std::vector<VirtualType::Type> variables(1, VirtualType::virtualUInt64);
+    ComponentDescription aComponent(variables);
+    ComponentDescription bComponent(variables);
+
+    EntityManager em;
+    em.components().registerComponent(EntityIDComponent::constructDescription());
+    em.components().registerComponent(&aComponent);
+    em.components().registerComponent(&bComponent);
+
+    const size_t recorders = 4096;
+    std::vector<EntityID> entities;
+    for(size_t i = 0; i < recorders; ++i)
+        entities.push_back(em.createEntity(ComponentSet({aComponent.id})));
+
+    // Every job records into the same buffer at once
+    EntityCommandBuffer commands;
+    std::vector<std::function<void()>> jobs;
+    for(size_t i = 0; i < recorders; ++i)
+    {
+        jobs.emplace_back([&, i]() {
+            EntityID entity = entities[i];
+            switch(i % 4)
+            {
+                case 0:
+                    commands.destroyEntity(entity);
+                    break;
+                case 1:
+                    commands.addComponent(entity, bComponent.id);
+                    break;
+                case 2:
+                {
+                    VirtualComponent b(&bComponent);
+                    b.setVar<uint64_t>(0, i);
+                    commands.setComponent(entity, std::move(b));
+                    break;
+                }
+                case 3:
+                    commands.addComponent(entity, bComponent.id);
+                    commands.removeComponent(entity, aComponent.id);
+                    break;
+            }
+            VirtualComponent created(&bComponent);
+            created.setVar<uint64_t>(0, recorders + i);
+            commands.createEntity(std::vector<VirtualComponent>{std::move(created)});
+        });
+    }
+    ThreadPool::enqueueBatch(std::move(jobs))->finish();
+    EXPECT_EQ(commands.size(), recorders * 2 + recorders / 4);
+
+    // Nothing is applied until playback
+    EXPECT_TRUE(em.entityExists(entities[0]));
+    EXPECT_FALSE(em.hasComponent(entities[1], bComponent.id));
+
+    commands.playback(em);
+    EXPECT_TRUE(commands.empty());
+
+    for(size_t i = 0; i < recorders; ++i)
+    {
+        EntityID entity = entities[i];
+        switch(i % 4)
+        {
+            case 0:
+                EXPECT_FALSE(em.entityExists(entity));
+                break;
+            case 1:
+                EXPECT_TRUE(em.hasComponent(entity, aComponent.id));
+                EXPECT_TRUE(em.hasComponent(entity, bComponent.id));
+                break;
+            case 2:
+                EXPECT_TRUE(em.hasComponent(entity, aComponent.id));
+                EXPECT_EQ(em.getComponent(entity, bComponent.id).readVar<uint64_t>(0), i);
+                break;
+            case 3:
+                EXPECT_FALSE(em.hasComponent(entity, aComponent.id));
+                EXPECT_TRUE(em.hasComponent(entity, bComponent.id));
+                break;
+        }
+    }
+
+    // Every index must still point at the right slot after all the swaps
+    EXPECT_TRUE(em.validate());
+
+    SystemContext ctx;
+    ComponentFilter onlyB(&ctx);
+    onlyB.addComponent(bComponent.id, ComponentFilterFlags_Const);
+    onlyB.addComponent(aComponent.id, ComponentFilterFlags_Exclude);
+    size_t createdCount = 0;
+    em.getEntities(onlyB).forEachNative([&](byte* components[]) {
+        if(VirtualComponentView(&bComponent, components[0]).readVar<uint64_t>(0) >= recorders)
+            ++createdCount;
+    });
+    EXPECT_EQ(createdCount, recorders);
+    EXPECT_EQ(em._entities.size(), recorders * 2 - recorders / 4);
+
+    // Commands for entities that were destroyed before playback are dropped
+    commands.addComponent(entities[0], bComponent.id);
+    commands.destroyEntity(entities[1]);
+    commands.addComponent(entities[1], bComponent.id);
+    commands.playback(em);
+    EXPECT_FALSE(em.entityExists(entities[1]));
+    EXPECT_EQ(em._entities.size(), recorders * 2 - recorders / 4 - 1);
+
+    // Removing a component twice, or one the entity never had, leaves its set intact
+    EntityID entity = entities[2];
+    commands.removeComponent(entity, bComponent.id);
+    commands.removeComponent(entity, bComponent.id);
+    commands.removeComponent(entities[7], aComponent.id);
+    commands.playback(em);
+    EXPECT_TRUE(em.hasComponent(entity, aComponent.id));
+    EXPECT_FALSE(em.hasComponent(entity, bComponent.id));
+    EXPECT_FALSE(em.hasComponent(entities[7], aComponent.id));
+    EXPECT_TRUE(em.hasComponent(entities[7], bComponent.id));
+    EXPECT_EQ(em.getEntityArchetype(entity)->components(), ComponentSet({EntityIDComponent::def()->id, aComponent.id}));
+    EXPECT_TRUE(em.validate());
+
+    Runtime::cleanup();
+}
+
+TEST(ECS, BatchedMigrationTest)
+{
+    Runtime::init();
+    Runtime::timeline().addBlock("main");
+
+    // The string member means this one can't be relocated with memcpy
+    std::vector<VirtualType::Type> variables = {VirtualType::virtualUInt64, VirtualType::virtualString};
+    ComponentDescription valueComponent(variables);
+    std::vector<VirtualType::Type> tagVariables = {VirtualType::virtualBool};
+    ComponentDescription tagComponent(tagVariables);
+    EXPECT_FALSE(valueComponent.pod());
+    EXPECT_TRUE(tagComponent.pod());
+
+    EntityManager em;
+    em.components().registerComponent(EntityIDComponent::constructDescription());
+    em.components().registerComponent(&valueComponent);
+    em.components().registerComponent(&tagComponent);
+
+    // Enough to span several chunks
+    const size_t count = 2000;
+    std::vector<EntityID> entities;
+    for(size_t i = 0; i < count; ++i)
+    {
+        EntityID entity = em.createEntity(ComponentSet({valueComponent.id}));
+        VirtualComponent value(&valueComponent);
+        value.setVar<uint64_t>(0, i);
+        value.setVar<std::string>(1, std::to_string(i));
+        em.setComponent(entity, value);
+        entities.push_back(entity);
+    }
+
+    auto checkEntities = [&]() {
+        EXPECT_TRUE(em.validate());
+        for(size_t i = 0; i < count; ++i)
+        {
+            VirtualComponentView value = em.getComponent(entities[i], valueComponent.id);
+            EXPECT_EQ(value.readVar<uint64_t>(0), i);
+            EXPECT_EQ(*value.getVar<std::string>(1), std::to_string(i));
+        }
+    };
+
+    // A contiguous block, a scattered set and a duplicate
+    std::vector<EntityID> selected;
+    for(size_t i = 100; i < 1100; ++i)
+        selected.push_back(entities[i]);
+    for(size_t i = 1100; i < count; i += 3)
+        selected.push_back(entities[i]);
+    selected.push_back(entities[100]);
+
+    em.addComponents(selected, tagComponent.id);
+    checkEntities();
+    for(size_t i = 0; i < count; ++i)
+    {
+        bool expected = (i >= 100 && i < 1100) || (i >= 1100 && (i - 1100) % 3 == 0);
+        EXPECT_EQ(em.hasComponent(entities[i], tagComponent.id), expected);
+    }
+
+    // Entities that already have the component are skipped
+    em.addComponents(entities, tagComponent.id);
+    checkEntities();
+    for(EntityID entity : entities)
+        EXPECT_TRUE(em.hasComponent(entity, tagComponent.id));
+
+    std::vector<EntityID> firstHalf(entities.begin(), entities.begin() + count / 2);
+    em.removeComponents(firstHalf, tagComponent.id);
+    checkEntities();
+    for(size_t i = 0; i < count; ++i)
+        EXPECT_EQ(em.hasComponent(entities[i], tagComponent.id), i >= count / 2);
+
+    Runtime::cleanup();
+}
+
+TEST(ECS, BulkSpawnTest)
+{
+    Runtime::init();
+    Runtime::timeline().addBlock("main");
+
+    std::vector<VirtualType::Type> variables = {VirtualType::virtualUInt64, VirtualType::virtualString};
+    ComponentDescription valueComponent(variables);
+    std::vector<VirtualType::Type> floatVariables = {VirtualType::virtualFloat};
+    ComponentDescription floatComponent(floatVariables);
+
+    EntityManager em;
+    em.components().registerComponent(EntityIDComponent::constructDescription());
+    em.components().registerComponent(&valueComponent);
+    em.components().registerComponent(&floatComponent);
+
+    // Spans several chunks
+    const size_t count = 3000;
+    VirtualComponent prototype(&valueComponent);
+    prototype.setVar<uint64_t>(0, 42);
+    prototype.setVar<std::string>(1, "prototype");
+    std::vector<EntityID> copies = em.createEntities(std::vector<VirtualComponent>{prototype}, count);
+    ASSERT_EQ(copies.size(), count);
+
+    std::vector<float> floats(count);
+    for(size_t i = 0; i < count; ++i)
+        floats[i] = static_cast<float>(i);
+    size_t writes = 0;
+    std::vector<EntityID> columns = em.createEntities(
+        ComponentSet({valueComponent.id, floatComponent.id}),
+        count,
+        [&](const ComponentDescription* def, size_t first, size_t n, byte* dest) {
+        ++writes;
+        if(def == &floatComponent)
+            std::memcpy(dest, floats.data() + first, sizeof(float) * n);
+        else
+        {
+            for(size_t i = 0; i < n; ++i)
+                VirtualComponentView(def, dest + def->size() * i).setVar<uint64_t>(0, first + i);
+        }
+    });
+    // One call per column per chunk, not per entity
+    EXPECT_LT(writes, count / 10);
+
+    ComponentID idComponent = EntityIDComponent::def()->id;
+    for(size_t i = 0; i < count; ++i)
+    {
+        ASSERT_TRUE(em.entityExists(copies[i]));
+        EXPECT_EQ(em.getComponent(copies[i], idComponent).readVar<EntityID>(0), copies[i]);
+        VirtualComponentView value = em.getComponent(copies[i], valueComponent.id);
+        EXPECT_EQ(value.readVar<uint64_t>(0), 42);
+        EXPECT_EQ(*value.getVar<std::string>(1), "prototype");
+
+        ASSERT_TRUE(em.entityExists(columns[i]));
+        EXPECT_EQ(em.getComponent(columns[i], idComponent).readVar<EntityID>(0), columns[i]);
+        EXPECT_EQ(em.getComponent(columns[i], valueComponent.id).readVar<uint64_t>(0), i);
+        EXPECT_EQ(em.getComponent(columns[i], floatComponent.id).readVar<float>(0), static_cast<float>(i));
+    }
+
+    // Bulk spawned entities can be destroyed like any other, which relies on their ids having been written
+    for(size_t i = 0; i < count; i += 2)
+        em.destroyEntity(columns[i]);
+    for(size_t i = 1; i < count; i += 2)
+        EXPECT_EQ(em.getComponent(columns[i], valueComponent.id).readVar<uint64_t>(0), i);
+    EXPECT_TRUE(em.validate());
+
+    Runtime::cleanup();
+}
+
+TEST(ECS, ValidateTest)
+{
+    Runtime::init();
+    Runtime::timeline().addBlock("main");
+    EntityManager em;
+    em.components().registerComponent(EntityIDComponent::constructDescription());
+    em.components().registerComponent(TestNativeComponent::constructDescription());
+
+    std::vector<EntityID> entities;
+    for(size_t i = 0; i < 10; ++i)
+        entities.push_back(em.createEntity(ComponentSet({TestNativeComponent::def()->id})));
+    em.destroyEntity(entities[3]);
+    EXPECT_TRUE(em.validate());
+
+    // Two entities pointing at the same slot
+    size_t index = em._entities[entities[5].id].index;
+    em._entities[entities[5].id].index = em._entities[entities[6].id].index;
+    EXPECT_FALSE(em.validate());
+    em._entities[entities[5].id].index = index;
+    EXPECT_TRUE(em.validate());
+
+    // A slot no entity points at
+    em._entities.remove(entities[7].id);
+    EXPECT_FALSE(em.validate());
+
+    Runtime::cleanup();
+}
+
+class TrackedComponent : public NativeComponent<TrackedComponent>
+{
+    REGISTER_MEMBERS_1("TrackedComponent", value, "value")
+  public:
+    int64_t value;
+};
+
+class TrackedComponent2 : public NativeComponent<TrackedComponent2>
+{
+    REGISTER_MEMBERS_1("TrackedComponent2", value, "value")
+  public:
+    int64_t value;
+};
+
+TEST(ECS, RowChangeTrackingTest)
+{
+    Runtime::init();
+    Runtime::timeline().addBlock("main");
+    TrackedComponent::constructDescription()->trackRowChanges = true;
+    TrackedComponent2::constructDescription()->trackRowChanges = true;
+    EntityManager em;
+    em.components().registerComponent(EntityIDComponent::constructDescription());
+    em.components().registerComponent(TrackedComponent::def());
+    em.components().registerComponent(TrackedComponent2::def());
+
+    ComponentSet components;
+    components.add(TrackedComponent::def()->id);
+    components.add(TrackedComponent2::def()->id);
+    std::vector<EntityID> entities = em.createEntities(components, 2000);
+    Archetype* arch = em.getEntityArchetype(entities[0]);
+    ASSERT_GT(arch->chunks().size(), 1);
+
+    // Runs a query over changed TrackedComponents once per frame, like a system would
+    SystemContext ctx;
+    Query<Read<EntityIDComponent>, Changed<TrackedComponent>> changed(&ctx);
+    std::vector<EntityID> visited;
+    auto frame = [&]() {
+        em.archetypes().rotateChangedRows(em.systems().globalVersion);
+        visited.clear();
+        ctx.version = em.systems().globalVersion++;
+        changed.forEach(em, [&](const EntityIDComponent& id) { visited.push_back(id.id); });
+        ctx.lastVersion = ctx.version;
+        std::sort(visited.begin(), visited.end(), [](EntityID a, EntityID b) { return a.id < b.id; });
+    };
+
+    // Newly created entities count as changed. Rows stay marked for the frame they changed in and the one after, since
+    // the bits don't record whether a change happened before or after the system ran.
+    frame();
+    EXPECT_EQ(visited.size(), entities.size());
+    frame();
+    frame();
+    EXPECT_TRUE(visited.empty());
+
+    // Only the touched entities are visited, not the rest of their chunks
+    em.markComponentChanged(entities[3], TrackedComponent::def()->id);
+    em.markComponentChanged(entities[1500], TrackedComponent::def()->id);
+    TrackedComponent value;
+    value.value = 5;
+    em.setComponent(entities[1999], value.toVirtual());
+    frame();
+    EXPECT_EQ(visited, std::vector<EntityID>({entities[3], entities[1500], entities[1999]}));
+    frame();
+    frame();
+    EXPECT_TRUE(visited.empty());
+
+    // Reading doesn't count as a change, for either granularity
+    SystemContext readerCtx;
+    readerCtx.version = em.systems().globalVersion++;
+    ComponentFilter readFilter(&readerCtx);
+    readFilter.addComponent(TrackedComponent::def()->id, ComponentFilterFlags_Const);
+    size_t read = 0;
+    em.getEntities(readFilter).forEachNative([&](byte**) { ++read; });
+    EXPECT_EQ(read, entities.size());
+    for(auto& chunk : arch->chunks())
+        EXPECT_NE(chunk->getComponent(TrackedComponent::def()->id).version, readerCtx.version);
+    frame();
+    EXPECT_TRUE(visited.empty());
+
+    // Destroying an entity moves the last one into its row, which has to keep its changed bit
+    em.markComponentChanged(entities[1999], TrackedComponent::def()->id);
+    em.destroyEntity(entities[1998]);
+    frame();
+    EXPECT_EQ(visited, std::vector<EntityID>({entities[1999]}));
+    frame();
+
+    // A writer filtered by changed rows only marks the rows it visited
+    SystemContext writerCtx;
+    writerCtx.lastVersion = em.systems().globalVersion++;
+    Query<Write<TrackedComponent>, Changed<TrackedComponent2>> writer(&writerCtx);
+    em.markComponentChanged(entities[10], TrackedComponent2::def()->id);
+    em.markComponentChanged(entities[1000], TrackedComponent2::def()->id);
+    writerCtx.version = em.systems().globalVersion++;
+    size_t written = 0;
+    writer.forEach(em, [&](TrackedComponent& c) {
+        c.value = 1;
+        ++written;
+    });
+    EXPECT_EQ(written, 2);
+    frame();
+    EXPECT_EQ(visited, std::vector<EntityID>({entities[10], entities[1000]}));
+    frame();
+    frame();
+
+    // A system that missed more than a frame can't rely on the bits anymore and visits every entity of changed chunks
+    em.markComponentChanged(entities[20], TrackedComponent::def()->id);
+    em.archetypes().rotateChangedRows(em.systems().globalVersion);
+    em.archetypes().rotateChangedRows(em.systems().globalVersion++);
+    visited.clear();
+    ctx.version = em.systems().globalVersion++;
+    changed.forEach(em, [&](const EntityIDComponent& id) { visited.push_back(id.id); });
+    EXPECT_EQ(visited.size(), arch->chunks()[0]->size());
+
+    Runtime::cleanup();
+}
+
+TEST(ECS, CompactionRowChangesTest)
+{
+    Runtime::init();
+    Runtime::timeline().addBlock("main");
+    TrackedComponent::constructDescription()->trackRowChanges = true;
+    EntityManager em;
+    em.components().registerComponent(EntityIDComponent::constructDescription());
+    em.components().registerComponent(TrackedComponent::def());
+    ChunkLayout layout;
+    layout.chunkSize = 8192;
+    layout.minChunkSize = 512;
+    em.archetypes().setChunkLayout(layout);
+
+    std::vector<EntityID> entities = em.createEntities(ComponentSet({TrackedComponent::def()->id}), 2000);
+    std::vector<EntityID> kept;
+    for(size_t i = 0; i < entities.size(); ++i)
+    {
+        if(i % 200 == 0)
+            kept.push_back(entities[i]);
+        else
+            em.destroyEntity(entities[i]);
+    }
+
+    SystemContext ctx;
+    Query<Read<EntityIDComponent>, Changed<TrackedComponent>> changed(&ctx);
+    std::vector<EntityID> visited;
+    auto frame = [&]() {
+        em.archetypes().rotateChangedRows(em.systems().globalVersion);
+        visited.clear();
+        ctx.version = em.systems().globalVersion++;
+        changed.forEach(em, [&](const EntityIDComponent& id) { visited.push_back(id.id); });
+        ctx.lastVersion = ctx.version;
+    };
+    frame();
+    frame();
+    frame();
+    EXPECT_TRUE(visited.empty());
+
+    // Shrinking moves every row into a new chunk, but only the row that was actually changed is reported
+    em.markComponentChanged(kept[3], TrackedComponent::def()->id);
+    em.archetypes().setPoolHighWaterMark(0);
+    EXPECT_EQ(em.archetypes().compact().chunksShrunk, 1);
+    frame();
+    EXPECT_EQ(visited, std::vector<EntityID>({kept[3]}));
+    frame();
+    frame();
+    EXPECT_TRUE(visited.empty());
+    ECS_VALIDATE(em);
+
+    Runtime::cleanup();
+}
+
+TEST(ECS, TransformHierarchyTest)
+{
+    Runtime::init();
+    Runtime::timeline().addBlock("main");
+    EntityManager em;
+    em.components().registerComponent(EntityIDComponent::constructDescription());
+    em.components().registerComponent(Transform::constructDescription());
+    em.components().registerComponent(LocalTransform::constructDescription());
+    em.components().registerComponent(TRS::constructDescription());
+    em.components().registerComponent(Children::constructDescription());
+    auto system = std::make_unique<TransformSystem>();
+    TransformSystem* transforms = system.get();
+    em.systems().addSystem("transform", std::move(system));
+
+    ComponentSet components({Transform::def()->id, TRS::def()->id});
+    auto spawn = [&](float x) {
+        EntityID e = em.createEntity(components);
+        em.getComponent<TRS>(e)->translation = {x, 0, 0};
+        em.getComponent<TRS>(e)->scale = {1, 2, 1};
+        return e;
+    };
+    // A chain hanging off one root and a few children on another, parented in an order that doesn't match depth
+    EntityID rootA = spawn(1);
+    EntityID rootB = spawn(100);
+    std::vector<EntityID> chain;
+    for(size_t i = 0; i < 8; ++i)
+        chain.push_back(spawn((float)i));
+    for(size_t i = chain.size() - 1; i > 0; --i)
+        Transforms::setParent(chain[i], chain[i - 1], em, false);
+    Transforms::setParent(chain[0], rootA, em, false);
+    std::vector<EntityID> wide;
+    for(size_t i = 0; i < 10; ++i)
+    {
+        wide.push_back(spawn((float)i));
+        Transforms::setParent(wide.back(), rootB, em, false);
+    }
+
+    auto expectWorld = [&](EntityID entity, const glm::mat4& parentWorld) {
+        glm::mat4 world = parentWorld * em.getComponent<TRS>(entity)->toMat();
+        EXPECT_TRUE(em.getComponent<Transform>(entity)->value == world);
+        return world;
+    };
+    auto check = [&]() {
+        glm::mat4 world = expectWorld(rootA, glm::mat4(1));
+        for(EntityID e : chain)
+            world = expectWorld(e, world);
+        glm::mat4 rootWorld = expectWorld(rootB, glm::mat4(1));
+        for(EntityID e : wide)
+            expectWorld(e, rootWorld);
+    };
+
+    em.systems().runSystems(em);
+    EXPECT_EQ(transforms->hierarchyLevels(), chain.size() + 1);
+    check();
+
+    // Parented transforms are only marked changed when they actually moved
+    SystemContext ctx;
+    Query<Read<EntityIDComponent>, Read<LocalTransform>, Changed<Transform>> moved(&ctx);
+    auto countMoved = [&]() {
+        size_t count = 0;
+        moved.forEach(em, [&](const EntityIDComponent&, const LocalTransform&) { ++count; });
+        return count;
+    };
+    ctx.lastVersion = em.systems().globalVersion;
+    em.systems().runSystems(em);
+    EXPECT_EQ(countMoved(), 0);
+
+    // Moving a root moves everything below it
+    ctx.lastVersion = em.systems().globalVersion;
+    em.getComponent<TRS>(rootA)->translation = {5, 5, 5};
+    em.markComponentChanged(rootA, TRS::def()->id);
+    em.getComponent<TRS>(chain[3])->rotation = glm::quat(0, 1, 0, 0);
+    em.markComponentChanged(chain[3], TRS::def()->id);
+    em.systems().runSystems(em);
+    check();
+    EXPECT_GE(countMoved(), chain.size());
+
+    // Reparenting half the chain onto the other root changes the levels
+    Transforms::setParent(chain[4], rootB, em, false);
+    em.systems().runSystems(em);
+    EXPECT_EQ(transforms->hierarchyLevels(), 5);
+    glm::mat4 world = expectWorld(rootA, glm::mat4(1));
+    for(size_t i = 0; i < 4; ++i)
+        world = expectWorld(chain[i], world);
+    world = expectWorld(rootB, glm::mat4(1));
+    for(size_t i = 4; i < chain.size(); ++i)
+        world = expectWorld(chain[i], world);
+
+    // Children of a destroyed parent are treated as roots
+    em.destroyEntity(rootB);
+    em.systems().runSystems(em);
+    for(EntityID e : wide)
+        expectWorld(e, glm::mat4(1));
+
+    Runtime::cleanup();
+}
+
+TEST(ECS, TransformKernelsTest)
+{
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<float> dist(-10, 10);
+    std::vector<TRS> trs(37);
+    for(auto& t : trs)
+    {
+        t.translation = {dist(rng), dist(rng), dist(rng)};
+        t.rotation = glm::normalize(glm::quat(dist(rng), dist(rng), dist(rng), dist(rng)));
+        t.scale = {dist(rng), dist(rng), dist(rng)};
+    }
+
+    std::vector<glm::mat4> a(trs.size()), b(trs.size());
+    std::vector<const glm::mat4*> aPtrs, bPtrs;
+    for(size_t i = 0; i < trs.size(); ++i)
+    {
+        a[i] = trs[i].toMat();
+        b[i] = trs[(i + 1) % trs.size()].toMat();
+        aPtrs.push_back(&a[i]);
+        bPtrs.push_back(&b[i]);
+    }
+
+    auto expectNear = [](const glm::mat4& value, const glm::mat4& expected) {
+        for(int c = 0; c < 4; ++c)
+        {
+            for(int r = 0; r < 4; ++r)
+                EXPECT_NEAR(value[c][r], expected[c][r], 1e-4f * std::max(1.0f, std::abs(expected[c][r])));
+        }
+    };
+
+    // Odd sizes so the scalar tails of the vector versions get used, and a stride like a component column's
+    for(const TransformKernels* kernels : TransformKernels::available())
+    {
+        SCOPED_TRACE(kernels->name);
+        std::vector<Transform> composed(trs.size());
+        kernels->composeTRS(trs.data(), &composed[0].value, sizeof(Transform), trs.size());
+        for(size_t i = 0; i < trs.size(); ++i)
+        {
+            expectNear(composed[i].value, trs[i].toMat());
+            EXPECT_TRUE(composed[i].dirty);
+        }
+
+        std::vector<glm::mat4> products(trs.size());
+        kernels->multiply(aPtrs.data(), bPtrs.data(), products.data(), products.size());
+        for(size_t i = 0; i < trs.size(); ++i)
+            expectNear(products[i], a[i] * b[i]);
+    }
+}
+
+class SyntheticSystem : public System
+{
+  public:
+    struct Run
+    {
+        std::chrono::steady_clock::time_point start;
+        std::chrono::steady_clock::time_point end;
+        std::thread::id thread;
+        ComponentSet unlockedReads;
+    };
+
+    SystemAccess _access;
+    Run* _run;
+
+    SyntheticSystem(SystemAccess access, Run* run) : _access(std::move(access)), _run(run) {}
+
+    void run(EntityManager&) override
+    {
+        _run->start = std::chrono::steady_clock::now();
+        _run->thread = std::this_thread::get_id();
+        _run->unlockedReads = _ctx.unlockedReads;
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+        _run->end = std::chrono::steady_clock::now();
+    }
+
+    SystemAccess access() const override { return _access; }
+};
+
+TEST(ECS, SystemSchedulerTest)
+{
+    Runtime::init();
+    Runtime::timeline().addBlock("main");
+
+    EntityManager em;
+    ComponentID a = 1, b = 2, c = 3, d = 4;
+    auto access = [](std::vector<ComponentID> reads, std::vector<ComponentID> writes) {
+        SystemAccess access;
+        for(ComponentID id : reads)
+            access.reads.add(id);
+        for(ComponentID id : writes)
+            access.writes.add(id);
+        return access;
+    };
+    SystemAccess exclusive;
+    exclusive.exclusive = true;
+
+    std::vector<std::pair<std::string, SystemAccess>> systems = {
+        {"writeA", access({}, {a})},
+        {"writeB", access({}, {b})},
+        {"writeC", access({}, {c})},
+        {"readA", access({a}, {})},
+        {"readA2", access({a}, {})},
+        {"readAB", access({a, b}, {})},
+        {"readB", access({b}, {})},
+        {"readC", access({c}, {})},
+        {"writeA2", access({}, {a})},
+        {"readD", access({d}, {})},
+        {"readD2", access({d}, {})},
+        {"exclusive", exclusive},
+    };
+    std::unordered_map<std::string, SyntheticSystem::Run> runs;
+    for(auto& [name, sysAccess] : systems)
+        em.systems().addSystem(name, std::make_unique<SyntheticSystem>(sysAccess, &runs[name]));
+    // Doesn't share any components, so the ordering can only come from the explicit dependency
+    EXPECT_TRUE(em.systems().addDependency("readD", "readC"));
+
+    em.systems().runSystems(em);
+
+    auto before = [&](const std::string& first, const std::string& second) {
+        return runs[first].end <= runs[second].start;
+    };
+    EXPECT_TRUE(before("writeA", "readA"));
+    EXPECT_TRUE(before("writeA", "readA2"));
+    EXPECT_TRUE(before("writeA", "readAB"));
+    EXPECT_TRUE(before("writeB", "readAB"));
+    EXPECT_TRUE(before("writeB", "readB"));
+    EXPECT_TRUE(before("writeC", "readC"));
+    EXPECT_TRUE(before("readA", "writeA2"));
+    EXPECT_TRUE(before("readA2", "writeA2"));
+    EXPECT_TRUE(before("readAB", "writeA2"));
+    EXPECT_TRUE(before("readC", "readD"));
+    for(auto& [name, sysAccess] : systems)
+    {
+        if(name != "exclusive")
+        {
+            EXPECT_TRUE(before(name, "exclusive")) << name;
+        }
+    }
+    EXPECT_EQ(runs["exclusive"].thread, ThreadPool::main_thread_id);
+    // Declared reads skip column locks while the system runs, exclusive systems declare nothing
+    EXPECT_EQ(runs["readAB"].unlockedReads, ComponentSet({a, b}));
+    EXPECT_EQ(runs["writeA"].unlockedReads.size(), 0);
+    EXPECT_EQ(runs["exclusive"].unlockedReads.size(), 0);
+
+    const auto& stats = em.systems().scheduleStats();
+    EXPECT_EQ(stats.systems, 12);
+    EXPECT_EQ(stats.edges, 22);
+    // writeA -> readA -> writeA2 -> exclusive
+    EXPECT_EQ(stats.criticalPath, 4);
+    EXPECT_EQ(stats.exclusiveSystems, 1);
+    std::cout << "Ran " << stats.systems << " systems in " << stats.wallTime / 1000 << "us, " << stats.systemTime / 1000
+              << "us of system time" << std::endl;
+    // Run one after another this would take 12 sleeps, the critical path is only 4
+    EXPECT_LT(stats.wallTime, stats.systemTime * 3 / 4);
+
+    // Systems added later are picked up by the next run
+    SyntheticSystem::Run lateRun;
+    em.systems().addSystem("lateWriteD", std::make_unique<SyntheticSystem>(access({}, {d}), &lateRun));
+    em.systems().runSystems(em);
+    EXPECT_EQ(em.systems().scheduleStats().systems, 13);
+    EXPECT_TRUE(runs["readD2"].end <= lateRun.start);
+
+    Runtime::cleanup();
+}
+
 TEST(ECS, ForEachParellelTest)
 {
     Runtime::init();
-    //Create two for each ID one for entities with one component, another for those with two
+    Runtime::timeline().addBlock("main");
 
     std::vector<VirtualType::Type> variables(4, VirtualType::virtualUInt64);
-
     ComponentDescription counterComponent(variables);
+
     EntityManager em;
     em.components().registerComponent(EntityIDComponent::constructDescription());
     em.components().registerComponent(&counterComponent);
 
-#ifdef _DEBUG
-    size_t instances = 200000;
+#ifndef NDEBUG
+    size_t instances = 20000;
 #else
-    //Try to make it so this takes 1 second
-    size_t instances = 20000000;
+    size_t instances = 2000000;
 #endif
 
     em.createEntities(ComponentSet({counterComponent.id}), instances);
+
+    SystemContext ctx;
+    ComponentFilter filter(&ctx);
+    filter.addComponent(counterComponent.id);
+
     Stopwatch sw;
-    em.forEach({counterComponent.id}, [&](byte *components[]) {
+    em.getEntities(filter).forEachNative([&](byte* components[]) {
         VirtualComponentView counter = VirtualComponentView(&counterComponent, components[0]);
-        counter.setVar(0, 64);
+        counter.setVar<uint64_t>(0, 64);
     });
-    long long time = sw.time();
-    std::cout << "For Each took: " << time << std::endl;
+    long long time = sw.time<std::chrono::microseconds>();
+    std::cout << "For Each took: " << time << "us" << std::endl;
 
     Stopwatch sw2;
-    em.forEachParallel({counterComponent.id}, [&](byte *components[]) {
+    em.getEntities(filter).forEachParallel([&](byte* components[]) {
         VirtualComponentView counter = VirtualComponentView(&counterComponent, components[0]);
-        counter.setVar(0, 420);
-    }, instances / 12)->finish();
-    time = sw2.time();
-    std::cout << "For Each Parallel took: " << time << std::endl;
+        counter.setVar<uint64_t>(0, counter.readVar<uint64_t>(0) + 356);
+    });
+    time = sw2.time<std::chrono::microseconds>();
+    std::cout << "For Each Parallel took: " << time << "us" << std::endl;
+
+    em.getEntities(filter).forEachChunkParallel([&](byte* components[], size_t count) {
+        for(size_t i = 0; i < count; ++i)
+        {
+            VirtualComponentView counter(&counterComponent, components[0] + counterComponent.size() * i);
+            counter.setVar<uint64_t>(1, 1);
+        }
+    });
+
+    size_t visited = 0;
+    em.getEntities(filter).forEachNative([&](byte* components[]) {
+        VirtualComponentView counter = VirtualComponentView(&counterComponent, components[0]);
+        EXPECT_EQ(counter.readVar<uint64_t>(0), 420);
+        EXPECT_EQ(counter.readVar<uint64_t>(1), 1);
+        ++visited;
+    });
+    EXPECT_EQ(visited, instances);
 
-    for (size_t i = 0; i < instances; i++)
-    {
-        VirtualComponent c = em.getComponent(i, counterComponent.id);
-        EXPECT_EQ(*c.getVar<size_t>(0), 420) << "entitiy: " << i << std::endl;
-    }
     Runtime::cleanup();
-}*/
+}
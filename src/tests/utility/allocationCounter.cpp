@@ -0,0 +1,76 @@
+#include "allocationCounter.h"
+#include <atomic>
+#include <cstdlib>
+#include <algorithm>
+#include <new>
+
+// Every form of operator new and delete is replaced, so whatever a test allocates with is counted and freed by the
+// matching function. They live in their own translation unit so the compiler can't see malloc and free through them
+// and flag them as mismatched with the new expressions that call them.
+
+static std::atomic<size_t> allocations = 0;
+
+size_t allocationCount() { return allocations.load(std::memory_order_relaxed); }
+
+static void* countedAlloc(size_t size, size_t alignment) noexcept
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if(alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__)
+        return std::malloc(size ? size : 1);
+    // aligned_alloc wants a size that is a multiple of the alignment
+    size = (std::max<size_t>(size, 1) + alignment - 1) & ~(alignment - 1);
+    return std::aligned_alloc(alignment, size);
+}
+
+static void* countedAllocOrThrow(size_t size, size_t alignment)
+{
+    if(void* ptr = countedAlloc(size, alignment))
+        return ptr;
+    throw std::bad_alloc();
+}
+
+void* operator new(size_t size) { return countedAllocOrThrow(size, 0); }
+
+void* operator new[](size_t size) { return countedAllocOrThrow(size, 0); }
+
+void* operator new(size_t size, std::align_val_t al) { return countedAllocOrThrow(size, static_cast<size_t>(al)); }
+
+void* operator new[](size_t size, std::align_val_t al) { return countedAllocOrThrow(size, static_cast<size_t>(al)); }
+
+void* operator new(size_t size, const std::nothrow_t&) noexcept { return countedAlloc(size, 0); }
+
+void* operator new[](size_t size, const std::nothrow_t&) noexcept { return countedAlloc(size, 0); }
+
+void* operator new(size_t size, std::align_val_t al, const std::nothrow_t&) noexcept
+{
+    return countedAlloc(size, static_cast<size_t>(al));
+}
+
+void* operator new[](size_t size, std::align_val_t al, const std::nothrow_t&) noexcept
+{
+    return countedAlloc(size, static_cast<size_t>(al));
+}
+
+void operator delete(void* ptr) noexcept { std::free(ptr); }
+
+void operator delete[](void* ptr) noexcept { std::free(ptr); }
+
+void operator delete(void* ptr, size_t) noexcept { std::free(ptr); }
+
+void operator delete[](void* ptr, size_t) noexcept { std::free(ptr); }
+
+void operator delete(void* ptr, std::align_val_t) noexcept { std::free(ptr); }
+
+void operator delete[](void* ptr, std::align_val_t) noexcept { std::free(ptr); }
+
+void operator delete(void* ptr, size_t, std::align_val_t) noexcept { std::free(ptr); }
+
+void operator delete[](void* ptr, size_t, std::align_val_t) noexcept { std::free(ptr); }
+
+void operator delete(void* ptr, const std::nothrow_t&) noexcept { std::free(ptr); }
+
+void operator delete[](void* ptr, const std::nothrow_t&) noexcept { std::free(ptr); }
+
+void operator delete(void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { std::free(ptr); }
+
+void operator delete[](void* ptr, std::align_val_t, const std::nothrow_t&) noexcept { std::free(ptr); }
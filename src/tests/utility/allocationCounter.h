@@ -0,0 +1,6 @@
+#pragma once
+#include <cstddef>
+
+// Allocations made through any form of global operator new since the test binary started, so the profiling tests can
+// see what the job system allocates
+size_t allocationCount();
@@ -1,14 +1,766 @@
+#include <algorithm>
+#include <cmath>
+#include "utility/clock.h"
+#include "utility/taskGraph.h"
 #include "utility/threadPool.h"
+#include "allocationCounter.h"
 #include "testing.h"
 
 TEST(Threading, ThreadPoolTest)
 {
     ThreadPool::init(4);
     std::atomic_bool testBool = false;
-    std::shared_ptr<JobHandle> jh = ThreadPool::enqueue([&]() { testBool = true; });
+    JobHandlePtr jh = ThreadPool::enqueue([&]() { testBool = true; });
     jh->finish();
 
     ThreadPool::cleanup();
 
     EXPECT_TRUE(testBool);
 }
+
+TEST(Threading, WorkStealingDequeTest)
+{
+    WorkStealingDeque<size_t> deque(4);
+    std::vector<size_t> values(64);
+    for(size_t i = 0; i < values.size(); ++i)
+        values[i] = i;
+
+    // The owner takes the newest item, thieves the oldest, and the buffer grows past its starting capacity
+    for(size_t i = 0; i < 8; ++i)
+        deque.push(&values[i]);
+    EXPECT_EQ(*deque.pop(), 7);
+    EXPECT_EQ(*deque.steal(), 0);
+    EXPECT_EQ(*deque.steal(), 1);
+    EXPECT_EQ(*deque.pop(), 6);
+    while(deque.pop())
+        ;
+    EXPECT_TRUE(deque.empty());
+    EXPECT_EQ(deque.steal(), nullptr);
+
+    // Every item is taken exactly once while thieves race the owner
+    std::vector<std::atomic<size_t>> taken(100000);
+    std::vector<size_t> items(taken.size());
+    for(size_t i = 0; i < items.size(); ++i)
+        items[i] = i;
+    std::atomic_bool done = false;
+    std::vector<std::thread> thieves;
+    for(size_t t = 0; t < 3; ++t)
+    {
+        thieves.emplace_back([&]() {
+            while(!done || !deque.empty())
+                if(size_t* item = deque.steal())
+                    taken[*item]++;
+        });
+    }
+    for(size_t i = 0; i < items.size(); ++i)
+    {
+        deque.push(&items[i]);
+        if(i % 3 == 0)
+            if(size_t* item = deque.pop())
+                taken[*item]++;
+    }
+    while(size_t* item = deque.pop())
+        taken[*item]++;
+    done = true;
+    for(auto& thief : thieves)
+        thief.join();
+    for(auto& count : taken)
+        EXPECT_EQ(count, 1);
+}
+
+static void spawnTree(size_t depth, std::atomic<size_t>& leaves, JobHandlePtr& handle)
+{
+    if(depth == 0)
+    {
+        leaves++;
+        return;
+    }
+    for(size_t i = 0; i < 2; ++i)
+        ThreadPool::enqueue([depth, &leaves, &handle]() { spawnTree(depth - 1, leaves, handle); }, handle);
+}
+
+TEST(Threading, NestedJobsTest)
+{
+    ThreadPool::init(4);
+    std::atomic<size_t> leaves = 0;
+    auto handle = JobHandle::create();
+    ThreadPool::enqueue([&]() { spawnTree(12, leaves, handle); }, handle);
+    handle->finish();
+    EXPECT_EQ(leaves, 1 << 12);
+
+    // Batches submitted from outside the pool
+    std::atomic<size_t> ran = 0;
+    std::vector<std::function<void()>> jobs;
+    for(size_t i = 0; i < 1000; ++i)
+        jobs.emplace_back([&ran]() { ran++; });
+    ThreadPool::enqueueBatch(std::move(jobs))->finish();
+    EXPECT_EQ(ran, 1000);
+
+    ThreadPool::cleanup();
+}
+
+TEST(Threading, ParallelForTest)
+{
+    ThreadPool::init(4);
+    const size_t count = 10000;
+    std::vector<std::atomic<uint32_t>> visits(count);
+    std::atomic<size_t> largestPiece = 0;
+    ThreadPool::parallelFor(0, count, 7, [&](size_t begin, size_t end) {
+        size_t piece = end - begin;
+        size_t largest = largestPiece.load();
+        while(piece > largest && !largestPiece.compare_exchange_weak(largest, piece))
+            ;
+        for(size_t i = begin; i < end; ++i)
+            visits[i]++;
+    });
+    EXPECT_LE(largestPiece, 7);
+    for(auto& v : visits)
+        EXPECT_EQ(v, 1);
+
+    // Automatic grain, and parallelFor called from inside jobs that are themselves split up
+    for(auto& v : visits)
+        v = 0;
+    ThreadPool::parallelFor(0, 10, 1, [&](size_t outerBegin, size_t outerEnd) {
+        for(size_t o = outerBegin; o < outerEnd; ++o)
+        {
+            ThreadPool::parallelFor(o * 1000, (o + 1) * 1000, 0, [&](size_t begin, size_t end) {
+                for(size_t i = begin; i < end; ++i)
+                    visits[i]++;
+            });
+        }
+    });
+    for(auto& v : visits)
+        EXPECT_EQ(v, 1);
+
+    bool ran = false;
+    ThreadPool::parallelFor(5, 5, 1, [&](size_t, size_t) { ran = true; });
+    EXPECT_FALSE(ran);
+
+    // A piece that throws, wherever it runs, surfaces on the caller only after every started piece has finished
+    for(size_t thrower : {size_t(0), count / 2, count - 1})
+    {
+        std::atomic<size_t> running = 0;
+        auto piece = [&](size_t begin, size_t end) {
+            ++running;
+            std::this_thread::yield();
+            --running;
+            if(begin <= thrower && thrower < end)
+                throw std::runtime_error("piece failed");
+        };
+        EXPECT_THROW(ThreadPool::parallelFor(0, count, 7, piece), std::runtime_error);
+        EXPECT_EQ(running, 0);
+    }
+    // The pool still works afterwards
+    std::atomic<size_t> total = 0;
+    ThreadPool::parallelFor(0, count, 0, [&](size_t begin, size_t end) { total += end - begin; });
+    EXPECT_EQ(total, count);
+
+    ThreadPool::cleanup();
+}
+
+TEST(Threading, ParallelReduceTest)
+{
+    ThreadPool::init(4);
+    const size_t count = 100000;
+    auto sum = ThreadPool::parallelReduce<size_t>(
+        0,
+        count,
+        64,
+        0,
+        [](size_t begin, size_t end) {
+            size_t s = 0;
+            for(size_t i = begin; i < end; ++i)
+                s += i;
+            return s;
+        },
+        [](size_t a, size_t b) { return a + b; });
+    EXPECT_EQ(sum, count * (count - 1) / 2);
+
+    // Floating point addition isn't associative enough to hide a scheduling dependent order
+    auto floatSum = [](size_t begin, size_t end) {
+        float s = 0;
+        for(size_t i = begin; i < end; ++i)
+            s += 1.0f / static_cast<float>(i + 1);
+        return s;
+    };
+    auto add = [](float a, float b) { return a + b; };
+    float first = ThreadPool::parallelReduce<float>(0, count, 100, 0.0f, floatSum, add);
+    for(size_t i = 0; i < 10; ++i)
+        EXPECT_EQ(ThreadPool::parallelReduce<float>(0, count, 100, 0.0f, floatSum, add), first);
+
+    // Order of the fold is preserved
+    auto joined = ThreadPool::parallelReduce<std::string>(
+        0,
+        26,
+        3,
+        "",
+        [](size_t begin, size_t end) {
+            std::string s;
+            for(size_t i = begin; i < end; ++i)
+                s += static_cast<char>('a' + i);
+            return s;
+        },
+        [](std::string a, std::string b) { return a + b; });
+    EXPECT_EQ(joined, "abcdefghijklmnopqrstuvwxyz");
+
+    ThreadPool::cleanup();
+}
+
+TEST(Threading, ThenContinuationsTest)
+{
+    ThreadPool::init(4);
+    std::atomic<size_t> ran = 0;
+    std::atomic_bool release = false;
+    auto handle = ThreadPool::enqueue([&]() {
+        while(!release)
+            std::this_thread::yield();
+    });
+    // Every continuation runs, and waiting on the returned handle waits for all of them
+    JobHandlePtr next;
+    for(size_t i = 0; i < 8; ++i)
+        next = handle->then([&]() { ran++; });
+    EXPECT_FALSE(next->finished());
+    release = true;
+    next->finish();
+    EXPECT_EQ(ran, 8);
+
+    // Continuations added after the handle finished still run
+    handle->then([&]() { ran++; })->finish();
+    EXPECT_EQ(ran, 9);
+
+    // Chained continuations
+    std::atomic<size_t> stage = 0;
+    auto last = ThreadPool::enqueue([&]() { stage = 1; })->then([&]() { stage = stage == 1 ? 2 : 0; })->then([&]() {
+        stage = stage == 2 ? 3 : 0;
+    });
+    last->finish();
+    EXPECT_EQ(stage, 3);
+
+    ThreadPool::cleanup();
+}
+
+TEST(Threading, ConditionJobTest)
+{
+    ThreadPool::init(4);
+    const size_t signals = 1000;
+    std::atomic<size_t> fired = 0;
+    auto job = ThreadPool::conditionalEnqueue([&]() { fired++; }, signals);
+    auto handle = JobHandle::create();
+    for(size_t i = 0; i < signals; ++i)
+        ThreadPool::enqueue([job]() { job->signal(); }, handle);
+    handle->finish();
+    while(fired == 0)
+        std::this_thread::yield();
+    EXPECT_EQ(fired, 1);
+
+    ThreadPool::cleanup();
+}
+
+TEST(Threading, TaskGraphDiamondTest)
+{
+    ThreadPool::init(4);
+    // a -> (b, c) -> d, checked over many runs of the same graph
+    std::atomic<size_t> a = 0, b = 0, c = 0, d = 0;
+    std::atomic<size_t> errors = 0;
+    TaskGraph graph;
+    auto ta = graph.addTask([&]() { a++; });
+    auto tb = graph.addTask([&]() {
+        if(b >= a)
+            errors++;
+        b++;
+    });
+    auto tc = graph.addTask([&]() {
+        if(c >= a)
+            errors++;
+        c++;
+    });
+    auto td = graph.addTask([&]() {
+        if(d >= b || d >= c)
+            errors++;
+        d++;
+    });
+    graph.addDependency(ta, tb);
+    graph.addDependency(ta, tc);
+    graph.addDependency(tb, td);
+    graph.addDependency(tc, td);
+
+    const size_t runs = 2000;
+    for(size_t i = 0; i < runs; ++i)
+        graph.runAndWait();
+    EXPECT_EQ(errors, 0);
+    EXPECT_EQ(d, runs);
+
+    // Diamonds stacked on top of each other, the join of each one is the fork of the next
+    TaskGraph stacked;
+    const size_t layers = 50;
+    std::vector<std::atomic<size_t>> counts(layers * 3 + 1);
+    auto check = [&](size_t task, std::initializer_list<size_t> predecessors) {
+        for(size_t p : predecessors)
+            if(counts[p] <= counts[task])
+                errors++;
+        counts[task]++;
+    };
+    TaskGraph::TaskID fork = stacked.addTask([&]() { check(0, {}); });
+    for(size_t l = 0; l < layers; ++l)
+    {
+        size_t f = l * 3;
+        auto left = stacked.addTask([&, f]() { check(f + 1, {f}); });
+        auto right = stacked.addTask([&, f]() { check(f + 2, {f}); });
+        auto join = stacked.addTask([&, f]() { check(f + 3, {f + 1, f + 2}); });
+        stacked.addDependency(fork, left);
+        stacked.addDependency(fork, right);
+        stacked.addDependency(left, join);
+        stacked.addDependency(right, join);
+        fork = join;
+    }
+    for(size_t i = 0; i < 200; ++i)
+        stacked.runAndWait();
+    EXPECT_EQ(errors, 0);
+    for(auto& count : counts)
+        EXPECT_EQ(count, 200);
+
+    ThreadPool::cleanup();
+}
+
+TEST(Threading, TaskGraphFanInTest)
+{
+    ThreadPool::init(4);
+    const size_t width = 1000;
+    std::atomic<size_t> started = 0;
+    std::atomic<size_t> finished = 0;
+    std::atomic<size_t> errors = 0;
+    std::atomic<size_t> sinkRuns = 0;
+
+    // One source fans out to width tasks, which all fan back in to one sink
+    TaskGraph graph;
+    auto source = graph.addTask([&]() {
+        started = 0;
+        finished = 0;
+    });
+    auto sink = graph.addTask([&]() {
+        if(finished != width)
+            errors++;
+        sinkRuns++;
+    });
+    for(size_t i = 0; i < width; ++i)
+    {
+        auto task = graph.addTask([&]() {
+            started++;
+            finished++;
+        });
+        graph.addDependency(source, task);
+        graph.addDependency(task, sink);
+    }
+
+    const size_t runs = 200;
+    for(size_t i = 0; i < runs; ++i)
+    {
+        auto handle = graph.run();
+        EXPECT_TRUE(graph.running() || handle->finished());
+        handle->finish();
+    }
+    EXPECT_EQ(errors, 0);
+    EXPECT_EQ(sinkRuns, runs);
+    EXPECT_EQ(started, width);
+
+    // Cycles are caught before anything runs
+    TaskGraph cyclic;
+    auto x = cyclic.addTask([]() {});
+    auto y = cyclic.addTask([]() {});
+    cyclic.addDependency(x, y);
+    cyclic.addDependency(y, x);
+    EXPECT_THROW(cyclic.run(), std::runtime_error);
+
+    // A task that throws skips everything after it but still lets the run finish, and the error reaches the caller
+    TaskGraph failing;
+    std::atomic<size_t> afterRuns = 0;
+    bool shouldThrow = true;
+    auto first = failing.addTask([&shouldThrow]() {
+        if(shouldThrow)
+            throw std::runtime_error("task failed");
+    });
+    auto after = failing.addTask([&afterRuns]() { ++afterRuns; });
+    failing.addDependency(first, after);
+    EXPECT_THROW(failing.runAndWait(), std::runtime_error);
+    EXPECT_EQ(afterRuns, 0);
+    failing.run()->finish();
+    EXPECT_THROW(failing.rethrowError(), std::runtime_error);
+    // The next run starts clean
+    shouldThrow = false;
+    failing.runAndWait();
+    EXPECT_EQ(afterRuns, 1);
+    EXPECT_NO_THROW(failing.rethrowError());
+
+    // An empty graph finishes straight away
+    TaskGraph empty;
+    EXPECT_TRUE(empty.run()->finished());
+
+    ThreadPool::cleanup();
+}
+
+// Busy waits instead of sleeping, so a job takes about as long as asked even on a loaded machine
+static void spinFor(std::chrono::microseconds time)
+{
+    auto end = std::chrono::steady_clock::now() + time;
+    while(std::chrono::steady_clock::now() < end)
+        ;
+}
+
+TEST(Threading, JobPriorityTest)
+{
+    ThreadPool::init(1, 1);
+    std::atomic_bool release = false;
+    std::atomic_bool blocked = false;
+    ThreadPool::enqueueDetached([&]() {
+        blocked = true;
+        while(!release)
+            std::this_thread::yield();
+    });
+    while(!blocked)
+        std::this_thread::yield();
+
+    // Queued lowest priority first while the only worker is busy, they should still run highest priority first
+    std::mutex orderLock;
+    std::vector<JobPriority> order;
+    std::atomic<size_t> ran = 0;
+    for(JobPriority priority : {JobPriority::background, JobPriority::streaming, JobPriority::frameCritical})
+    {
+        for(size_t i = 0; i < 10; ++i)
+        {
+            ThreadPool::enqueueDetached(
+                [&]() {
+                std::scoped_lock lock(orderLock);
+                order.push_back(ThreadPool::currentPriority());
+                ran++;
+                },
+                priority);
+        }
+    }
+    auto stats = ThreadPool::stats();
+    EXPECT_EQ(stats.workers[0].depth, 10);
+    EXPECT_EQ(stats.workers[1].depth, 10);
+    EXPECT_EQ(stats.workers[2].depth, 10);
+
+    release = true;
+    while(ran < 30)
+        std::this_thread::yield();
+    ASSERT_EQ(order.size(), 30);
+    EXPECT_TRUE(std::is_sorted(order.begin(), order.end()));
+
+    // Jobs enqueued from a job inherit its priority
+    std::atomic<JobPriority> inherited = JobPriority::frameCritical;
+    ThreadPool::enqueue([&]() { ThreadPool::enqueue([&]() { inherited = ThreadPool::currentPriority(); })->finish(); },
+                        JobPriority::background)
+        ->finish();
+    EXPECT_EQ(inherited, JobPriority::background);
+
+    // Waiting on a frame critical job only helps with jobs at least that urgent, background ones are left to the worker
+    release = false;
+    blocked = false;
+    JobHandlePtr blocker = ThreadPool::enqueue(
+        [&]() {
+        blocked = true;
+        while(!release)
+            std::this_thread::yield();
+        },
+        JobPriority::frameCritical);
+    while(!blocked)
+        std::this_thread::yield();
+    std::atomic<size_t> ranOnMain = 0;
+    ran = 0;
+    for(size_t i = 0; i < 10; ++i)
+    {
+        ThreadPool::enqueueDetached(
+            [&]() {
+            if(IS_MAIN_THREAD())
+                ranOnMain++;
+            ran++;
+            },
+            JobPriority::background);
+    }
+    std::thread releaser([&]() {
+        std::this_thread::sleep_for(std::chrono::milliseconds(20));
+        release = true;
+    });
+    blocker->finish();
+    releaser.join();
+    while(ran < 10)
+        std::this_thread::yield();
+    EXPECT_EQ(ranOnMain, 0);
+
+    ThreadPool::cleanup();
+}
+
+TEST(Threading, MainThreadBudgetTest)
+{
+    ThreadPool::resetStats();
+    ThreadPool::setMainThreadBudget(std::chrono::milliseconds(2));
+    std::vector<JobPriority> order;
+    for(size_t i = 0; i < 5; ++i)
+        ThreadPool::enqueueMain([&]() { order.push_back(JobPriority::background); }, JobPriority::background);
+    for(size_t i = 0; i < 20; ++i)
+    {
+        ThreadPool::enqueueMain(
+            [&]() {
+            spinFor(std::chrono::microseconds(500));
+            order.push_back(JobPriority::streaming);
+            },
+            JobPriority::streaming);
+    }
+    for(size_t i = 0; i < 5; ++i)
+        ThreadPool::enqueueMain([&]() { order.push_back(JobPriority::frameCritical); });
+
+    // Frame critical jobs ignore the budget, the rest roll over into later calls
+    ThreadPool::runMainJobs();
+    EXPECT_GE(order.size(), 6);
+    EXPECT_LT(order.size(), 15);
+    auto stats = ThreadPool::stats();
+    EXPECT_EQ(stats.main[0].depth, 0);
+    EXPECT_GT(stats.main[1].depth, 0);
+    EXPECT_EQ(stats.main[2].depth, 5);
+
+    size_t frames = 1;
+    while(order.size() < 30)
+    {
+        ThreadPool::runMainJobs();
+        ++frames;
+    }
+    EXPECT_GT(frames, 4);
+    EXPECT_TRUE(std::is_sorted(order.begin(), order.end()));
+
+    stats = ThreadPool::stats();
+    EXPECT_EQ(stats.main[0].samples, 5);
+    EXPECT_EQ(stats.main[1].samples, 20);
+    EXPECT_EQ(stats.main[2].samples, 5);
+    // The last streaming job waited for every frame before it
+    EXPECT_GE(stats.main[1].maxLatency, 9000000);
+    EXPECT_LE(stats.main[1].averageLatency, stats.main[1].maxLatency);
+
+    // A budget smaller than any job still runs one per call
+    ThreadPool::setMainThreadBudget(std::chrono::nanoseconds(0));
+    size_t ran = 0;
+    for(size_t i = 0; i < 3; ++i)
+        ThreadPool::enqueueMain([&]() { ran++; }, JobPriority::streaming);
+    ThreadPool::runMainJobs();
+    EXPECT_EQ(ran, 1);
+    ThreadPool::runMainJobs();
+    ThreadPool::runMainJobs();
+    EXPECT_EQ(ran, 3);
+
+    // Time spent on frame critical jobs doesn't eat into the budget for the rest
+    ThreadPool::setMainThreadBudget(std::chrono::milliseconds(100));
+    ran = 0;
+    ThreadPool::enqueueMain([]() { spinFor(std::chrono::milliseconds(150)); });
+    for(size_t i = 0; i < 3; ++i)
+        ThreadPool::enqueueMain([&]() { ran++; }, JobPriority::streaming);
+    ThreadPool::runMainJobs();
+    EXPECT_EQ(ran, 3);
+
+    ThreadPool::setMainThreadBudget(std::chrono::milliseconds(4));
+}
+
+TEST(Threading_Profiling, TinyJobs)
+{
+    ThreadPool::init(4);
+    const size_t jobCount = 1000000;
+    std::atomic<size_t> ran = 0;
+
+    Stopwatch singleTime;
+    auto handle = JobHandle::create();
+    for(size_t i = 0; i < jobCount; ++i)
+        ThreadPool::enqueue([&ran]() { ran.fetch_add(1, std::memory_order_relaxed); }, handle);
+    handle->finish();
+    auto singleResult = singleTime.time<std::chrono::milliseconds>();
+    EXPECT_EQ(ran, jobCount);
+
+    std::vector<std::function<void()>> jobs;
+    jobs.reserve(jobCount);
+    for(size_t i = 0; i < jobCount; ++i)
+        jobs.emplace_back([&ran]() { ran.fetch_add(1, std::memory_order_relaxed); });
+    Stopwatch batchTime;
+    ThreadPool::enqueueBatch(std::move(jobs))->finish();
+    auto batchResult = batchTime.time<std::chrono::milliseconds>();
+    EXPECT_EQ(ran, 2 * jobCount);
+
+    std::cout << jobCount << " tiny jobs took " << singleResult << "ms enqueued one at a time and " << batchResult
+              << "ms as one batch" << std::endl;
+    ThreadPool::cleanup();
+}
+
+TEST(Threading_Profiling, NestedSpawnTree)
+{
+    ThreadPool::init(4);
+    const size_t depth = 20;
+    std::atomic<size_t> leaves = 0;
+
+    Stopwatch treeTime;
+    auto handle = JobHandle::create();
+    ThreadPool::enqueue([&]() { spawnTree(depth, leaves, handle); }, handle);
+    handle->finish();
+    auto treeResult = treeTime.time<std::chrono::milliseconds>();
+    EXPECT_EQ(leaves, 1 << depth);
+
+    std::cout << "Binary spawn tree of depth " << depth << " (" << (2 << depth) - 1 << " jobs) took " << treeResult
+              << "ms" << std::endl;
+    ThreadPool::cleanup();
+}
+
+TEST(Threading_Profiling, JobAllocations)
+{
+    ThreadPool::init(4);
+    const size_t jobCount = 100000;
+    std::atomic<size_t> ran = 0;
+    // Bigger than std::function's small buffer, like most real jobs
+    size_t a = 1, b = 2, c = 3;
+    auto job = [&ran, a, b, c]() { ran.fetch_add(a + b + c - 5, std::memory_order_relaxed); };
+    static_assert(BraneJob::Function::storesInline<decltype(job)>());
+
+    auto waitFor = [&ran](size_t count) {
+        while(ran < count)
+            std::this_thread::yield();
+    };
+    // The first round fills the pools, the second is measured
+    auto measure = [&](const char* name, auto&& submitAll) {
+        double perJob = 0;
+        for(size_t round = 0; round < 2; ++round)
+        {
+            ran = 0;
+            size_t before = allocationCount();
+            submitAll();
+            waitFor(jobCount);
+            perJob = static_cast<double>(allocationCount() - before) / jobCount;
+        }
+        std::cout << name << ": " << perJob << " allocations per job" << std::endl;
+        return perJob;
+    };
+
+    measure("Handle per job", [&]() {
+        for(size_t i = 0; i < jobCount; ++i)
+            ThreadPool::enqueue(job);
+    });
+    double shared = measure("Shared handle", [&]() {
+        auto handle = JobHandle::create();
+        for(size_t i = 0; i < jobCount; ++i)
+            ThreadPool::enqueue(job, handle);
+        handle->finish();
+    });
+    double detached = measure("Detached", [&]() {
+        for(size_t i = 0; i < jobCount; ++i)
+            ThreadPool::enqueueDetached(job);
+    });
+    EXPECT_LT(shared, 0.05);
+    EXPECT_LT(detached, 0.05);
+
+    ThreadPool::cleanup();
+}
+
+TEST(Threading_Profiling, ParallelForScaling)
+{
+    const size_t count = 1 << 22;
+    // Enough math per index that the loop is compute bound rather than memory bound
+    auto work = [](size_t begin, size_t end) {
+        double s = 0;
+        for(size_t i = begin; i < end; ++i)
+            s += std::sqrt(static_cast<double>(i)) * std::sin(static_cast<double>(i));
+        return s;
+    };
+    auto add = [](double a, double b) { return a + b; };
+
+    Stopwatch serialTime;
+    double expected = 0;
+    for(size_t begin = 0; begin < count; begin += 4096)
+        expected += work(begin, std::min(begin + 4096, count));
+    auto serialResult = serialTime.time<std::chrono::microseconds>();
+    std::cout << "Serial: " << serialResult / 1000.0 << "ms" << std::endl;
+
+    // The calling thread helps too, so n workers means n + 1 threads
+    size_t maxWorkers = std::max<size_t>(std::thread::hardware_concurrency(), 2);
+    for(size_t workers = 1; workers <= maxWorkers; workers *= 2)
+    {
+        ThreadPool::init(workers, workers);
+        Stopwatch parallelTime;
+        double result = ThreadPool::parallelReduce<double>(0, count, 4096, 0.0, work, add);
+        auto parallelResult = parallelTime.time<std::chrono::microseconds>();
+        EXPECT_EQ(result, expected);
+        std::cout << workers << " workers: " << parallelResult / 1000.0 << "ms, "
+                  << static_cast<double>(serialResult) / parallelResult << "x" << std::endl;
+        ThreadPool::cleanup();
+    }
+}
+
+TEST(Threading_Profiling, TaskGraphReplay)
+{
+    ThreadPool::init(4);
+    // Layers of tasks where each task depends on two in the layer before, built once and replayed
+    const size_t layers = 16, width = 64, runs = 500;
+    std::atomic<size_t> ran = 0;
+    TaskGraph graph;
+    std::vector<TaskGraph::TaskID> previous;
+    for(size_t l = 0; l < layers; ++l)
+    {
+        std::vector<TaskGraph::TaskID> layer;
+        for(size_t i = 0; i < width; ++i)
+        {
+            auto task = graph.addTask([&ran]() { ran.fetch_add(1, std::memory_order_relaxed); });
+            if(!previous.empty())
+            {
+                graph.addDependency(previous[i], task);
+                graph.addDependency(previous[(i + 1) % width], task);
+            }
+            layer.push_back(task);
+        }
+        previous = std::move(layer);
+    }
+
+    graph.runAndWait();
+    size_t before = allocationCount();
+    Stopwatch replayTime;
+    for(size_t i = 0; i < runs; ++i)
+        graph.runAndWait();
+    auto replayResult = replayTime.time<std::chrono::microseconds>();
+    double allocations = static_cast<double>(allocationCount() - before) / runs;
+    EXPECT_EQ(ran, (runs + 1) * layers * width);
+
+    std::cout << "Graph of " << graph.size() << " tasks took " << static_cast<double>(replayResult) / runs
+              << "us per run, " << allocations << " allocations per run" << std::endl;
+    ThreadPool::cleanup();
+}
+
+TEST(Threading_Profiling, MainThreadBudget)
+{
+    // A burst of streamed asset callbacks landing at once, like a chunk's worth of assemblies
+    const size_t callbacks = 200;
+    const auto callbackTime = std::chrono::microseconds(100);
+    auto burst = [&](std::chrono::nanoseconds budget) {
+        ThreadPool::setMainThreadBudget(budget);
+        ThreadPool::resetStats();
+        size_t ran = 0;
+        for(size_t i = 0; i < callbacks; ++i)
+        {
+            ThreadPool::enqueueMain(
+                [&]() {
+                spinFor(callbackTime);
+                ran++;
+                },
+                JobPriority::streaming);
+        }
+        size_t frames = 0;
+        uint64_t longestFrame = 0;
+        while(ran < callbacks)
+        {
+            ThreadPool::runMainJobs();
+            longestFrame = std::max(longestFrame, ThreadPool::stats().mainTime);
+            ++frames;
+        }
+        auto latency = ThreadPool::stats().main[static_cast<size_t>(JobPriority::streaming)];
+        std::cout << "Budget " << std::chrono::duration_cast<std::chrono::microseconds>(budget).count() << "us: "
+                  << frames << " frames, longest " << longestFrame / 1000 << "us, average latency "
+                  << latency.averageLatency / 1000 << "us" << std::endl;
+        return longestFrame;
+    };
+
+    uint64_t unbudgeted = burst(std::chrono::hours(1));
+    uint64_t budgeted = burst(std::chrono::milliseconds(4));
+    EXPECT_LT(budgeted, unbudgeted);
+    ThreadPool::setMainThreadBudget(std::chrono::milliseconds(4));
+}